@@ -70,9 +70,9 @@ int send_longcmd(int sockfd, uint8_t cmd, uint8_t fd, nameinfo_t *ninfo) {
 
 	uint8_t *buf = mem_alloc_c(256, "longcmd buffer");
 
-	if (ninfo->drive == NAMEINFO_UNUSED_DRIVE) {
+	if (ninfo->trg.drive == NAMEINFO_UNUSED_DRIVE) {
 		// default drive
-		ninfo->drive = 0;
+		ninfo->trg.drive = 0;
 	}
 
 	uint8_t len = assemble_filename_packet(buf+FSP_DATA, ninfo);
@@ -190,6 +190,50 @@ static int cmd_info(int sockfd, int argc, const char *argv[]) {
 	return 0;
 }
 
+static int cmd_stats(int sockfd, int argc, const char *argv[]) {
+
+	log_debug("cmd_stats(sockfd=%d, argc=%d, argv[]=%s\n",
+		sockfd, argc, argc>0 ? argv[0] : "-");
+
+	uint8_t *buf = mem_alloc_c(256, "stats buffer");
+	int chunk = 0;
+	int rv = 0;
+
+	// the statistics text is sent in chunks, until FS_DATA_EOF
+	do {
+		buf[FSP_CMD] = FS_INFO;
+		buf[FSP_FD] = FSFD_CMD;
+		buf[FSP_LEN] = FSP_DATA + 3;
+		buf[FSP_DATA] = FS_INFO_STATS;
+		buf[FSP_DATA+1] = chunk & 0xff;
+		buf[FSP_DATA+2] = (chunk >> 8) & 0xff;
+
+		rv = send_packet(sockfd, buf, FSP_DATA + 3);
+		if (rv < 0) {
+			log_errno("Unable to send stats request!\n");
+			break;
+		}
+
+		rv = recv_packet(sockfd, buf, 256);
+		if (rv <= 0) {
+			log_errno("Could not receive packet!\n");
+			rv = -1;
+			break;
+		}
+		if (buf[FSP_CMD] != FS_DATA && buf[FSP_CMD] != FS_DATA_EOF) {
+			log_error("Received unexpected packet of type %d!\n", buf[FSP_CMD]);
+			rv = -1;
+			break;
+		}
+
+		fwrite(buf + FSP_DATA, 1, buf[FSP_LEN] - FSP_DATA, stdout);
+		chunk++;
+	} while (buf[FSP_CMD] == FS_DATA);
+
+	mem_free(buf);	
+	return rv < 0 ? 1 : 0;
+}
+
 static int cmd_assign(int sockfd, int argc, const char *argv[]) {
 
 	log_error("cmd_assign(sockfd=%d, argc=%d, argv[]=%s) - not yet implemented!\n",
@@ -216,6 +260,9 @@ static const cmdtab_t cmdtab[] = {
 	{	"info",		cmd_info,
 			"Get info from the server",
 			{ NULL } },
+	{	"stats",	cmd_stats,
+			"Get the server statistics in Prometheus text format",
+			{ NULL } },
 	{	"assign",	cmd_assign,
 			"Assign a drive to a new drivespec with parameters:",
 			{ 	"<drivespec>    '<drive>:[<prov>]=<path>'", 
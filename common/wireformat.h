@@ -35,6 +35,12 @@
 #define FSP_LEN         1	/* total packet length, i.e. including CMD and LEN */
 #define FSP_FD          2	/* channel that packet is sent for */
 #define FSP_DATA        3	/* first payload data byte */
+
+/* packet size limits. The length byte limits a packet to 255 bytes on the wire.
+ * A device announces the max. packet length it can receive as the (optional)
+ * single payload byte of FS_RESET; devices that do not, get FSP_DEFAULT_LEN */
+#define	FSP_MAX_LEN	255	/* max. total packet length on the wire */
+#define	FSP_DEFAULT_LEN	64	/* total packet length if not negotiated */
     
 // reserved file descriptors 
 // Note: -1 = 0xff is reserved
@@ -61,7 +67,8 @@
 #define   FS_OPEN_AP     5	/* open file for appending data to it */
 #define   FS_OPEN_DR     6	/* open a directory for reading */
     
-#define   FS_READ        7      /* pull data */
+#define   FS_READ        7      /* pull data; optional payload byte gives a number of credits,
+				   i.e. up to that many FS_DATA packets are streamed back */
 #define   FS_WRITE       8      /* push data */
 #define   FS_WRITE_EOF   9      /* push data with EOF */
 #define   FS_REPLY       10     /* return value */
@@ -80,7 +87,8 @@
     
 #define   FS_ASSIGN      22	/* assign a drive number to a directory */
 #define   FS_SETOPT      23	/* set an option using an X-command string as payload */
-#define   FS_RESET       24	/* device sends this to notify it has reset */
+#define   FS_RESET       24	/* device sends this to notify it has reset; optional payload
+				   byte is the max. packet length the device can receive */
     
 #define   FS_BLOCK       25	/* summary for block commands */
 #define	  FS_GETDATIM	 26	/* request an FS_DATE_* struct with the current date/time as FS_REPLY */
@@ -96,6 +104,15 @@
 #define   FS_INITIALIZE  32     /* initialize (e.g. free buffers and remove file locks) */
 
 #define   FS_INFO  	 33     /* server sends info about the server to drive (or command) */
+
+/*
+ * FS_INFO sub-functions, given in the optional first payload byte
+ */
+#define	FS_INFO_VERSION	0	/* server version string (also without payload) */
+#define	FS_INFO_STATS	1	/* server statistics as text; the next two bytes give the
+				   chunk number (low byte first) of the text, which is sent in
+				   FS_DATA packets; FS_DATA_EOF marks the last chunk. Chunk 0
+				   takes a new snapshot of the statistics. */
     
 /*
  * BLOCK and DIRECT commands
@@ -232,7 +232,11 @@ uint8_t buffer_read_buffer(uint8_t channel_no, endpoint_t *endpoint, uint16_t re
 	// we loop as long as we get more data; we break on error or EOF
         while (ptype == FS_DATA && lengthread < receive_nbytes) {
 
-                packet_init(&buf_datapack, 128, buffer->buffer + lengthread);
+                // the server sends up to the negotiated packet size, but
+                // never more than is left of the block
+                uint16_t room = sizeof(buffer->buffer) - lengthread;
+                packet_init(&buf_datapack, (room < DATA_BUFLEN) ? room : DATA_BUFLEN,
+                                buffer->buffer + lengthread);
                 packet_init(&buf_cmdpack, CMD_BUFFER_LENGTH, (uint8_t*) buf);
                 packet_set_filled(&buf_cmdpack, channel_no, FS_READ, 0);
 
@@ -80,9 +80,24 @@ static uint8_t _pull_callback(int8_t channel_no, int8_t errorno, packet_t *rxpac
 		// Probably need some PULL_ERROR as well	
 		if (p->pull_state == PULL_PRELOAD) {
 			p->pull_state = PULL_ONECONV;
+			if (p->stream_state == STREAM_PENDING) {
+				if (p->last_pull_errorno == CBM_ERROR_OK
+					&& packet_get_type(rxpacket) == FS_DATA
+					&& packet_get_contentlen(rxpacket) > 0) {
+					// the server streams the second buffer, keep receiving
+					return 1;
+				}
+				// server stopped after the first packet
+				p->stream_state = STREAM_NONE;
+			}
 		} else
 		if (p->pull_state == PULL_PULL2ND) {
 			p->pull_state = PULL_TWOCONV;
+			p->stream_state = STREAM_NONE;
+		} else
+		if (p->stream_state == STREAM_PENDING) {
+			// streamed second buffer, first one not yet converted
+			p->stream_state = STREAM_RECEIVED;
 		}
 	}
 	return 0;
@@ -135,6 +150,17 @@ static void channel_pull(channel_t *c, uint8_t slot, uint8_t options) {
 	// not irq-protected, as exlusive state conditions
 	if (c->pull_state == PULL_OPEN) {
 		c->pull_state = PULL_PRELOAD;
+#ifdef CONFIG_STREAM_READ
+		if (c->writetype == WTYPE_READONLY && endpoint->provider->submit_call_stream != NULL) {
+			// give the server two credits, so it sends both buffers 
+			// without waiting for another FS_READ
+			packet_get_buffer(p)[0] = 2;
+			packet_set_filled(p, c->channel_no, FS_READ, 1);
+			c->stream_state = STREAM_PENDING;
+			endpoint->provider->submit_call_stream(endpoint->provdata, c->channel_no, p, p, 
+				&c->buf[1-slot], _pull_callback);
+		} else
+#endif
 		endpoint->provider->submit_call_data(endpoint->provdata, c->channel_no, p, p, _pull_callback);
 
 		if (options & GET_SYNC) {
@@ -188,6 +214,7 @@ int8_t channel_open(int8_t channo, uint8_t writetype, endpoint_t *prov,
 			chan->drive = drive;
 			chan->pull_state = PULL_OPEN;
 			chan->push_state = PUSH_OPEN;
+			chan->stream_state = STREAM_NONE;
 			chan->had_data = 0;
 			// note: we should not channel_pull() here, as file open has not yet even been sent
 			// the pull is done in the open callback for a read-only channel
@@ -250,7 +277,8 @@ static void channel_flush_int(channel_t *chan) {
 	}
 
 	while (chan->pull_state == PULL_PRELOAD
-		|| chan->pull_state == PULL_PULL2ND) {
+		|| chan->pull_state == PULL_PULL2ND
+		|| chan->stream_state == STREAM_PENDING) {
 
 		delayms(1);
 		main_delay();
@@ -313,7 +341,17 @@ static int8_t channel_preload_int(channel_t *chan, uint8_t wait) {
 				chan->directory_converter(chan->endpoint, &chan->buf[chan->current], chan->drive);
 			}
 			// we have one packet, and it's already converted as well
-			chan->pull_state = PULL_ONEREAD;
+			if (chan->stream_state == STREAM_PENDING) {
+				// second buffer is still being streamed in
+				chan->pull_state = PULL_PULL2ND;
+			} else
+			if (chan->stream_state == STREAM_RECEIVED) {
+				// second buffer has already been streamed in
+				chan->stream_state = STREAM_NONE;
+				chan->pull_state = PULL_TWOCONV;
+			} else {
+				chan->pull_state = PULL_ONEREAD;
+			}
 		}
 	    }
 	    if (chan->pull_state == PULL_TWOCONV) {
@@ -391,6 +429,7 @@ static void channel_close_int(channel_t *chan) {
 	chan->channel_no = -1;
 	chan->pull_state = PULL_OPEN;
 	chan->push_state = PUSH_OPEN;
+	chan->stream_state = STREAM_NONE;
 	chan->had_data = 0;
 	packet_init(&chan->buf[0], DATA_BUFLEN, chan->data[0]);
 	packet_init(&chan->buf[1], DATA_BUFLEN, chan->data[1]);
@@ -30,10 +30,18 @@
 
 #include <stdio.h>
 
+#include "config.h"
 #include "packet.h"
 #include "provider.h"
 
+// size of a channel data buffer, i.e. the max payload of an FS_DATA / FS_WRITE
+// packet. The device announces it to the server in the FS_RESET packet, so
+// the server never sends more than that. Must not exceed 255-FSP_DATA (wire limit).
+#ifdef CONFIG_DATA_BUFFER_SIZE
+#define	DATA_BUFLEN	CONFIG_DATA_BUFFER_SIZE
+#else
 #define	DATA_BUFLEN	64
+#endif
 
 /**
  * writetype values as seen from the IEEE device
@@ -71,6 +79,14 @@
 #define	PULL_TWOCONV	5	// second buffer is read, but may still need to be converted
 #define	PULL_TWOREAD	6	// both buffers read and valid
 
+/**
+ * stream_state values. When streaming is used, the initial pull asks the server
+ * for both buffers with a single FS_READ (with credits)
+ */
+#define	STREAM_NONE	0	// no streamed packet outstanding
+#define	STREAM_PENDING	1	// second buffer is still being streamed in
+#define	STREAM_RECEIVED	2	// second buffer received before the first was converted
+
 /**
  * push_state values. The delay callback updates the state
  * push means send (push) data to the server
@@ -103,6 +119,7 @@ typedef struct {
 	// channel pull state - only one can be pulled at a time
 	int8_t pull_state;
 	int8_t last_pull_errorno;
+	uint8_t stream_state;
 	// channel push state - only one can be pushed at a time
 	int8_t push_state;
 	int8_t last_push_errorno;
@@ -505,7 +505,8 @@ static provider_t directprovider = {
 	block_submit_call_cmd,	// submit_call_cmd
 	NULL,			// directory_converter
 	NULL,			// channel_get
-	NULL			// channel_put
+	NULL,			// channel_put
+	NULL			// submit_call_stream
 };
 
 static endpoint_t direct_endpoint = {
@@ -84,7 +84,8 @@ provider_t fat_provider  = {
    fat_submit_call_cmd,
    directory_converter,
    NULL,                        // channel_get
-   NULL                         // channel_put
+   NULL,                        // channel_put
+   NULL                         // submit_call_stream
 };
 
 
@@ -86,12 +86,12 @@ static inline int8_t packet_get_type(packet_t * packet)
 	return packet->type;
 }
 
-static inline int8_t packet_get_contentlen(packet_t * packet)
+static inline uint8_t packet_get_contentlen(packet_t * packet)
 {
 	return packet->wp;
 }
 
-static inline int8_t packet_get_capacity(packet_t * packet)
+static inline uint8_t packet_get_capacity(packet_t * packet)
 {
 	return packet->len;
 }
@@ -165,7 +165,7 @@ static inline void packet_set_filled(packet_t * packet, int8_t chan,
 	packet_set_read(packet);
 }
 
-static inline void packet_update_wp(packet_t * packet, int8_t datalen)
+static inline void packet_update_wp(packet_t * packet, uint8_t datalen)
 {
 	packet->wp = datalen;
 }
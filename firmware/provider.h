@@ -73,6 +73,14 @@ typedef struct {
 	// channel_put shortcut into provider (where applicable)
 	 int8_t(*channel_put) (void *pdata, int8_t channelno,
 			       char c, uint8_t forceflush);
+	// submit a streamed FS_READ that may be answered with two packets; the first
+	// response is received into rxbuf, the second (if the callback returns != 0)
+	// into rxnext. NULL if the provider does not support streaming
+	void (*submit_call_stream) (void *pdata, int8_t channelno, packet_t * txbuf,
+			     packet_t * rxbuf, packet_t * rxnext,
+			     uint8_t(*callback) (int8_t channelno,
+						 int8_t errnum,
+						 packet_t * packet));
 } provider_t;
 
 typedef struct {
@@ -374,7 +374,8 @@ static provider_t relfile_provider = {
 	NULL,			// submit_call_cmd
 	NULL,			// directory_converter
 	relfile_get,		// channel_get
-	relfile_put		// channel_put
+	relfile_put,		// channel_put
+	NULL			// submit_call_stream
 };
 
 static endpoint_t relfile_endpoint = {
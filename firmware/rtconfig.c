@@ -36,6 +36,8 @@
 #include "rtconfig2.h"
 #include "errors.h"
 #include "provider.h"	// MAX_DRIVES
+#include "channel.h"	// DATA_BUFLEN
+#include "wireformat.h"
 #include "nvconfig.h"
 #include "bus.h"	// get_default_device_address()
 #include "system.h"	// reset_mcu()
@@ -202,8 +204,10 @@ void rtconfig_pullconfig(int argc, const char *argv[]) {
 		}
 	}
 
-        // prepare FS_RESET packet
-        packet_set_filled(&buspack, FSFD_SETOPT, FS_RESET, 0);
+        // prepare FS_RESET packet; the payload tells the server the
+	// max. packet length we can receive in our channel buffers
+	buf[0] = DATA_BUFLEN + FSP_DATA;
+        packet_set_filled(&buspack, FSFD_SETOPT, FS_RESET, 1);
 
         // send request, receive in same buffer we sent from
         endpoint->provider->submit_call_data(endpoint->provdata, FSFD_SETOPT, &buspack, &buspack, setopt_callback);
@@ -80,6 +80,9 @@ void serial_submit_call_data(void *epdata, int8_t channelno, packet_t *txbuf, pa
 void serial_submit_call_cmd(void *epdata, int8_t channelno, packet_t *txbuf, packet_t *rxbuf, rtconfig_t *rtc,
                 uint8_t (*callback)(int8_t channelno, int8_t errnum, packet_t *packet));
 
+void serial_submit_call_stream(void *epdata, int8_t channelno, packet_t *txbuf, packet_t *rxbuf, 
+		packet_t *rxnext, uint8_t (*callback)(int8_t channelno, int8_t errnum, packet_t *packet));
+
 // dummy
 static void *prov_assign(uint8_t drive, const char *parameter) {
 	return NULL;
@@ -112,7 +115,8 @@ provider_t serial_provider  = {
         serial_submit_call_cmd,
 	directory_converter,
 	NULL,
-	NULL
+	NULL,
+	serial_submit_call_stream
 };
 
 #define	NUMBER_OF_SLOTS		4
@@ -135,6 +139,7 @@ static int8_t		txstate;
 static struct {
 	int8_t		channelno;	// -1 is unused
 	packet_t	*rxpacket;
+	packet_t	*rxnext;	// second packet for streamed reads, or NULL
 	uint8_t		(*callback)(int8_t channelno, int8_t errnum, packet_t *packet);
 } rx_channels[NUMBER_OF_SLOTS];
 
@@ -148,7 +153,7 @@ static int8_t			rxstate;
 static int8_t			current_channelno;
 static int8_t			current_channelpos;
 static packet_t			*current_rxpacket;
-static int8_t			current_data_left;
+static uint8_t			current_data_left;
 static int8_t			current_is_eoi;
 
 /*****************************************************************************
@@ -224,10 +229,29 @@ static void send(void) {
 }
 
 
+/**
+ * a packet has been fully received; do the callback. 
+ * If the callback returns 0, the rx slot is freed, otherwise it is kept
+ * for further packets, which go into the rxnext packet if one is given
+ */
+static void rx_done() {
+	// prohibit receiving just in case (we reuse the rx buffer e.g. 
+	// in X option)
+	serial_lock = 1;
+	if (rx_channels[current_channelpos].callback(current_channelno, 0, current_rxpacket) == 0) {
+		rx_channels[current_channelpos].channelno = -1;
+	} else
+	if (rx_channels[current_channelpos].rxnext != NULL) {
+		rx_channels[current_channelpos].rxpacket = rx_channels[current_channelpos].rxnext;
+		rx_channels[current_channelpos].rxnext = NULL;
+	}
+	serial_lock = 0;
+}
+
 /**
  * interrupt for received data
  */
-static void push_data_to_packet(int8_t rxdata)
+static void push_data_to_packet(uint8_t rxdata)
 {
 	switch(rxstate) {
 	case RX_IDLE:
@@ -255,7 +279,7 @@ static void push_data_to_packet(int8_t rxdata)
 		}
 		break;
 	case RX_LEN:
-		current_data_left = rxdata - 3;
+		current_data_left = (rxdata < 3) ? 0 : rxdata - 3;
 		rxstate = RX_CHANNELNO;
 		break;
 	case RX_CHANNELNO:
@@ -277,38 +301,23 @@ static void push_data_to_packet(int8_t rxdata)
 		// well, RX_IGNORE should not happen, but we have no means of telling anyone here
 		if (current_data_left == 0) {
 			// we are actually already done. do callback and set status to idle
-			// prohibit receiving just in case (we reuse the rx buffer e.g. 
-			// in X option)
-			serial_lock = 1;
-			if ((rxstate == RX_DATA) 
-				&& (rx_channels[current_channelpos].callback(current_channelno, 
-					(rxstate == RX_IGNORE) ? -1 : 0, 
-					(rxstate == RX_IGNORE) ? NULL : current_rxpacket) == 0)) {
-				rx_channels[current_channelpos].channelno = -1;
+			if (rxstate == RX_DATA) {
+				rx_done();
 			}
-			serial_lock = 0;
 			rxstate = RX_IDLE;
 		}
 		break;
 	case RX_DATA:
 		packet_write_char(current_rxpacket, rxdata);
 		current_data_left --;
-		if (current_data_left <= 0) {
-			// prohibit receiving just in case (we reuse the rx buffer e.g. 
-			// in X option)
-			serial_lock = 1;
-			if (rx_channels[current_channelpos].callback(current_channelno, 
-					(rxstate == RX_IGNORE) ? -1 : 0, 
-					(rxstate == RX_IGNORE) ? NULL : current_rxpacket) == 0) {
-				rx_channels[current_channelpos].channelno = -1;
-			}
-			serial_lock = 0;
+		if (current_data_left == 0) {
+			rx_done();
 			rxstate = RX_IDLE;
 		}
 		break;
 	case RX_IGNORE:
 		current_data_left --;
-		if (current_data_left <= 0) {
+		if (current_data_left == 0) {
 			rxstate = RX_IDLE;
 		}
 		break;
@@ -395,8 +404,8 @@ void serial_submit_call_cmd(void *epdata, int8_t channelno, packet_t *txbuf, pac
 	serial_submit_call_data(epdata, channelno, txbuf, rxbuf, callback);
 }
 
-void serial_submit_call_data(void *epdata, int8_t channelno, packet_t *txbuf, packet_t *rxbuf, 
-		uint8_t (*callback)(int8_t channelno, int8_t errnum, packet_t *packet)) {
+static void submit_call(void *epdata, int8_t channelno, packet_t *txbuf, packet_t *rxbuf, 
+		packet_t *rxnext, uint8_t (*callback)(int8_t channelno, int8_t errnum, packet_t *packet)) {
 
 	if (channelno < 0) {
 		debug_printf("!!!! submit with channelno=%d\n", channelno);
@@ -424,12 +433,31 @@ void serial_submit_call_data(void *epdata, int8_t channelno, packet_t *txbuf, pa
 
 	rx_channels[channelpos].channelno = channelno;
 	rx_channels[channelpos].rxpacket = rxbuf;
+	rx_channels[channelpos].rxnext = rxnext;
 	rx_channels[channelpos].callback = callback;
 
 	// send request
 	serial_submit(epdata, txbuf);
 }
 
+void serial_submit_call_data(void *epdata, int8_t channelno, packet_t *txbuf, packet_t *rxbuf, 
+		uint8_t (*callback)(int8_t channelno, int8_t errnum, packet_t *packet)) {
+
+	submit_call(epdata, channelno, txbuf, rxbuf, NULL, callback);
+}
+
+/*****************************************************************************
+ * submit a streamed read request, i.e. an FS_READ with credits, that is
+ * answered with up to two packets for the same channel. The first is received
+ * into rxbuf, the second into rxnext - as long as the callback returns != 0
+ * after the first one.
+ */
+void serial_submit_call_stream(void *epdata, int8_t channelno, packet_t *txbuf, packet_t *rxbuf, 
+		packet_t *rxnext, uint8_t (*callback)(int8_t channelno, int8_t errnum, packet_t *packet)) {
+
+	submit_call(epdata, channelno, txbuf, rxbuf, rxnext, callback);
+}
+
 /*****************************************************************************
 * initialize the UART code
 */
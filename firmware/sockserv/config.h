@@ -29,6 +29,14 @@
 // buffer sizes
 #define CONFIG_COMMAND_BUFFER_SIZE      120
 #define CONFIG_ERROR_BUFFER_SIZE        46
+
+// size of the channel data buffers (FS_DATA/FS_WRITE payload); max. 252,
+// the actual packet size is negotiated with the server on FS_RESET
+#define CONFIG_DATA_BUFFER_SIZE         252
+
+// initial read on a channel requests both channel buffers from the server
+// in one go (streamed FS_READ with credits)
+#define	CONFIG_STREAM_READ
     
 // number of direct buffers (for U1/U2/B-* commands)
 // Note: 12 is the number of buffers in the old dual drives, which we use to test
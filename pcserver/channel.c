@@ -24,73 +24,122 @@
 
 ****************************************************************************/
 
+#define	LOG_MODULE	LOGM_CMD
+
 #include <stddef.h>
 
 #include "log.h"
+#include "mem.h"
 #include "handler.h"
+#include "session.h"
+#include "channel.h"
 
 
 //------------------------------------------------------------------------------------
 // Mapping from channel number for open files to endpoint providers
-// These are set when the channel is opened
-
-typedef struct {
-       int             	channo;
-       file_t      	*fp;
-} chan_t;
+// These are set when the channel is opened. Each session has its own table.
+//
+// Channel numbers are a byte on the wire, so the table is indexed by the
+// channel number directly. It is grown on demand up to the full channel
+// number space.
+
+static type_t channels_type = {
+	"channels",
+	sizeof(file_t*),
+	NULL
+};
+
+static int channel_valid(int channo) {
+	if (channo < 0 || channo >= MAX_CHANNELS) {
+		log_error("Illegal channel number %d\n", channo);
+		return 0;
+	}
+	return 1;
+}
 
-chan_t chantable[MAX_NUMBER_OF_ENDPOINTS];
+void channel_init(session_t *session) {
+	session->channels = NULL;
+	session->chancap = 0;
+	session->chan_open = 0;
+	session->chan_peak = 0;
+	session->chan_total = 0;
+}
 
+file_t *channel_to_file(session_t *session, int chan) {
 
-void channel_init() {
-       int i;
-        for(i=0;i<MAX_NUMBER_OF_ENDPOINTS;i++) {
-          chantable[i].channo = -1;
-        }
+	if (chan >= 0 && chan < session->chancap && session->channels[chan] != NULL) {
+		return session->channels[chan];
+	}
+	log_info("Did not find open file for channel %d\n", chan);
+	return NULL;
 }
 
-file_t *channel_to_file(int chan) {
+void channel_free(session_t *session, int channo) {
 
-       int i;
-        for(i=0;i<MAX_NUMBER_OF_ENDPOINTS;i++) {
-               if (chantable[i].channo == chan) {
-                       return chantable[i].fp;
-               }
-        }
-       log_info("Did not find open file for channel %d\n", chan);
-       return NULL;
+	if (channo >= 0 && channo < session->chancap && session->channels[channo] != NULL) {
+		session->channels[channo] = NULL;
+		session->chan_open--;
+	}
 }
 
-void channel_free(int channo) {
-       int i;
-        for(i=0;i<MAX_NUMBER_OF_ENDPOINTS;i++) {
-               if (chantable[i].channo == channo) {
-                       chantable[i].channo = -1;
-                       chantable[i].fp = NULL;
-               }
-        }
-}
+void channel_set(session_t *session, int channo, file_t *fp) {
+
+	if (!channel_valid(channo)) {
+		return;
+	}
 
-void channel_set(int channo, file_t *fp) {
-       int i;
-        for(i=0;i<MAX_NUMBER_OF_ENDPOINTS;i++) {
-               // we overwrite existing entries, to "heal" leftover cruft
-               // just in case...
-		if (chantable[i].channo == channo) {
-			log_error("Closing leftover file for channel %d\n", channo);
-			if (chantable[i].fp != NULL) {
-				chantable[i].fp->handler->close(chantable[i].fp, 1, NULL, NULL);
+	if (channo >= session->chancap) {
+		int newcap = session->chancap ? session->chancap : 16;
+		while (newcap <= channo) {
+			newcap *= 2;
+		}
+		if (session->channels == NULL) {
+			session->channels = mem_alloc_n(newcap, &channels_type);
+		} else {
+			session->channels = mem_realloc_n(newcap, &channels_type, session->channels);
+			// realloc does not clear the new area
+			for (int i = session->chancap; i < newcap; i++) {
+				session->channels[i] = NULL;
 			}
-			chantable[i].fp = NULL;
-			chantable[i].channo = -1;
 		}
-               if (chantable[i].channo == -1) {
-                       chantable[i].channo = channo;
-                       chantable[i].fp = fp;
-                       return;
-               }
-        }
-       log_error("Did not find free ep slot for channel %d\n", channo);
+		session->chancap = newcap;
+	}
+
+	// we overwrite existing entries, to "heal" leftover cruft
+	// just in case...
+	file_t *old = session->channels[channo];
+	if (old != NULL) {
+		log_error("Closing leftover file for channel %d\n", channo);
+		old->handler->close(old, 1, NULL, NULL);
+		session->chan_open--;
+	}
+
+	session->channels[channo] = fp;
+	if (fp != NULL) {
+		session->chan_open++;
+		session->chan_total++;
+		if (session->chan_open > session->chan_peak) {
+			session->chan_peak = session->chan_open;
+		}
+	}
 }
 
+void channel_close_all(session_t *session) {
+
+	for (int i = 0; i < session->chancap; i++) {
+		file_t *fp = session->channels[i];
+		if (fp != NULL) {
+			log_info("Closing file for channel %d\n", i);
+			fp->handler->close(fp, 1, NULL, NULL);
+			session->channels[i] = NULL;
+		}
+	}
+	session->chan_open = 0;
+
+	if (session->channels != NULL) {
+		mem_free(session->channels);
+		session->channels = NULL;
+	}
+	session->chancap = 0;
+}
 
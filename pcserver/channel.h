@@ -31,11 +31,16 @@
 
 //------------------------------------------------------------------------------------
 // Mapping from channel number for open files to endpoint providers
-// These are set when the channel is opened
+// These are set when the channel is opened. Each session has its own table.
 
-void channel_init();
-file_t *channel_to_file(int chan);
-void channel_free(int channo);
-void channel_set(int channo, file_t * fp);
+// size of the channel number space (channel numbers are a byte on the wire)
+#define	MAX_CHANNELS	256
+
+void channel_init(session_t * session);
+file_t *channel_to_file(session_t * session, int chan);
+void channel_free(session_t * session, int channo);
+void channel_set(session_t * session, int channo, file_t * fp);
+// close all open files of a session, and free the table
+void channel_close_all(session_t * session);
 
 #endif
@@ -31,6 +31,8 @@
  * In this file the actual command work is done
  */
 
+#define	LOG_MODULE	LOGM_CMD
+
 #include "os.h"
 
 #include <stdio.h>
@@ -54,6 +56,9 @@
 #include "log.h"
 #include "xcmd.h"
 #include "channel.h"
+#include "session.h"
+#include "stats.h"
+#include "workers.h"
 #include "serial.h"
 #include "handler.h"
 #include "cmdnames.h"
@@ -63,7 +68,6 @@
 #undef DEBUG_READ
 #undef DEBUG_WRITE
 
-#define	MAX_BUFFER_SIZE			64
 #define	RET_BUFFER_SIZE			200
 
 
@@ -74,7 +78,7 @@
 void cmd_init() {
 	handler_init();
 	provider_init();
-	channel_init();
+	session_init();
 	xcmd_init();
 
 	// init P00/S00/R00/... file handler
@@ -90,10 +94,13 @@ void cmd_free() {
 
 	xcmd_free();
 	handler_free();
+	session_exit();
 	provider_free();
 }
 
-int cmd_assign(const char *assign_str, charset_t cset, int from_cmdline) {
+int cmd_assign(session_t *session, const char *assign_str, int from_cmdline) {
+
+	charset_t cset = session->charset;
 
 	log_debug("Assigning from server: '%s'\n", assign_str);
 
@@ -143,7 +150,7 @@ int cmd_assign(const char *assign_str, charset_t cset, int from_cmdline) {
 
 					log_debug("cmdline_assign '%s' = '%s'\n", pname, 
 						provider_parameter);
-					rv = provider_assign(drive, pname, 
+					rv = provider_assign(session, drive, pname, 
 						provider_parameter, CHARSET_ASCII, from_cmdline);
 
 					mem_free(pname);
@@ -153,7 +160,7 @@ int cmd_assign(const char *assign_str, charset_t cset, int from_cmdline) {
 				}
 			} else {
 				log_debug("No parameter for cmdline_assign\n");
-				rv = provider_assign(drive, assign_str + 2, NULL, cset, 0);
+				rv = provider_assign(session, drive, assign_str + 2, NULL, cset, 0);
 			} 
 			if (rv < 0) {
 				log_error("Could not assign, error number is %d\n", rv);
@@ -172,14 +179,16 @@ const char *get_options(const char *name, int len) {
 
 // ----------------------------------------------------------------------------------
 
-int cmd_open_file(int tfd, const char *inname, int namelen, charset_t cset, char *outbuf, int *outlen, int cmd) {
+int cmd_open_file(session_t *session, int tfd, const char *inname, int namelen, char *outbuf, int *outlen, int cmd) {
+
+	charset_t cset = session->charset;
 	
 	int rv = CBM_ERROR_DRIVE_NOT_READY;
 	const char *name = NULL;
 	file_t *fp = NULL;
 	int outln = 0;
 
-	endpoint_t *ep = provider_lookup(inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
+	endpoint_t *ep = provider_lookup(session, inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
 	if (ep != NULL) {
 		provider_t *prov = (provider_t*) ep->ptype;
 		//provider_convto(prov)(name, convlen, name, convlen);
@@ -195,7 +204,9 @@ int cmd_open_file(int tfd, const char *inname, int namelen, charset_t cset, char
 			rv = CBM_ERROR_OPEN_REL;
 		}
 		if (rv == CBM_ERROR_OK || rv == CBM_ERROR_OPEN_REL) {
-			channel_set(tfd, fp);
+			fp->drive = inname[0];
+			stats_open(fp);
+			channel_set(session, tfd, fp);
 		} else {
 			if (fp != NULL) {
 				fp->handler->close(fp, 1, outbuf, &outln);
@@ -212,7 +223,9 @@ int cmd_open_file(int tfd, const char *inname, int namelen, charset_t cset, char
 }
 
 
-int cmd_info(char *outbuf, int *outlen, charset_t outcset) {
+int cmd_info(session_t *session, char *outbuf, int *outlen) {
+
+	charset_t outcset = session->charset;
 	
 	int rv = CBM_ERROR_OK;
 
@@ -223,14 +236,45 @@ int cmd_info(char *outbuf, int *outlen, charset_t outcset) {
 	return rv;
 }
 
-int cmd_read(int tfd, char *outbuf, int *outlen, int *readflag, charset_t outcset) {
+/**
+ * send a chunk of the server statistics; chunk 0 takes a new snapshot
+ */
+int cmd_stats(session_t *session, int chunk, char *outbuf, int maxlen, int *outlen, int *eof) {
+
+	if (chunk == 0 || session->stats == NULL) {
+		mem_free(session->stats);
+		session->stats = stats_render(&session->statslen);
+	}
+
+	int offset = chunk * maxlen;
+	int n = session->statslen - offset;
+	if (n < 0) {
+		n = 0;
+	}
+	if (n > maxlen) {
+		n = maxlen;
+	}
+	memcpy(outbuf, session->stats + offset, n);
+	*outlen = n;
+	*eof = (offset + n >= session->statslen);
+
+	if (*eof) {
+		mem_free(session->stats);
+		session->stats = NULL;
+	}
+	return CBM_ERROR_OK;
+}
+
+int cmd_read(session_t *session, int tfd, char *outbuf, int maxlen, int *outlen, int *readflag) {
+
+	charset_t outcset = session->charset;
 	
 	int rv = CBM_ERROR_FILE_NOT_OPEN;
 
-	file_t *fp = channel_to_file(tfd);
+	file_t *fp = channel_to_file(session, tfd);
 	if (fp != NULL) {
 		    *readflag = 0;	// default just in case
-		    rv = fp->handler->readfile(fp, outbuf, MAX_BUFFER_SIZE-FSP_DATA, readflag, outcset);
+		    rv = fp->handler->readfile(fp, outbuf, maxlen, readflag, outcset);
 		    // TODO: handle error (rv<0)
 		    if (rv < 0) {
 				// an error is sent as REPLY with error code
@@ -238,17 +282,18 @@ int cmd_read(int tfd, char *outbuf, int *outlen, int *readflag, charset_t outcse
 				log_rv(rv);
 		    } else {
 				*outlen = rv;
+				stats_read(fp, rv);
 				rv = CBM_ERROR_OK;
 		    }
 	}
 	return rv;
 }
 
-int cmd_write(int tfd, int cmd, const char *indata, int datalen) {
+int cmd_write(session_t *session, int tfd, int cmd, const char *indata, int datalen) {
 
 	int rv = CBM_ERROR_FILE_NOT_OPEN;
 
-	file_t *fp = channel_to_file(tfd);
+	file_t *fp = channel_to_file(session, tfd);
 	//printf("WRITE: chan=%d, ep=%p\n", tfd, ep);
 	if (fp != NULL) {
 		bool_t has_eof = (cmd == FS_WRITE_EOF);
@@ -262,13 +307,14 @@ int cmd_write(int tfd, int cmd, const char *indata, int datalen) {
 			log_rv(rv);
 		} else {
 			// returns the number of bytes written when positive
+			stats_write(fp, rv);
 			rv = CBM_ERROR_OK;
 		}
 	}
 	return rv;
 }
 
-int cmd_position(int tfd, const char *indata, int datalen) {
+int cmd_position(session_t *session, int tfd, const char *indata, int datalen) {
 
 	int rv = CBM_ERROR_FILE_NOT_OPEN;
 
@@ -276,7 +322,7 @@ int cmd_position(int tfd, const char *indata, int datalen) {
 		rv = CBM_ERROR_FAULT;
 	} else {
 		// position the read/write cursor into a file
-		file_t *fp = channel_to_file(tfd);
+		file_t *fp = channel_to_file(session, tfd);
 		if (fp != NULL) {
 			int record = (indata[0] & 0xff) | ((indata[1] & 0xff) << 8);
 			log_debug("POSITION: chan=%d, record=%d\n", tfd, record);
@@ -290,36 +336,42 @@ int cmd_position(int tfd, const char *indata, int datalen) {
 }
 
 
-int cmd_close(int tfd, char *outbuf, int *outlen) {
+int cmd_close(session_t *session, int tfd, char *outbuf, int *outlen) {
 
 	int rv = CBM_ERROR_FILE_NOT_OPEN;
 	
-	*outlen = 2;
-
-	file_t *fp = channel_to_file(tfd);
+	file_t *fp = channel_to_file(session, tfd);
 	if (fp != NULL) {
 		log_info("CLOSE(%d)\n", tfd);
+		// room in outbuf; the handler sets the length it returns
+		*outlen = 2;
 		rv = fp->handler->close(fp, 1, outbuf, outlen);
-		channel_free(tfd);
+		channel_free(session, tfd);
+	} else {
+		*outlen = 0;
 	}
 	return rv;
 }
 
-int cmd_open_dir(int tfd, const char *inname, int namelen, charset_t cset) {
+int cmd_open_dir(session_t *session, int tfd, const char *inname, int namelen) {
+
+	charset_t cset = session->charset;
 
 	int rv = CBM_ERROR_DRIVE_NOT_READY;
 	const char *name = NULL;
 	file_t *fp = NULL;
 
 	//log_debug("Open directory for drive: %d\n", 0xff & buf[FSP_DATA]);
-	endpoint_t *ep = provider_lookup(inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
+	endpoint_t *ep = provider_lookup(session, inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
 	if (ep != NULL) {
 		provider_t *prov = (provider_t*) ep->ptype;
 		const char *options = get_options(inname, namelen - 1);
 		log_info("OPEN_DR(%d->%s:%s)\n", tfd, prov->name, name);
 		rv = handler_resolve_dir(ep, &fp, name, cset, NULL, options);
 		if (rv == 0) {
-			channel_set(tfd, fp);
+			fp->drive = inname[0];
+			stats_open(fp);
+			channel_set(session, tfd, fp);
 		} else {
 			log_rv(rv);
 		}
@@ -330,7 +382,8 @@ int cmd_open_dir(int tfd, const char *inname, int namelen, charset_t cset) {
 	return rv;
 }
 
-int cmd_delete(const char *inname, int namelen, charset_t cset, char *outbuf, int *outlen, int isrmdir) {
+int cmd_delete(session_t *session, const char *inname, int namelen, char *outbuf, int *outlen, int isrmdir) {
+	charset_t cset = session->charset;
 	int rv = CBM_ERROR_DRIVE_NOT_READY;
 	int outdeleted = 0;
 	file_t *file = NULL;
@@ -341,7 +394,7 @@ int cmd_delete(const char *inname, int namelen, charset_t cset, char *outbuf, in
 
 	(void) namelen;	// silence unused warning
 
-	endpoint_t *ep = provider_lookup(inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
+	endpoint_t *ep = provider_lookup(session, inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
 	if (ep != NULL) {
 		rv = handler_resolve_dir(ep, &dir, name, cset, NULL, NULL);
 
@@ -366,6 +419,8 @@ int cmd_delete(const char *inname, int namelen, charset_t cset, char *outbuf, in
 					} else {
 						rv = file->handler->scratch(file);
 					}
+					// the entry keeps a reference to the dir, which is closed below
+					file->handler->close(file, 0, NULL, NULL);
 
 					if (rv != CBM_ERROR_OK) {
 						break;
@@ -389,7 +444,9 @@ int cmd_delete(const char *inname, int namelen, charset_t cset, char *outbuf, in
 	return rv;
 }
 
-int cmd_mkdir(const char *inname, int namelen, charset_t cset) {
+int cmd_mkdir(session_t *session, const char *inname, int namelen) {
+
+	charset_t cset = session->charset;
 
 	int rv = CBM_ERROR_DRIVE_NOT_READY;
 	file_t *newdir = NULL;
@@ -397,7 +454,7 @@ int cmd_mkdir(const char *inname, int namelen, charset_t cset) {
 
 	(void) namelen;	// silence unused warning
 
-	endpoint_t *ep = provider_lookup(inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
+	endpoint_t *ep = provider_lookup(session, inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
 	if (ep != NULL) {
 		log_info("MKDIR(%s)\n", name);
 		rv = handler_resolve_file(ep, &newdir, name, cset, NULL, FS_MKDIR);
@@ -408,29 +465,31 @@ int cmd_mkdir(const char *inname, int namelen, charset_t cset) {
 	return rv;
 }
 
-int cmd_chdir(const char *inname, int namelen, charset_t cset) {
+int cmd_chdir(session_t *session, const char *inname, int namelen) {
 
 	int rv = CBM_ERROR_FAULT;
 
 	log_info("CHDIR(%s)\n", inname);
 
-	rv = provider_chdir(inname, namelen, cset);
+	rv = provider_chdir(session, inname, namelen, session->charset);
 
 	return rv;
 }
 
-int cmd_move(const char *inname, int namelen, charset_t cset) {
+int cmd_move(session_t *session, const char *inname, int namelen) {
+
+	charset_t cset = session->charset;
 
 	int err = CBM_ERROR_DRIVE_NOT_READY;
 
 	int todrive = inname[0];
 	const char *fromname = NULL;
 	const char *toname = NULL;
-	endpoint_t *epto = provider_lookup(inname, namelen, cset, &toname, NAMEINFO_UNDEF_DRIVE);
+	endpoint_t *epto = provider_lookup(session, inname, namelen, cset, &toname, NAMEINFO_UNDEF_DRIVE);
 	if (epto != NULL) {
 		const char *name2 = strchr(inname+1, 0);	// points to null byte after name
 		name2++;					// first byte of second name
-		endpoint_t *epfrom = provider_lookup(name2, namelen, cset, &fromname, todrive);
+		endpoint_t *epfrom = provider_lookup(session, name2, namelen, cset, &fromname, todrive);
 
 		if (epfrom != NULL) {
 			file_t *fromfile = NULL;
@@ -472,7 +531,9 @@ int cmd_move(const char *inname, int namelen, charset_t cset) {
 	return err;
 }
 
-int cmd_copy(const char *inname, int namelen, charset_t cset) {
+int cmd_copy(session_t *session, const char *inname, int namelen) {
+
+	charset_t cset = session->charset;
 
 	int err = CBM_ERROR_DRIVE_NOT_READY;
 
@@ -480,7 +541,7 @@ int cmd_copy(const char *inname, int namelen, charset_t cset) {
 	const char *fromname = NULL;
 	const char *toname = NULL;
 	const char *p = inname+1;
-	endpoint_t *epto = provider_lookup(inname, namelen, cset, &toname, NAMEINFO_UNDEF_DRIVE);
+	endpoint_t *epto = provider_lookup(session, inname, namelen, cset, &toname, NAMEINFO_UNDEF_DRIVE);
 	if (epto != NULL) {
 		file_t *tofile = NULL;
 		err = handler_resolve_file(epto, &tofile, toname, cset, NULL, FS_OPEN_WR);
@@ -495,7 +556,7 @@ int cmd_copy(const char *inname, int namelen, charset_t cset) {
 			int thislen = namelen - (fromname - inname);
 			while ((err == CBM_ERROR_OK) && (thislen > 0)) {
 				p = fromname + 1;
-				endpoint_t *fromep = provider_lookup(fromname, thislen, cset, &fromname, todrive);
+				endpoint_t *fromep = provider_lookup(session, fromname, thislen, cset, &fromname, todrive);
 				if (fromep != NULL) {
 					err = handler_resolve_file(fromep, &fromfile, fromname, cset,
 										NULL, FS_OPEN_RD);
@@ -525,6 +586,8 @@ int cmd_copy(const char *inname, int namelen, charset_t cset) {
 								}
 								nwritten += wlen;
 							}
+							// let other connections work between the blocks
+							workers_yield();
 						} while ((err == CBM_ERROR_OK) 
 								&& ((readflag & READFLAG_EOF) == 0));	
 						
@@ -542,7 +605,7 @@ int cmd_copy(const char *inname, int namelen, charset_t cset) {
 	return err;
 }
 
-int cmd_block(int tfd, const char *indata, const int datalen, char *outdata, int *outlen) {
+int cmd_block(session_t *session, int tfd, const char *indata, const int datalen, char *outdata, int *outlen) {
 
 	(void)datalen; // silence warning unused parameter
 
@@ -551,15 +614,20 @@ int cmd_block(int tfd, const char *indata, const int datalen, char *outdata, int
 	// not file-related, so no file descriptor (tfd)
 	// we only support mapped drives (thus name is NULL)
 	// we only interpret the drive, so namelen for the lookup is 1
-	endpoint_t *ep = provider_lookup(indata, 1, 0, NULL, NAMEINFO_UNDEF_DRIVE);
+	endpoint_t *ep = provider_lookup(session, indata, 1, 0, NULL, NAMEINFO_UNDEF_DRIVE);
 	if (ep != NULL) {
 		provider_t *prov = (provider_t*) ep->ptype;
 		if (prov->block != NULL) {
+			file_t *fp = NULL;
 			log_info("DIRECT(%d,...)\n", tfd);
-			rv = prov->block(ep, indata + 1, outdata, outlen);
+			rv = prov->block(ep, indata + 1, outdata, outlen, &fp);
 			if (rv != 0) {
 				log_rv(rv);
 			}
+			if (fp != NULL) {
+				// U1/U2 opened a block channel
+				channel_set(session, indata[FS_BLOCK_PAR_CHANNEL] & 0xff, fp);
+			}
 			log_debug("block: outlen=%d, outdata=%02x %02x %02x %02x\n",
 					*outlen, outdata[0], outdata[1], outdata[2], outdata[3]);
 		}
@@ -569,12 +637,14 @@ int cmd_block(int tfd, const char *indata, const int datalen, char *outdata, int
 	return rv;
 }
 
-int cmd_format(const char *inname, int namelen, charset_t cset) {
+int cmd_format(session_t *session, const char *inname, int namelen) {
+
+	charset_t cset = session->charset;
 
 	int rv = CBM_ERROR_DRIVE_NOT_READY;
 	const char *name = NULL;
 
-	endpoint_t *ep = provider_lookup(inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
+	endpoint_t *ep = provider_lookup(session, inname, namelen, cset, &name, NAMEINFO_UNDEF_DRIVE);
 	if (ep != NULL) {
 		provider_t *prov = (provider_t*) ep->ptype;
 		if (prov->format != NULL) {
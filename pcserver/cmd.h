@@ -27,6 +27,8 @@
 #ifndef FSCMD_H
 #define FSCMD_H
 
+#include "session.h"
+
 /* status values */
 /* Note: not really used at themoment, only F_FREE is set in the init */
 #define F_FREE          0	/* must be 0 */
@@ -36,20 +38,23 @@
 void cmd_init();
 void cmd_free();
 
-int cmd_assign(const char *assign_str, charset_t cset, int from_cmdline);
-int cmd_open_file(int tfd, const char *inname, int namelen, charset_t cset, char *outbuf, int *outlen, int cmd);
-int cmd_read(int tfd, char *outbuf, int *outlen, int *readflag, charset_t outcset);
-int cmd_info(char *outbuf, int *outlen, charset_t outcset);
-int cmd_write(int tfd, int cmd, const char *indata, int datalen);
-int cmd_position(int tfd, const char *indata, int datalen);
-int cmd_close(int tfd, char *outbuf, int *outlen);
-int cmd_open_dir(int tfd, const char *inname, int namelen, charset_t cset);
-int cmd_delete(const char *inname, int namelen, charset_t cset, char *outbuf, int *outlen, int isrmdir);
-int cmd_mkdir(const char *inname, int namelen, charset_t cset);
-int cmd_chdir(const char *inname, int namelen, charset_t cset);
-int cmd_move(const char *inname, int namelen, charset_t cset);
-int cmd_copy(const char *inname, int namelen, charset_t cset);
-int cmd_block(int tfd, const char *indata, const int datalen, char *outdata, int *outlen);
-int cmd_format(const char *inname, int namelen, charset_t cset);
+// all commands work in the context of a session, i.e. its channels, assigns and charset
+int cmd_assign(session_t *session, const char *assign_str, int from_cmdline);
+int cmd_open_file(session_t *session, int tfd, const char *inname, int namelen, char *outbuf, int *outlen, int cmd);
+int cmd_read(session_t *session, int tfd, char *outbuf, int maxlen, int *outlen, int *readflag);
+int cmd_info(session_t *session, char *outbuf, int *outlen);
+
+int cmd_stats(session_t *session, int chunk, char *outbuf, int maxlen, int *outlen, int *eof);
+int cmd_write(session_t *session, int tfd, int cmd, const char *indata, int datalen);
+int cmd_position(session_t *session, int tfd, const char *indata, int datalen);
+int cmd_close(session_t *session, int tfd, char *outbuf, int *outlen);
+int cmd_open_dir(session_t *session, int tfd, const char *inname, int namelen);
+int cmd_delete(session_t *session, const char *inname, int namelen, char *outbuf, int *outlen, int isrmdir);
+int cmd_mkdir(session_t *session, const char *inname, int namelen);
+int cmd_chdir(session_t *session, const char *inname, int namelen);
+int cmd_move(session_t *session, const char *inname, int namelen);
+int cmd_copy(session_t *session, const char *inname, int namelen);
+int cmd_block(session_t *session, int tfd, const char *indata, const int datalen, char *outdata, int *outlen);
+int cmd_format(session_t *session, const char *inname, int namelen);
 
 #endif
@@ -24,6 +24,8 @@
 
 ****************************************************************************/
 
+#define	LOG_MODULE	LOGM_CMD
+
 #include "os.h"
 
 #include <stdio.h>
@@ -61,6 +61,8 @@
 #include "terminal.h"
 #include "dir.h"
 #include "loop.h"
+#include "workers.h"
+#include "stats.h"
 #include "cmdline.h"
 #include "array_list.h"
 
@@ -73,11 +75,16 @@ static char *tsocket_name = NULL;	/* tools socket name or NULL if not given */
 
 static char *cfg_name = NULL;		/* name of the config file if non-standard */
 
+static int num_workers = 4;		/* number of worker threads for blocking provider operations */
+
+static char *stats_name = NULL;		/* file to write statistics to, or NULL */
+static int stats_interval = 10;		/* seconds between statistics updates */
+
 static err_t main_assign(const char *param, void *extra, int ival) {
 	(void) extra;
 	(void) ival;
 	
-	int err = cmd_assign(param, CHARSET_ASCII, 1);
+	int err = cmd_assign(session_default(), param, 1);
         if (err != CBM_ERROR_OK) {
                 log_error("%d Error assigning %s\n", err, param);
         }
@@ -102,6 +109,66 @@ static err_t main_xcmd(const char *param, void *extra, int ival) {
 }
 
 
+static err_t main_set_workers(const char *param, void *extra, int ival) {
+	(void) extra;
+	(void) ival;
+
+	char *end = NULL;
+	long n = strtol(param, &end, 10);
+	if (end == param || *end != 0 || n < 0 || n > 64) {
+		log_error("Illegal number of worker threads '%s'\n", param);
+		return E_ABORT;
+	}
+	num_workers = n;
+
+	return E_OK;
+}
+
+static err_t main_set_stats_interval(const char *param, void *extra, int ival) {
+	(void) extra;
+	(void) ival;
+
+	char *end = NULL;
+	long n = strtol(param, &end, 10);
+	if (end == param || *end != 0 || n < 1 || n > 86400) {
+		log_error("Illegal statistics interval '%s'\n", param);
+		return E_ABORT;
+	}
+	stats_interval = n;
+
+	return E_OK;
+}
+
+static err_t main_set_dir_ttl(const char *param, void *extra, int ival) {
+	(void) extra;
+	(void) ival;
+
+	char *end = NULL;
+	long n = strtol(param, &end, 10);
+	if (end == param || *end != 0 || n < 0 || n > 86400) {
+		log_error("Illegal directory cache time '%s'\n", param);
+		return E_ABORT;
+	}
+	curl_dir_ttl = n;
+
+	return E_OK;
+}
+
+static err_t main_set_cache_size(const char *param, void *extra, int ival) {
+	(void) extra;
+	(void) ival;
+
+	char *end = NULL;
+	long n = strtol(param, &end, 10);
+	if (end == param || *end != 0 || n < 1 || n > 1024 * 1024) {
+		log_error("Illegal cache size '%s'\n", param);
+		return E_ABORT;
+	}
+	curl_cache_mb = n;
+
+	return E_OK;
+}
+
 static err_t main_set_daemon(int flag, void *param) {
 	(void) param;
 	if (flag) {
@@ -118,9 +185,24 @@ static err_t main_set_verbose(int flag, void *param) {
         return E_OK;
 }
 
+static err_t main_set_loglevels(const char *param, void *extra, int ival) {
+	(void) extra;
+	(void) ival;
+
+	if (log_set_levels(param)) {
+		log_error("Illegal log level setting '%s'\n", param);
+		return E_ABORT;
+	}
+	return E_OK;
+}
+
 static cmdline_t main_options[] = {
         { "verbose",    "v",	CMDL_INIT,	PARTYPE_FLAG,   NULL, main_set_verbose, NULL,
                 "Set verbose mode", NULL },
+	{ "log",	"L",	CMDL_INIT,	PARTYPE_PARAM,	main_set_loglevels, NULL, NULL,
+		"Set log levels per module, e.g. '-Ldi=debug,net=warn'\n"
+		"               (modules: all, main, dev, cmd, prov, di, fs, net;\n"
+		"               levels: error, warn, info, debug)", NULL },
 	{ "config",	"c",	CMDL_CFG,	PARTYPE_PARAM,	cmdline_set_param, NULL, &cfg_name,
 		"Set name of config file instead of default ~/.xdconfig", NULL },
         { "daemon", 	"D",	CMDL_RUN,	PARTYPE_FLAG,   NULL, main_set_daemon, NULL,
@@ -133,6 +215,19 @@ static cmdline_t main_options[] = {
 	{ "tools",	"T",	CMDL_RUN,	PARTYPE_PARAM,	main_set_param, NULL, &tsocket_name,
 		"Set name of tools socket to use instead of ~/.xdtools", NULL },
 #endif
+	{ "workers",	"W",	CMDL_RUN,	PARTYPE_PARAM,	main_set_workers, NULL, NULL,
+		"Set number of worker threads for blocking provider operations\n"
+		"               (0 runs everything in the main loop, default 4)", NULL },
+	{ "stats",	"S",	CMDL_RUN,	PARTYPE_PARAM,	main_set_param, NULL, &stats_name,
+		"Periodically write statistics in Prometheus text format to the given file", NULL },
+	{ "stats-interval", NULL, CMDL_RUN,	PARTYPE_PARAM,	main_set_stats_interval, NULL, NULL,
+		"Set seconds between statistics file updates (default 10)", NULL },
+	{ "dir-ttl",	NULL,	CMDL_RUN,	PARTYPE_PARAM,	main_set_dir_ttl, NULL, NULL,
+		"Set seconds an ftp/http directory listing is reused (0 never, default 30)", NULL },
+	{ "cache-dir",	NULL,	CMDL_RUN,	PARTYPE_PARAM,	main_set_param, NULL, &curl_cache_dir,
+		"Set directory for the ftp/http block cache instead of ~/.cache/xd2031/curl", NULL },
+	{ "cache-size",	NULL,	CMDL_RUN,	PARTYPE_PARAM,	main_set_cache_size, NULL, NULL,
+		"Set max. megabytes of the ftp/http block cache (default 256)", NULL },
         { "wildcards", 	"w",	CMDL_PARAM,	PARTYPE_FLAG,   NULL, cmdline_set_flag, &advanced_wildcards,
 		"Use advanced wildcards", NULL },
         { "assign", 	"A",	CMDL_CMD,	PARTYPE_PARAM,  main_assign, NULL, NULL,
@@ -202,6 +297,10 @@ static err_t cfg_load(void) {
 
 void end(int rv) {
 
+	workers_free();
+
+	stats_free();
+
 	poll_free();
 
 	cmdline_module_free();
@@ -209,6 +308,8 @@ void end(int rv) {
 	mem_free(tsocket_name);
 	mem_free(socket_name);
 	mem_free(device_name);
+	mem_free(stats_name);
+	mem_free(curl_cache_dir);
 
 	cmd_free();
 
@@ -271,6 +372,19 @@ static void fd_hup(int fd, void *data) {
 	poll_unregister(fd);
 }
 
+static void dev_hup(int fd, void *data) {
+
+	log_debug("dev_hup for fd=%d (%p)\n", fd, data);
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	in_device_free((in_device_t*) data);
+
+	poll_unregister(fd);
+}
+
 static void fd_read(int fd, void *data) {
 
 	log_debug("fd_read for fd=%d (%p)\n", fd, data);
@@ -280,10 +394,30 @@ static void fd_read(int fd, void *data) {
 	int rv = in_device_loop(fddata);
 
 	if (rv == 2) {
-		poll_unregister(fd);
+		// device lost
+		dev_hup(fd, data);
 	}
 }
 
+static void fd_write(int fd, void *data) {
+
+	log_debug("fd_write for fd=%d (%p)\n", fd, data);
+
+	in_device_write((in_device_t*) data);
+}
+
+// wait for input and/or for the connection to become writable
+static void dev_wait(in_device_t *tp, int rd, int wr) {
+
+	poll_set_actions(tp->readfd, rd ? fd_read : NULL, wr ? fd_write : NULL);
+}
+
+static void dev_register(serial_port_t fd, in_device_t *tp) {
+
+	poll_register_readwrite(fd, tp, fd_read, NULL, dev_hup);
+	tp->wait = dev_wait;
+}
+
 static void fd_accept(int fd, void *data) {
 
 	log_debug("fd_accept for fd=%d (%p)\n", fd, data);
@@ -292,9 +426,10 @@ static void fd_accept(int fd, void *data) {
 
 	int data_fd = socket_accept(fd);
 
-	in_device_t *td = in_device_init(data_fd, data_fd, adata->do_reset);
+	// tools connections share their assigns with the default session
+	in_device_t *td = in_device_init(data_fd, data_fd, adata->do_reset, 1);
 
-	poll_register_readwrite(data_fd, td, fd_read, NULL, fd_hup);
+	dev_register(data_fd, td);
 }
 
 static void fd_listen(const char *socketname, int do_reset) {
@@ -345,6 +480,9 @@ int main(int argc, char *argv[]) {
 	if (cmdline_parse(&p, argv, CMDL_INIT+CMDL_CFG)) {
 		mainusage(EXIT_RESPAWN_NEVER);
 	}
+
+	// from here on, log output is written by a background thread
+	log_async_start();
 	
 	// set working directory before we actually parse any relevant option for it (like assign)
 	if(argc == 1) {
@@ -416,8 +554,8 @@ int main(int argc, char *argv[]) {
 		  end(EXIT_RESPAWN_NEVER);
 		}
 
-		in_device_t *fdp = in_device_init(fdesc, fdesc, 1);
-		poll_register_readwrite(fdesc, fdp, fd_read, NULL, fd_hup);
+		in_device_t *fdp = in_device_init(fdesc, fdesc, 1, 0);
+		dev_register(fdesc, fdp);
 		min_num_socks ++;
 	}
 
@@ -442,8 +580,8 @@ int main(int argc, char *argv[]) {
 				log_errno("Could not open listen socket at %s\n", socket_name);
 				end(EXIT_RESPAWN_NEVER);
 			}
-			in_device_t *fdp = in_device_init(data_fd, data_fd, 1);
-			poll_register_readwrite(data_fd, fdp, fd_read, NULL, fd_hup);
+			in_device_t *fdp = in_device_init(data_fd, data_fd, 1, 0);
+			dev_register(data_fd, fdp);
 			min_num_socks ++;
 		}
         } else 
@@ -465,16 +603,22 @@ int main(int argc, char *argv[]) {
 	}
 
 
-	while (poll_loop(1000) == 0) { 
-		// TODO: move UI input into poll_loop()
-		// UI input
-		int rv = in_ui_loop();
-		if (rv) {
+	// user interface input is handled in the poll loop
+	in_ui_register();
+
+	workers_init(num_workers);
+
+	if (stats_name != NULL) {
+		stats_set_file(stats_name, stats_interval);
+	}
+
+	while (poll_loop(-1) == 0) { 
+		if (in_ui_aborted()) {
 			break;
 		}
 
 		if (poll_num_sockets() < min_num_socks) {
-			log_debug("number of sockets %d below minimum %d - terminating\n", poll_num_sockets, min_num_socks);
+			log_debug("number of sockets %d below minimum %d - terminating\n", poll_num_sockets(), min_num_socks);
 			break;
 		}
 	}
@@ -19,6 +19,8 @@
 
 ****************************************************************************/
 
+#define	LOG_MODULE	LOGM_PROV
+
 #include "os.h"
 
 #include <sys/types.h>
@@ -34,6 +36,8 @@
 #include "wireformat.h"
 #include "wildcard.h"
 #include "openpars.h"
+#include "hashmap.h"
+#include "stats.h"
 
 
 
@@ -47,6 +51,37 @@
 
 static registry_t handlers;
 
+// max. number of files in the wrapper detection cache
+#define	DETECT_MAX		4096
+
+// no handler wraps the file resp. not known yet
+#define	DETECT_NONE		-1
+#define	DETECT_UNKNOWN		-2
+
+typedef struct {
+	uint64_t	fsdev;
+	uint64_t	fsino;
+	time_t		lastmod;
+	size_t		filesize;
+	char		*filename;
+} detect_key_t;
+
+typedef struct {
+	detect_key_t	key;
+	int		handler;	// index of the handler that wraps the file, or DETECT_*
+	int		datalen;	// -1 when no data saved
+	uint8_t		data[HANDLER_DETECT_DATA];
+} detect_t;
+
+static type_t detect_type = {
+	"handler_detect",
+	sizeof(detect_t),
+	NULL
+};
+
+// wrapper detection cache
+static hash_t *detects = NULL;
+
 /*
  * register a new provider, usually called at startup
  */
@@ -63,12 +98,102 @@ void handler_init(void) {
 	reg_init(&handlers, "handlers", 10);
 }
 
+static int detect_hash(const void *key) {
+	const detect_key_t *k = (const detect_key_t*) key;
+
+	return (int) (k->fsino * 31 + k->fsdev * 7 + k->lastmod + k->filesize);
+}
+
+static const void *detect_key(const void *entry) {
+	return &((const detect_t*) entry)->key;
+}
+
+static bool_t detect_equals(const void *fromhash, const void *tobeadded) {
+	const detect_key_t *a = (const detect_key_t*) fromhash;
+	const detect_key_t *b = (const detect_key_t*) tobeadded;
+
+	return a->fsdev == b->fsdev && a->fsino == b->fsino
+		&& a->lastmod == b->lastmod && a->filesize == b->filesize
+		&& !strcmp(a->filename, b->filename);
+}
+
+static void detect_free(const void *key, void *entry) {
+	(void) key;
+	detect_t *dt = (detect_t*) entry;
+
+	mem_free(dt->key.filename);
+	mem_free(dt);
+}
+
+/*
+ * find the cache entry for the file, and create it when create is set.
+ * Returns NULL when the file has no identity.
+ */
+static detect_t *detect_get(file_t *file, int create) {
+
+	if (file->fsino == 0 || file->filename == NULL) {
+		return NULL;
+	}
+
+	detect_key_t key = { file->fsdev, file->fsino, file->lastmod, file->filesize,
+				(char*) file->filename };
+
+	detect_t *dt = NULL;
+	if (detects != NULL) {
+		dt = hash_get(detects, &key);
+	}
+
+	if (dt == NULL && create) {
+		if (detects != NULL && hash_size(detects) >= DETECT_MAX) {
+			// start over, files seen again come back soon enough
+			hash_free(detects, detect_free);
+			detects = NULL;
+		}
+		if (detects == NULL) {
+			detects = hash_init(DETECT_MAX, DETECT_MAX / 8, detect_hash, detect_key, detect_equals);
+		}
+		dt = mem_alloc(&detect_type);
+		dt->key = key;
+		dt->key.filename = mem_alloc_str(file->filename);
+		dt->handler = DETECT_UNKNOWN;
+		dt->datalen = -1;
+		hash_put(detects, dt);
+	}
+	return dt;
+}
+
+int handler_detect_data(file_t *file, uint8_t *buf, int len) {
+
+	detect_t *dt = detect_get(file, 0);
+
+	if (dt == NULL || dt->datalen < 0 || dt->datalen > len) {
+		return -1;
+	}
+	memcpy(buf, dt->data, dt->datalen);
+	return dt->datalen;
+}
+
+void handler_detect_save(file_t *file, const uint8_t *data, int len) {
+
+	detect_t *dt = detect_get(file, 1);
+
+	if (dt != NULL && len <= HANDLER_DETECT_DATA) {
+		memcpy(dt->data, data, len);
+		dt->datalen = len;
+	}
+}
+
 /*
  * clean up
  */
 void handler_free(void) {
 
 	reg_free(&handlers, NULL);
+
+	if (detects != NULL) {
+		hash_free(detects, detect_free);
+		detects = NULL;
+	}
 }
 
 
@@ -101,7 +226,18 @@ int handler_next(file_t *infile, const char *pattern, charset_t cset, const char
 	int err = CBM_ERROR_FILE_NOT_FOUND;
 	*outfile = NULL;
 
-	for (int i = 0; ; i++) {
+	// Whether a handler wraps the file does not depend on the pattern. A
+	// handler wrapping the file either returns the wrapped file, or an error
+	// if the name does not match
+	detect_t *dt = detect_get(infile, 1);
+	int known = (dt == NULL) ? DETECT_UNKNOWN : dt->handler;
+	int found = DETECT_NONE;
+
+	if (dt != NULL) {
+		stats_cache("handler_detect", known != DETECT_UNKNOWN);
+	}
+
+	for (int i = (known >= 0) ? known : 0; known != DETECT_NONE; i++) {
 		handler_t *handler = reg_get(&handlers, i);
 		if (handler == NULL) {
 			// no handler found
@@ -113,15 +249,31 @@ int handler_next(file_t *infile, const char *pattern, charset_t cset, const char
 			if (*outfile != NULL) {
 				// found a handler
 				err = CBM_ERROR_OK;
+				found = i;
 				break;
 			}
 		} else {
 			log_error("Got %d as error from handler %s for %s\n", 
 				err, handler->name, pattern);
-			return err;
+			found = i;
+			break;
+		}
+		if (known >= 0) {
+			// only the known handler
+			break;
 		}
 	}
 
+	if (known == DETECT_UNKNOWN && dt != NULL) {
+		// resolve may have let other threads run, so look it up again
+		dt = detect_get(infile, 1);
+		dt->handler = found;
+	}
+
+	if (found >= 0 && *outfile == NULL) {
+		return err;
+	}
+
 	if (*outfile == NULL) {
 		// no wrapper has matched
 		// check original name
@@ -756,14 +908,8 @@ int default_open(file_t *file, openpars_t *pars, int opentype) {
 
 int default_scratch(file_t *file) {
 
-	cbm_errno_t rv = file->parent->handler->scratch(file->parent);
-
-	if (rv == CBM_ERROR_OK) {	
-		// parent file is closed
-		mem_free(file);
-	}
-
-	return rv;
+	// the wrapper and the parent file are closed by the caller
+	return file->parent->handler->scratch(file->parent);
 }
 
 file_t* default_parent(file_t *file) {
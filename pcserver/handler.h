@@ -94,6 +94,20 @@ int handler_resolve_block(endpoint_t * ep, int chan, file_t ** outfile);
 int handler_next(file_t * infile, const char *pattern, charset_t cset,
 		 const char **outpattern, file_t ** outfile);
 
+/*
+ * The handler that wraps a file is remembered per file (by fsdev, fsino,
+ * lastmod, filesize and name), so handler_next() only needs to ask that
+ * handler next time. A handler can also save up to HANDLER_DETECT_DATA
+ * bytes of data it needed for the detection, like the x00 header.
+ */
+#define	HANDLER_DETECT_DATA	32
+
+// copy the saved detection data for the file into buf, and return its
+// length, or -1 if none saved
+int handler_detect_data(file_t *file, uint8_t *buf, int len);
+
+void handler_detect_save(file_t *file, const uint8_t *data, int len);
+
 /*
  * not really nice, but here's the list of existing handlers (before we do an own
  * header file for each one separately...
@@ -0,0 +1,437 @@
+/****************************************************************************
+
+    Serial line filesystem server
+    Copyright (C) 2012 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/*
+ * block cache on disk for the curl provider, see curl_cache.h
+ *
+ * All functions are called with the server lock held.
+ */
+
+#define	LOG_MODULE	LOGM_NET
+
+// for flock(), hidden by _POSIX_C_SOURCE
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define	_DEFAULT_SOURCE
+#endif
+
+#include "os.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "curl_cache.h"
+#include "mem.h"
+#include "log.h"
+
+// first line of the index file
+#define	INDEX_MAGIC	"xd2031 curl cache 1"
+
+// directory of the cache files, NULL for the default
+char *curl_cache_dir = NULL;
+
+// max. size of the cache files in the directory, in megabytes
+int curl_cache_mb = 256;
+
+static type_t cache_type = {
+	"curl_cache",
+	sizeof(curl_cache_t),
+	NULL
+};
+
+// directory of the cache files, NULL until first used
+static char *cache_dir = NULL;
+
+// bytes written to the cache since the size of the directory was checked
+static off_t cache_grown = 0;
+
+// create the cache directory and its parents as needed
+static const char *get_cache_dir(void) {
+
+	if (cache_dir == NULL) {
+		char *path = NULL;
+
+		if (curl_cache_dir != NULL) {
+			path = mem_alloc_str(curl_cache_dir);
+		} else {
+			const char *home = os_get_home_dir();
+			mem_append_str2(&path, home, "/.cache");
+			os_mkdir(path, 0700);
+			mem_append_str2(&path, "/xd2031", NULL);
+			os_mkdir(path, 0700);
+			mem_append_str2(&path, "/curl", NULL);
+		}
+		if (os_mkdir(path, 0700) < 0 && errno != EEXIST) {
+			log_errno("Could not create cache directory %s", path);
+			mem_free(path);
+			return NULL;
+		}
+		cache_dir = path;
+	}
+	return cache_dir;
+}
+
+// FNV-1a hash of the URL as file name
+static char *cache_path(const char *url) {
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char *p = url; *p; p++) {
+		hash ^= (uint8_t) *p;
+		hash *= 1099511628211ULL;
+	}
+
+	const char *dir = get_cache_dir();
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	char name[20];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long) hash);
+
+	char *path = NULL;
+	mem_append_str5(&path, dir, "/", name, NULL, NULL);
+	return path;
+}
+
+// a data file in the cache directory, for cache_trim()
+typedef struct {
+	char		*name;		// without extension
+	time_t		mtime;		// last use
+	off_t		used;		// disk space used
+} cache_entry_t;
+
+static int cache_entry_cmp(const void *a, const void *b) {
+	time_t ta = ((const cache_entry_t*) a)->mtime;
+	time_t tb = ((const cache_entry_t*) b)->mtime;
+
+	return (ta < tb) ? -1 : (ta > tb);
+}
+
+// remove the least recently used cache files, until the directory holds
+// at most three quarters of curl_cache_mb. Files that are locked are
+// open, here or in another server process, and are kept.
+static void cache_trim(void) {
+
+	const char *dir = get_cache_dir();
+	DIR *dp = (dir == NULL) ? NULL : opendir(dir);
+	if (dp == NULL) {
+		return;
+	}
+
+	int n = 0;
+	int cap = 16;
+	cache_entry_t *entries = mem_alloc_c(cap * sizeof(cache_entry_t), "curl_cache_entries");
+	off_t total = 0;
+	off_t max = (off_t) curl_cache_mb * 1024 * 1024;
+
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		size_t len = strlen(de->d_name);
+		if (len < 5 || strcmp(de->d_name + len - 4, ".dat")) {
+			continue;
+		}
+		char *name = NULL;
+		mem_append_str5(&name, dir, "/", de->d_name, NULL, NULL);
+		name[strlen(name) - 4] = 0;
+
+		char *dataname = NULL;
+		mem_append_str2(&dataname, name, ".dat");
+		struct stat st;
+		if (stat(dataname, &st) < 0) {
+			mem_free(dataname);
+			mem_free(name);
+			continue;
+		}
+		mem_free(dataname);
+
+		if (n == cap) {
+			cap *= 2;
+			cache_entry_t *ne = mem_alloc_c(cap * sizeof(cache_entry_t), "curl_cache_entries");
+			memcpy(ne, entries, n * sizeof(cache_entry_t));
+			mem_free(entries);
+			entries = ne;
+		}
+		// the files are sparse
+		entries[n].name = name;
+		entries[n].mtime = st.st_mtime;
+		entries[n].used = (off_t) st.st_blocks * 512;
+		total += entries[n].used;
+		n++;
+	}
+	closedir(dp);
+
+	if (total > max) {
+		qsort(entries, n, sizeof(cache_entry_t), cache_entry_cmp);
+
+		for (int i = 0; i < n && total > max / 4 * 3; i++) {
+			char *dataname = NULL;
+			char *idxname = NULL;
+			mem_append_str2(&dataname, entries[i].name, ".dat");
+			mem_append_str2(&idxname, entries[i].name, ".idx");
+
+			int fd = open(dataname, O_RDWR | O_CLOEXEC);
+			if (fd >= 0) {
+				if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+					log_debug("removing cache file %s\n", dataname);
+					unlink(idxname);
+					unlink(dataname);
+					total -= entries[i].used;
+				}
+				close(fd);
+			}
+			mem_free(dataname);
+			mem_free(idxname);
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		mem_free(entries[i].name);
+	}
+	mem_free(entries);
+	cache_grown = 0;
+}
+
+// an unnamed data file for a URL whose cache file is open elsewhere
+static int cache_tmpfile(void) {
+
+	const char *dir = get_cache_dir();
+	if (dir == NULL) {
+		return -1;
+	}
+	char *name = NULL;
+	mem_append_str2(&name, dir, "/tmpXXXXXX");
+	int fd = mkstemp(name);
+	if (fd >= 0) {
+		unlink(name);
+	} else {
+		log_errno("Could not create temporary cache file %s", name);
+	}
+	mem_free(name);
+	return fd;
+}
+
+static char *index_name(curl_cache_t *cc, const char *ext) {
+	char *name = NULL;
+	mem_append_str2(&name, cc->path, ext);
+	return name;
+}
+
+static void cache_set(curl_cache_t *cc, off_t size, const char *validator) {
+
+	if (cc->present != NULL) {
+		mem_free(cc->present);
+	}
+	if (cc->validator != NULL) {
+		mem_free(cc->validator);
+	}
+	cc->size = size;
+	cc->validator = mem_alloc_str(validator == NULL ? "" : validator);
+	cc->nblocks = (size + CURL_CACHE_BLOCK - 1) / CURL_CACHE_BLOCK;
+	cc->present = mem_alloc_c((cc->nblocks + 7) / 8 + 1, "curl_cache_present");
+	memset(cc->present, 0, (cc->nblocks + 7) / 8 + 1);
+}
+
+// write the index to a new file, then move it over the old one
+static void index_save(curl_cache_t *cc) {
+
+	if (cc->private) {
+		return;
+	}
+
+	char *tmpname = index_name(cc, ".idx.tmp");
+	char *idxname = index_name(cc, ".idx");
+
+	FILE *fp = fopen(tmpname, "wb");
+	if (fp != NULL) {
+		fprintf(fp, "%s\n%lld\n%s\n", INDEX_MAGIC, (long long) cc->size, cc->validator);
+		fwrite(cc->present, 1, (cc->nblocks + 7) / 8, fp);
+		if (fclose(fp) == 0) {
+			rename(tmpname, idxname);
+		}
+	} else {
+		log_errno("Could not write cache index %s", tmpname);
+	}
+	mem_free(tmpname);
+	mem_free(idxname);
+}
+
+// read the index; returns 0 when it is for the given size and validator
+static int index_load(curl_cache_t *cc, off_t size, const char *validator) {
+
+	int rv = -1;
+	char *idxname = index_name(cc, ".idx");
+	FILE *fp = fopen(idxname, "rb");
+	mem_free(idxname);
+
+	if (fp == NULL) {
+		return rv;
+	}
+
+	char line[256];
+	long long isize = -1;
+	if (fgets(line, sizeof(line), fp) != NULL
+		&& !strncmp(line, INDEX_MAGIC "\n", sizeof(line))
+		&& fgets(line, sizeof(line), fp) != NULL
+		&& sscanf(line, "%lld", &isize) == 1
+		&& isize == (long long) size
+		&& fgets(line, sizeof(line), fp) != NULL) {
+
+		line[strcspn(line, "\n")] = 0;
+		if (!strcmp(line, validator == NULL ? "" : validator)) {
+			int len = (cc->nblocks + 7) / 8;
+			if ((int) fread(cc->present, 1, len, fp) == len) {
+				rv = 0;
+			}
+		}
+	}
+	fclose(fp);
+	return rv;
+}
+
+curl_cache_t *curl_cache_open(const char *url, off_t size, const char *validator) {
+
+	char *path = cache_path(url);
+	if (path == NULL) {
+		return NULL;
+	}
+
+	cache_trim();
+
+	curl_cache_t *cc = mem_alloc(&cache_type);
+	cc->path = path;
+	cc->private = 0;
+	cc->fd = -1;
+	cache_set(cc, size, validator);
+
+	char *dataname = index_name(cc, ".dat");
+	cc->fd = open(dataname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (cc->fd >= 0 && flock(cc->fd, LOCK_EX | LOCK_NB) < 0) {
+		log_debug("cache file %s is in use, using a temporary file\n", dataname);
+		close(cc->fd);
+		cc->private = 1;
+		cc->fd = cache_tmpfile();
+	}
+	if (cc->fd < 0) {
+		log_errno("Could not open cache file %s", dataname);
+		mem_free(dataname);
+		curl_cache_close(cc);
+		return NULL;
+	}
+	mem_free(dataname);
+
+	// last use, for cache_trim()
+	futimens(cc->fd, NULL);
+
+	if (cc->private || index_load(cc, size, validator) != 0) {
+		log_debug("curl cache for %s is new or outdated\n", url);
+		curl_cache_reset(cc, size, validator);
+	}
+	return cc;
+}
+
+void curl_cache_reset(curl_cache_t *cc, off_t size, const char *validator) {
+
+	cache_set(cc, size, validator);
+
+	// drop the data, but keep the file sparse
+	if (ftruncate(cc->fd, 0) < 0 || ftruncate(cc->fd, size) < 0) {
+		log_errno("Could not truncate cache file %s", cc->path);
+	}
+	index_save(cc);
+}
+
+int curl_cache_has(curl_cache_t *cc, int block) {
+
+	return block >= 0 && block < cc->nblocks
+		&& (cc->present[block >> 3] & (1 << (block & 7)));
+}
+
+int curl_cache_read(curl_cache_t *cc, off_t offset, uint8_t *buf, int len) {
+
+	ssize_t n = pread(cc->fd, buf, len, offset);
+	if (n < 0) {
+		log_errno("Could not read cache file %s", cc->path);
+		return -1;
+	}
+	return n;
+}
+
+int curl_cache_write(curl_cache_t *cc, off_t offset, const uint8_t *buf, int len) {
+
+	if (offset + len > cc->size) {
+		// more data than announced
+		len = offset < cc->size ? cc->size - offset : 0;
+	}
+	ssize_t n = pwrite(cc->fd, buf, len, offset);
+	if (n < 0) {
+		log_errno("Could not write cache file %s", cc->path);
+		return -1;
+	}
+	return n;
+}
+
+void curl_cache_mark(curl_cache_t *cc, off_t from, off_t to) {
+
+	int first = (from + CURL_CACHE_BLOCK - 1) / CURL_CACHE_BLOCK;
+	int last = (to >= cc->size) ? cc->nblocks : to / CURL_CACHE_BLOCK;
+
+	for (int b = first; b < last; b++) {
+		cc->present[b >> 3] |= 1 << (b & 7);
+	}
+	if (first < last) {
+		index_save(cc);
+
+		cache_grown += (off_t) (last - first) * CURL_CACHE_BLOCK;
+		if (cache_grown > (off_t) curl_cache_mb * 1024 * 1024 / 8) {
+			cache_trim();
+		}
+	}
+}
+
+void curl_cache_close(curl_cache_t *cc) {
+
+	if (cc->fd >= 0) {
+		// also releases the lock
+		close(cc->fd);
+	}
+	mem_free(cc->path);
+	if (cc->validator != NULL) {
+		mem_free(cc->validator);
+	}
+	if (cc->present != NULL) {
+		mem_free(cc->present);
+	}
+	mem_free(cc);
+}
+
+void curl_cache_free(void) {
+
+	if (cache_dir != NULL) {
+		mem_free(cache_dir);
+		cache_dir = NULL;
+	}
+}
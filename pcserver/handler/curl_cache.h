@@ -0,0 +1,92 @@
+/****************************************************************************
+
+    Serial line filesystem server
+    Copyright (C) 2012 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/*
+ * Block cache on disk for random access to remote files of the curl provider.
+ *
+ * The blocks of a remote file are kept in a sparse file in the cache
+ * directory (curl_cache_dir, default ~/.cache/xd2031/curl), named after a
+ * hash of the URL. An index file next to it holds the size and validator
+ * (ETag or Last-Modified) of the remote file, and which blocks are present.
+ * When the validator or size changes, the cached blocks are dropped.
+ *
+ * The data file is locked with flock() while it is open. Another file
+ * open on the same URL, in this or another server process, gets an
+ * unnamed temporary file instead, which is gone on close. The least
+ * recently used cache files that are not open are removed when the
+ * directory holds more than curl_cache_mb megabytes.
+ */
+
+#ifndef CURL_CACHE_H
+#define CURL_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// size of a cache block, i.e. the unit fetched with a range request
+#define	CURL_CACHE_BLOCK	4096
+
+typedef struct {
+	char		*path;		// name of the cache files, without extension
+	int		private;	// temporary data file, without index
+	int		fd;		// sparse data file, or -1
+	off_t		size;		// size of the remote file
+	char		*validator;	// ETag or Last-Modified of the remote file
+	int		nblocks;
+	uint8_t		*present;	// bitmap of the blocks present
+} curl_cache_t;
+
+/**
+ * open the cache for the given URL. Cached blocks are kept when size
+ * and validator are the same as when they were stored. Returns NULL
+ * when the cache files cannot be created.
+ */
+curl_cache_t *curl_cache_open(const char *url, off_t size, const char *validator);
+
+/**
+ * drop all blocks, e.g. when the remote file has changed
+ */
+void curl_cache_reset(curl_cache_t *cc, off_t size, const char *validator);
+
+/**
+ * return true when the block is in the cache
+ */
+int curl_cache_has(curl_cache_t *cc, int block);
+
+/**
+ * read/write data at the given file offset. Returns the number of bytes
+ * read/written, or -1 on error
+ */
+int curl_cache_read(curl_cache_t *cc, off_t offset, uint8_t *buf, int len);
+int curl_cache_write(curl_cache_t *cc, off_t offset, const uint8_t *buf, int len);
+
+/**
+ * mark the blocks that are completely within from (incl.) and to (excl.)
+ * as present, and save the index. The last block counts as complete when
+ * to is the end of the file.
+ */
+void curl_cache_mark(curl_cache_t *cc, off_t from, off_t to);
+
+void curl_cache_close(curl_cache_t *cc);
+
+void curl_cache_free(void);
+
+#endif
@@ -34,6 +34,8 @@
 
 #define DEBUG_CURL
 
+#define	LOG_MODULE	LOGM_NET
+
 #include "os.h"
 
 #include <curl/curl.h>
@@ -42,23 +44,32 @@
 #include <strings.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <poll.h>
 
 
 #include "wireformat.h"
 #include "provider.h"
 #include "handler.h"
 #include "log.h"
+#include "workers.h"
+#include "loop.h"
 #include "filetypes.h"
 #include "dir.h"
+#include "stats.h"
+#include "curl_cache.h"
 
 
 #undef DEBUG_CURL
 
-#define	MAX_BUFFER_SIZE	64
+#define	MAX_BUFFER_SIZE	32768	// per file buffer for received data, at least CURL_MAX_WRITE_SIZE
 
 #define	MAX_PROTO_SIZE	11	// max length of "<proto>://", like "webdavs://", plus one "/" path separator
 
-#define	MAX_SESSIONS	10
+#define	MAX_SESSIONS	10	// max. number of idle sessions kept for reuse
+
+#define	MAX_LISTINGS	16	// max. number of directory listings kept
+
+#define	READAHEAD_BLOCKS 8	// cache blocks are fetched in aligned groups of this many
 
 extern provider_t ftp_provider;
 extern provider_t http_provider;
@@ -69,6 +80,25 @@ static handler_t curl_file_handler;
 static int curl_init_done = 0;
 // list of endpoints
 static registry_t endpoints;
+// idle sessions, oldest first
+static registry_t sessions;
+// directory listings (curl_listing_t), oldest first
+static registry_t listings;
+// servers ("<proto>://<host>") that do not know MLSD
+static registry_t nomlsd;
+
+// seconds a directory listing is reused
+int curl_dir_ttl = 30;
+
+// the multi handle all transfers run in. Its sockets and timeout are
+// watched by the server's poll loop, so transfers make progress in the
+// background, and the data is buffered per file until the device reads it.
+// All calls into curl are done with the server lock held.
+static CURLM *multi = NULL;
+// poll loop timer for curl's timeout, or -1
+static int multi_timer = -1;
+// curl's sockets (curl_sock_t), to drive the transfers without worker threads
+static registry_t socks;
 
 static int curl_close(file_t *fp, int recurse, char *outbuf, int *outlen);
 
@@ -81,12 +111,15 @@ typedef enum {
 } proto_t;
 
 struct curl_endpoint_t;
+struct curl_listing_t;
 
 typedef struct File {
 	file_t	file;			// embedded
 	int	chan;			// channel
 	CURL 	*session;		// curl session info
-	CURLM 	*multi;			// curl session info
+	int	paused;			// transfer paused, as the read buffer is full
+	int	done;			// transfer has ended
+	CURLcode result;		// result of the transfer when done
 	int	(*read_converter)(struct curl_endpoint_t *cep, struct File *fp, char *retbuf, int len, int *eof);
 
 	char	*wrbuffer;		// write transfer buffer (for callback) - malloc'd
@@ -98,7 +131,19 @@ typedef struct File {
 	int	rdbufdatalen;		// read transfer buffer content length (for callback)
 	int	bufrp;			// buffer read pointer
 	// directory read state
-	int	read_state;		// data for read_converter / read_file
+	int	read_state;		// data for read_converter
+	struct curl_listing_t *listing;	// directory entries
+	// random access through the block cache, after a seek
+	curl_cache_t *cache;		// block cache, NULL before the first seek
+	off_t	pos;			// read position
+	off_t	size;			// size of the remote file, -1 when not known yet
+	char	*validator;		// ETag or Last-Modified of the remote file
+	char	*etag;			// headers of the last response
+	char	*lastmod;
+	int	busy;			// request for the cache or size running
+	int	wfirst;			// request has not yet received data
+	off_t	wstart;			// where the request's data goes in the cache
+	off_t	wpos;
 } File;
 
 
@@ -113,7 +158,9 @@ static void file_init(const type_t *t, void *obj) {
 
 	fp->chan = -1;
 	fp->session = NULL;
-	fp->multi = NULL;
+	fp->paused = 0;
+	fp->done = 0;
+	fp->result = CURLE_OK;
 
 	fp->rdbuffer = NULL;
 	fp->rdbuflen = 0;
@@ -127,6 +174,15 @@ static void file_init(const type_t *t, void *obj) {
 
 	fp->read_converter = NULL;
 	fp->read_state = 0;
+	fp->listing = NULL;
+
+	fp->cache = NULL;
+	fp->pos = 0;
+	fp->size = -1;
+	fp->validator = NULL;
+	fp->etag = NULL;
+	fp->lastmod = NULL;
+	fp->busy = 0;
 }
 
 static type_t file_type = {
@@ -146,7 +202,6 @@ typedef struct curl_endpoint_t {
 	// payload
 	proto_t			protocol;	// type of provider
 	char			error_buffer[CURL_ERROR_SIZE];
-	char			*name_buffer;
 	char			*host_buffer;
 	char			*path_buffer;
 
@@ -165,7 +220,6 @@ static void endpoint_init(const type_t *t, void *obj) {
         fsep->base.is_assigned = 0;
 
 	fsep->error_buffer[0] = 0;
-	fsep->name_buffer = NULL;
 	fsep->path_buffer = NULL;
 	fsep->host_buffer = NULL;
 
@@ -191,8 +245,29 @@ static void curl_free_ep(registry_t *reg, void *en) {
         mem_free(en);
 }
 
+static void curl_free_session(registry_t *reg, void *en);
+static void curl_free_sock(registry_t *reg, void *en);
+static void curl_free_listing(registry_t *reg, void *en);
+static void curl_free_server(registry_t *reg, void *en);
+static void listing_put(struct curl_listing_t *li);
+static void multi_init(void);
+
 static void curl_end() {
 	reg_free(&endpoints, curl_free_ep);
+	reg_free(&sessions, curl_free_session);
+	reg_free(&listings, curl_free_listing);
+	reg_free(&nomlsd, curl_free_server);
+
+	if (multi != NULL) {
+		// the poll loop is gone already
+		curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, NULL);
+		curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, NULL);
+		curl_multi_cleanup(multi);
+		multi = NULL;
+	}
+	reg_free(&socks, curl_free_sock);
+
+	curl_cache_free();
 }
 
 // note: curl_init is being called twice, for HTTP as well as FTP
@@ -201,6 +276,10 @@ static void curl_init() {
 	if (!curl_init_done) {
 
 		reg_init(&endpoints, "curl_endpoints", 10);
+		reg_init(&sessions, "curl_sessions", MAX_SESSIONS + 1);
+		reg_init(&socks, "curl_sockets", 4);
+		reg_init(&listings, "curl_listings", MAX_LISTINGS + 1);
+		reg_init(&nomlsd, "curl_nomlsd", 4);
 
 		// according to the curl man page, this init can be done multiple times
 		CURLcode cc = curl_global_init(CURL_GLOBAL_ALL);
@@ -208,6 +287,8 @@ static void curl_init() {
 			// error handling!
 		}
 
+		multi_init();
+
 		curl_init_done = 1;
 	}
 }
@@ -366,6 +447,9 @@ static int curl_to_endpoint(file_t *file, endpoint_t **outep) {
         curl_endpoint_t *newep = mem_alloc(&endpoint_type);
 
 
+	newep->protocol = parentep->protocol;
+	newep->base.ptype = parentep->base.ptype;
+
 	newep->host_buffer = mem_alloc_str(parentep->host_buffer);
 	if (parentep->path_buffer != NULL) {
 		newep->path_buffer = mem_alloc_str(parentep->path_buffer);
@@ -382,6 +466,328 @@ static int curl_to_endpoint(file_t *file, endpoint_t **outep) {
 }
 
 
+//-----------------------------------------------------
+// session pool
+//
+// A closed file gives its easy handle back to the pool, so the next file
+// on the same server can reuse it. The connection stays in the connection
+// cache of the multi handle, so the next transfer does not need to connect
+// again as long as the server keeps the connection alive. Sessions are
+// shared between all endpoints for the same server, as e.g. each
+// LOAD"ftp:host/file" creates a new temporary endpoint.
+
+typedef struct {
+	char	*server;	// "<proto>://<host>" the connections go to
+	CURL	*session;
+} curl_session_t;
+
+static type_t session_type = {
+	"curl_session",
+	sizeof(curl_session_t),
+	NULL
+};
+
+static void curl_free_session(registry_t *reg, void *en) {
+	(void) reg;
+	curl_session_t *ses = (curl_session_t*) en;
+
+	curl_easy_cleanup(ses->session);
+	mem_free(ses->server);
+	mem_free(ses);
+}
+
+static char *session_server(curl_endpoint_t *cep) {
+	char *server = NULL;
+	mem_append_str5(&server, ((provider_t*)(cep->base.ptype))->name, "://",
+		cep->host_buffer, NULL, NULL);
+	return server;
+}
+
+/**
+ * get the handles for a new transfer to the endpoint's server; an idle
+ * session for the same server is reused, the most recently used first.
+ * Returns CBM_ERROR_OK or CBM_ERROR_FAULT.
+ */
+static int session_get(curl_endpoint_t *cep, File *fp) {
+
+	char *server = session_server(cep);
+
+	for (int i = reg_size(&sessions) - 1; i >= 0; i--) {
+		curl_session_t *ses = reg_get(&sessions, i);
+		if (!strcmp(ses->server, server)) {
+			reg_remove_pos(&sessions, i);
+			fp->session = ses->session;
+			mem_free(ses->server);
+			mem_free(ses);
+			mem_free(server);
+			stats_cache("curl_session", 1);
+			return CBM_ERROR_OK;
+		}
+	}
+	mem_free(server);
+	stats_cache("curl_session", 0);
+
+	fp->session = curl_easy_init();
+	if (fp->session == NULL) {
+		log_error("easy session is NULL\n");
+		return CBM_ERROR_FAULT;
+	}
+	return CBM_ERROR_OK;
+}
+
+/**
+ * give the file's handle back to the pool. The options are reset,
+ * but the connection stays open. When more than MAX_SESSIONS sessions are
+ * idle, the one unused for the longest time is closed.
+ */
+static void session_put(curl_endpoint_t *cep, File *fp) {
+
+	curl_multi_remove_handle(multi, fp->session);
+	curl_easy_reset(fp->session);
+
+	curl_session_t *ses = mem_alloc(&session_type);
+	ses->server = session_server(cep);
+	ses->session = fp->session;
+	reg_append(&sessions, ses);
+
+	fp->session = NULL;
+
+	if (reg_size(&sessions) > MAX_SESSIONS) {
+		curl_session_t *old = reg_get(&sessions, 0);
+		reg_remove_pos(&sessions, 0);
+		curl_free_session(&sessions, old);
+	}
+}
+
+//-----------------------------------------------------
+// multi handle driven by the poll loop
+
+typedef struct {
+	int	fd;
+	int	what;		// CURL_POLL_* curl waits for
+} curl_sock_t;
+
+static type_t sock_type = {
+	"curl_sock",
+	sizeof(curl_sock_t),
+	NULL
+};
+
+static void curl_free_sock(registry_t *reg, void *en) {
+	(void) reg;
+	mem_free(en);
+}
+
+// mark the transfers that have ended, and wake up the readers
+static void multi_check_done(void) {
+
+	int msgs_in_queue = 0;
+	CURLMsg *cmsg = NULL;
+	while ((cmsg = curl_multi_info_read(multi, &msgs_in_queue)) != NULL) {
+		if (cmsg->msg == CURLMSG_DONE) {
+			File *fp = NULL;
+			curl_easy_getinfo(cmsg->easy_handle, CURLINFO_PRIVATE, (char**) &fp);
+			if (fp == NULL) {
+				continue;
+			}
+			fp->done = 1;
+			fp->result = cmsg->data.result;
+			if (fp->result != CURLE_OK) {
+				log_error("errorbuffer = %s\n",
+					((curl_endpoint_t*)fp->file.endpoint)->error_buffer);
+			}
+			log_debug("transfer done, result=%d\n", fp->result);
+		}
+	}
+	workers_notify();
+}
+
+static void multi_action(curl_socket_t s, int ev) {
+	int running_handles = 0;
+
+	curl_multi_socket_action(multi, s, ev, &running_handles);
+	multi_check_done();
+}
+
+static void sock_read(int fd, void *data) {
+	(void) data;
+	multi_action(fd, CURL_CSELECT_IN);
+}
+
+static void sock_write(int fd, void *data) {
+	(void) data;
+	multi_action(fd, CURL_CSELECT_OUT);
+}
+
+static void sock_hup(int fd, void *data) {
+	(void) data;
+	multi_action(fd, CURL_CSELECT_ERR);
+}
+
+// curl tells which sockets to watch for what
+static int sock_cb(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+	(void) easy;
+	(void) userp;
+	curl_sock_t *cs = (curl_sock_t*) socketp;
+
+	if (what == CURL_POLL_REMOVE) {
+		if (cs != NULL) {
+			poll_unregister(s);
+			reg_remove(&socks, cs);
+			mem_free(cs);
+			curl_multi_assign(multi, s, NULL);
+		}
+		return 0;
+	}
+
+	void (*rd)(int fd, void *data) = (what & CURL_POLL_IN) ? sock_read : NULL;
+	void (*wr)(int fd, void *data) = (what & CURL_POLL_OUT) ? sock_write : NULL;
+
+	if (cs == NULL) {
+		cs = mem_alloc(&sock_type);
+		cs->fd = s;
+		reg_append(&socks, cs);
+		curl_multi_assign(multi, s, cs);
+
+		poll_register_readwrite(s, NULL, rd, wr, sock_hup);
+		// not a device connection
+		poll_set_options(s, POLL_OPT_AUX);
+	} else {
+		poll_set_actions(s, rd, wr);
+	}
+	cs->what = what;
+	return 0;
+}
+
+static void multi_timeout(void *data) {
+	(void) data;
+	multi_timer = -1;
+	multi_action(CURL_SOCKET_TIMEOUT, 0);
+}
+
+// curl tells when it wants to be called next
+static int timer_cb(CURLM *m, long timeout_ms, void *userp) {
+	(void) m;
+	(void) userp;
+
+	if (multi_timer >= 0) {
+		poll_timer_cancel(multi_timer);
+		multi_timer = -1;
+	}
+	if (timeout_ms >= 0) {
+		multi_timer = poll_timer_add(timeout_ms, 0, multi_timeout, NULL);
+		// we may be in a worker, while the loop waits for a later time
+		workers_wakeup();
+	}
+	return 0;
+}
+
+static void multi_init(void) {
+
+	multi = curl_multi_init();
+	if (multi == NULL) {
+		log_error("multi session is NULL\n");
+		return;
+	}
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, sock_cb);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long) MAX_SESSIONS);
+}
+
+// when the loop thread itself waits for a transfer, e.g. without worker
+// threads, the loop cannot run, so the transfers are driven here, for up
+// to a second. With unlock set, workers may run requests in the meantime.
+static void multi_drive(int unlock) {
+
+	long timeout_ms = -1;
+	curl_multi_timeout(multi, &timeout_ms);
+	if (timeout_ms < 0 || timeout_ms > 1000) {
+		timeout_ms = 1000;
+	}
+
+	int n = reg_size(&socks);
+	struct pollfd *pfds = mem_alloc_c(sizeof(struct pollfd) * (n + 1), "curl_pollfds");
+	for (int i = 0; i < n; i++) {
+		curl_sock_t *cs = reg_get(&socks, i);
+		pfds[i].fd = cs->fd;
+		pfds[i].events = ((cs->what & CURL_POLL_IN) ? POLLIN : 0)
+				| ((cs->what & CURL_POLL_OUT) ? POLLOUT : 0);
+		pfds[i].revents = 0;
+	}
+
+	if (unlock) {
+		workers_unlock();
+	}
+	int rv = poll(pfds, n, timeout_ms);
+	if (unlock) {
+		workers_lock();
+	}
+
+	if (rv <= 0) {
+		multi_action(CURL_SOCKET_TIMEOUT, 0);
+	} else {
+		for (int i = 0; i < n; i++) {
+			short ev = pfds[i].revents;
+			if (ev) {
+				multi_action(pfds[i].fd, ((ev & POLLIN) ? CURL_CSELECT_IN : 0)
+					| ((ev & POLLOUT) ? CURL_CSELECT_OUT : 0)
+					| ((ev & (POLLERR | POLLHUP | POLLNVAL)) ? CURL_CSELECT_ERR : 0));
+			}
+		}
+	}
+	mem_free(pfds);
+}
+
+/**
+ * let the transfers go on while waiting for a condition. A worker waits
+ * until the loop notifies it. The loop thread runs commands that are not
+ * passed to a worker, and nothing else would drive the transfers then.
+ * The file of a disk image is shared by all channels on the image, and
+ * the image provider relies on the server lock, so it is kept while the
+ * transfers are driven for such a file.
+ * Returns 0, or -1 when the server is shutting down.
+ */
+static int multi_wait(File *fp) {
+
+	if (fp->file.shared) {
+		multi_drive(0);
+		return 0;
+	}
+	if (workers_in_worker()) {
+		return workers_wait();
+	}
+	multi_drive(1);
+	return 0;
+}
+
+/**
+ * wait until the file's buffer has data, or the transfer has ended.
+ * Returns 0, or -1 when the server is shutting down.
+ */
+static int wait_data(File *fp) {
+
+	while (fp->rdbufdatalen <= fp->bufrp && !fp->done) {
+		if (multi_wait(fp) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * continue a transfer paused because the buffer was full, when the device
+ * has read at least half of it
+ */
+static void resume_data(File *fp) {
+
+	if (fp->paused && (fp->rdbufdatalen - fp->bufrp) <= fp->rdbuflen / 2) {
+		fp->paused = 0;
+		// may call write_cb right away
+		curl_easy_pause(fp->session, CURLPAUSE_CONT);
+		multi_check_done();
+	}
+}
+
 //-----------------------------------------------------
 
 
@@ -390,16 +796,23 @@ static void close_fd(File *fp) {
 	reg_remove(&fp->file.endpoint->files, fp);
 
 	if (fp->session != NULL) {
-		curl_multi_remove_handle(fp->multi, fp->session);
-		curl_easy_cleanup(fp->session);
-		curl_multi_cleanup(fp->multi);
-		if (fp->rdbuffer != NULL) {
-			free(fp->rdbuffer);
-		}
-		if (fp->wrbuffer != NULL) {
-			free(fp->wrbuffer);
-		}
+		session_put((curl_endpoint_t*) fp->file.endpoint, fp);
+	}
+	if (fp->rdbuffer != NULL) {
+		free(fp->rdbuffer);
+	}
+	if (fp->wrbuffer != NULL) {
+		free(fp->wrbuffer);
+	}
+	if (fp->cache != NULL) {
+		curl_cache_close(fp->cache);
 	}
+	if (fp->listing != NULL) {
+		listing_put(fp->listing);
+	}
+	mem_free(fp->validator);
+	mem_free(fp->etag);
+	mem_free(fp->lastmod);
 
 	mem_free(fp);
 }
@@ -437,9 +850,6 @@ void curl_pfree(endpoint_t *ep) {
 	if (cep->path_buffer != NULL) {
 		mem_free(cep->path_buffer);
 	}
-	if (cep->name_buffer != NULL) {
-		mem_free(cep->name_buffer);
-	}
 
         mem_free(ep);
 }
@@ -463,120 +873,461 @@ static int curl_close(file_t *fp, int recurse, char *outbuf, int *outlen) {
 	return CBM_ERROR_OK;
 }
 
+// receives the data from curl, into the file's buffer
 static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *user) {
 
 	File *fp = (File*) user;
 
-	fp->rdbufdatalen = 0;
-
-	long inlen = size * nmemb;
+	int inlen = size * nmemb;
 
 #ifdef DEBUG_CURL
-printf("write_cb-> %ld (buffer is %d): ", inlen, fp->rdbuflen);
-if (fp->rdbuflen > 0) {
+printf("write_cb-> %d (buffer has %d): ", inlen, fp->rdbufdatalen - fp->bufrp);
+if (inlen > 0) {
 	printf("%02x ", ptr[0]);
 }
 printf("\n");
 #endif
 
-	if (inlen > fp->rdbuflen) {
-		free(fp->rdbuffer);	// fp->rdbuffer NULL is ok, nothing is done
-		int alloclen = inlen < 8192 ? 8192 : inlen;
-		fp->rdbuffer = malloc(alloclen);
-		if (fp->rdbuffer == NULL) {
-			// malloc failed
-			printf("malloc failed!\n");
-			return 0;
-		}
-		fp->rdbuflen = alloclen;
+	if (fp->rdbufdatalen + inlen > fp->rdbuflen && fp->bufrp > 0) {
+		// move the data not yet read to the start of the buffer
+		memmove(fp->rdbuffer, fp->rdbuffer + fp->bufrp, fp->rdbufdatalen - fp->bufrp);
+		fp->rdbufdatalen -= fp->bufrp;
+		fp->bufrp = 0;
 	}
-	memcpy(fp->rdbuffer, ptr, inlen);
-	
-	fp->rdbufdatalen = inlen;
-	fp->bufrp = 0;
+	if (fp->rdbufdatalen + inlen > fp->rdbuflen) {
+		// buffer is full; curl keeps the data until we continue
+		fp->paused = 1;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	memcpy(fp->rdbuffer + fp->rdbufdatalen, ptr, inlen);
+	fp->rdbufdatalen += inlen;
+
+	workers_notify();
 
 	return inlen;
 }
 
-static CURLMcode pull_data(curl_endpoint_t *cep, File *fp, int *eof) {
-	int running_handles = 0;
-	
-	*eof = 0;
-	fp->rdbufdatalen = 0;
-	fp->bufrp = 0;
 
-	CURLMcode rv = CURLM_OK;
-	do {
-		rv = curl_multi_perform(fp->multi, &running_handles);
-#ifdef DEBUG_CURL
-		if (rv != 0 || running_handles != 1) {
-			printf("curl read file returns: %d, running=%d\n", rv, running_handles);
+/**
+ * return the URL of the file; for a directory it ends with a slash "/"
+ */
+static char *file_url(File *fp, int isdir) {
+
+	curl_endpoint_t *cep = (curl_endpoint_t*) fp->file.endpoint;
+
+	char *url = NULL;
+	mem_append_str5(&url,
+		((provider_t*)(cep->base.ptype))->name,
+		"://",
+		cep->host_buffer,
+		"/",
+		cep->path_buffer);
+
+	url = add_parent_path(url, (file_t*)fp);
+
+	if (isdir) {
+		// end with a slash "/" to indicate a dir list
+		mem_append_str2(&url, "/", NULL);
+	}
+	return url;
+}
+
+/**
+ * set the options common to all transfers of the file
+ */
+static void session_setup(File *fp, const char *url) {
+
+	curl_endpoint_t *cep = (curl_endpoint_t*) fp->file.endpoint;
+
+	curl_easy_setopt(fp->session, CURLOPT_VERBOSE, (long)1);
+	curl_easy_setopt(fp->session, CURLOPT_PRIVATE, fp);
+	curl_easy_setopt(fp->session, CURLOPT_WRITEDATA, fp);
+	curl_easy_setopt(fp->session, CURLOPT_READDATA, fp);
+	curl_easy_setopt(fp->session, CURLOPT_ERRORBUFFER, &(cep->error_buffer));
+	// keep idle connections in the pool alive
+	curl_easy_setopt(fp->session, CURLOPT_TCP_KEEPALIVE, (long)1);
+	// end stalled transfers, as a read waits for data or the end
+	curl_easy_setopt(fp->session, CURLOPT_LOW_SPEED_LIMIT, (long)1);
+	curl_easy_setopt(fp->session, CURLOPT_LOW_SPEED_TIME, (long)60);
+
+	log_info("curl URL: %s\n", url);
+
+	// set URL (curl keeps a copy)
+	curl_easy_setopt(fp->session, CURLOPT_URL, url);
+}
+
+//-----------------------------------------------------
+// random access
+//
+// The first seek on a file, e.g. by the disk image provider mounting a
+// remote image, switches it from streaming to reading through the block
+// cache (see curl_cache.h). Missing blocks are fetched with HTTP range
+// requests (REST for FTP), a run of missing blocks in one request. The
+// If-Range header makes the server send the whole file when it has
+// changed since the blocks were cached; the cache is then reset, and
+// the data written to it from the start.
+
+static int is_http(File *fp) {
+	return fp->file.endpoint->ptype == &http_provider;
+}
+
+static void set_header(char **header, const char *value, size_t len) {
+
+	while (len > 0 && (*value == ' ' || *value == '\t')) {
+		value++;
+		len--;
+	}
+	while (len > 0 && (value[len-1] == '\r' || value[len-1] == '\n' || value[len-1] == ' ')) {
+		len--;
+	}
+	mem_free(*header);
+	*header = mem_alloc_strn(value, len);
+}
+
+// picks the validators from the response headers
+static size_t header_cb(char *ptr, size_t size, size_t nmemb, void *user) {
+
+	File *fp = (File*) user;
+	size_t len = size * nmemb;
+
+	if (len > 5 && !strncasecmp(ptr, "ETag:", 5)) {
+		set_header(&fp->etag, ptr + 5, len - 5);
+	} else
+	if (len > 14 && !strncasecmp(ptr, "Last-Modified:", 14)) {
+		set_header(&fp->lastmod, ptr + 14, len - 14);
+	}
+	return len;
+}
+
+// run the transfer set up in the file's session until it ends
+static CURLcode run_request(File *fp) {
+
+	mem_free(fp->etag);
+	mem_free(fp->lastmod);
+	fp->etag = NULL;
+	fp->lastmod = NULL;
+
+	curl_easy_setopt(fp->session, CURLOPT_HEADERFUNCTION, header_cb);
+	curl_easy_setopt(fp->session, CURLOPT_HEADERDATA, fp);
+
+	fp->done = 0;
+	fp->result = CURLE_OK;
+	curl_multi_add_handle(multi, fp->session);
+
+	while (!fp->done) {
+		if (multi_wait(fp) < 0) {
+			return CURLE_ABORTED_BY_CALLBACK;
 		}
-#endif
-	} while (rv == CURLM_CALL_MULTI_PERFORM);
+	}
+	return fp->result;
+}
 
-	// note that on R/W files EOF will not be set by the read side ending,
-	// as the write side will keep running_handles>0, except of course this also
-	// ends
-	if (running_handles == 0) {
-		// no more data will be available
-		log_debug("pull_data sets EOF (running=0), rv=%d, datalen=%d\n", rv, fp->rdbufdatalen);
-		*eof = READFLAG_EOF;
+/**
+ * wait until no other worker runs a request for the file, then mark it
+ * busy. Returns 0, or -1 when the server is shutting down.
+ */
+static int lock_file(File *fp) {
+	while (fp->busy) {
+		if (multi_wait(fp) < 0) {
+			return -1;
+		}
 	}
+	fp->busy = 1;
+	return 0;
+}
 
-	int msgs_in_queue = 0;
-	CURLMsg *cmsg = NULL;
-	while ((cmsg = curl_multi_info_read(fp->multi, &msgs_in_queue)) != NULL) {
-#ifdef DEBUG_CURL	
-		printf("cmsg=%p, in queue=%d\n", (void*)cmsg, msgs_in_queue);
-#endif	
-		// we only added one easy handle, so easy_handle is known
-		CURLMSG msg = cmsg->msg;
-		if (msg == CURLMSG_DONE) {
-			CURLcode cc = cmsg->data.result;
-			//printf("cc = %d\n", cc);
-			if (cc != CURLE_OK) {
-				log_error("errorbuffer = %s\n", cep->error_buffer);
-			}
-			log_debug("pull_data sets EOF (err msg)\n");
-			*eof = READFLAG_EOF;
-			break;
+static void unlock_file(File *fp) {
+	fp->busy = 0;
+	workers_notify();
+}
+
+// get size and validator of the remote file
+static int stat_remote(File *fp) {
+
+	curl_endpoint_t *cep = (curl_endpoint_t*) fp->file.endpoint;
+
+	if (session_get(cep, fp) != CBM_ERROR_OK) {
+		return CBM_ERROR_FAULT;
+	}
+	char *url = file_url(fp, 0);
+	session_setup(fp, url);
+	mem_free(url);
+
+	curl_easy_setopt(fp->session, CURLOPT_NOBODY, (long)1);
+	curl_easy_setopt(fp->session, CURLOPT_FILETIME, (long)1);
+
+	CURLcode cc = run_request(fp);
+
+	curl_off_t len = -1;
+	curl_off_t ftime = -1;
+	long code = 0;
+	curl_easy_getinfo(fp->session, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+	curl_easy_getinfo(fp->session, CURLINFO_FILETIME_T, &ftime);
+	curl_easy_getinfo(fp->session, CURLINFO_RESPONSE_CODE, &code);
+
+	session_put(cep, fp);
+
+	if (cc != CURLE_OK || len < 0 || (is_http(fp) && code != 200)) {
+		log_warn("could not get size of remote file (result=%d, code=%ld)\n", cc, code);
+		return CBM_ERROR_FILE_NOT_FOUND;
+	}
+
+	fp->size = len;
+	mem_free(fp->validator);
+	if (fp->etag != NULL) {
+		fp->validator = mem_alloc_str(fp->etag);
+	} else
+	if (fp->lastmod != NULL) {
+		fp->validator = mem_alloc_str(fp->lastmod);
+	} else
+	if (ftime >= 0) {
+		char buf[24];
+		snprintf(buf, sizeof(buf), "%lld", (long long) ftime);
+		fp->validator = mem_alloc_str(buf);
+	} else {
+		fp->validator = NULL;
+	}
+	log_debug("remote file size=%lld, validator=%s\n", (long long) fp->size,
+		fp->validator == NULL ? "-" : fp->validator);
+	return CBM_ERROR_OK;
+}
+
+// get the size, and open the cache on first use
+static int open_cache(File *fp) {
+
+	int rv = CBM_ERROR_OK;
+
+	if (fp->cache != NULL) {
+		return rv;
+	}
+	if (lock_file(fp) < 0) {
+		return CBM_ERROR_FAULT;
+	}
+	if (fp->size < 0) {
+		rv = stat_remote(fp);
+	}
+	if (rv == CBM_ERROR_OK && fp->cache == NULL) {
+		char *url = file_url(fp, 0);
+		fp->cache = curl_cache_open(url, fp->size, fp->validator);
+		mem_free(url);
+		if (fp->cache == NULL) {
+			rv = CBM_ERROR_FAULT;
 		}
 	}
+	unlock_file(fp);
 	return rv;
 }
 
-static int reply_with_data(curl_endpoint_t *cep, File *fp, char *retbuf, int len, int *eof) {
+// receives range data from curl, into the cache
+static size_t cache_write_cb(char *ptr, size_t size, size_t nmemb, void *user) {
 
-	// we already have some data to give back
-	int datalen = fp->rdbufdatalen - fp->bufrp;
-	if (datalen > len) {
-		// we have more data than requested
-		datalen = len;
+	File *fp = (File*) user;
+	int inlen = size * nmemb;
+
+	if (fp->wfirst) {
+		fp->wfirst = 0;
+		long code = 0;
+		curl_easy_getinfo(fp->session, CURLINFO_RESPONSE_CODE, &code);
+		if (is_http(fp) && code == 200) {
+			// the whole file, as the server does not do ranges, or
+			// the file has changed
+			curl_off_t len = -1;
+			curl_easy_getinfo(fp->session, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+			const char *v = fp->etag != NULL ? fp->etag : fp->lastmod;
+			if (len >= 0 && (len != fp->size
+				|| strcmp(v == NULL ? "" : v, fp->validator == NULL ? "" : fp->validator))) {
+				log_info("remote file has changed, dropping cached blocks\n");
+				fp->size = len;
+				mem_free(fp->validator);
+				fp->validator = v == NULL ? NULL : mem_alloc_str(v);
+				curl_cache_reset(fp->cache, fp->size, fp->validator);
+			}
+			fp->wstart = 0;
+			fp->wpos = 0;
+		}
 	}
-	memcpy(retbuf, &(fp->rdbuffer[fp->bufrp]), datalen);
-	fp->bufrp += datalen;
+	if (curl_cache_write(fp->cache, fp->wpos, (uint8_t*) ptr, inlen) < 0) {
+		// aborts the transfer
+		return 0;
+	}
+	fp->wpos += inlen;
+	return inlen;
+}
+
+// fetch the blocks first to last (incl.) into the cache
+static int fetch_blocks(File *fp, int first, int last) {
+
+	curl_endpoint_t *cep = (curl_endpoint_t*) fp->file.endpoint;
+
+	if (session_get(cep, fp) != CBM_ERROR_OK) {
+		return CBM_ERROR_FAULT;
+	}
+	char *url = file_url(fp, 0);
+	session_setup(fp, url);
+	mem_free(url);
+
+	off_t from = (off_t) first * CURL_CACHE_BLOCK;
+	off_t to = (off_t) (last + 1) * CURL_CACHE_BLOCK;
+	if (to > fp->size) {
+		to = fp->size;
+	}
+	char range[48];
+	snprintf(range, sizeof(range), "%lld-%lld", (long long) from, (long long) to - 1);
+	log_debug("fetching range %s\n", range);
+
+	struct curl_slist *headers = NULL;
+	if (is_http(fp) && fp->validator != NULL) {
+		char *ifrange = NULL;
+		mem_append_str2(&ifrange, "If-Range: ", fp->validator);
+		headers = curl_slist_append(headers, ifrange);
+		mem_free(ifrange);
+		curl_easy_setopt(fp->session, CURLOPT_HTTPHEADER, headers);
+	}
+	curl_easy_setopt(fp->session, CURLOPT_RANGE, range);
+	curl_easy_setopt(fp->session, CURLOPT_WRITEFUNCTION, cache_write_cb);
+
+	fp->wfirst = 1;
+	fp->wstart = from;
+	fp->wpos = from;
+
+	CURLcode cc = run_request(fp);
+
+	session_put(cep, fp);
+	curl_slist_free_all(headers);
 
-	if (fp->rdbufdatalen <= fp->bufrp) {
-		// reached the end of the buffer
-		CURLMcode rv = CURLM_OK;
-		if (!fp->read_state) {		// set from previous pull_data
-			// try to pull in more, so we see if eof should be sent
-			rv = pull_data(cep, fp, &(fp->read_state));
-			if (rv != CURLM_OK) {
-				log_debug("reply_with_data sets EOF rv=%d, datalen=%d\n", rv, fp->rdbufdatalen);
-				*eof = READFLAG_EOF;
+	// what has arrived is kept, even when the transfer failed
+	curl_cache_mark(fp->cache, fp->wstart, fp->wpos);
+
+	if (cc != CURLE_OK) {
+		log_warn("range request failed (result=%d)\n", cc);
+		return CBM_ERROR_FAULT;
+	}
+	return CBM_ERROR_OK;
+}
+
+// read at the file position, through the cache
+static int read_cached(File *fp, char *retbuf, int len, int *readflag) {
+
+	off_t pos = fp->pos;
+
+	if (pos >= fp->size) {
+		*readflag = READFLAG_EOF;
+		return 0;
+	}
+	if (len > fp->size - pos) {
+		len = fp->size - pos;
+	}
+
+	int first = pos / CURL_CACHE_BLOCK;
+	int last = (pos + len - 1) / CURL_CACHE_BLOCK;
+
+	for (int b = first; b <= last; b++) {
+		int hit = curl_cache_has(fp->cache, b);
+		stats_cache("curl_block", hit);
+		if (hit) {
+			continue;
+		}
+		if (lock_file(fp) < 0) {
+			return -CBM_ERROR_FAULT;
+		}
+		int rv = CBM_ERROR_OK;
+		// another worker may have fetched it meanwhile
+		if (!curl_cache_has(fp->cache, b)) {
+			// the run of missing blocks, extended to whole groups
+			// of READAHEAD_BLOCKS, as e.g. the sectors of a file in a
+			// disk image are spread over a track in either direction
+			int s = b - (b % READAHEAD_BLOCKS);
+			int e = b;
+			while (e < last && !curl_cache_has(fp->cache, e + 1)) {
+				e++;
+			}
+			e += READAHEAD_BLOCKS - 1 - (e % READAHEAD_BLOCKS);
+			if (e >= fp->cache->nblocks) {
+				e = fp->cache->nblocks - 1;
 			}
+			rv = fetch_blocks(fp, s, e);
+			b = e;
 		}
+		unlock_file(fp);
+		if (rv != CBM_ERROR_OK) {
+			return -rv;
+		}
+	}
+
+	int n = curl_cache_read(fp->cache, pos, (uint8_t*) retbuf, len);
+	if (n < 0) {
+		return -CBM_ERROR_FAULT;
+	}
+	fp->pos = pos + n;
+	if (fp->pos >= fp->size) {
+		*readflag = READFLAG_EOF;
+	}
+	return n;
+}
 
-		if (fp->read_state && fp->rdbufdatalen <= fp->bufrp) {
-			log_debug("reply with data sets EOF (2)\n");
-			*eof = READFLAG_EOF;
+static int curl_seek(file_t *file, long position, int flag) {
+
+	File *fp = (File*) file;
+
+	if (fp->read_converter != NULL) {
+		// directory
+		return CBM_ERROR_FAULT;
+	}
+	if (fp->session != NULL) {
+		// stop streaming, from now on the file is read through the cache
+		session_put((curl_endpoint_t*) fp->file.endpoint, fp);
+	}
+	int rv = open_cache(fp);
+	if (rv != CBM_ERROR_OK) {
+		return rv;
+	}
+	if (flag == SEEKFLAG_END) {
+		position += fp->size;
+	}
+	if (position < 0) {
+		return CBM_ERROR_FAULT;
+	}
+	fp->pos = position;
+	return CBM_ERROR_OK;
+}
+
+static size_t curl_realsize(file_t *file) {
+
+	File *fp = (File*) file;
+
+	if (fp->size < 0 && fp->session == NULL && fp->read_converter == NULL) {
+		if (lock_file(fp) == 0) {
+			if (fp->size < 0) {
+				stat_remote(fp);
+			}
+			unlock_file(fp);
 		}
 	}
-	return datalen;
+	return fp->size < 0 ? 0 : fp->size;
 }
 
+static int curl_equals(file_t *thisfile, file_t *otherfile) {
+
+	if (otherfile->handler != &curl_file_handler) {
+		return 1;
+	}
+	char *thisurl = file_url((File*) thisfile, 0);
+	char *otherurl = file_url((File*) otherfile, 0);
+	int rv = strcmp(thisurl, otherurl);
+	mem_free(thisurl);
+	mem_free(otherurl);
+	return rv;
+}
+
+static int curl_flush(file_t *file) {
+	(void) file;
+
+	// nothing to write back
+	return CBM_ERROR_OK;
+}
+
+//-----------------------------------------------------
+
 // read file data
 static int read_file(file_t *file, char *retbuf, int len, int *readflag, charset_t outcset) {
 
@@ -592,36 +1343,36 @@ static int read_file(file_t *file, char *retbuf, int len, int *readflag, charset
 			return fp->read_converter((struct curl_endpoint_t*)cep, fp, retbuf, len, readflag);
 		}
 
-		if (fp->rdbufdatalen > fp->bufrp) {
-#ifdef DEBUG_CURL
-			printf("Got some data already: datalen=%d\n", fp->rdbufdatalen);
-#endif
-			return reply_with_data(cep, fp, retbuf, len, readflag);
+		if (fp->cache != NULL) {
+			return read_cached(fp, retbuf, len, readflag);
 		}
-		// we don't have enough data to send something
-		CURLMcode rv = pull_data(cep, fp, &(fp->read_state));
 
-		if (fp->rdbufdatalen > fp->bufrp) {
-			// we should now have some data to give back
-#ifdef DEBUG_CURL
-			printf("Pulled some data: datalen=%d, eof=%d\n", fp->rdbufdatalen, *readflag);
-#endif
-			return reply_with_data(cep, fp, retbuf, len, readflag);
-		}
-		// no data left
-			
-		if (fp->read_state != 0) {
-			log_warn("adding bogus zero byte, to make CBM noticing the EOF\n");
-			*readflag = READFLAG_EOF;
-			*retbuf = 0;
-			return 1;
+		if (wait_data(fp) < 0) {
+			return -CBM_ERROR_FAULT;
 		}
 
-		if (rv == CURLM_OK) {
-			return 0;
+		int datalen = fp->rdbufdatalen - fp->bufrp;
+		if (datalen > 0) {
+			if (datalen > len) {
+				// we have more data than requested
+				datalen = len;
+			}
+			memcpy(retbuf, fp->rdbuffer + fp->bufrp, datalen);
+			fp->bufrp += datalen;
+
+			resume_data(fp);
+
+			if (fp->done && fp->rdbufdatalen <= fp->bufrp) {
+				*readflag = READFLAG_EOF;
+			}
+			return datalen;
 		}
-	
-	return -CBM_ERROR_FAULT;
+		// no data left
+			
+		log_warn("adding bogus zero byte, to make CBM noticing the EOF\n");
+		*readflag = READFLAG_EOF;
+		*retbuf = 0;
+		return 1;
 }
 
 // ----------------------------------------------------------------------------------
@@ -693,58 +1444,28 @@ static int open_file(file_t *file, openpars_t *pars, int type) {
 
 	int rv = CBM_ERROR_FAULT;
 
-	curl_endpoint_t *cep = (curl_endpoint_t*) file->endpoint;
 	File *fp = (File*) file;
 
-		// create session	
-		fp->multi = curl_multi_init();
-
-		if (fp->multi == NULL) {
-			log_error("multi session is NULL\n");
-			return rv;
-		}
-
-		fp->session = curl_easy_init();
-
-		if (fp->session == NULL) {
-			log_error("easy session is NULL\n");
-			curl_multi_cleanup(fp->multi);
+		// get a new or idle session
+		if (session_get((curl_endpoint_t*) file->endpoint, fp) != CBM_ERROR_OK) {
 			return rv;
 		}
 
-		// set options
-		curl_easy_setopt(fp->session, CURLOPT_VERBOSE, (long)1);
-		//curl_easy_setopt(fp->session, CURLOPT_WRITEFUNCTION, write_cb);
-		curl_easy_setopt(fp->session, CURLOPT_WRITEDATA, fp);
-		//curl_easy_setopt(fp->session, CURLOPT_READFUNCTION, read_cb);
-		curl_easy_setopt(fp->session, CURLOPT_READDATA, fp);
-		curl_easy_setopt(fp->session, CURLOPT_ERRORBUFFER, &(cep->error_buffer));
-
-		// prepare name
-		mem_append_str5(&cep->name_buffer, 
-			((provider_t*)(cep->base.ptype))->name,
-			"://",
-			cep->host_buffer,
-			"/",
-			cep->path_buffer);
-
-		cep->name_buffer = add_parent_path(cep->name_buffer, (file_t*)fp);
-
-		if (type == FS_OPEN_DR) {
-			// end with a slash "/" to indicate a dir list
-			mem_append_str2(&cep->name_buffer, "/", NULL);
+		// buffer for the data received in the background
+		if (fp->rdbuffer == NULL) {
+			fp->rdbuffer = malloc(MAX_BUFFER_SIZE);
+			if (fp->rdbuffer == NULL) {
+				log_error("malloc failed!\n");
+				return rv;
+			}
+			fp->rdbuflen = MAX_BUFFER_SIZE;
 		}
+		fp->rdbufdatalen = 0;
+		fp->bufrp = 0;
 
-		log_info("curl URL: %s\n", cep->name_buffer);
-
-		// set URL
-		curl_easy_setopt(fp->session, CURLOPT_URL, cep->name_buffer);
-
-		// debatable...
-		curl_easy_setopt(fp->session, CURLOPT_BUFFERSIZE, (long) MAX_BUFFER_SIZE);
-
-		// add to multi session
-		//curl_multi_add_handle(fp->multi, fp->session);
+		char *url = file_url(fp, type == FS_OPEN_DR);
+		session_setup(fp, url);
+		mem_free(url);
 
 		rv = CBM_ERROR_OK;
 	
@@ -770,7 +1491,7 @@ static int open_rd(file_t *file, openpars_t *pars, int type) {
 		//}	
 
 		//add to multi session
-		CURLMcode rv = curl_multi_add_handle(fp->multi, fp->session);
+		CURLMcode rv = curl_multi_add_handle(multi, fp->session);
 
 		printf("multi add returns %d\n", rv);
 
@@ -786,112 +1507,320 @@ static int open_rd(file_t *file, openpars_t *pars, int type) {
  * Because of the FS_DIR_* macros used here, the wireformat.h include
  * is required, which I would like to have avoided...
  */
-int dir_nlst_read_converter(struct curl_endpoint_t *cep, File *fp, char *retbuf, int len, int *readflag) {
+//-----------------------------------------------------
+// directory listings
+//
+// A listing is read completely when the directory is opened, and kept
+// for curl_dir_ttl seconds, so browsing a remote archive does not send
+// the same listing request for each LOAD"$". FTP servers are asked with
+// MLSD, which also gives type, size and time of the entries; servers
+// that do not know it get NLST, which only gives the names.
+
+typedef struct {
+	char	*name;
+	off_t	size;			// 0 when not known
+	int	isdir;
+	uint8_t	date[FS_DATE_LEN];	// FS_DATE_* of the last change, zero when not known
+} curl_dirent_t;
+
+typedef struct curl_listing_t {
+	char		*url;		// of the directory
+	uint64_t	stamp;		// stats_now() when read
+	int		refcnt;		// number of open listings, plus one when cached
+	registry_t	entries;	// curl_dirent_t
+} curl_listing_t;
+
+static type_t dirent_type = {
+	"curl_dirent",
+	sizeof(curl_dirent_t),
+	NULL
+};
 
-	if (len < FS_DIR_NAME + 1) {
-		log_error("read buffer too small for dir entry (is %d, need at least %d)\n",
-				len, FS_DIR_NAME+1);
-		return -CBM_ERROR_FAULT;
+static type_t listing_type = {
+	"curl_listing",
+	sizeof(curl_listing_t),
+	NULL
+};
+
+static void curl_free_dirent(registry_t *reg, void *en) {
+	(void) reg;
+	mem_free(((curl_dirent_t*)en)->name);
+	mem_free(en);
+}
+
+static void listing_put(curl_listing_t *li) {
+
+	li->refcnt--;
+	if (li->refcnt <= 0) {
+		reg_free(&li->entries, curl_free_dirent);
+		mem_free(li->url);
+		mem_free(li);
 	}
+}
 
-	// prepare dir entry
-	memset(retbuf, 0, FS_DIR_NAME+1);	
+static void curl_free_listing(registry_t *reg, void *en) {
+	(void) reg;
+	listing_put((curl_listing_t*) en);
+}
 
-	*readflag = READFLAG_DENTRY;
+static void curl_free_server(registry_t *reg, void *en) {
+	(void) reg;
+	mem_free(en);
+}
 
-	int eof = 0;	
-	int l = 0;
-	char *namep = retbuf + FS_DIR_NAME;
-	switch(fp->read_state) {
-	case 0:		// disk name
-		l = dir_fill_header(retbuf, 0, cep->path_buffer);
-		fp->read_state++;
-		break;
-	case 1:
-		// file names
-#ifdef DEBUG_CURL
-		log_debug("get filename, bufdatalen=%d, bufrp=%d, eof=%d\n",
-			fp->rdbufdatalen, fp->bufrp, *readflag);
-#endif
+// a cached listing of the URL that is not older than curl_dir_ttl, or NULL
+static curl_listing_t *listing_get(const char *url) {
 
-		l = FS_DIR_NAME;
-		retbuf[FS_DIR_MODE] = FS_DIR_MOD_FIL;
-		do {
-			while ((fp->rdbufdatalen <= fp->bufrp) && (eof == 0)) {
+	uint64_t now = stats_now();
 
-				//log_debug("Trying to pull...\n");
+	for (int i = reg_size(&listings) - 1; i >= 0; i--) {
+		curl_listing_t *li = reg_get(&listings, i);
+		if (now - li->stamp >= (uint64_t) curl_dir_ttl * 1000000000u) {
+			// outdated, as are all older ones
+			for (; i >= 0; i--) {
+				li = reg_get(&listings, 0);
+				reg_remove_pos(&listings, 0);
+				listing_put(li);
+			}
+			break;
+		}
+		if (!strcmp(li->url, url)) {
+			li->refcnt++;
+			stats_cache("curl_listing", 1);
+			return li;
+		}
+	}
+	stats_cache("curl_listing", 0);
+	return NULL;
+}
 
-				CURLMcode rv = pull_data((curl_endpoint_t*)cep, fp, &eof);
+// keep a new listing, instead of an older one of the same URL
+static void listing_add(curl_listing_t *li) {
 
-				if (rv != CURLM_OK) {
-					log_error("Error retrieving directory data (%d)\n", rv);
-					return -CBM_ERROR_DIR_ERROR;
-				}
+	if (curl_dir_ttl <= 0) {
+		return;
+	}
+	for (int i = reg_size(&listings) - 1; i >= 0; i--) {
+		curl_listing_t *old = reg_get(&listings, i);
+		if (!strcmp(old->url, li->url)) {
+			reg_remove_pos(&listings, i);
+			listing_put(old);
+			break;
+		}
+	}
+	li->refcnt++;
+	reg_append(&listings, li);
+
+	if (reg_size(&listings) > MAX_LISTINGS) {
+		curl_listing_t *old = reg_get(&listings, 0);
+		reg_remove_pos(&listings, 0);
+		listing_put(old);
+	}
+}
+
+static int no_mlsd(const char *server) {
+	for (int i = reg_size(&nomlsd) - 1; i >= 0; i--) {
+		if (!strcmp(reg_get(&nomlsd, i), server)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// receives the listing, into a buffer growing as needed
+static size_t listing_write_cb(char *ptr, size_t size, size_t nmemb, void *user) {
+
+	File *fp = (File*) user;
+	int inlen = size * nmemb;
+
+	if (fp->rdbufdatalen + inlen > fp->rdbuflen) {
+		int newlen = fp->rdbuflen == 0 ? MAX_BUFFER_SIZE : fp->rdbuflen;
+		while (fp->rdbufdatalen + inlen > newlen) {
+			newlen *= 2;
+		}
+		char *newbuf = realloc(fp->rdbuffer, newlen);
+		if (newbuf == NULL) {
+			log_error("realloc failed!\n");
+			// aborts the transfer
+			return 0;
+		}
+		fp->rdbuffer = newbuf;
+		fp->rdbuflen = newlen;
+	}
+	memcpy(fp->rdbuffer + fp->rdbufdatalen, ptr, inlen);
+	fp->rdbufdatalen += inlen;
+	return inlen;
+}
+
+// parse an MLSD line "fact=value;...; name"; returns NULL for "." and ".."
+static curl_dirent_t *parse_mlsd(char *line) {
+
+	char *name = strchr(line, ' ');
+	if (name == NULL) {
+		return NULL;
+	}
+	*name++ = 0;
+
+	curl_dirent_t *de = mem_alloc(&dirent_type);
+
+	char *save = NULL;
+	for (char *fact = strtok_r(line, ";", &save); fact != NULL;
+			fact = strtok_r(NULL, ";", &save)) {
+		if (!strncasecmp(fact, "type=", 5)) {
+			const char *type = fact + 5;
+			if (!strcasecmp(type, "cdir") || !strcasecmp(type, "pdir")) {
+				mem_free(de);
+				return NULL;
 			}
-			// find length of name
-			
-			while (fp->bufrp < fp->rdbufdatalen) {
-				char c = fp->rdbuffer[fp->bufrp];
-				fp->bufrp ++;
-				if (c == 13) {
-					// ignore
-				} else
-				if (c != 10) {
-					*namep = c;
-					namep++;
-					l++;
-				} else {
-					// end of name
-					*namep = 0;
-					l++;
-#ifdef DEBUG_CURL
-					log_debug("bufrp=%d, datalen=%d\n", fp->bufrp, fp->rdbufdatalen);
-#endif
-					break;
-				}
-				if ((l + 2) >= len) {
-					log_error("read buffer too small for dir name (is %d, need at least %d, concatenating)\n",
-						len, l+2);
-					*namep = 0;
-					l++;
-					break;
-				}
+			de->isdir = !strcasecmp(type, "dir");
+		} else
+		if (!strncasecmp(fact, "size=", 5)) {
+			de->size = strtoll(fact + 5, NULL, 10);
+		} else
+		if (!strncasecmp(fact, "modify=", 7)) {
+			// YYYYMMDDHHMMSS[.sss], in UTC
+			int y, mo, d, h, mi, s;
+			if (sscanf(fact + 7, "%4d%2d%2d%2d%2d%2d", &y, &mo, &d, &h, &mi, &s) == 6) {
+				de->date[FS_DATE_YEAR] = y - 1900;
+				de->date[FS_DATE_MONTH] = mo - 1;
+				de->date[FS_DATE_DAY] = d;
+				de->date[FS_DATE_HOUR] = h;
+				de->date[FS_DATE_MIN] = mi;
+				de->date[FS_DATE_SEC] = s;
 			}
+		}
+	}
+	de->name = mem_alloc_str(name);
+	return de;
+}
+
+// parse an NLST line, which is a name, possibly with a path
+static curl_dirent_t *parse_nlst(char *line) {
+
+	char *name = strrchr(line, '/');
+	name = (name == NULL) ? line : name + 1;
+
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return NULL;
+	}
+	curl_dirent_t *de = mem_alloc(&dirent_type);
+	de->name = mem_alloc_str(name);
+	return de;
+}
 
+// request the listing with MLSD or NLST
+static int read_listing(File *fp, const char *url, int mlsd, curl_listing_t **outli) {
 
-			if (eof != 0) {
-				log_debug("end of dir read\n");
-				fp->read_state++;
-				*namep = 0;
+	curl_endpoint_t *cep = (curl_endpoint_t*) fp->file.endpoint;
+
+	if (session_get(cep, fp) != CBM_ERROR_OK) {
+		return CBM_ERROR_FAULT;
+	}
+	session_setup(fp, url);
+
+	curl_easy_setopt(fp->session, CURLOPT_WRITEFUNCTION, listing_write_cb);
+	curl_easy_setopt(fp->session, CURLOPT_CUSTOMREQUEST, mlsd ? "MLSD" : "NLST");
+
+	fp->rdbufdatalen = 0;
+
+	CURLcode cc = run_request(fp);
+
+	long code = 0;
+	curl_easy_getinfo(fp->session, CURLINFO_RESPONSE_CODE, &code);
+
+	session_put(cep, fp);
+
+	if (cc != CURLE_OK) {
+		log_warn("listing %s with %s failed (result=%d, code=%ld)\n",
+			url, mlsd ? "MLSD" : "NLST", cc, code);
+		// command not known
+		return (code >= 500 && code <= 502) ? CBM_ERROR_SYNTAX_UNKNOWN : CBM_ERROR_FILE_NOT_FOUND;
+	}
+
+	curl_listing_t *li = mem_alloc(&listing_type);
+	li->url = mem_alloc_str(url);
+	li->stamp = stats_now();
+	reg_init(&li->entries, "curl_listing_entries", 16);
+
+	char *p = fp->rdbuffer;
+	char *end = p + fp->rdbufdatalen;
+	while (p < end) {
+		char *eol = memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			eol = end;
+		}
+		char *line = mem_alloc_strn(p, eol - p);
+		line[strcspn(line, "\r")] = 0;
+		if (*line != 0) {
+			curl_dirent_t *de = mlsd ? parse_mlsd(line) : parse_nlst(line);
+			if (de != NULL) {
+				reg_append(&li->entries, de);
 			}
 		}
-		while ((*namep != 0) && (eof == 0));	// not null byte, then not done
-		eof = 0;
-		if (l > FS_DIR_NAME) {
+		mem_free(line);
+		p = eol + 1;
+	}
+
+	*outli = li;
+	return CBM_ERROR_OK;
+}
+
+int dir_read_converter(struct curl_endpoint_t *cep, File *fp, char *retbuf, int len, int *readflag) {
+
+	if (len < FS_DIR_NAME + 1) {
+		log_error("read buffer too small for dir entry (is %d, need at least %d)\n",
+				len, FS_DIR_NAME+1);
+		return -CBM_ERROR_FAULT;
+	}
+
+	// prepare dir entry
+	memset(retbuf, 0, FS_DIR_NAME+1);	
+
+	*readflag = READFLAG_DENTRY;
+
+	int l = 0;
+	int pos = fp->read_state - 1;
+
+	if (fp->read_state == 0) {
+		// disk name
+		l = dir_fill_header(retbuf, 0, cep->path_buffer == NULL ? "" : cep->path_buffer);
+	} else
+	if (pos < reg_size(&fp->listing->entries)) {
+		curl_dirent_t *de = reg_get(&fp->listing->entries, pos);
+
+		retbuf[FS_DIR_LEN] = de->size & 255;
+		retbuf[FS_DIR_LEN+1] = (de->size >> 8) & 255;
+		retbuf[FS_DIR_LEN+2] = (de->size >> 16) & 255;
+		retbuf[FS_DIR_LEN+3] = (de->size >> 24) & 255;
+		memcpy(retbuf + FS_DIR_YEAR, de->date, FS_DATE_LEN);
+
+		int namelen = strlen(de->name);
+		if (namelen > len - FS_DIR_NAME - 1) {
+			namelen = len - FS_DIR_NAME - 1;
+		}
+		memcpy(retbuf + FS_DIR_NAME, de->name, namelen);
+		retbuf[FS_DIR_NAME + namelen] = 0;
+		l = FS_DIR_NAME + namelen + 1;
+
+		if (de->isdir) {
+			retbuf[FS_DIR_MODE] = FS_DIR_MOD_DIR;
+		} else {
+			retbuf[FS_DIR_MODE] = FS_DIR_MOD_FIL;
 			// Check if filename has a known extension, e.g. PRG USR SEQ
 			// Default to PRG for files that have no extension
 			// Default to SEQ to prevent LOADing unknown extensions
 			retbuf[FS_DIR_ATTR] |= extension_to_filetype(retbuf + FS_DIR_NAME,
 					FS_DIR_TYPE_PRG, FS_DIR_TYPE_SEQ);
-			break;
 		}
-		// otherwise fall through
-	case 2:
+	} else {
 		log_debug("final dir entry\n");
 		retbuf[FS_DIR_MODE] = FS_DIR_MOD_FRE;
 		retbuf[FS_DIR_NAME] = 0;
 		l = FS_DIR_NAME + 1;
 		*readflag |= READFLAG_EOF;
-		fp->read_state++;
-		break;
 	}
-#ifdef DEBUG_CURL
-	printf("Got some dir data : datalen=%d\n", l);
-        for (int i = 0; i < FS_DIR_NAME; i++) {
-	        printf("%02x ", retbuf[i]);
-        }
-        printf(": %s\n", retbuf+FS_DIR_NAME);
-#endif
+	fp->read_state++;
+
 	return l;
 }
 
@@ -900,35 +1829,38 @@ static int open_dr(file_t *file, openpars_t *pars) {
 
 	(void)pars; // silence warning unused parameter
 
-	// curl_endpoint_t *cep = (curl_endpoint_t*) file->endpoint;
 	File *fp = (File*) file;
+	int rv = CBM_ERROR_OK;
+
+	// end with a slash "/" to indicate a dir list
+	char *url = file_url(fp, 1);
+
+	curl_listing_t *li = listing_get(url);
+	if (li == NULL) {
+		char *server = session_server((curl_endpoint_t*) file->endpoint);
+		int mlsd = file->endpoint->ptype == &ftp_provider && !no_mlsd(server);
+
+		rv = read_listing(fp, url, mlsd, &li);
+		if (rv == CBM_ERROR_SYNTAX_UNKNOWN && mlsd) {
+			log_info("server %s does not know MLSD, using NLST\n", server);
+			reg_append(&nomlsd, server);
+			server = NULL;
+			rv = read_listing(fp, url, 0, &li);
+		}
+		mem_free(server);
 
-	int rv = open_file(file, pars, FS_OPEN_DR);
-	if (rv == CBM_ERROR_OK) {
-
-		fp->read_converter = &dir_nlst_read_converter;	// do DIR conversion
-	
-		// set for receiving
-		curl_easy_setopt(fp->session, CURLOPT_WRITEFUNCTION, write_cb);
-
-		// TODO: support for MLST/MLSD FTP commands,
-		// only they are so new, I still need to find a running one for tests
-		//
-		// NLST is the "name list" without other data
-		char *cmd = NULL;
-		mem_append_str2(&cmd, "NLST ", file->filename);
-		// custom FTP command to make info more grokable
-		curl_easy_setopt(fp->session, CURLOPT_CUSTOMREQUEST, cmd);
-		mem_free(cmd);
-
-		//add to multi session
-		CURLMcode rv = curl_multi_add_handle(fp->multi, fp->session);
-
-		printf("multi add returns %d\n", rv);
+		if (rv == CBM_ERROR_OK) {
+			li->refcnt = 1;
+			listing_add(li);
+		}
+	}
+	mem_free(url);
 
-		return CBM_ERROR_OK;
+	if (rv == CBM_ERROR_OK) {
+		fp->listing = li;
+		fp->read_converter = &dir_read_converter;	// do DIR conversion
 	}
-	return CBM_ERROR_FAULT;
+	return rv;
 }
 
 
@@ -1140,20 +2072,21 @@ static handler_t curl_file_handler = {
         curl_close,             // close
         curl_open,              // open
         handler_parent,         // default parent() implementation
-        NULL,                   // fs_seek,                // seek
+        curl_seek,              // seek
         read_file,              // readfile
         NULL,			// writefile unsupported for now
         NULL,                   // truncate
         curl_direntry,          // direntry
         NULL,                   // fs_create,              // create
-        NULL,                   // fs_flush,               // flush data out to disk
-        NULL,                   // fs_equals,              // check if two files (e.g. d64 files are the same)
-        NULL,                   // fs_realsize,            // real size of file (same as file->filesize here)
+        curl_flush,             // flush data out to disk
+        curl_equals,            // check if two files (e.g. d64 files are the same)
+        curl_realsize,          // real size of the remote file
         NULL,                   // fs_delete,              // delete file
         NULL,                   // fs_mkdir,               // create a directory
         NULL,                   // fs_rmdir,               // remove a directory
         NULL,                   // fs_move,                // move a file or directory
-        curl_dump_file            // dump file
+        curl_dump_file,           // dump file
+        NULL                    // map
 };
 
 
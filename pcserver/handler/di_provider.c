@@ -26,6 +26,8 @@
  * Commodore disk images of type d64, d71, d80, d81, d82
  */
 
+#define	LOG_MODULE	LOGM_DI
+
 #include "os.h"
 
 #include <stdio.h>
@@ -48,13 +50,13 @@
 #include "errors.h"
 #include "mem.h"
 #include "wireformat.h"
-#include "channel.h"
 #include "wildcard.h"
 #include "openpars.h"
 
 #include "diskimgs.h"
 
 #include "log.h"
+#include "stats.h"
 
 
 // when set, emulate the allocation of a bogus sector when a 254 byte long sector is written in a non-rel file
@@ -88,6 +90,20 @@ typedef struct {
 
 struct but_t;
 
+// block cache entry
+typedef struct cblock_t {
+	struct cblock_t *prev;	// LRU list, most recently used first
+	struct cblock_t *next;
+	int lba;		// logical block address in the image
+	uint8_t dirty;		// needs to be written back to the image
+	uint8_t data[256];
+} cblock_t;
+
+// number of blocks cached per image
+#define	CACHE_BLOCKS	64
+
+struct dindex_t;
+
 typedef struct {		// derived from endpoint_t
 	endpoint_t base;	// payload
 	file_t *Ip;		// Image file pointer
@@ -100,9 +116,19 @@ typedef struct {		// derived from endpoint_t
 	uint8_t chan[5];	// channel #
 	uint8_t bp[5];		// buffer pointer
 	uint8_t CurrentTrack;	// start track for scannning of BAM
+	uint64_t *bammap;	// decoded BAM: free sectors per track (bit set = free), or NULL
+	uint8_t *bamfree;	// decoded BAM: free block count per track
+	int blocksfree;		// free blocks, not counting the directory track
+	uint8_t bamdirty;	// decoded BAM needs to be written to the BAM blocks
 	uint8_t U2_track;	// track  for U2 command
 	uint8_t U2_sector;	// sector for U2 command
 	slot_t Slot;		// directory slot - should be deprecated!
+	cblock_t **cindex;	// block cache index by LBA (DI.Blocks entries)
+	cblock_t *chead;	// most recently used cached block
+	cblock_t *ctail;	// least recently used cached block
+	int cnum;		// number of cached blocks
+	uint8_t *map;		// image mapped into memory; bypasses the cache when set
+	struct dindex_t *dindex;	// directory index, NULL when not (yet) built
 } di_endpoint_t;
 
 // buffer handling
@@ -141,6 +167,11 @@ handler_t di_file_handler;
 
 // prototypes
 static void di_write_slot(di_endpoint_t * diep, slot_t * slot);
+static cbm_errno_t di_cache_flush(di_endpoint_t * diep);
+static void di_cache_free(di_endpoint_t * diep);
+static void di_dindex_update(di_endpoint_t * diep, slot_t * slot);
+static void di_dindex_free(di_endpoint_t * diep);
+static void di_bam_free(di_endpoint_t * diep);
 static void di_dump_file(file_t * fp, int recurse, int indent);
 
 // ------------------------------------------------------------------
@@ -154,6 +185,16 @@ static void endpoint_init(const type_t * t, void *obj)
 	fsep->base.ptype = &di_provider;
 	fsep->base.is_assigned = 0;
 	fsep->base.is_temporary = 0;
+	fsep->cindex = NULL;
+	fsep->chead = NULL;
+	fsep->ctail = NULL;
+	fsep->cnum = 0;
+	fsep->map = NULL;
+	fsep->dindex = NULL;
+	fsep->bammap = NULL;
+	fsep->bamfree = NULL;
+	fsep->blocksfree = 0;
+	fsep->bamdirty = 0;
 }
 
 static type_t endpoint_type = {
@@ -218,7 +259,20 @@ static cbm_errno_t di_load_image(di_endpoint_t * diep, file_t * file)
 		return CBM_ERROR_FILE_TYPE_MISMATCH;	// not an image file
 	}
 
-	log_debug("di_load_image(%s) as d%d\n", file->filename, diep->DI.ID);
+	// map the image into memory where the underlying file supports it,
+	// otherwise blocks are read and written through the block cache
+	if (file->handler->map != NULL) {
+		size_t maplen = 0;
+		diep->map = file->handler->map(file, &maplen);
+		if (diep->map != NULL && maplen < 256 * (size_t)diep->DI.Blocks) {
+			log_warn("Mapped image too short (%lu bytes), not using map\n",
+				 (unsigned long)maplen);
+			diep->map = NULL;
+		}
+	}
+
+	log_debug("di_load_image(%s) as d%d%s\n", file->filename, diep->DI.ID,
+		  diep->map == NULL ? "" : " (mapped)");
 	return CBM_ERROR_OK;	// success
 }
 
@@ -263,6 +317,12 @@ static void di_freeep(endpoint_t * ep)
 
 	// close/free resources
 	if (cep->Ip != NULL) {
+		di_cache_flush(cep);
+		di_cache_free(cep);
+		di_dindex_free(cep);
+		di_bam_free(cep);
+		// closing the image file also unmaps it
+		cep->map = NULL;
 		cep->Ip->handler->close(cep->Ip, 1, NULL, NULL);
 		cep->Ip = NULL;
 	}
@@ -294,16 +354,269 @@ static inline int di_fflush(file_t * file)
 
 	di_endpoint_t *diep = (di_endpoint_t *) file->endpoint;
 
-	return diep->Ip->handler->flush(diep->Ip);
+	cbm_errno_t err = di_cache_flush(diep);
+	int rv = diep->Ip->handler->flush(diep->Ip);
+
+	return (err != CBM_ERROR_OK) ? (int) err : rv;
 }
 
 
-static inline void di_fsync(file_t * file)
+static inline cbm_errno_t di_fsync(di_endpoint_t * diep)
 {
 	// TODO
 	// if(res) log_error("os_fsync failed: (%d) %s\n", os_errno(), os_strerror(os_errno()));
 
-	file->handler->flush(file);
+	cbm_errno_t err = di_cache_flush(diep);
+
+	diep->Ip->handler->flush(diep->Ip);
+
+	return err;
+}
+
+
+// ------------------------------------------------------------------
+// block cache
+//
+// All block reads and writes on the image go through a per-image cache
+// of CACHE_BLOCKS blocks, indexed by LBA. When full, the least recently used
+// block is reused. Dirty blocks are written back when evicted, and on
+// di_fsync() / di_fflush(), which is done when a modifying operation completes.
+// If the image could be mapped into memory (see di_load_image()), the cache
+// is not used, and di_fsync() syncs the mapping instead.
+
+static type_t cblock_type = {
+	"di_cblock",
+	sizeof(cblock_t),
+	NULL
+};
+
+static type_t cindex_type = {
+	"di_cache_index",
+	sizeof(cblock_t*),
+	NULL
+};
+
+static void di_cache_unlink(di_endpoint_t * diep, cblock_t * cb)
+{
+	if (cb->prev != NULL) {
+		cb->prev->next = cb->next;
+	} else {
+		diep->chead = cb->next;
+	}
+	if (cb->next != NULL) {
+		cb->next->prev = cb->prev;
+	} else {
+		diep->ctail = cb->prev;
+	}
+	cb->prev = NULL;
+	cb->next = NULL;
+}
+
+static void di_cache_push(di_endpoint_t * diep, cblock_t * cb)
+{
+	cb->prev = NULL;
+	cb->next = diep->chead;
+	if (diep->chead != NULL) {
+		diep->chead->prev = cb;
+	} else {
+		diep->ctail = cb;
+	}
+	diep->chead = cb;
+}
+
+static cbm_errno_t di_cache_writeback(di_endpoint_t * diep, cblock_t * cb)
+{
+	file_t *file = diep->Ip;
+
+	cbm_errno_t err = file->handler->seek(file, 256 * (long)cb->lba, SEEKFLAG_ABS);
+	if (err == CBM_ERROR_OK) {
+		int rv = file->handler->writefile(file, (char *)(cb->data), 256, 0);
+		if (rv < 0) {
+			err = -rv;
+		}
+	}
+	if (err != CBM_ERROR_OK) {
+		// the block stays dirty, so it is not dropped from the cache
+		log_error("Error %d writing back block %d\n", err, cb->lba);
+		return CBM_ERROR_WRITE_ERROR;
+	}
+	cb->dirty = 0;
+
+	return CBM_ERROR_OK;
+}
+
+// read a block from the image
+static cbm_errno_t di_cache_read(di_endpoint_t * diep, int lba, uint8_t *data)
+{
+	file_t *file = diep->Ip;
+	int readfl = 0;
+	int rv = 0;
+
+	cbm_errno_t err = file->handler->seek(file, 256 * (long)lba, SEEKFLAG_ABS);
+	if (err == CBM_ERROR_OK) {
+		// TODO: CHARSET_PETSCII should not be necessary (in readfile only used for directory reads)
+		rv = file->handler->readfile(file, (char *)data, 256, &readfl, CHARSET_PETSCII);
+		if (rv < 0) {
+			err = -rv;
+			rv = 0;
+		}
+	}
+	if (err == CBM_ERROR_OK && rv < 256) {
+		memset(data + rv, 0, 256 - rv);
+	}
+	return err;
+}
+
+/*
+ * get the cache block for the given LBA, making it the most recently used one.
+ * On a miss, a new block is allocated or the least recently used one is
+ * evicted. When load is set, the block contents are read from the image;
+ * otherwise the caller is going to overwrite the whole block anyway.
+ */
+static cbm_errno_t di_cache_get(di_endpoint_t * diep, int lba, int load, cblock_t ** outp)
+{
+	cbm_errno_t err = CBM_ERROR_OK;
+	cblock_t *cb;
+	uint8_t data[256];
+
+	if (lba < 0 || (unsigned int)lba >= diep->DI.Blocks) {
+		return CBM_ERROR_ILLEGAL_T_OR_S;
+	}
+
+	if (diep->cindex == NULL) {
+		diep->cindex = mem_alloc_n(diep->DI.Blocks, &cindex_type);
+	}
+
+	cb = diep->cindex[lba];
+	stats_cache("di_block", cb != NULL);
+
+	if (cb == NULL && load) {
+		// read before taking a block from the cache, so a block we
+		// could not read is not cached, and the next access tries again
+		err = di_cache_read(diep, lba, data);
+		if (err != CBM_ERROR_OK) {
+			return err;
+		}
+	}
+
+	if (cb != NULL) {
+		di_cache_unlink(diep, cb);
+		di_cache_push(diep, cb);
+		*outp = cb;
+		return CBM_ERROR_OK;
+	}
+
+	for (;;) {
+		if (diep->cnum < CACHE_BLOCKS) {
+			cb = mem_alloc(&cblock_type);
+			diep->cnum++;
+			break;
+		}
+		cb = diep->ctail;
+		if (!cb->dirty) {
+			diep->cindex[cb->lba] = NULL;
+			di_cache_unlink(diep, cb);
+			break;
+		}
+		// the block stays in the cache while it is written back, and
+		// the oldest block may be another one afterwards
+		err = di_cache_writeback(diep, cb);
+		if (err != CBM_ERROR_OK) {
+			return err;
+		}
+	}
+
+	cb->lba = lba;
+	cb->dirty = 0;
+	if (load) {
+		memcpy(cb->data, data, 256);
+	}
+
+	diep->cindex[lba] = cb;
+	di_cache_push(diep, cb);
+
+	*outp = cb;
+	return CBM_ERROR_OK;
+}
+
+/*
+ * get the data of a block, either directly in the mapped image, or from the
+ * block cache. When forwrite is set, the caller is going to overwrite the
+ * whole block, and it is marked dirty.
+ */
+static cbm_errno_t di_block_data(di_endpoint_t * diep, int lba, int forwrite, uint8_t ** outp)
+{
+	cbm_errno_t err;
+	cblock_t *cb;
+
+	if (diep->map != NULL) {
+		size_t maplen = 0;
+		// the image may have been truncated by another process, and then
+		// the map access raises SIGBUS; use the block cache from now on
+		if (diep->Ip->handler->map(diep->Ip, &maplen) != diep->map
+			|| maplen < 256 * (size_t)diep->DI.Blocks) {
+			log_warn("Image changed size, not using the map any more\n");
+			diep->map = NULL;
+		}
+	}
+	if (diep->map != NULL) {
+		if (lba < 0 || (unsigned int)lba >= diep->DI.Blocks) {
+			return CBM_ERROR_ILLEGAL_T_OR_S;
+		}
+		if (forwrite && !diep->Ip->writable) {
+			return CBM_ERROR_WRITE_PROTECT;
+		}
+		*outp = diep->map + 256 * (size_t)lba;
+		return CBM_ERROR_OK;
+	}
+
+	err = di_cache_get(diep, lba, !forwrite, &cb);
+	if (err == CBM_ERROR_OK) {
+		if (forwrite) {
+			cb->dirty = 1;
+		}
+		*outp = cb->data;
+	}
+	return err;
+}
+
+/*
+ * write back all dirty blocks
+ */
+static cbm_errno_t di_cache_flush(di_endpoint_t * diep)
+{
+	cbm_errno_t err = CBM_ERROR_OK;
+
+	for (cblock_t *cb = diep->chead; cb != NULL; cb = cb->next) {
+		if (cb->dirty) {
+			cbm_errno_t rv = di_cache_writeback(diep, cb);
+			if (err == CBM_ERROR_OK) {
+				err = rv;
+			}
+		}
+	}
+	return err;
+}
+
+/*
+ * free the cache; dirty blocks are dropped, so flush first
+ */
+static void di_cache_free(di_endpoint_t * diep)
+{
+	cblock_t *cb = diep->chead;
+
+	while (cb != NULL) {
+		cblock_t *next = cb->next;
+		mem_free(cb);
+		cb = next;
+	}
+	if (diep->cindex != NULL) {
+		mem_free(diep->cindex);
+	}
+	diep->cindex = NULL;
+	diep->chead = NULL;
+	diep->ctail = NULL;
+	diep->cnum = 0;
 }
 
 
@@ -431,17 +744,12 @@ static cbm_errno_t di_RDBUF(buf_t * bufp)
 {
 
 	cbm_errno_t err;
-	int readfl;
+	uint8_t *data;
 	di_endpoint_t *diep = bufp->diep;
-	file_t *file = diep->Ip;
 
-	long seekpos = 256 * diep->DI.LBA(bufp->track, bufp->sector);
-	err = file->handler->seek(file, seekpos, SEEKFLAG_ABS);
+	err = di_block_data(diep, diep->DI.LBA(bufp->track, bufp->sector), 0, &data);
 	if (err == CBM_ERROR_OK) {
-		// TODO: error on read?
-		// TODO: CHARSET_PETSCII should not be necessary (in readfile only used for directory reads)
-		file->handler->readfile(file, (char *)(bufp->buf), 256,
-					&readfl, CHARSET_PETSCII);
+		memcpy(bufp->buf, data, 256);
 	}
 
 	bufp->dirty = 0;
@@ -450,7 +758,7 @@ static cbm_errno_t di_RDBUF(buf_t * bufp)
 		  err);
 #ifdef DEBUG_DATA
 	uint8_t *b = bufp->buf;
-	for (int i = 0; i < 256; i+=16) {
+	for (int i = 0; log_enabled(LOG_DEBUG) && i < 256; i+=16) {
 		log_debug("    < %02x %02x %02x %02x %02x %02x %02x %02x  %02x %02x %02x %02x %02x %02x %02x %02x\n",
 			b[i],b[i+1],b[i+2],b[i+3],b[i+4],b[i+5],b[i+6],b[i+7],
 			b[i+8],b[i+9],b[i+10],b[i+11],b[i+12],b[i+13],b[i+14],b[i+15]);
@@ -464,14 +772,13 @@ static cbm_errno_t di_WRBUF(buf_t * p)
 {
 
 	cbm_errno_t err;
+	uint8_t *data;
 	di_endpoint_t *diep = p->diep;
-	file_t *file = diep->Ip;
 
-	long seekpos = 256 * diep->DI.LBA(p->track, p->sector);
-	err = file->handler->seek(file, seekpos, SEEKFLAG_ABS);
+	// written back on di_fsync(), or when evicted from the cache
+	err = di_block_data(diep, diep->DI.LBA(p->track, p->sector), 1, &data);
 	if (err == CBM_ERROR_OK) {
-		// TODO: error on write?
-		file->handler->writefile(file, (char *)(p->buf), 256, 0);
+		memcpy(data, p->buf, 256);
 	}
 
 	p->dirty = 0;
@@ -479,7 +786,7 @@ static cbm_errno_t di_WRBUF(buf_t * p)
 	log_debug("WRBUF(%d,%d (%p)) -> %d\n", p->track, p->sector, p, err);
 #ifdef DEBUG_DATA
 	uint8_t *b = p->buf;
-	for (int i = 0; i < 256; i+=16) {
+	for (int i = 0; log_enabled(LOG_DEBUG) && i < 256; i+=16) {
 		log_debug("    > %02x %02x %02x %02x %02x %02x %02x %02x  %02x %02x %02x %02x %02x %02x %02x %02x\n",
 			b[i],b[i+1],b[i+2],b[i+3],b[i+4],b[i+5],b[i+6],b[i+7],
 			b[i+8],b[i+9],b[i+10],b[i+11],b[i+12],b[i+13],b[i+14],b[i+15]);
@@ -593,6 +900,18 @@ static int di_assert_ts(di_endpoint_t * diep, uint8_t track, uint8_t sector)
 // ------------------------------------------------------------------
 // BAM handling
 
+static type_t bammap_type = {
+	"di_bammap",
+	sizeof(uint64_t),
+	NULL
+};
+
+static type_t bamfree_type = {
+	"di_bamfree",
+	sizeof(uint8_t),
+	NULL
+};
+
 static cbm_errno_t di_GETBUF_bam(buf_t ** bufp, di_endpoint_t *diep) {
 
 	cbm_errno_t err = CBM_ERROR_OK;
@@ -615,48 +934,25 @@ static cbm_errno_t di_GETBUF_bam2(buf_t ** bufp, di_endpoint_t *diep) {
 	return err;
 }
 
+static void di_bam_store(di_endpoint_t *diep);
+
+// the allocation code works on the decoded BAM (see di_bam_load()),
+// which is written back to the BAM blocks on di_FLUSH_bam()
 static void di_DIRTY_bam(di_endpoint_t *diep) {
 
-	di_DIRTY(diep->bam1);
-	di_DIRTY(diep->bam2);
+	diep->bamdirty = 1;
 }
 
 static void di_FLUSH_bam(di_endpoint_t *diep) {
 
+	if (diep->bamdirty) {
+		di_bam_store(diep);
+		diep->bamdirty = 0;
+	}
 	di_FLUSH(diep->bam1);
 	di_FLUSH(diep->bam2);
 }
 
-// ***********
-// di_scan_BAM
-// ***********
-
-// linearly scan to find a new sector for a file, for B-A
-// do NOT allocate the block
-// mimic GETSEC (8250 DOS at $FA35)
-// note that it seems the last sector of a track can not be allocated here...
-static int
-di_scan_BAM_GETSEC(Disk_Image_t * di, uint8_t * bam, uint8_t track,
-		   uint8_t firstSector)
-{
-	uint8_t s = firstSector;	// sector index
-	int lastsector = di->LSEC(track);
-
-	while (s <= lastsector) {
-		if (bam[s >> 3] & (1 << (s & 7))) {
-			return s;
-		}
-		s = s + 1;
-	}
-	return -1;		// no free sector
-}
-
-// do allocate a block
-static void di_alloc_BAM(uint8_t * bam, uint8_t sector)
-{
-	bam[sector >> 3] &= ~(1 << (sector & 7));
-}
-
 // calculate the position of the BAM entry for a given track
 static void
 di_calculate_BAM(di_endpoint_t * diep, uint8_t Track, uint8_t ** outBAM,
@@ -694,6 +990,139 @@ di_calculate_BAM(di_endpoint_t * diep, uint8_t Track, uint8_t ** outBAM,
 	*outBAM = bam;
 }
 
+// number of BAM bitmap bytes for a track
+static int di_bam_bytes(Disk_Image_t * di, uint8_t Track)
+{
+	if (di->ID == 71 && Track > di->Tracks) {
+		return 3;
+	}
+	return (di->Sectors + 7) >> 3;
+}
+
+// **********
+// di_bam_load
+// **********
+
+// decode the BAM blocks into a bitmap and free block counts per track
+static void di_bam_load(di_endpoint_t * diep)
+{
+	Disk_Image_t *di = &diep->DI;
+	int lasttrack = di->Tracks * di->Sides;
+	uint8_t *fbl;
+	uint8_t *bam;
+
+	if (diep->bammap != NULL) {
+		return;
+	}
+
+	diep->bammap = mem_alloc_n(lasttrack + 1, &bammap_type);
+	diep->bamfree = mem_alloc_n(lasttrack + 1, &bamfree_type);
+	diep->bammap[0] = 0;
+	diep->bamfree[0] = 0;
+	diep->blocksfree = 0;
+	diep->bamdirty = 0;
+
+	for (int t = 1; t <= lasttrack; t++) {
+		di_calculate_BAM(diep, t, &bam, &fbl);
+
+		uint64_t map = 0;
+		for (int i = di_bam_bytes(di, t) - 1; i >= 0; i--) {
+			map = (map << 8) | bam[i];
+		}
+		diep->bammap[t] = map;
+		diep->bamfree[t] = fbl[0];
+		if (t != di->DirTrack) {
+			diep->blocksfree += fbl[0];
+		}
+	}
+
+	log_debug("di_bam_load: %d blocks free\n", diep->blocksfree);
+}
+
+// ***********
+// di_bam_store
+// ***********
+
+// encode the decoded BAM back into the BAM blocks
+static void di_bam_store(di_endpoint_t * diep)
+{
+	Disk_Image_t *di = &diep->DI;
+	int lasttrack = di->Tracks * di->Sides;
+	uint8_t *fbl;
+	uint8_t *bam;
+
+	if (diep->bammap == NULL) {
+		return;
+	}
+
+	for (int t = 1; t <= lasttrack; t++) {
+		di_calculate_BAM(diep, t, &bam, &fbl);
+
+		int changed = (fbl[0] != diep->bamfree[t]);
+		fbl[0] = diep->bamfree[t];
+
+		uint64_t map = diep->bammap[t];
+		for (int i = 0; i < di_bam_bytes(di, t); i++) {
+			changed |= (bam[i] != (map & 0xff));
+			bam[i] = map & 0xff;
+			map >>= 8;
+		}
+		if (changed) {
+			di_DIRTY(diep->bam1);
+			di_DIRTY(diep->bam2);
+		}
+	}
+}
+
+static void di_bam_free(di_endpoint_t * diep)
+{
+	if (diep->bammap != NULL) {
+		mem_free(diep->bammap);
+		mem_free(diep->bamfree);
+		diep->bammap = NULL;
+		diep->bamfree = NULL;
+	}
+	diep->bamdirty = 0;
+}
+
+// ***********
+// di_scan_BAM
+// ***********
+
+// find a new sector for a file, for B-A
+// do NOT allocate the block
+// mimic GETSEC (8250 DOS at $FA35), i.e. return the first free sector
+// from firstSector up to the last sector of the track
+static int
+di_scan_BAM_GETSEC(di_endpoint_t * diep, uint8_t track, uint8_t firstSector)
+{
+	if (firstSector > diep->DI.LSEC(track)) {
+		return -1;
+	}
+
+	uint64_t map = diep->bammap[track] >> firstSector;
+	if (map == 0) {
+		return -1;	// no free sector
+	}
+
+	int s = firstSector + __builtin_ctzll(map);
+	if (s > diep->DI.LSEC(track)) {
+		return -1;	// no free sector
+	}
+	return s;
+}
+
+// do allocate a block
+static void di_alloc_BAM(di_endpoint_t * diep, uint8_t track, uint8_t sector)
+{
+	diep->bammap[track] &= ~(1ULL << sector);
+	diep->bamfree[track]--;	// decrease free block counter
+	if (track != diep->DI.DirTrack) {
+		diep->blocksfree--;
+	}
+	di_DIRTY_bam(diep);
+}
+
 // **************
 // di_block_alloc
 // **************
@@ -714,8 +1143,6 @@ di_block_alloc(di_endpoint_t * diep, uint8_t * req_track, uint8_t * req_sector)
 	int track;
 	int lasttrack;
 	Disk_Image_t *di = &diep->DI;
-	uint8_t *fbl;		// pointer to track free blocks
-	uint8_t *bam;		// pointer to track BAM
 
 	lasttrack = di->Tracks * di->Sides;
 	sector = *req_sector;
@@ -726,12 +1153,13 @@ di_block_alloc(di_endpoint_t * diep, uint8_t * req_track, uint8_t * req_sector)
 		return CBM_ERROR_ILLEGAL_T_OR_S;
 	}
 
+	di_bam_load(diep);
+
 	while (track <= lasttrack) {
-		di_calculate_BAM(diep, track, &bam, &fbl);
-		if (fbl[0]) {
+		if (diep->bamfree[track]) {
 			// number of free blocks in track is not null
 			sectorfound =
-			    di_scan_BAM_GETSEC(di, bam, track, sector);
+			    di_scan_BAM_GETSEC(diep, track, sector);
 			// but the free sector may well be below the start sector 
 			// as GETSEC only searches up, GETSEC may thus still fail
 			// note: we can overwrite sector, as on failure, it will
@@ -747,12 +1175,10 @@ di_block_alloc(di_endpoint_t * diep, uint8_t * req_track, uint8_t * req_sector)
 	if (sectorfound >= 0) {
 		if (*req_track == track && *req_sector == sectorfound) {
 			// found the requested one, allocate it
-			fbl[0]--;	// decrease free block counter
-			di_alloc_BAM(bam, sectorfound);
-			di_DIRTY_bam(diep);
+			di_alloc_BAM(diep, track, sectorfound);
 			log_debug
-			    ("di_block_alloc: found %d/%d to alloc, BAM at pos d\n",
-			     track, sectorfound /*, bam - diep->BAM[0]*/);
+			    ("di_block_alloc: found %d/%d to alloc\n",
+			     track, sectorfound);
 			return CBM_ERROR_OK;
 		}
 		// we found another block
@@ -780,8 +1206,6 @@ static int di_find_free_block_INTTS(di_endpoint_t * diep, uint8_t * out_track,
 	int lasttrack;
 	int sector;
 	int counter;
-	uint8_t *bam;
-	uint8_t *fbl;
 
 	Disk_Image_t *di = &diep->DI;
 
@@ -789,14 +1213,15 @@ static int di_find_free_block_INTTS(di_endpoint_t * diep, uint8_t * out_track,
 	sector = -1;
 	counter = 1;
 
+	di_bam_load(diep);
+
 	// alternating search first "below" then "above" dir track
 	do {
 		track = di->DirTrack - counter;
 
 		if (track > 0) {
 			// below dir track
-			di_calculate_BAM(diep, track, &bam, &fbl);
-			if (fbl[0]) {
+			if (diep->bamfree[track]) {
 				// number of free blocks in track not null
 				break;
 			}
@@ -805,8 +1230,7 @@ static int di_find_free_block_INTTS(di_endpoint_t * diep, uint8_t * out_track,
 		track = di->DirTrack + counter;
 
 		if (track <= lasttrack) {
-			di_calculate_BAM(diep, track, &bam, &fbl);
-			if (fbl[0]) {
+			if (diep->bamfree[track]) {
 				// number of free blocks in track not null
 				break;
 			}
@@ -819,10 +1243,8 @@ static int di_find_free_block_INTTS(di_endpoint_t * diep, uint8_t * out_track,
 
 	if (track <= lasttrack) {
 		// found one
-		sector = di_scan_BAM_GETSEC(di, bam, track, 0);
-		fbl[0]--;	// decrease free block counter
-		di_alloc_BAM(bam, sector);
-		di_DIRTY_bam(diep);
+		sector = di_scan_BAM_GETSEC(diep, track, 0);
+		di_alloc_BAM(diep, track, sector);
 		diep->CurrentTrack = track;
 		*out_track = track;
 		*out_sector = sector;
@@ -848,11 +1270,11 @@ di_find_free_block_NXTTS(di_endpoint_t * diep, uint8_t * inout_track,
 	int sector;
 	int interleave;
 	int counter;
-	uint8_t *bam;
-	uint8_t *fbl;
 
 	Disk_Image_t *di = &diep->DI;
 
+	di_bam_load(diep);
+
 	dirtrack = di->DirTrack;
 	lasttrack = di->Tracks * di->Sides;
 
@@ -874,8 +1296,7 @@ di_find_free_block_NXTTS(di_endpoint_t * diep, uint8_t * inout_track,
 	// search from current position out, then from dir into other direction, then from
 	// dir in original direction
 	do {
-		di_calculate_BAM(diep, track, &bam, &fbl);
-		if (fbl[0]) {
+		if (diep->bamfree[track]) {
 			// number of free blocks in track not null
 			break;
 		}
@@ -918,20 +1339,18 @@ di_find_free_block_NXTTS(di_endpoint_t * diep, uint8_t * inout_track,
 				sector--;
 			}
 		}
-		sector = di_scan_BAM_GETSEC(di, bam, track, sector);
+		sector = di_scan_BAM_GETSEC(diep, track, sector);
 		if (sector < 0) {
-			sector = di_scan_BAM_GETSEC(di, bam, track, 0);
+			sector = di_scan_BAM_GETSEC(diep, track, 0);
 		}
 
-		fbl[0]--;	// decrease free block counter
-		di_alloc_BAM(bam, sector);
-		di_DIRTY_bam(diep);
-		diep->CurrentTrack = track;
-
 		log_debug
-		    ("di_find_free_block_NXTTS (diep=%p, %d/%d, intrlv=%d, lstsec=%d, bam=%02x %02x %02x %02x) -> (%d,%d)\n",
+		    ("di_find_free_block_NXTTS (diep=%p, %d/%d, intrlv=%d, lstsec=%d, bam=%010llx) -> (%d,%d)\n",
 		     diep, *inout_track, *inout_sector, interleave, lastsector,
-		     bam[0], bam[1], bam[2], bam[3], track, sector);
+		     (unsigned long long)diep->bammap[track], track, sector);
+
+		di_alloc_BAM(diep, track, sector);
+		diep->CurrentTrack = track;
 
 		*inout_track = track;
 		*inout_sector = sector;
@@ -942,44 +1361,12 @@ di_find_free_block_NXTTS(di_endpoint_t * diep, uint8_t * inout_track,
 }
 
 static int di_BAM_blocks_free(di_endpoint_t *diep) {
-	int FreeBlocks;
-	int BAM_Number;		// BAM block for current track
-	int BAM_Increment;
-	int Track;
-	int i;
-	uint8_t *fbl;		// pointer to track free blocks
-	Disk_Image_t *di = &diep->DI;
-	buf_t *bam;
-
-	FreeBlocks = 0;
-	BAM_Number = 0;
-	BAM_Increment = 1 + ((di->Sectors + 7) >> 3);
-	Track = 1;
-	di_GETBUF_bam(&bam, diep);
 
-	while (BAM_Number < 4 && di->bamts[BAM_Number * 2]) {
+	di_bam_load(diep);
 
-		di_REUSEFLUSHMAP(bam, di->bamts[BAM_Number * 2], di->bamts[BAM_Number * 2 + 1]);
+	log_debug("di_BAM_blocks_free: %u\n", diep->blocksfree);
 
-		fbl = bam->buf + di->BAMOffset;
-		if (di->ID == 71 && Track > di->Tracks) {
-			fbl = bam->buf + 221;
-			BAM_Increment = 1;
-		}
-		for (i = 0;
-		     i < di->TracksPerBAM && Track <= di->Tracks * di->Sides;
-		     ++i) {
-			if (Track != di->DirTrack)
-				FreeBlocks += *fbl;
-			fbl += BAM_Increment;
-			++Track;
-		}
-		++BAM_Number;
-	}
-
-	log_debug("di_BAM_blocks_free: %u\n", FreeBlocks);
-
-	return FreeBlocks;
+	return diep->blocksfree;
 }
 
 // ------------------------------------------------------------------
@@ -1024,9 +1411,13 @@ static int di_save_buffer(di_endpoint_t * diep)
 {
 	log_debug("di_save_buffer U2(%d/%d)\n", diep->U2_track,
 		  diep->U2_sector);
+	di_FLUSH_bam(diep);
 	di_SETBUF(diep->buf[0], diep->U2_track, diep->U2_sector);
 	di_WRBUF(diep->buf[0]);
-	di_fsync(diep->Ip);
+	di_fsync(diep);
+	// the block may have been a directory or BAM block
+	di_dindex_free(diep);
+	di_bam_free(diep);
 	diep->U2_track = 0;
 	// di_dump_block(diep->buf[0]);
 	return 1;		// OK
@@ -1095,17 +1486,21 @@ static int di_write_block(di_endpoint_t * diep, const char *buf, int len)
 
 static int di_block_free(di_endpoint_t * diep, uint8_t Track, uint8_t Sector)
 {
-	uint8_t *fbl;		// pointer to track free blocks
-	uint8_t *bam;		// pointer to track BAM
-
 	log_debug("di_block_free(%d,%d)\n", Track, Sector);
 
-	di_calculate_BAM(diep, Track, &bam, &fbl);
+	if (di_assert_ts(diep, Track, Sector) != CBM_ERROR_OK) {
+		return CBM_ERROR_ILLEGAL_T_OR_S;
+	}
+
+	di_bam_load(diep);
 
-	if (!(bam[Sector >> 3] & (1 << (Sector & 7))))	// allocated ?
+	if (!(diep->bammap[Track] & (1ULL << Sector)))	// allocated ?
 	{
-		++fbl[0];	// increase # of free blocks on track
-		bam[Sector >> 3] |= (1 << (Sector & 7));	// mark as free (1)
+		++diep->bamfree[Track];	// increase # of free blocks on track
+		diep->bammap[Track] |= (1ULL << Sector);	// mark as free (1)
+		if (Track != diep->DI.DirTrack) {
+			diep->blocksfree++;
+		}
 
 		di_DIRTY_bam(diep);
 
@@ -1120,7 +1515,8 @@ static int di_block_free(di_endpoint_t * diep, uint8_t Track, uint8_t Sector)
 // *********
 
 static int
-di_direct(endpoint_t * ep, const char *buf, char *retbuf, int *retlen)
+di_direct(endpoint_t * ep, const char *buf, char *retbuf, int *retlen,
+	  file_t ** outfp)
 {
 	int rv = CBM_ERROR_OK;
 
@@ -1160,7 +1556,7 @@ di_direct(endpoint_t * ep, const char *buf, char *retbuf, int *retlen)
 		file->access_mode = FS_BLOCK;
 		fp = (file_t *) file;
 
-		channel_set(chan, fp);
+		*outfp = fp;
 		break;
 	case FS_BLOCK_BW:
 	case FS_BLOCK_U2:
@@ -1176,15 +1572,21 @@ di_direct(endpoint_t * ep, const char *buf, char *retbuf, int *retlen)
 		file->access_mode = FS_BLOCK;
 		fp = (file_t *) file;
 
-		channel_set(chan, fp);
+		*outfp = fp;
 		break;
 	case FS_BLOCK_BA:
 		rv = di_block_alloc(diep, &track, &sector);
 		di_FLUSH_bam(diep);
+		if (di_fsync(diep) != CBM_ERROR_OK && rv == CBM_ERROR_OK) {
+			rv = CBM_ERROR_WRITE_ERROR;
+		}
 		break;
 	case FS_BLOCK_BF:
 		rv = di_block_free(diep, track, sector);
 		di_FLUSH_bam(diep);
+		if (di_fsync(diep) != CBM_ERROR_OK && rv == CBM_ERROR_OK) {
+			rv = CBM_ERROR_WRITE_ERROR;
+		}
 		break;
 	}
 
@@ -1449,9 +1851,8 @@ static int di_rel_navigate(di_endpoint_t * diep, File *f,
 					datap->track, datap->sector, datap->buf[0], datap->buf[1]);
 #if 0
 			// debug output if discarded sector is allocated or not
-			uint8_t *bam, *fbl;
-			di_calculate_BAM(diep, datap->buf[0], &bam, &fbl);
-			int next_free = di_scan_BAM_GETSEC(&diep->DI, bam, datap->buf[0], datap->buf[1]);
+			di_bam_load(diep);
+			int next_free = di_scan_BAM_GETSEC(diep, datap->buf[0], datap->buf[1]);
 			log_debug("di_navigate: BAM for discarded t/s: %d/%d -> next free is %d\n", 
 					datap->buf[0], datap->buf[1], next_free);
 #endif
@@ -2298,6 +2699,8 @@ static void di_write_slot(di_endpoint_t * diep, slot_t * slot)
 	log_debug("di_write_slot pos %d/%d/%d\n", slot->dir_track, slot->dir_sector, slot->in_sector);
 
 	di_WRBUF(b);
+
+	di_dindex_update(diep, slot);
 }
 
 // ************
@@ -2408,6 +2811,303 @@ di_match_slot(di_endpoint_t * diep, slot_t * slot, const uint8_t * name,
 }
 
 
+// ------------------------------------------------------------------
+// directory index
+//
+// Built from the directory chain on first use, and kept up to date by
+// di_write_slot(). It maps the PETSCII file names to their directory slots
+// with a hash, and keeps the free slots in a list in directory order, so
+// that opening a file by its exact name, or creating a file, does not need
+// to walk the directory.
+
+#define	DINDEX_HASH		64	// number of hash buckets
+#define	DINDEX_MAXBLOCKS	255	// guard against loops in the directory chain
+
+typedef struct {
+	uint8_t track;
+	uint8_t sector;
+} dblock_t;
+
+typedef struct {
+	int next;		// next entry in hash chain or free list, -1 at the end
+	uint8_t used;		// slot holds a file
+	uint8_t name[17];	// file name (PETSCII)
+} dentry_t;
+
+typedef struct dindex_t {
+	int nblocks;		// number of directory blocks
+	dblock_t *blocks;	// directory blocks in chain order
+	dentry_t *entries;	// 8 entries per directory block, in directory order
+	int hash[DINDEX_HASH];	// first used entry per name hash
+	int freelist;		// first free entry
+	int irregular;		// number of names that may match other than verbatim
+} dindex_t;
+
+static type_t dindex_type = {
+	"di_dindex",
+	sizeof(dindex_t),
+	NULL
+};
+
+static type_t dblock_type = {
+	"di_dindex_block",
+	sizeof(dblock_t),
+	NULL
+};
+
+static type_t dentry_type = {
+	"di_dindex_entry",
+	sizeof(dentry_t),
+	NULL
+};
+
+static unsigned int di_dindex_hash(const uint8_t * name)
+{
+	unsigned int h = 0;
+
+	while (*name) {
+		h = h * 31 + *name++;
+	}
+	return h % DINDEX_HASH;
+}
+
+// names a handler may wrap (like "NAME.P00" or "NAME,P"), or that contain
+// wildcards themselves, may match other patterns than just their own name
+static int di_dindex_irregular(const uint8_t * name)
+{
+	size_t l = strlen((const char *)name);
+
+	if (l >= 4 && name[l - 4] == '.') {
+		return 1;
+	}
+	return strpbrk((const char *)name, ",*?") != NULL;
+}
+
+// list the entry is in: its hash chain when used, the free list otherwise
+static int *di_dindex_list(dindex_t * dx, int n)
+{
+	dentry_t *e = &dx->entries[n];
+
+	return e->used ? &dx->hash[di_dindex_hash(e->name)] : &dx->freelist;
+}
+
+// insert entry into a list, keeping the directory order
+static void di_dindex_link(dindex_t * dx, int n)
+{
+	int *head = di_dindex_list(dx, n);
+
+	while (*head >= 0 && *head < n) {
+		head = &dx->entries[*head].next;
+	}
+	dx->entries[n].next = *head;
+	*head = n;
+}
+
+static void di_dindex_unlink(dindex_t * dx, int n)
+{
+	int *head = di_dindex_list(dx, n);
+
+	while (*head >= 0) {
+		if (*head == n) {
+			*head = dx->entries[n].next;
+			dx->entries[n].next = -1;
+			return;
+		}
+		head = &dx->entries[*head].next;
+	}
+}
+
+// set entry from slot; must not be linked
+static void di_dindex_set(dindex_t * dx, int n, slot_t * slot)
+{
+	dentry_t *e = &dx->entries[n];
+	int i = 0;
+
+	if (e->used && di_dindex_irregular(e->name)) {
+		dx->irregular--;
+	}
+
+	// the name may be padded with $A0, see di_move()
+	while (i < 16 && slot->filename[i] != 0 && slot->filename[i] != 0xa0) {
+		e->name[i] = slot->filename[i];
+		i++;
+	}
+	e->name[i] = 0;
+	e->used = (slot->type != 0);
+
+	if (e->used && di_dindex_irregular(e->name)) {
+		dx->irregular++;
+	}
+}
+
+// append a directory block with 8 unused, unlinked entries
+static void di_dindex_add_block(dindex_t * dx, uint8_t track, uint8_t sector)
+{
+	int n = dx->nblocks++;
+
+	if (dx->blocks == NULL) {
+		dx->blocks = mem_alloc_n(dx->nblocks, &dblock_type);
+		dx->entries = mem_alloc_n(dx->nblocks * 8, &dentry_type);
+	} else {
+		dx->blocks = mem_realloc_n(dx->nblocks, &dblock_type, dx->blocks);
+		dx->entries = mem_realloc_n(dx->nblocks * 8, &dentry_type, dx->entries);
+	}
+	dx->blocks[n].track = track;
+	dx->blocks[n].sector = sector;
+
+	for (int i = n * 8; i < (n + 1) * 8; i++) {
+		dx->entries[i].next = -1;
+		dx->entries[i].used = 0;
+		dx->entries[i].name[0] = 0;
+	}
+}
+
+static void di_dindex_free(di_endpoint_t * diep)
+{
+	dindex_t *dx = diep->dindex;
+
+	if (dx != NULL) {
+		if (dx->blocks != NULL) {
+			mem_free(dx->blocks);
+			mem_free(dx->entries);
+		}
+		mem_free(dx);
+		diep->dindex = NULL;
+	}
+}
+
+/*
+ * get the directory index, building it from the directory if necessary.
+ * Returns NULL if the directory can not be indexed.
+ */
+static dindex_t *di_dindex_get(di_endpoint_t * diep)
+{
+	slot_t slot;
+
+	stats_cache("di_dir_index", diep->dindex != NULL);
+	if (diep->dindex != NULL) {
+		return diep->dindex;
+	}
+
+	dindex_t *dx = mem_alloc(&dindex_type);
+	dx->nblocks = 0;
+	dx->blocks = NULL;
+	dx->entries = NULL;
+	dx->freelist = -1;
+	dx->irregular = 0;
+	for (int i = 0; i < DINDEX_HASH; i++) {
+		dx->hash[i] = -1;
+	}
+	diep->dindex = dx;
+
+	di_first_slot(diep, &slot);
+	do {
+		if (slot.in_sector == 0) {
+			if (dx->nblocks >= DINDEX_MAXBLOCKS) {
+				log_warn("Directory chain too long, not indexing\n");
+				di_dindex_free(diep);
+				return NULL;
+			}
+			di_dindex_add_block(dx, slot.dir_track, slot.dir_sector);
+		}
+		di_read_slot(diep, &slot);
+
+		int n = (dx->nblocks - 1) * 8 + slot.in_sector;
+		di_dindex_set(dx, n, &slot);
+		di_dindex_link(dx, n);
+	}
+	while (di_next_slot(diep, &slot));
+
+	log_debug("di_dindex_get: indexed %d directory blocks\n", dx->nblocks);
+
+	return dx;
+}
+
+// position slot on the given index entry
+static void di_dindex_slot(dindex_t * dx, int n, slot_t * slot)
+{
+	slot->dir_track = dx->blocks[n / 8].track;
+	slot->dir_sector = dx->blocks[n / 8].sector;
+	slot->in_sector = n % 8;
+	slot->eod = 0;
+}
+
+/*
+ * find the first file with exactly the given PETSCII name, and position the
+ * slot on it. Returns 1 if found, 0 if not, and -1 if there is no index.
+ */
+static int di_dindex_find(di_endpoint_t * diep, const uint8_t * name, slot_t * slot)
+{
+	dindex_t *dx = di_dindex_get(diep);
+
+	if (dx == NULL) {
+		return -1;
+	}
+	for (int n = dx->hash[di_dindex_hash(name)]; n >= 0; n = dx->entries[n].next) {
+		if (!strcmp((const char *)dx->entries[n].name, (const char *)name)) {
+			di_dindex_slot(dx, n, slot);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * update the index after a slot has been written
+ */
+static void di_dindex_update(di_endpoint_t * diep, slot_t * slot)
+{
+	dindex_t *dx = diep->dindex;
+	int n = -1;
+
+	if (dx == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < dx->nblocks; i++) {
+		if (dx->blocks[i].track == slot->dir_track
+		    && dx->blocks[i].sector == slot->dir_sector) {
+			n = i * 8 + slot->in_sector;
+			break;
+		}
+	}
+	if (n < 0) {
+		// new directory block, appended by di_allocate_new_dir_block()
+		if (dx->nblocks >= DINDEX_MAXBLOCKS) {
+			di_dindex_free(diep);
+			return;
+		}
+		di_dindex_add_block(dx, slot->dir_track, slot->dir_sector);
+		for (int i = (dx->nblocks - 1) * 8; i < dx->nblocks * 8; i++) {
+			di_dindex_link(dx, i);
+		}
+		n = (dx->nblocks - 1) * 8 + slot->in_sector;
+	}
+
+	di_dindex_unlink(dx, n);
+	di_dindex_set(dx, n, slot);
+	di_dindex_link(dx, n);
+}
+
+/*
+ * if the pattern (up to a path separator) can only match a file with exactly
+ * that name, i.e. has no wildcards and no type suffix, return the name in PETSCII
+ */
+static uint8_t *di_exact_name(const char *pattern, charset_t cset)
+{
+	size_t l = strcspn(pattern, "/");
+
+	if (l == 0 || l > 16 || strcspn(pattern, "*?,") < l) {
+		return NULL;
+	}
+
+	char *seg = mem_alloc_strn(pattern, l);
+	uint8_t *name = (uint8_t *) conv_name_alloc(seg, cset, CHARSET_PETSCII);
+	mem_free(seg);
+
+	return name;
+}
+
 // *************************
 // di_allocate_new_dir_block
 // *************************
@@ -2453,6 +3153,19 @@ static int di_allocate_new_dir_block(di_endpoint_t * diep, slot_t * slot)
 
 static int di_find_free_slot(di_endpoint_t * diep, slot_t * slot)
 {
+	dindex_t *dx = di_dindex_get(diep);
+
+	if (dx != NULL) {
+		if (dx->freelist >= 0) {
+			di_dindex_slot(dx, dx->freelist, slot);
+			di_read_slot(diep, slot);
+			return 0;	// found
+		}
+		// extend the directory after its last block
+		di_dindex_slot(dx, dx->nblocks * 8 - 1, slot);
+		return di_allocate_new_dir_block(diep, slot);
+	}
+
 	di_first_slot(diep, slot);
 	do {
 		di_read_slot(diep, slot);
@@ -2616,10 +3329,8 @@ di_direntry(file_t * fp, file_t ** outentry, int isresolve, int *readflag,
 	    const char **outpattern, charset_t outcset)
 {
 
-	(void)isresolve;	// silence warning unused parameter
-
-	// here we (currently) only use it in resolve, not in read_dir_entry,
-	// so we don't care about isresolve and first/last entry
+	// header and blocks free entries are handled in di_read_dir_entry,
+	// isresolve only enables the exact name lookup below
 
 	log_debug("di_direntry(fp=%p)\n", fp);
 
@@ -2653,6 +3364,23 @@ di_direntry(file_t * fp, file_t ** outentry, int isresolve, int *readflag,
 
 	//di_first_slot(diep, &diep->Slot);
 
+	// when resolving an exact name, jump to the only possible match
+	// using the directory index, instead of matching each entry
+	if (isresolve && !diep->Slot.eod && diep->Slot.in_sector == 0
+	    && diep->Slot.dir_track == diep->DI.DirTrack
+	    && diep->Slot.dir_sector == diep->DI.DirSector) {
+		uint8_t *name = di_exact_name(file->dospattern, outcset);
+		if (name != NULL) {
+			dindex_t *dx = di_dindex_get(diep);
+			if (dx != NULL && dx->irregular == 0
+			    && di_dindex_find(diep, name, &diep->Slot) == 0) {
+				// not found
+				diep->Slot.eod = 1;
+			}
+			mem_free(name);
+		}
+	}
+
 	do {
 
 		if (diep->Slot.eod) {
@@ -2907,6 +3635,8 @@ di_read_seq(File * file, char *retbuf, int len, int *eof)
 		}
 		if (datap->buf[0] != 0 && file->chp + 1 >= 255) {
 			err = di_REUSEFLUSHMAP(datap, datap->buf[0], datap->buf[1]);
+			// continue with the first data byte of the next block
+			file->chp = 0;
 		}
 		if (*eof)
 			return i + 1;
@@ -2965,7 +3695,10 @@ static int di_writefile(file_t * fp, const char *buf, int len, int is_eof)
 				}
 				data->buf[0] = t;
 				data->buf[1] = s;
-				di_WRBUF(data);
+				err = di_WRBUF(data);
+				if (err != CBM_ERROR_OK) {
+					goto end;
+				}
 				di_SWITCH_data_side(file);
 				di_GETBUF_data(&data, file);
 				di_SETBUF(data, t, s);
@@ -3006,6 +3739,9 @@ static int di_format(endpoint_t * ep, const char *name)
 	const char *p = index(name, ',');
 	int len = strlen(name);
 
+	// the BAM is rewritten below
+	di_bam_free(diep);
+
 	// the buffer we are going to use for format
 	buf_t *bp = NULL;
 	di_GETBUF_bam(&bp, diep);
@@ -3261,7 +3997,10 @@ static int di_format(endpoint_t * ep, const char *name)
 	buf[1] = 0xff;
 	di_WRBUF(bp);
 
-	return CBM_ERROR_OK;
+	cbm_errno_t err = di_fsync(diep);
+	di_dindex_free(diep);
+
+	return err;
 }
 
 // **************
@@ -3303,7 +4042,7 @@ static int di_scratch(file_t * file)
 
 	di_delete_file(diep, &fp->Slot);
 
-	return CBM_ERROR_OK;
+	return di_fsync(diep);
 }
 
 // *********
@@ -3325,9 +4064,15 @@ static int di_move(file_t * fromfile, file_t * todir, const char *toname, charse
 	const char *nameto = conv_name_alloc(toname, cset, CHARSET_PETSCII);
 
 	// check if target exists
-	di_first_slot(diep, &newslot);
-	if (di_match_slot
-	    (diep, &newslot, (uint8_t *) nameto, FS_DIR_TYPE_UNKNOWN)) {
+	int found = -1;
+	if (strpbrk(nameto, "*?") == NULL) {
+		found = di_dindex_find(diep, (uint8_t *) nameto, &newslot);
+	}
+	if (found < 0) {
+		di_first_slot(diep, &newslot);
+		found = di_match_slot(diep, &newslot, (uint8_t *) nameto, FS_DIR_TYPE_UNKNOWN);
+	}
+	if (found) {
 		mem_free(nameto);
 		return CBM_ERROR_FILE_EXISTS;
 	}
@@ -3344,7 +4089,7 @@ static int di_move(file_t * fromfile, file_t * todir, const char *toname, charse
 	di_write_slot(diep, slot);
 
 	mem_free(nameto);
-	return CBM_ERROR_OK;
+	return di_fsync(diep);
 }
 
 // TODO: detect loop / break after max len
@@ -3554,6 +4299,11 @@ static void di_free_ep(registry_t *reg, void *en) {
 	di_endpoint_t *diep = (di_endpoint_t*)en;
         reg_free(&(diep->base.files), di_free_file);
 
+	// the image file may already be gone here, but closing the files
+	// above has already written back the cache
+	di_cache_free(diep);
+	di_dindex_free(diep);
+	di_bam_free(diep);
 	mem_free(diep);
 }
 
@@ -3776,7 +4526,7 @@ static cbm_errno_t di_close_fd(di_endpoint_t * diep, File * f, uint8_t *tr, uint
 		f->data->buf[0] = 0;
 		f->data->buf[1] = f->chp + 1;
 		log_debug("%p: Updated chain to (%d/%d)\n", diep, 0, f->chp + 1);
-		di_WRBUF(f->data);	
+		err = di_WRBUF(f->data);
 
 #ifdef BUG_FILE254
 		if (f->chp + 1 == 255 && diep->DI.ID != 80 && diep->DI.ID != 82) {
@@ -3791,10 +4541,13 @@ static cbm_errno_t di_close_fd(di_endpoint_t * diep, File * f, uint8_t *tr, uint
 		log_debug("%p: Status of directory entry saved\n", diep);
 		di_FLUSH_bam(diep);	// Save BAM status
 		log_debug("%p: BAM saved.\n", diep);
-		di_fsync(diep->Ip);
+		cbm_errno_t serr = di_fsync(diep);
+		if (err == CBM_ERROR_OK) {
+			err = serr;
+		}
 
 		int free_blocks = di_BAM_blocks_free(diep);
-		if (free_blocks == 0) {
+		if (err == CBM_ERROR_OK && free_blocks == 0) {
 			err = CBM_ERROR_DISK_FULL;
 			*tr = f->data->track;
 			*se = f->data->sector;
@@ -3816,7 +4569,7 @@ static cbm_errno_t di_close_fd(di_endpoint_t * diep, File * f, uint8_t *tr, uint
 		log_debug("Status of directory entry saved\n");
 		di_FLUSH_bam(diep);	// Save BAM status
 		log_debug("BAM saved.\n");
-		di_fsync(diep->Ip);
+		err = di_fsync(diep);
 	} else {
 		log_debug("Closing read only file, no sync required.\n");
 	}
@@ -4000,6 +4753,8 @@ static int di_wrap(file_t * file, file_t ** wrapped)
 	// allocate a new endpoint
 	di_endpoint_t *newep = (di_endpoint_t *) di_newep(name);
 	newep->Ip = file;
+	// every file on the image seeks and reads through it
+	file->shared = 1;
 	newep->base.is_temporary = 1;
 
 	if ((err = di_load_image(newep, file)) == CBM_ERROR_OK) {
@@ -4056,7 +4811,8 @@ handler_t di_file_handler = {
 	NULL,			// mkdir not supported
 	NULL,			// rmdir not supported
 	di_move,		// move a file
-	di_dump_file		// dump
+	di_dump_file,		// dump
+	NULL			// map, not supported
 };
 
 provider_t di_provider = {
@@ -26,6 +26,8 @@
  * Commodore disk images of type d64, d71, d80, d81, d82
  */
 
+#define	LOG_MODULE	LOGM_DI
+
 #include <inttypes.h>
 
 #include "log.h"
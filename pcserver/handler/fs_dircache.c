@@ -0,0 +1,478 @@
+/****************************************************************************
+
+    Serial line filesystem server
+    Copyright (C) 2012 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/*
+ * directory metadata cache for the fs_provider, see fs_dircache.h
+ *
+ * All functions are called with the server lock held.
+ */
+
+#define	LOG_MODULE	LOGM_FS
+
+#include "os.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "fs_dircache.h"
+#include "provider.h"
+#include "mem.h"
+#include "stats.h"
+#include "log.h"
+
+#ifdef __linux__
+// any change of an entry, or the directory itself
+#define	WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY \
+			| IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+static type_t dirent_type = {
+	"fs_dirent",
+	sizeof(fs_dirent_t),
+	NULL
+};
+
+static type_t dirsnap_type = {
+	"fs_dirsnap",
+	sizeof(fs_dirsnap_t),
+	NULL
+};
+
+// entry positions of a name in the index
+typedef struct {
+	char		*key;
+	int		npos;
+	int		cap;
+	int		*pos;		// in ascending order
+} fs_dirkey_t;
+
+static type_t dirkey_type = {
+	"fs_dirkey",
+	sizeof(fs_dirkey_t),
+	NULL
+};
+
+static type_t pos_type = {
+	"fs_dirpos",
+	sizeof(int),
+	NULL
+};
+
+// cached snapshots, the most recently used last
+static registry_t cache;
+
+// inotify file descriptor, or -1 when not available
+static int notify_fd = -1;
+
+static void dirent_free(registry_t *reg, void *en) {
+	(void) reg;
+	fs_dirent_t *de = (fs_dirent_t*) en;
+
+	mem_free(de->name);
+	if (de->convname != NULL) {
+		mem_free(de->convname);
+	}
+	if (de->ospath != NULL) {
+		// ospath is from realpath()
+		free(de->ospath);
+	}
+	mem_free(de);
+}
+
+static void dirkey_free(const void *key, void *en) {
+	(void) key;
+	fs_dirkey_t *dk = (fs_dirkey_t*) en;
+
+	mem_free(dk->key);
+	mem_free(dk->pos);
+	mem_free(dk);
+}
+
+static void index_free(fs_dirsnap_t *snap) {
+	if (snap->index != NULL) {
+		hash_free(snap->index, dirkey_free);
+		snap->index = NULL;
+	}
+	if (snap->always != NULL) {
+		mem_free(snap->always);
+		snap->always = NULL;
+	}
+	snap->nalways = 0;
+}
+
+static void snap_free(fs_dirsnap_t *snap) {
+	index_free(snap);
+	reg_free(&snap->entries, dirent_free);
+	mem_free(snap->ospath);
+	mem_free(snap);
+}
+
+#ifdef __linux__
+// remove a watch, unless a cached snapshot still uses it. inotify returns
+// the same wd for a directory that is cached under another path.
+static void watch_drop(int wd) {
+
+	if (wd < 0) {
+		return;
+	}
+	for (int i = 0; i < reg_size(&cache); i++) {
+		fs_dirsnap_t *other = reg_get(&cache, i);
+		if (other->wd == wd) {
+			return;
+		}
+	}
+	inotify_rm_watch(notify_fd, wd);
+}
+#endif
+
+// remove a snapshot from the cache; it is freed when the last listing
+// using it is closed
+static void cache_remove(fs_dirsnap_t *snap) {
+
+	log_debug("dircache: drop %s\n", snap->ospath);
+
+	reg_remove(&cache, snap);
+
+#ifdef __linux__
+	watch_drop(snap->wd);
+#endif
+	snap->wd = -1;
+
+	fs_dircache_put(snap);
+}
+
+// read all pending inotify events, and drop the snapshots of the
+// changed directories
+static void drain_events(void) {
+#ifdef __linux__
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	if (notify_fd < 0) {
+		return;
+	}
+
+	ssize_t n;
+	while ((n = read(notify_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; ) {
+			struct inotify_event *ev = (struct inotify_event*) p;
+
+			for (int i = reg_size(&cache) - 1; i >= 0; i--) {
+				fs_dirsnap_t *snap = reg_get(&cache, i);
+				if ((ev->mask & IN_Q_OVERFLOW) || snap->wd == ev->wd) {
+					cache_remove(snap);
+				}
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+#endif
+}
+
+// read the directory into a new snapshot
+static int snap_read(const char *ospath, fs_dirsnap_t **outsnap) {
+
+	DIR *dp = opendir(ospath);
+	if (dp == NULL) {
+		log_errno("Error opening directory");
+		return errno;
+	}
+
+	fs_dirsnap_t *snap = mem_alloc(&dirsnap_type);
+	snap->ospath = mem_alloc_str(ospath);
+	snap->refcnt = 1;
+	snap->wd = -1;
+	snap->index = NULL;
+	snap->always = NULL;
+	snap->nalways = 0;
+	reg_init(&snap->entries, "fs_dirsnap_entries", 16);
+
+	struct dirent *de;
+	struct stat sbuf;
+	int dfd = dirfd(dp);
+
+	while ((de = readdir(dp)) != NULL) {
+
+		log_debug("Got next dir entry for: %s\n", de->d_name);
+
+		fs_dirent_t *ent = mem_alloc(&dirent_type);
+		ent->name = mem_alloc_str(de->d_name);
+
+		// the entry ospath is malloc'd like the realpath() result
+		char *path = malloc(strlen(ospath) + strlen(de->d_name) + 2);
+		strcpy(path, ospath);
+		if (ospath[0] == 0 || ospath[strlen(ospath) - 1] != dir_separator_char()) {
+			strcat(path, dir_separator_string());
+		}
+		strcat(path, de->d_name);
+
+		// only symlinks and "." resp. ".." need to be resolved, the
+		// directory path itself already is a real path
+		if (fstatat(dfd, de->d_name, &sbuf, AT_SYMLINK_NOFOLLOW) < 0
+			|| S_ISLNK(sbuf.st_mode)
+			|| !strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+
+			ent->ospath = os_realpath(path);
+			free(path);
+
+			if (ent->ospath == NULL || stat(ent->ospath, &sbuf) < 0) {
+				log_errno("Problem stat'ing dir entry (%s)", de->d_name);
+				ent->err = errno;
+			}
+		} else {
+			ent->ospath = path;
+		}
+
+		if (ent->err == 0) {
+			ent->isreg = S_ISREG(sbuf.st_mode) ? 1 : 0;
+			ent->isdir = S_ISDIR(sbuf.st_mode) ? 1 : 0;
+			ent->size = sbuf.st_size;
+			ent->mtime = sbuf.st_mtime;
+			ent->dev = sbuf.st_dev;
+			ent->ino = sbuf.st_ino;
+
+			// TODO: error handling
+			int writecheck = faccessat(dfd, de->d_name, W_OK, 0);
+			if ((writecheck < 0) && (errno != EACCES)) {
+				writecheck = -errno;
+				log_error("Could not get write access to %s\n", de->d_name);
+				log_errno("Reason");
+			}
+			log_debug("WRITE Check: %s -> %d\n", ent->ospath, writecheck);
+			ent->writable = (writecheck >= 0) ? 1 : 0;
+		}
+		reg_append(&snap->entries, ent);
+	}
+	closedir(dp);
+
+	*outsnap = snap;
+	return 0;
+}
+
+int fs_dircache_get(const char *ospath, fs_dirsnap_t **outsnap) {
+
+	drain_events();
+
+	for (int i = 0; i < reg_size(&cache); i++) {
+		fs_dirsnap_t *snap = reg_get(&cache, i);
+		if (!strcmp(snap->ospath, ospath)) {
+			// move to the end as most recently used
+			reg_remove_pos(&cache, i);
+			reg_append(&cache, snap);
+
+			snap->refcnt++;
+			stats_cache("fs_dir", 1);
+			*outsnap = snap;
+			return 0;
+		}
+	}
+	stats_cache("fs_dir", 0);
+
+	int wd = -1;
+#ifdef __linux__
+	// watch before reading, so changes during the read drop the snapshot
+	if (notify_fd >= 0) {
+		wd = inotify_add_watch(notify_fd, ospath, WATCH_MASK);
+		if (wd < 0) {
+			log_errno("Could not watch directory %s", ospath);
+		}
+	}
+#endif
+
+	fs_dirsnap_t *snap = NULL;
+	int err = snap_read(ospath, &snap);
+	if (err != 0) {
+#ifdef __linux__
+		watch_drop(wd);
+#endif
+		return err;
+	}
+
+	if (wd >= 0) {
+		snap->wd = wd;
+		snap->refcnt++;
+		reg_append(&cache, snap);
+		// evict after adding, so a watch shared with the new snapshot stays
+		if (reg_size(&cache) > FS_DIRCACHE_MAX) {
+			cache_remove(reg_get(&cache, 0));
+		}
+	}
+
+	*outsnap = snap;
+	return 0;
+}
+
+void fs_dircache_put(fs_dirsnap_t *snap) {
+
+	snap->refcnt--;
+	if (snap->refcnt <= 0) {
+		snap_free(snap);
+	}
+}
+
+static const char *dirkey_key(const void *en) {
+	return ((const fs_dirkey_t*) en)->key;
+}
+
+// add the entry at pos under the first len characters of name
+static void index_add(fs_dirsnap_t *snap, const char *name, int len, int pos) {
+
+	char *key = mem_alloc_c(len + 1, "fs_dirkey_key");
+	strncpy(key, name, len);
+	key[len] = 0;
+
+	fs_dirkey_t *dk = hash_get(snap->index, key);
+	if (dk == NULL) {
+		dk = mem_alloc(&dirkey_type);
+		dk->key = key;
+		dk->npos = 0;
+		dk->cap = 2;
+		dk->pos = mem_alloc_n(dk->cap, &pos_type);
+		hash_put(snap->index, dk);
+	} else {
+		mem_free(key);
+	}
+	if (dk->npos >= dk->cap) {
+		dk->cap *= 2;
+		dk->pos = mem_realloc_n(dk->cap, &pos_type, dk->pos);
+	}
+	dk->pos[dk->npos++] = pos;
+}
+
+// x00 files have their real name in the header, see x00_resolve()
+static int is_x00_name(const char *name) {
+
+	int len = strlen(name);
+	if (len < 5 || name[len - 4] != '.') {
+		return 0;
+	}
+	return strchr("PSURpsur", name[len - 3]) != NULL
+		&& isdigit(name[len - 2]) && isdigit(name[len - 1]);
+}
+
+static void index_build(fs_dirsnap_t *snap, charset_t cset) {
+
+	int n = reg_size(&snap->entries);
+
+	snap->index = hash_init_stringkey(2 * n + 1, n / 2 + 1, dirkey_key);
+	snap->icset = cset;
+	snap->always = mem_alloc_n(n + 1, &pos_type);
+	snap->nalways = 0;
+
+	for (int i = 0; i < n; i++) {
+		fs_dirent_t *de = reg_get(&snap->entries, i);
+
+		// wildcards in the entry name match as well
+		if (is_x00_name(de->name) || strpbrk(de->name, "*?") != NULL) {
+			snap->always[snap->nalways++] = i;
+			continue;
+		}
+
+		const char *name = fs_dirent_name(de, cset);
+		index_add(snap, name, strlen(name), i);
+
+		// typed file, addressed without the ",<type>"
+		const char *comma = strrchr(name, ',');
+		if (comma != NULL) {
+			index_add(snap, name, comma - name, i);
+		}
+	}
+}
+
+int fs_dircache_lookup(fs_dirsnap_t *snap, const char *name, int len, charset_t cset, int **outpos) {
+
+	if (snap->index != NULL && snap->icset != cset) {
+		index_free(snap);
+	}
+	if (snap->index == NULL) {
+		index_build(snap, cset);
+	}
+
+	char *key = mem_alloc_c(len + 1, "fs_dirkey_key");
+	strncpy(key, name, len);
+	key[len] = 0;
+	fs_dirkey_t *dk = hash_get(snap->index, key);
+	mem_free(key);
+
+	int nkey = (dk == NULL) ? 0 : dk->npos;
+	int *pos = mem_alloc_n(nkey + snap->nalways + 1, &pos_type);
+
+	// merge both ascending lists
+	int n = 0;
+	int k = 0;
+	int a = 0;
+	while (k < nkey || a < snap->nalways) {
+		if (a >= snap->nalways || (k < nkey && dk->pos[k] < snap->always[a])) {
+			pos[n++] = dk->pos[k++];
+		} else {
+			pos[n++] = snap->always[a++];
+		}
+	}
+
+	*outpos = pos;
+	return n;
+}
+
+const char *fs_dirent_name(fs_dirent_t *de, charset_t cset) {
+
+	if (de->convname == NULL || de->cset != cset) {
+		if (de->convname != NULL) {
+			mem_free(de->convname);
+		}
+		de->convname = conv_name_alloc(de->name, CHARSET_ASCII, cset);
+		de->cset = cset;
+	}
+	return de->convname;
+}
+
+void fs_dircache_init(void) {
+
+	reg_init(&cache, "fs_dircache", FS_DIRCACHE_MAX);
+
+#ifdef __linux__
+	notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (notify_fd < 0) {
+		log_errno("Could not init inotify, directories are not cached");
+	}
+#endif
+}
+
+void fs_dircache_free(void) {
+
+	while (reg_size(&cache) > 0) {
+		cache_remove(reg_get(&cache, 0));
+	}
+	reg_free(&cache, NULL);
+
+	if (notify_fd >= 0) {
+		close(notify_fd);
+		notify_fd = -1;
+	}
+}
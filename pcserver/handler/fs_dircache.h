@@ -0,0 +1,100 @@
+/****************************************************************************
+
+    Serial line filesystem server
+    Copyright (C) 2012 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/*
+ * Directory metadata cache for the fs_provider.
+ *
+ * A directory is read once into a snapshot, with the stat() and access()
+ * results of each entry. The snapshot is kept until the directory changes,
+ * which is found out with inotify on Linux. Without inotify each listing
+ * reads a new snapshot.
+ */
+
+#ifndef FS_DIRCACHE_H
+#define FS_DIRCACHE_H
+
+#include <time.h>
+#include <sys/types.h>
+
+#include "charconvert.h"
+#include "registry.h"
+#include "hashmap.h"
+
+// max. number of directories kept in the cache
+#define	FS_DIRCACHE_MAX		16
+
+typedef struct {
+	char		*name;		// entry name as read from the directory
+	char		*ospath;	// real path of the entry, NULL on error
+	int		err;		// errno from resolving the entry, or 0
+	off_t		size;
+	time_t		mtime;
+	uint64_t	dev;
+	uint64_t	ino;
+	uint8_t		isdir;
+	uint8_t		isreg;
+	uint8_t		writable;
+	charset_t	cset;		// charset convname is in
+	char		*convname;	// name converted for the last listing
+} fs_dirent_t;
+
+typedef struct {
+	char		*ospath;	// real path of the directory
+	int		refcnt;		// number of open listings, plus one when cached
+	int		wd;		// inotify watch, or -1
+	registry_t	entries;	// fs_dirent_t
+	// name index for lookups without wildcards, built on first use
+	hash_t		*index;		// fs_dirkey_t, or NULL
+	charset_t	icset;		// charset of the index keys
+	int		*always;	// entries that need to be checked for any name
+	int		nalways;
+} fs_dirsnap_t;
+
+/**
+ * get a snapshot of the directory with the given real path. The
+ * snapshot is kept until it is given back with fs_dircache_put().
+ * Returns 0, or the errno value when the directory could not be read.
+ */
+int fs_dircache_get(const char *ospath, fs_dirsnap_t **outsnap);
+
+void fs_dircache_put(fs_dirsnap_t *snap);
+
+/**
+ * find the entries that can match the given name (of len characters,
+ * without wildcards) in the given charset. These are the entries with
+ * that name, the typed files "name,<type>", and the entries whose real
+ * name is only known from the file content, i.e. x00 files.
+ * *outpos is set to a new array with the entry positions in directory
+ * order; the number of positions is returned.
+ */
+int fs_dircache_lookup(fs_dirsnap_t *snap, const char *name, int len, charset_t cset, int **outpos);
+
+/**
+ * return the name of the entry converted to the given charset; it
+ * belongs to the entry
+ */
+const char *fs_dirent_name(fs_dirent_t *de, charset_t cset);
+
+void fs_dircache_init(void);
+
+void fs_dircache_free(void);
+
+#endif
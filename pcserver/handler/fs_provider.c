@@ -32,6 +32,13 @@
  * local filesystem.
  */
 
+#define	LOG_MODULE	LOGM_FS
+
+// for the syscall() prototype, hidden by _POSIX_C_SOURCE
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define	_DEFAULT_SOURCE
+#endif
+
 #include "os.h"
 
 #include <stdio.h>
@@ -42,20 +49,27 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stdbool.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#endif
+
 #include "provider.h"
 #include "dir.h"
 #include "handler.h"
 #include "errors.h"
 #include "mem.h"
 #include "wireformat.h"
-#include "channel.h"
 #include "os.h"
 #include "openpars.h"
 #include "registry.h"
 #include "wildcard.h"
+#include "workers.h"
+#include "fs_dircache.h"
 
 #include "log.h"
 
@@ -80,12 +94,16 @@ static registry_t endpoints;
 typedef struct {
 	file_t		file;
 	FILE		*fp;
-	DIR 		*dp;
+	fs_dirsnap_t	*dir;		// directory snapshot when reading a directory
+	int		dirpos;		// next entry in dir, or in cand when set
+	int		*cand;		// positions of the entries that can match the pattern
+	int		ncand;
 	uint8_t		temp_open;	// set when fp is temporary (for wrapper)
 	const char	*ospath;	// full path to the file (incl. filename)
-	struct dirent	*de;
 	char		*block;		// direct channel block buffer, 256 byte when allocated
 	unsigned char	block_ptr;
+	uint8_t		*map;		// memory mapped file content (for wrapper)
+	size_t		maplen;
 } File;
 
 static void file_init(const type_t *t, void *obj) {
@@ -98,12 +116,16 @@ static void file_init(const type_t *t, void *obj) {
 	fp->file.recordlen = 0;
 
 	fp->fp = NULL;
-	fp->dp = NULL;
-	fp->de = NULL;
+	fp->dir = NULL;
+	fp->dirpos = 0;
+	fp->cand = NULL;
+	fp->ncand = 0;
 	fp->block = NULL;
 	fp->block_ptr = 0;
 	fp->temp_open = 0;
 	fp->ospath = NULL;
+	fp->map = NULL;
+	fp->maplen = 0;
 }
 
 static type_t file_type = {
@@ -112,12 +134,15 @@ static type_t file_type = {
 	file_init
 };
 
+static void fs_unmap(File *file);
+
 typedef struct {
 	// derived from endpoint_t
 	endpoint_t	 	base;
 	// payload
 	char			*basepath;			// malloc'd base path
 	char			*curpath;			// malloc'd current path
+	int			basefd;				// open fd of basepath, or -1
 } fs_endpoint_t;
 
 // root endpoint ("/" for resolves without parent from command line)
@@ -133,6 +158,7 @@ static void endpoint_init(const type_t *t, void *obj) {
 
 	fsep->basepath = NULL;
 	fsep->curpath = NULL;
+	fsep->basefd = -1;
 
 	fsep->base.ptype = &fs_provider;
 
@@ -162,6 +188,7 @@ static type_t record_type = {
 
 static int expand_relfile(File *file, long cursize, long curpos);
 static size_t file_get_size(FILE *fp);
+static void open_base(fs_endpoint_t *fsep);
 
 
 
@@ -178,6 +205,7 @@ static fs_endpoint_t *create_home_ep() {
 
 	// copy into current path
 	fsep->curpath = mem_alloc_str(fsep->basepath);
+	open_base(fsep);
 	fsep->base.is_assigned++;
 
 	return fsep;
@@ -195,6 +223,7 @@ static fs_endpoint_t *create_root_ep() {
 
 	// copy into current path
 	fsep->curpath = mem_alloc_str(fsep->basepath);
+	open_base(fsep);
 	fsep->base.is_assigned++;
 
 	return fsep;
@@ -217,11 +246,16 @@ static void fsp_free_ep(registry_t *reg, void *en) {
 	if (fep->curpath) {
 		mem_free(fep->curpath);
 	}
+	if (fep->basefd >= 0) {
+		close(fep->basefd);
+	}
 	mem_free(fep);
 }
 
 static void fsp_end() {
 	reg_free(&endpoints, fsp_free_ep);
+
+	fs_dircache_free();
 }
 
 static void fsp_init() {
@@ -230,6 +264,8 @@ static void fsp_init() {
 	// init endpoint registry
 	reg_init(&endpoints, "fs endpoints", 10);
 
+	fs_dircache_init();
+
 	root_endpoint = create_root_ep();
 	home_endpoint = create_home_ep();
 
@@ -284,6 +320,8 @@ static int close_fd(File *file, int recurse) {
 		mem_free((void*)file->file.filename);
 	}
 
+	fs_unmap(file);
+
 	if (file->fp != NULL) {
 		fflush(file->fp);
 		er = fclose(file->fp);
@@ -292,12 +330,13 @@ static int close_fd(File *file, int recurse) {
 		}
 		file->fp = NULL;
 	}
-	if (file->dp != NULL) {
-		er = closedir(file->dp);
-		if (er < 0) {
-			log_errno("Error closing dp");
-		}
-		file->dp = NULL;
+	if (file->dir != NULL) {
+		fs_dircache_put(file->dir);
+		file->dir = NULL;
+	}
+	if (file->cand != NULL) {
+		mem_free(file->cand);
+		file->cand = NULL;
 	}
 	if (file->block != NULL) {
 		mem_free(file->block);
@@ -343,6 +382,9 @@ static void fsp_free(endpoint_t *ep) {
 	free(cep->basepath);
 	// others are mem_alloc'd
 	mem_free(cep->curpath);
+	if (cep->basefd >= 0) {
+		close(cep->basefd);
+	}
         mem_free(ep);
 }
 
@@ -466,6 +508,7 @@ static int fsp_to_endpoint(file_t *file, endpoint_t **outep) {
 
 	// copy into current path
 	fsep->curpath = mem_alloc_str(fsep->basepath);
+	open_base(fsep);
 
 	// free resources
 	close_fd(fp, 1);
@@ -501,6 +544,9 @@ static int errno_to_error(int err) {
 		return CBM_ERROR_NO_CHANNEL;
 	case EINVAL:
 		return CBM_ERROR_SYNTAX_INVAL;
+	case EXDEV:	// path not beneath the endpoint base
+	case ELOOP:	// symlink as last path component
+		return CBM_ERROR_NO_PERMISSION;
 	default:
 		return CBM_ERROR_FAULT;
 	}
@@ -602,6 +648,156 @@ exit:
 
 
 
+// open the base directory of the endpoint, for the *at() calls below
+static void open_base(fs_endpoint_t *fsep) {
+
+	fsep->basefd = open(fsep->basepath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fsep->basefd < 0) {
+		log_errno("Could not open base directory %s", fsep->basepath);
+	}
+}
+
+/**
+ * open the directory containing ospath, which must be beneath the base
+ * directory of the endpoint. On Linux openat2() with RESOLVE_BENEATH makes
+ * sure that no symlink or ".." leads out of the base directory.
+ * Returns the directory fd, with *outname pointing to the last path
+ * component in ospath, or -1 with errno set.
+ */
+static int open_parent(fs_endpoint_t *fsep, const char *ospath, const char **outname) {
+
+	size_t baselen = strlen(fsep->basepath);
+	const char *rel = ospath;
+
+	if (fsep->basefd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (strncmp(ospath, fsep->basepath, baselen) != 0) {
+		errno = EXDEV;
+		return -1;
+	}
+	rel += baselen;
+	if (*rel == 0) {
+		// the base directory itself
+		*outname = ".";
+		return openat(fsep->basefd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if (baselen > 0 && fsep->basepath[baselen - 1] != dir_separator_char()) {
+		if (*rel != dir_separator_char()) {
+			errno = EXDEV;
+			return -1;
+		}
+	}
+	while (*rel == dir_separator_char()) {
+		rel++;
+	}
+
+	const char *name = strrchr(rel, dir_separator_char());
+	if (name == NULL) {
+		*outname = rel;
+		return openat(fsep->basefd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	*outname = name + 1;
+
+	char *dir = mem_alloc_c(name - rel + 1, "open_parent");
+	strncpy(dir, rel, name - rel);
+	dir[name - rel] = 0;
+
+	int fd = -1;
+#ifdef SYS_openat2
+	// set when the kernel does not have openat2(), or a seccomp
+	// filter (e.g. in a container) rejects it
+	static int no_openat2 = 0;
+
+	if (!no_openat2) {
+		struct open_how how = { O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0, RESOLVE_BENEATH };
+		fd = syscall(SYS_openat2, fsep->basefd, dir, &how, sizeof(how));
+		if (fd < 0 && (errno == ENOSYS || errno == EPERM)) {
+			log_debug("openat2() not available (errno=%d), using openat()\n", errno);
+			no_openat2 = 1;
+		}
+	}
+	if (no_openat2)
+#endif
+	{
+		// ospath is a real path, so this at least does not follow ".."
+		fd = openat(fsep->basefd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	mem_free(dir);
+	return fd;
+}
+
+/**
+ * fopen() replacement that opens ospath beneath the endpoint base
+ * directory, without following a symlink as last path component
+ */
+static FILE *fopen_beneath(fs_endpoint_t *fsep, const char *ospath, const char *mode) {
+
+	int flags;
+
+	if (mode[0] == 'r') {
+		flags = strchr(mode, '+') ? O_RDWR : O_RDONLY;
+	} else
+	if (mode[0] == 'w') {
+		flags = (strchr(mode, '+') ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+	} else {
+		flags = (strchr(mode, '+') ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+	}
+
+	const char *name;
+	int parentfd = open_parent(fsep, ospath, &name);
+	if (parentfd < 0) {
+		return NULL;
+	}
+	int fd = openat(parentfd, name, flags | O_NOFOLLOW | O_CLOEXEC, 0666);
+	int err = errno;
+	close(parentfd);
+	if (fd < 0) {
+		errno = err;
+		return NULL;
+	}
+	FILE *fp = fdopen(fd, mode);
+	if (fp == NULL) {
+		err = errno;
+		close(fd);
+		errno = err;
+	}
+	return fp;
+}
+
+// like access(ospath, F_OK), beneath the endpoint base directory
+static int exists_beneath(fs_endpoint_t *fsep, const char *ospath) {
+
+	struct stat sbuf;
+	const char *name;
+
+	int parentfd = open_parent(fsep, ospath, &name);
+	if (parentfd < 0) {
+		return 0;
+	}
+	int rv = fstatat(parentfd, name, &sbuf, AT_SYMLINK_NOFOLLOW);
+	close(parentfd);
+	return rv == 0;
+}
+
+// like unlink() resp. rmdir(), beneath the endpoint base directory
+static int unlink_beneath(fs_endpoint_t *fsep, const char *ospath, int flags) {
+
+	const char *name;
+
+	int parentfd = open_parent(fsep, ospath, &name);
+	if (parentfd < 0) {
+		return -1;
+	}
+	int rv = unlinkat(parentfd, name, flags);
+	int err = errno;
+	close(parentfd);
+	errno = err;
+	return rv;
+}
+
+
 // ----------------------------------------------------------------------------------
 // commands as sent from the device
 
@@ -630,7 +826,7 @@ static int open_block_channel(File *fp) {
 
 // in Firmware currently used for:
 // B-A/B-F/U1/U2
-static int fs_direct(endpoint_t *ep, const char *buf, char *retbuf, int *retlen) {
+static int fs_direct(endpoint_t *ep, const char *buf, char *retbuf, int *retlen, file_t **outfp) {
 
 	// Note that buf has already consumed the drive (first byte), so all indexes are -1
 	unsigned char cmd = buf[FS_BLOCK_PAR_CMD-1];
@@ -642,6 +838,7 @@ static int fs_direct(endpoint_t *ep, const char *buf, char *retbuf, int *retlen)
 
 	file_t *fp = NULL;
 	File *file = NULL;
+	(void) outfp;	// set for U1/U2, which are not supported yet
 
 	// (bogus) check validity of parameters, otherwise fall through to error
 	// need to be validated for other commands besides U1/U2
@@ -663,7 +860,7 @@ static int fs_direct(endpoint_t *ep, const char *buf, char *retbuf, int *retlen)
 			// TODO
 			//handler_resolve_block(ep, channel, &fp);
 
-			channel_set(channel, fp);
+			*outfp = fp;
 #endif		
 			return CBM_ERROR_DRIVE_NOT_READY;
 		case FS_BLOCK_U2:
@@ -677,7 +874,7 @@ static int fs_direct(endpoint_t *ep, const char *buf, char *retbuf, int *retlen)
 			// TODO
 			//handler_resolve_block(ep, channel, &fp);
 
-			channel_set(channel, fp);
+			*outfp = fp;
 		
 			return CBM_ERROR_OK;
 #endif
@@ -877,7 +1074,7 @@ static int open_file(endpoint_t *ep, int tfd, const char *buf, const char *opts,
 
 		if (file) {
 			file->fp = fp;
-			file->dp = NULL;
+			file->dir = NULL;
 			if (recordlen == 0) {
 				er = CBM_ERROR_OK;
 			} else {
@@ -949,21 +1146,29 @@ static char *str_concat(const char *str1, const char *str2, const char *str3) {
 // open a directory read
 static int open_dir(File *file) {
 
-	DIR *dp = opendir(file->ospath); 
+	fs_dirsnap_t *dir = NULL;
+	int err = fs_dircache_get(file->ospath, &dir);
 
-	log_debug("ENTER: OPEN_DR(%p), (file=%p, dp=%p)\n",(void*)dp,
+	log_debug("ENTER: OPEN_DR(%p), (file=%p, name=%s)\n",(void*)dir,
 			(void*)file, (file == NULL)?"<nil>":file->file.filename);
 
-	if(dp != NULL) {
+	if(err == 0) {
 	  file->fp = NULL;
-	  file->dp = dp;
+	  if (file->dir != NULL) {
+		fs_dircache_put(file->dir);
+	  }
+	  file->dir = dir;
+	  file->dirpos = 0;
+	  if (file->cand != NULL) {
+		mem_free(file->cand);
+		file->cand = NULL;
+	  }
 	  file->file.dirstate = DIRSTATE_FIRST;
 		  
 	  log_exitr(CBM_ERROR_OK);
 	  return CBM_ERROR_OK;
 	} else {
-	  log_errno("Error opening directory");
-	  int er = errno_to_error(errno);
+	  int er = errno_to_error(err);
 	  log_exitr(er);
 	  return er;
 	}
@@ -1108,8 +1313,6 @@ static int fs_direntry(file_t *fp, file_t **outentry, int isresolve, int *readfl
 	  File *file = (File*) fp;
 	  File *retfile = NULL;
 	  int rv = CBM_ERROR_FAULT;
-	  struct stat sbuf;
-	  char *ospath = NULL;
 	  char *path = NULL;
 	  fs_endpoint_t *fsep = (fs_endpoint_t*) fp->endpoint;
 
@@ -1134,7 +1337,7 @@ static int fs_direntry(file_t *fp, file_t **outentry, int isresolve, int *readfl
           	return CBM_ERROR_FAULT;
           }
 
-	  if (file->dp == NULL) {
+	  if (file->dir == NULL) {
 		rv = open_dir(file);
 		if (rv != CBM_ERROR_OK) {
 			return rv;
@@ -1173,11 +1376,28 @@ static int fs_direntry(file_t *fp, file_t **outentry, int isresolve, int *readfl
 	  // check if we have to send a file entry
 	  if(isresolve || (fp->dirstate == DIRSTATE_ENTRIES)) {
 
-	            // read entry from underlying dir
+		    if (isresolve && file->dirpos == 0 && file->cand == NULL && fp->pattern != NULL) {
+			// without wildcards in the name, only the entries with that
+			// name need to be checked instead of the whole directory
+			int len = strcspn(fp->pattern, dir_separator_string());
+			if (len > 0 && memchr(fp->pattern, '*', len) == NULL
+				&& memchr(fp->pattern, '?', len) == NULL) {
+				file->ncand = fs_dircache_lookup(file->dir, fp->pattern, len,
+						outcset, &file->cand);
+			}
+		    }
+
+	            // read entry from the directory snapshot
 		    do {
-	            	file->de = readdir(file->dp);
+			fs_dirent_t *de = NULL;
+			if (file->cand == NULL) {
+				de = reg_get(&file->dir->entries, file->dirpos);
+			} else
+			if (file->dirpos < file->ncand) {
+				de = reg_get(&file->dir->entries, file->cand[file->dirpos]);
+			}
 
-	    	        if (file->de == NULL) {
+	    	        if (de == NULL) {
 				log_debug("Got NULL next dir entry\n");
 				if (isresolve) {
 					rv = CBM_ERROR_OK;
@@ -1186,78 +1406,60 @@ static int fs_direntry(file_t *fp, file_t **outentry, int isresolve, int *readfl
 				}
 				// done with search
 				break;
-			} else {
-				log_debug("Got next dir entry for: %s\n", file->de->d_name);
-
-			    	path = get_path(file, file->de->d_name);
-				ospath = os_realpath(path);
-				mem_free(path);
-				path = NULL;
-					
-		            	int rvx = stat(ospath, &sbuf);
-        		    	if (rvx < 0) {
-                			log_errno("Problem stat'ing dir entry (%s)", file->de->d_name);
-					if (errno != EOVERFLOW) {
-						rv = errno_to_error(errno);
-						break;
-					}
-        		    	} else {
-	 	  			// alloc directory entry struct
-		  			retfile = reserve_file((fs_endpoint_t*)fp->endpoint);
-		  			retfile->file.parent = fp;
-
-		    			// convert filename to external charset
-		    			retfile->file.filename = conv_name_alloc(
-								file->de->d_name, 
-								CHARSET_ASCII, outcset);
-
-			    		retfile->ospath = ospath;
-			  	  	retfile->file.mode = FS_DIR_MOD_FIL;
-					// we don't know the type yet for sure
-			    		retfile->file.type = FS_DIR_TYPE_UNKNOWN;
-			    		retfile->file.attr = 0;
-
-			    		retfile->file.seekable = 0;
-					if (S_ISREG(sbuf.st_mode)) {
-						retfile->file.seekable = 1;
-					}
-					retfile->file.isdir = 0;
-					if (S_ISDIR(sbuf.st_mode)) {
-						retfile->file.isdir = 1;
-					}
+			}
+			file->dirpos++;
 
-			        	// TODO: error handling
-                			int writecheck = access(retfile->ospath, W_OK);
-                			if ((writecheck < 0) && (errno != EACCES)) {
-                            			writecheck = -errno;
-	                            		log_error("Could not get write access to %s\n", file->de->d_name);
-        	                    		log_errno("Reason");
-                			}
-					log_debug("WRITE Check: %s -> %d\n", retfile->ospath, writecheck);
-					if (writecheck >= 0) {
-				    		retfile->file.writable = 1;
-					} else {
-				    		retfile->file.attr |= FS_DIR_ATTR_LOCKED;
-				    		retfile->file.writable = 0;
-					}
-					retfile->file.lastmod = sbuf.st_mtime;
-					retfile->file.filesize = sbuf.st_size;
-					if (S_ISDIR(sbuf.st_mode)) {
-						retfile->file.mode = FS_DIR_MOD_DIR;
-					}
+			log_debug("Got next dir entry for: %s\n", de->name);
 
-					// wrap and/or match name
-					if ( handler_next((file_t*)retfile, fp->pattern, outcset, outpattern, &wrapfile)
-						== CBM_ERROR_OK) {
-	  	    				*outentry = wrapfile;
-						rv = CBM_ERROR_OK;
-						break;
-					}
-					// cleanup, to read next dir entry
-					retfile->file.handler->close((file_t*)retfile, 0, NULL, NULL);
-					retfile = NULL;
+			if (de->err != 0) {
+				if (de->err != EOVERFLOW) {
+					rv = errno_to_error(de->err);
+					break;
 				}
+				continue;
+			}
+
+	 		// alloc directory entry struct
+			retfile = reserve_file((fs_endpoint_t*)fp->endpoint);
+			retfile->file.parent = fp;
+
+			// convert filename to external charset
+			retfile->file.filename = mem_alloc_str(fs_dirent_name(de, outcset));
+
+			// ospath is malloc'd
+			retfile->ospath = strdup(de->ospath);
+			retfile->file.mode = FS_DIR_MOD_FIL;
+			// we don't know the type yet for sure
+			retfile->file.type = FS_DIR_TYPE_UNKNOWN;
+			retfile->file.attr = 0;
+
+			retfile->file.seekable = de->isreg;
+			retfile->file.isdir = de->isdir;
+
+			if (de->writable) {
+				retfile->file.writable = 1;
+			} else {
+				retfile->file.attr |= FS_DIR_ATTR_LOCKED;
+				retfile->file.writable = 0;
+			}
+			retfile->file.lastmod = de->mtime;
+			retfile->file.filesize = de->size;
+			retfile->file.fsdev = de->dev;
+			retfile->file.fsino = de->ino;
+			if (de->isdir) {
+				retfile->file.mode = FS_DIR_MOD_DIR;
 			}
+
+			// wrap and/or match name
+			if ( handler_next((file_t*)retfile, fp->pattern, outcset, outpattern, &wrapfile)
+				== CBM_ERROR_OK) {
+	  	    		*outentry = wrapfile;
+				rv = CBM_ERROR_OK;
+				break;
+			}
+			// cleanup, to read next dir entry
+			retfile->file.handler->close((file_t*)retfile, 0, NULL, NULL);
+			retfile = NULL;
 			// read next entry
 		    } while (1);
 	  }
@@ -1296,6 +1498,15 @@ static int read_file(File *file, char *retbuf, int len, int *eof) {
 
 	FILE *fp = file->fp;
 
+	// only one request at a time runs on a channel, so a file of the
+	// channel can be read while the requests on other channels go on.
+	// The file of a disk image is shared by all channels on the image,
+	// and seek and read must not interleave, so it keeps the lock.
+	int unlock = !file->file.shared;
+	if (unlock) {
+		workers_unlock();
+	}
+
 	int n = fread(retbuf, 1, len, fp);
 	rv = n;
 	if(n<len) {
@@ -1316,6 +1527,11 @@ static int read_file(File *file, char *retbuf, int len, int *eof) {
 		      // do not send EOF
 		    }
 	}
+
+	if (unlock) {
+		workers_lock();
+	}
+
 	return rv;
 }
 
@@ -1510,7 +1726,7 @@ static int fs_delete(file_t *file) {
  
 	File *fp = (File*) file;
 
-	if (unlink(fp->ospath) < 0) {
+	if (unlink_beneath((fs_endpoint_t*) file->endpoint, fp->ospath, 0) < 0) {
 		// error handling
 		log_errno("While trying to unlink %s", fp->ospath);
 
@@ -1535,7 +1751,6 @@ static int fs_move(file_t *fromfile, file_t *todir, const char *toname, charset_
 	}
 
 	File *fromfp = (File*) fromfile;
-	const char *frompath = fromfp->ospath;
 
         // convert filename to external charset
         const char *tmpname = conv_name_alloc(toname, cset, CHARSET_ASCII);
@@ -1543,14 +1758,22 @@ static int fs_move(file_t *fromfile, file_t *todir, const char *toname, charset_
 	File *tofp = (File*) todir;
 	const char *topath = malloc_path(tofp->ospath, tmpname);
 
-	char *newreal = os_realpath(topath);
+	const char *fromname = NULL;
+	const char *newname = NULL;
+	int fromfd = open_parent((fs_endpoint_t*) fromfile->endpoint, fromfp->ospath, &fromname);
+	int tofd = open_parent((fs_endpoint_t*) todir->endpoint, topath, &newname);
+	struct stat sbuf;
 
-	if (newreal != NULL) {
+	if (fromfd < 0 || tofd < 0) {
+		er = errno_to_error(errno);
+		log_errno("Error renaming a file\n");
+	} else
+	if (fstatat(tofd, newname, &sbuf, AT_SYMLINK_NOFOLLOW) == 0) {
 		// file or directory exists
-		log_errno("File exists %s", topath);
+		log_error("File exists %s\n", topath);
 		er = CBM_ERROR_FILE_EXISTS;
 	} else {
-		int rv = rename(frompath, newreal);
+		int rv = renameat(fromfd, fromname, tofd, newname);
 		if (rv < 0) {
 			er = errno_to_error(errno);
 			log_errno("Error renaming a file\n");
@@ -1559,8 +1782,14 @@ static int fs_move(file_t *fromfile, file_t *todir, const char *toname, charset_
 		}
 	}
 
-	free(newreal);
+	if (fromfd >= 0) {
+		close(fromfd);
+	}
+	if (tofd >= 0) {
+		close(tofd);
+	}
 	mem_free(topath);
+	mem_free(tmpname);
 
 	return er;
 }
@@ -1587,15 +1816,21 @@ static int fs_mkdir(file_t *file, const char *name, charset_t cset, openpars_t *
 
 	mem_free(tmpnamep);
 
-	char *newreal = os_realpath(newpath);
+	const char *newname = NULL;
+	int parentfd = open_parent(fsep, newpath, &newname);
+	struct stat sbuf;
 
-	if (newreal != NULL) {
-		// file or directory exists
+	if (parentfd < 0) {
 		log_errno("Error finding directory path %s", newpath);
 		er = errno_to_error(errno);
+	} else
+	if (fstatat(parentfd, newname, &sbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+		// file or directory exists
+		log_error("Directory path %s exists\n", newpath);
+		er = CBM_ERROR_FILE_EXISTS;
 	} else {
 		mode_t oldmask=umask(0);
-		int rv = os_mkdir(newpath, 0755);
+		int rv = mkdirat(parentfd, newname, 0755);
 		umask(oldmask);
 
 		if (rv < 0) {
@@ -1606,8 +1841,10 @@ static int fs_mkdir(file_t *file, const char *name, charset_t cset, openpars_t *
 			er = CBM_ERROR_OK;
 		}
 	}
+	if (parentfd >= 0) {
+		close(parentfd);
+	}
 	mem_free(newpath);
-	free(newreal);
 	return er;
 }
 
@@ -1618,7 +1855,7 @@ static int fs_rmdir(file_t *dir) {
 
 	File *fp = (File*) dir;
 
-	int rv = rmdir(fp->ospath);
+	int rv = unlink_beneath((fs_endpoint_t*) dir->endpoint, fp->ospath, AT_REMOVEDIR);
 
 	if (rv < 0) {
 		er = errno_to_error(errno);
@@ -1627,7 +1864,6 @@ static int fs_rmdir(file_t *dir) {
 		// ok
 		er = CBM_ERROR_OK;
 	}
-	dir->handler->close(dir, 0, NULL, NULL);
 	return er;
 }
 
@@ -1642,7 +1878,8 @@ static int fs_open_temp(File *file) {
 	if (file->file.mode == FS_DIR_MOD_FIL) {
 	
 		if (file->fp == NULL) {
-			file->fp = fopen(file->ospath, file->file.writable ? "r+b" : "rb");
+			file->fp = fopen_beneath((fs_endpoint_t*) file->file.endpoint, file->ospath,
+					file->file.writable ? "r+b" : "rb");
 			file->temp_open = 1;
 			if (file->fp == NULL) {
 				log_errno("fopen");
@@ -1657,15 +1894,15 @@ static int readfile(file_t *fp, char *retbuf, int len, int *readflag, charset_t
 
 	File *f = (File*) fp;
 #ifdef DEBUG_READ
-	log_debug("fs_readfile file=%p (fp=%p, dp=%p, block=%p, len=%d, *readflag=%d)\n",
-		f, f==NULL ? NULL : f->fp, f == NULL ? NULL : f->dp, f == NULL ? NULL : f->block, len, *readflag);
+	log_debug("fs_readfile file=%p (fp=%p, dir=%p, block=%p, len=%d, *readflag=%d)\n",
+		f, f==NULL ? NULL : f->fp, f == NULL ? NULL : f->dir, f == NULL ? NULL : f->block, len, *readflag);
 #endif
 	int rv = fs_open_temp(f);
 	if (rv != CBM_ERROR_OK) {
 		return rv;
 	}
 
-	if (f->dp) {
+	if (f->dir) {
 		// read a directory entry
 		rv = read_dir(f, retbuf, len, outcset, readflag);
 	} else
@@ -1725,6 +1962,7 @@ static int fs_open(file_t *fp, openpars_t *pars, int type) {
 	File *file = (File*) fp;
 
 	if (file->temp_open && file->fp != NULL) {
+		fs_unmap(file);
 		fclose(file->fp);
 		file->temp_open = 0;
 		file->fp = NULL;
@@ -1757,7 +1995,8 @@ static int fs_open(file_t *fp, openpars_t *pars, int type) {
 			}
 		}
 
-		int file_exists = !access(file->ospath, F_OK);
+		fs_endpoint_t *fsep = (fs_endpoint_t*) fp->endpoint;
+		int file_exists = exists_beneath(fsep, file->ospath);
 
 		char *flags = "";
 		switch(type) {
@@ -1793,7 +2032,7 @@ static int fs_open(file_t *fp, openpars_t *pars, int type) {
 			log_error("Unable to open '%s': file exists\n", file->ospath);
 			rv = CBM_ERROR_FILE_EXISTS;
 		} else {
-			file->fp = fopen(file->ospath, flags);
+			file->fp = fopen_beneath(fsep, file->ospath, flags);
 			if (pars->filetype != FS_DIR_TYPE_UNKNOWN) {
 				// set file type (we cross-match, as we don't save the file type
 				// in the file system
@@ -1864,12 +2103,70 @@ static int fs_close(file_t *fp, int recurse, char *outbuf, int *outlen) {
 static int fs_flush(file_t *fp) {
 	
 	File *file = (File*)fp;
+	if (file->map != NULL) {
+		// called after each modifying operation on a mapped image, so
+		// do not wait for the writeback; fs_unmap() does on close
+		if (os_msync(file->map, file->maplen, 0) < 0) {
+			return CBM_ERROR_WRITE_ERROR;
+		}
+	}
 	if (file->fp != NULL) {
 		fflush(file->fp);
 	}
 	return CBM_ERROR_OK;
 }
 
+// ----------------------------------------------------------------------------------
+// map the file into memory, e.g. for the di_provider when wrapping an image
+
+static uint8_t *fs_map(file_t *fp, size_t *outlen) {
+
+	File *file = (File*)fp;
+
+	if (file->map == NULL) {
+		if (file->file.mode != FS_DIR_MOD_FIL || fs_open_temp(file) != CBM_ERROR_OK
+			|| file->fp == NULL) {
+			return NULL;
+		}
+
+		size_t len = file_get_size(file->fp);
+		if (len == 0 || len == (size_t)CBM_ERROR_DRIVE_NOT_READY) {
+			return NULL;
+		}
+
+		file->map = os_mmap(file->fp, len, file->file.writable);
+		if (file->map == NULL) {
+			return NULL;
+		}
+		file->maplen = len;
+
+		log_debug("fs_map(%p '%s') -> %p (%lu bytes)\n", fp, file->ospath, file->map,
+			(unsigned long)len);
+	} else if (file_get_size(file->fp) < file->maplen) {
+		// truncated by another process, and touching the pages beyond
+		// the end raises SIGBUS. The mapping stays until close, as the
+		// caller may still hold pointers into it
+		log_warn("File '%s' shrunk below the mapped size, not using the map\n",
+			file->ospath);
+		return NULL;
+	}
+
+	*outlen = file->maplen;
+	return file->map;
+}
+
+static void fs_unmap(File *file) {
+
+	if (file->map != NULL) {
+		os_msync(file->map, file->maplen, 1);
+		if (os_munmap(file->map, file->maplen) < 0) {
+			log_errno("Error unmapping file");
+		}
+		file->map = NULL;
+		file->maplen = 0;
+	}
+}
+
 static int fs_equals(file_t *thisfile, file_t *otherfile) {
 
 	if (otherfile->handler != &fs_file_handler) {
@@ -1909,6 +2206,7 @@ static void fs_dump_file(file_t *fp, int recurse, int indent) {
 	log_debug("%sseekable='%d';\n", prefix, file->file.seekable);
 	log_debug("%stemp_open='%d';\n", prefix, file->temp_open);
 	log_debug("%sospath='%s';\n", prefix, file->ospath);
+	log_debug("%smap='%p' (%lu bytes);\n", prefix, file->map, (unsigned long)file->maplen);
 	
 }
 
@@ -1988,7 +2286,8 @@ handler_t fs_file_handler = {
 	fs_mkdir,		// create a directory
 	fs_rmdir,		// remove a directory
 	fs_move,		// move a file or directory
-	fs_dump_file		// dump file
+	fs_dump_file,		// dump file
+	fs_map			// map file into memory
 };
 
 provider_t fs_provider = {
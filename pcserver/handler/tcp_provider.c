@@ -33,12 +33,17 @@
  */
 
 
+#define	LOG_MODULE	LOGM_NET
+
 #include "os.h"
 
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 
 #include "provider.h"
@@ -50,10 +55,27 @@
 #include "wireformat.h"
 
 #include "log.h"
+#include "workers.h"
+#include "loop.h"
 
 #undef DEBUG_READ
 
-#define	MAX_BUFFER_SIZE	64
+#define	RX_BUFFER_SIZE	4096	// receive ring per connection
+#define	TX_BUFFER_SIZE	4096	// write queue per connection; a write waits when it is full
+#define	CLOSE_DRAIN_MS	2000	// max. time the write queue is sent for after a close
+#define	TX_WAIT_MS	10000	// max. time the poll loop waits for room in the write queue
+
+// directions the poll loop watches the socket for
+#define	WATCH_READ	1
+#define	WATCH_WRITE	2
+
+// socket options from the assign, "tcp=<hostname>[,nodelay][,cork]"
+#define	TCP_OPT_NODELAY	1	// send each write right away (no Nagle)
+#define	TCP_OPT_CORK	2	// send full segments only, until the device sends EOF
+
+#ifndef MSG_NOSIGNAL
+#define	MSG_NOSIGNAL	0
+#endif
 
 #define	TELNET_PORT	"23"
 
@@ -69,9 +91,23 @@ typedef struct {
 	file_t		file;		// embedded
 	int		isroot;		// !=0 when root
 
-	char		has_lastbyte;	// lastbyte is valid when set
-	char		lastbyte;	// last byte read, to handle EOF correctly
 	int		sockfd;		// socket file descriptor
+	int		polled;		// sockfd is watched by the poll loop
+	int		watch;		// WATCH_* directions currently watched
+	// receive ring, filled by the poll loop
+	char		*rxbuf;
+	int		rxhead;		// first byte not yet read by the device
+	int		rxlen;		// number of bytes in the ring
+	int		rxeof;		// peer has closed the connection
+	int		rxerr;		// errno from reading the socket, or 0
+	// write queue, sent when the socket takes it
+	char		*txbuf;
+	int		txhead;		// first byte not yet sent
+	int		txlen;		// number of bytes queued
+	int		txerr;		// errno from writing the socket, or 0
+	// closed by the device, the loop still sends the write queue
+	int		draining;
+	int		drain_timer;	// timer id for CLOSE_DRAIN_MS
 } File;
 
 static void file_init(const type_t *t, void *obj) {
@@ -83,9 +119,21 @@ static void file_init(const type_t *t, void *obj) {
         fp->file.handler = &tcp_file_handler;
         fp->file.recordlen = 0;
 
-	fp->has_lastbyte = 0;
         fp->isroot = -0;
         fp->sockfd = -1;
+	fp->polled = 0;
+	fp->watch = 0;
+	fp->rxbuf = NULL;
+	fp->rxhead = 0;
+	fp->rxlen = 0;
+	fp->rxeof = 0;
+	fp->rxerr = 0;
+	fp->txbuf = NULL;
+	fp->txhead = 0;
+	fp->txlen = 0;
+	fp->txerr = 0;
+	fp->draining = 0;
+	fp->drain_timer = -1;
 }
 
 static type_t file_type = {
@@ -99,6 +147,7 @@ typedef struct {
 	endpoint_t 	base;
 	// payload
 	char			*hostname;	// from assign
+	int			sockopts;	// TCP_OPT_*
 } tn_endpoint_t;
 
 static void endpoint_init(const type_t *t, void *obj) {
@@ -122,15 +171,44 @@ static type_t endpoint_type = {
 
 
 
-// close a file descriptor
-static int close_fd(File *file) {
-	int er = 0;
+static void tx_flush(File *file);
+static void tx_drain(File *file);
+
+// close the socket and free the file
+static void close_now(File *file) {
 
 	if (file->sockfd >= 0) {
+		if (file->polled) {
+			poll_unregister(file->sockfd);
+		}
+		if (file->txlen > 0) {
+			log_warn("Dropping %d bytes not sent on fd=%d\n", file->txlen, file->sockfd);
+		}
 		close(file->sockfd);
 		file->sockfd = -1;
 	}
+	mem_free(file->rxbuf);
+	mem_free(file->txbuf);
 	mem_free(file);
+}
+
+// close a file descriptor. What the socket has not taken of the write
+// queue yet is sent by the poll loop, which then closes the socket.
+static int close_fd(File *file) {
+	int er = 0;
+
+	if (file->file.endpoint != NULL) {
+		reg_remove(&file->file.endpoint->files, file);
+		file->file.endpoint = NULL;
+	}
+	if (file->sockfd >= 0) {
+		tx_flush(file);
+		if (file->txlen > 0 && !file->txerr && file->polled) {
+			tx_drain(file);
+			return er;
+		}
+	}
+	close_now(file);
 	return er;
 }
 
@@ -172,15 +250,19 @@ static void tnp_init(void) {
 static int tn_close(file_t *fp, int recurse, char *outbuf, int *outlen) {
 	(void) outbuf;
 
+	file_t *parent = fp->parent;
+
 	close_fd((File*)fp);
 
 	if (recurse) {
-		if (fp->parent != NULL) {
-			fp->parent->handler->close(fp->parent, 1, NULL, NULL);
+		if (parent != NULL) {
+			parent->handler->close(parent, 1, NULL, NULL);
 		}
 	}
 
-	*outlen = 0;
+	if (outlen != NULL) {
+		*outlen = 0;
+	}
 
 	return CBM_ERROR_OK;
 }
@@ -222,6 +304,7 @@ static tn_endpoint_t *create_ep() {
 	tn_endpoint_t *tnep = mem_alloc(&endpoint_type);
 
 	tnep->hostname = NULL;
+	tnep->sockopts = 0;
 
 	return tnep;
 }
@@ -238,9 +321,25 @@ static endpoint_t *tnp_new(endpoint_t *parent, const char *path, charset_t cset,
 	tn_endpoint_t *tnep = create_ep();
 
 	char *hostname = conv_name_alloc(path, cset, CHARSET_ASCII);
+
+	// socket options after the host name
+	char *opt = strchr(hostname, ',');
+	if (opt != NULL) {
+		*opt++ = 0;
+		for (opt = strtok(opt, ","); opt != NULL; opt = strtok(NULL, ",")) {
+			if (!strcmp(opt, "nodelay")) {
+				tnep->sockopts |= TCP_OPT_NODELAY;
+			} else
+			if (!strcmp(opt, "cork")) {
+				tnep->sockopts |= TCP_OPT_CORK;
+			} else {
+				log_warn("Ignoring unknown tcp option '%s'\n", opt);
+			}
+		}
+	}
 	tnep->hostname = hostname;
 	
-	log_info("Telnet provider set to hostname '%s'\n", tnep->hostname);
+	log_info("Telnet provider set to hostname '%s' (options %d)\n", tnep->hostname, tnep->sockopts);
 
 	return (endpoint_t*) tnep;
 }
@@ -310,6 +409,218 @@ static int errno_to_error(int err) {
 }
 
 
+// ----------------------------------------------------------------------------------
+// socket buffering
+//
+// The socket of an open file is watched by the poll loop. Received data is
+// kept in a ring until the device reads it; while the ring is full the
+// socket is not read, so TCP flow control holds the peer back. Written data
+// is queued and sent when the socket takes it, so a slow peer does not hold
+// up a worker for each packet. All of this runs with the server lock held.
+
+static void sock_read(int fd, void *data);
+static void sock_write(int fd, void *data);
+
+// watch the socket for the directions there is room or data for
+static void sock_update(File *file) {
+
+	if (file->polled) {
+		int watch = 0;
+		if (file->rxlen < RX_BUFFER_SIZE && !file->rxeof && !file->rxerr
+				&& !file->draining) {
+			watch |= WATCH_READ;
+		}
+		if (file->txlen > 0 && !file->txerr) {
+			watch |= WATCH_WRITE;
+		}
+		if (watch != file->watch) {
+			file->watch = watch;
+			poll_set_actions(file->sockfd,
+				(watch & WATCH_READ) ? sock_read : NULL,
+				(watch & WATCH_WRITE) ? sock_write : NULL);
+			// we may be in a worker, while the loop waits with the old list
+			workers_wakeup();
+		}
+	}
+}
+
+// read from the socket into the ring, until it is full or the socket is empty
+static void rx_fill(File *file) {
+
+	while (file->rxlen < RX_BUFFER_SIZE && !file->rxeof && !file->rxerr) {
+
+		int wp = (file->rxhead + file->rxlen) % RX_BUFFER_SIZE;
+		int room = RX_BUFFER_SIZE - file->rxlen;
+		if (room > RX_BUFFER_SIZE - wp) {
+			room = RX_BUFFER_SIZE - wp;
+		}
+
+		ssize_t n = recv(file->sockfd, file->rxbuf + wp, room, 0);
+
+#ifdef DEBUG_READ
+		log_debug("Read %ld bytes from socket fd=%d\n", n, file->sockfd);
+#endif
+		if (n > 0) {
+			file->rxlen += n;
+		} else
+		if (n == 0) {
+			file->rxeof = 1;
+		} else
+		if (errno != EINTR) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				file->rxerr = errno;
+				log_errno("Error reading from socket");
+			}
+			break;
+		}
+	}
+}
+
+// send as much of the write queue as the socket takes
+static void tx_flush(File *file) {
+
+	while (file->txlen > 0 && !file->txerr) {
+
+		ssize_t n = send(file->sockfd, file->txbuf + file->txhead, file->txlen, MSG_NOSIGNAL);
+
+		if (n >= 0) {
+			file->txhead += n;
+			file->txlen -= n;
+		} else
+		if (errno != EINTR) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				file->txerr = errno;
+				log_errno("Error writing to socket");
+			}
+			break;
+		}
+	}
+	if (file->txlen == 0) {
+		file->txhead = 0;
+	}
+}
+
+// push out a partial segment held back by TCP_CORK
+static void tx_push(File *file) {
+#ifdef TCP_CORK
+	tn_endpoint_t *tnep = (tn_endpoint_t*) file->file.endpoint;
+
+	if (tnep != NULL && (tnep->sockopts & TCP_OPT_CORK)) {
+		int off = 0;
+		int on = 1;
+		setsockopt(file->sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+		setsockopt(file->sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	}
+#else
+	(void) file;
+#endif
+}
+
+/**
+ * wait until the socket has taken some of the write queue.
+ * Returns 0, or -1 when the server is shutting down.
+ */
+static int tx_wait(File *file) {
+
+	if (workers_in_worker() && file->polled) {
+		// sock_write wakes us up
+		sock_update(file);
+		return workers_wait();
+	}
+
+	// we are the poll loop, or the socket is not watched anymore; a peer
+	// that does not read fails the write instead of stopping the loop
+	struct pollfd pfd;
+	pfd.fd = file->sockfd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+
+	workers_unlock();
+	int rv = poll(&pfd, 1, TX_WAIT_MS);
+	workers_lock();
+
+	if (rv == 0) {
+		log_warn("Timeout writing to socket fd=%d\n", file->sockfd);
+		file->txerr = ETIMEDOUT;
+		return 0;
+	}
+	tx_flush(file);
+	return 0;
+}
+
+static void drain_timeout(void *data) {
+	File *file = (File*) data;
+
+	file->drain_timer = -1;
+	close_now(file);
+}
+
+// the device has closed the file, but the socket has not taken all of the
+// write queue yet. The poll loop sends the rest from sock_write, and closes
+// the socket when the queue is empty, the socket fails, or a peer that
+// does not read has held it up for CLOSE_DRAIN_MS.
+static void tx_drain(File *file) {
+
+	file->draining = 1;
+	file->drain_timer = poll_timer_add(CLOSE_DRAIN_MS, 0, drain_timeout, file);
+	sock_update(file);
+	// the loop may wait without the new timer
+	workers_wakeup();
+}
+
+// end the drain of a closed file
+static void drain_done(File *file) {
+
+	if (file->drain_timer >= 0) {
+		poll_timer_cancel(file->drain_timer);
+	}
+	close_now(file);
+}
+
+static void sock_read(int fd, void *data) {
+	(void) fd;
+	File *file = (File*) data;
+
+	rx_fill(file);
+	sock_update(file);
+}
+
+static void sock_write(int fd, void *data) {
+	(void) fd;
+	File *file = (File*) data;
+
+	tx_flush(file);
+	if (file->draining) {
+		if (file->txlen == 0 || file->txerr) {
+			drain_done(file);
+		}
+		return;
+	}
+	sock_update(file);
+	// writers waiting for room in the queue
+	workers_notify();
+}
+
+// The peer has closed the connection, or there is an error on the socket.
+// As these are reported even when no direction is watched, the socket is
+// not watched anymore. What the ring has no room for is read directly
+// from the socket later.
+static void sock_hup(int fd, void *data) {
+	File *file = (File*) data;
+
+	if (file->draining) {
+		// also on shutdown
+		tx_flush(file);
+		drain_done(file);
+		return;
+	}
+	rx_fill(file);
+	poll_unregister(fd);
+	file->polled = 0;
+	file->watch = 0;
+	workers_notify();
+}
+
 // ----------------------------------------------------------------------------------
 // commands as sent from the device
 
@@ -337,7 +648,10 @@ static int open_file(file_t *fp, openpars_t *pars, const char *mode) {
 	hints.ai_flags = (AI_V4MAPPED | AI_ADDRCONFIG);
 
 	// 1. get the internet address for it via getaddrinfo
+	// name lookup and connect may block, so let others work in the meantime
+	workers_unlock();
 	ern = getaddrinfo(tnep->hostname, filename, &hints, &addr);
+	workers_lock();
 	if (ern != 0) {
 		log_error("Did not get address info for %s:%s, returns %d (%s)", tnep->hostname, filename,
 				ern, gai_strerror(ern));
@@ -363,7 +677,9 @@ static int open_file(file_t *fp, openpars_t *pars, const char *mode) {
                 continue;
 	    }
 
+	    workers_unlock();
 	    int ern = connect(sockfd, ap->ai_addr, ap->ai_addrlen);
+	    workers_lock();
 	    if (ern == 0) {
                 break;                  /* Success */
 	    }
@@ -375,22 +691,42 @@ static int open_file(file_t *fp, openpars_t *pars, const char *mode) {
 
         freeaddrinfo(addr);           /* No longer needed */
 
+        if (ap == NULL) {               /* No address succeeded */
+            	log_error("Could not connect to %s:%s\n", tnep->hostname, fp->filename);
+		return er;
+        }
+
 	ern = fcntl(sockfd, F_SETFL, O_NONBLOCK);
 
 	if (ern != 0) {
 		log_errno("Could not set to non-blocking!");
 		close(sockfd);
 		er = CBM_ERROR_FAULT;
-		ap = NULL;
-	}
-
-        if (ap == NULL) {               /* No address succeeded */
-            	log_error("Could not connect to %s:%s\n", tnep->hostname, fp->filename);
-        } else {
+	} else {
 
 		log_debug("Connected with fd=%d\n", sockfd);
 
+		int on = 1;
+		if (tnep->sockopts & TCP_OPT_NODELAY) {
+			setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}
+#ifdef TCP_CORK
+		if (tnep->sockopts & TCP_OPT_CORK) {
+			setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+		}
+#endif
+
 		file->sockfd = sockfd;
+		file->rxbuf = mem_alloc_c(RX_BUFFER_SIZE, "tcp_rxbuf");
+		file->txbuf = mem_alloc_c(TX_BUFFER_SIZE, "tcp_txbuf");
+
+		poll_register_readwrite(sockfd, file, sock_read, NULL, sock_hup);
+		// not a device connection
+		poll_set_options(sockfd, POLL_OPT_AUX);
+		file->polled = 1;
+		file->watch = WATCH_READ;
+		workers_wakeup();
+
 		er = CBM_ERROR_OK;
 	}
 
@@ -403,7 +739,11 @@ static int open_file(file_t *fp, openpars_t *pars, const char *mode) {
 
 // read file data
 //
-// returns positive number of bytes read, or negative error number
+// returns positive number of bytes read, or negative error number.
+// Returns what the ring has, which may be nothing when the peer has not
+// sent anything; READFLAG_EOF is set with the last data after the peer has
+// closed the connection, or without data when it closes after the device
+// has read everything.
 //
 static int read_file(file_t *fp, char *retbuf, int len, int *readflag, charset_t outcset) {
 
@@ -412,56 +752,51 @@ static int read_file(file_t *fp, char *retbuf, int len, int *readflag, charset_t
 	File *file = (File*)fp;
 
 	if (file != NULL) {
-		int sockfd = file->sockfd;
-
-		int rv = CBM_ERROR_OK;
-
-		retbuf[0] = file->lastbyte;
 
-		ssize_t n = read(sockfd, file->has_lastbyte ? retbuf+1 : retbuf, 
-					file->has_lastbyte ? len - 1 : len);
+		if (!file->polled) {
+			// after a hangup, take the rest directly from the socket
+			rx_fill(file);
+		}
 
-#ifdef DEBUG_READ
-		log_debug("Read %ld bytes from socket fd=%d\n", n, sockfd);
-#endif
+		int n = 0;
+		while (n < len && file->rxlen > 0) {
+			int chunk = len - n;
+			if (chunk > file->rxlen) {
+				chunk = file->rxlen;
+			}
+			if (chunk > RX_BUFFER_SIZE - file->rxhead) {
+				chunk = RX_BUFFER_SIZE - file->rxhead;
+			}
+			memcpy(retbuf + n, file->rxbuf + file->rxhead, chunk);
+			n += chunk;
+			file->rxhead = (file->rxhead + chunk) % RX_BUFFER_SIZE;
+			file->rxlen -= chunk;
+		}
 
-		if (n < 0) {
-			// error condition
-			if (errno != EAGAIN && errno != EWOULDBLOCK) {
-				// error reading from socket
-				rv = errno_to_error(errno);
-				log_errno("Error reading from socket!\n");
-				return -rv;
+		if (file->rxlen == 0) {
+			if (file->rxerr) {
+				if (n == 0) {
+					return -errno_to_error(file->rxerr);
+				}
+			} else
+			if (file->rxeof) {
+				*readflag = READFLAG_EOF;
 			}
-			// no data available, not in error, just non-blocking
-			len = 0;
-		} else 
-		if (n > 0) {
-			// got some real data
-			// what's in the buffer?
-			len = n + (file->has_lastbyte ? 1 : 0);
-
-			// NOTE: this probably belongs into an option, or
-			// make it different defaults for read only and read/write files
-
-			// keep one for EOF handling (note: len here always >= 1)
-			//len--;
-			//file->lastbyte = retbuf[len];
-			//file->has_lastbyte = 1;
-			file->has_lastbyte = 0;
-		} else
-		if (n == 0) {
-			// got an EOF
-			*readflag = READFLAG_EOF;
-			len = file->has_lastbyte ? 1 : 0;
-			retbuf[0] = file->lastbyte;
 		}
-		return len;
+
+		// there may be room in the ring again
+		sock_update(file);
+
+		return n;
 	}
 	return -CBM_ERROR_FAULT;
 }
 
 // write file data
+//
+// queues the data, and sends what the socket takes. Waits only when the
+// queue is full.
+//
 static int write_file(file_t *fp, const char *buf, int len, int is_eof) {
 	File *file = (File*)fp;
 
@@ -471,20 +806,38 @@ static int write_file(file_t *fp, const char *buf, int len, int is_eof) {
 
 	if (file != NULL) {
 
-		int sockfd = file->sockfd;
+		while (len > 0 && !file->txerr) {
 
-		while (len > 0) {
-			ssize_t nw = write(sockfd, buf, len);
-
-			if (nw < 0) {
-				log_errno("Error writing to socket\n");
-				break;
+			if (file->txlen >= TX_BUFFER_SIZE) {
+				if (tx_wait(file) < 0) {
+					return -CBM_ERROR_FAULT;
+				}
+				continue;
+			}
+			if (file->txhead + file->txlen + len > TX_BUFFER_SIZE && file->txhead > 0) {
+				// move the queued data to the start of the buffer
+				memmove(file->txbuf, file->txbuf + file->txhead, file->txlen);
+				file->txhead = 0;
 			}
-			len -= nw;
+			int n = TX_BUFFER_SIZE - file->txhead - file->txlen;
+			if (n > len) {
+				n = len;
+			}
+			memcpy(file->txbuf + file->txhead + file->txlen, buf, n);
+			file->txlen += n;
+			buf += n;
+			len -= n;
+
+			tx_flush(file);
 		}
 
 		if (is_eof) {
-			//close_fd(file);
+			tx_push(file);
+		}
+		sock_update(file);
+
+		if (file->txerr) {
+			return -errno_to_error(file->txerr);
 		}
 		return 0;
 	}
@@ -656,7 +1009,8 @@ static handler_t tcp_file_handler = {
         NULL,			// fs_mkdir,               // create a directory
         NULL,			// fs_rmdir,               // remove a directory
         NULL,			// fs_move,                // move a file or directory
-        tn_dump_file            // dump file
+        tn_dump_file,           // dump file
+        NULL                    // map
 };
 
 
@@ -27,6 +27,8 @@
  This should be especially useful for REL files on a non-Dxx-media
 */
 
+#define	LOG_MODULE	LOGM_PROV
+
 #include <inttypes.h>
 #include <string.h>
 #include <strings.h>
@@ -275,7 +277,8 @@ static handler_t typed_handler = {
 
 	// -------------------------
 
-	typed_dump
+	typed_dump,
+	NULL		// map
 };
 
 
@@ -19,6 +19,8 @@
 
 ****************************************************************************/
 
+#define	LOG_MODULE	LOGM_PROV
+
 #include <inttypes.h>
 #include <string.h>
 #include <ctype.h>
@@ -143,10 +145,17 @@ static int x00_resolve(file_t *infile, file_t **outfile, const char *inname, cha
 		return CBM_ERROR_FILE_TYPE_MISMATCH;
 	}
 
-	// seek to start of file
-	infile->handler->seek(infile, 0, SEEKFLAG_ABS);
-	// read p00 header
-	infile->handler->readfile(infile, (char*)x00_buf, X00_HEADER_LEN, &flg, cset);
+	// the header of a file seen before is cached; an open seeks
+	// past the header anyway
+	if (handler_detect_data(infile, x00_buf, X00_HEADER_LEN) != X00_HEADER_LEN) {
+		memset(x00_buf, 0, X00_HEADER_LEN);
+		// seek to start of file
+		infile->handler->seek(infile, 0, SEEKFLAG_ABS);
+		// read p00 header
+		infile->handler->readfile(infile, (char*)x00_buf, X00_HEADER_LEN, &flg, cset);
+
+		handler_detect_save(infile, x00_buf, X00_HEADER_LEN);
+	}
 
 	if (strcmp("C64File", (char*)x00_buf) != 0) { 
 		mem_free((char*)name);
@@ -306,7 +315,8 @@ static handler_t x00_handler = {
 
 	// -------------------------
 
-	x00_dump
+	x00_dump,
+	NULL		// map
 };
 
 
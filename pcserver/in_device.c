@@ -31,6 +31,8 @@
  * In this file the actual command work is done
  */
 
+#define	LOG_MODULE	LOGM_DEV
+
 #include "os.h"
 
 #include "charconvert.h"
@@ -43,9 +45,11 @@
 #include "list.h"
 #include "cmd.h"
 #include "serial.h"
+#include "workers.h"
+#include "stats.h"
 
 #define	MAX_BUFFER_SIZE			64
-#define	RET_BUFFER_SIZE			200
+#define	RET_BUFFER_SIZE			(FSP_MAX_LEN+1)
 
 
 static void in_device_constructor(const type_t *t, void *o) {
@@ -55,7 +59,15 @@ static void in_device_constructor(const type_t *t, void *o) {
 	d->wrp = 0;
 	d->rdp = 0;
 
-	d->charset = cconv_getcharset(CHARSET_ASCII_NAME);
+	d->out = NULL;
+	d->outrdp = 0;
+	d->outwrp = 0;
+	d->outcap = 0;
+	d->wait = NULL;
+
+	d->session = NULL;
+	d->closed = 0;
+	d->maxpacket = FSP_DEFAULT_LEN;
 }
 	
 static type_t in_device_type = {
@@ -64,6 +76,22 @@ static type_t in_device_type = {
 	in_device_constructor
 };
 
+// a command packet run in a worker thread; the replies are collected
+// and written from the loop thread when done
+typedef struct {
+	in_device_t	*dt;
+	char		*out;		// reply packets
+	int		outlen;
+	int		outcap;
+	char		buf[256];	// command packet (the length is a byte)
+} dev_job_t;
+
+static type_t dev_job_type = {
+	"dev_job_t",
+	sizeof(dev_job_t),
+	NULL
+};
+
 //------------------------------------------------------------------------------------
 // helpers
 
@@ -123,7 +151,65 @@ static void dev_write_packet(serial_port_t fd, char *retbuf) {
 }
 
 
-static void cmd_sendxcmd(serial_port_t writefd, char buf[]) {
+// queue reply packets; they are written by dev_flush()
+static void dev_queue(in_device_t *dt, const char *data, int len) {
+
+	if (dt->outrdp == dt->outwrp) {
+		dt->outrdp = 0;
+		dt->outwrp = 0;
+	}
+	if (dt->outwrp + len > dt->outcap) {
+		int used = dt->outwrp - dt->outrdp;
+		int newcap = dt->outcap;
+		if (used + len > newcap) {
+			newcap = newcap ? newcap * 2 : 1024;
+			while (newcap < used + len) {
+				newcap *= 2;
+			}
+		}
+		char *newout = mem_alloc_c(newcap, "dev_out");
+		if (dt->out != NULL) {
+			memcpy(newout, dt->out + dt->outrdp, used);
+			mem_free(dt->out);
+		}
+		dt->out = newout;
+		dt->outcap = newcap;
+		dt->outrdp = 0;
+		dt->outwrp = used;
+	}
+	memcpy(dt->out + dt->outwrp, data, len);
+	dt->outwrp += len;
+#ifdef DEBUG_WRITE
+	log_debug("queued %d bytes, %d pending:\n", len, dt->outwrp - dt->outrdp);
+	log_hexdump(data, len, 0);
+#endif
+}
+
+// write as much of the queued replies as the fd takes, in a single write
+// when possible. Returns the number of bytes still queued.
+static int dev_flush(in_device_t *dt) {
+
+	while (dt->outrdp < dt->outwrp) {
+		int e = os_write(dt->writefd, dt->out + dt->outrdp, dt->outwrp - dt->outrdp);
+		if (e < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			log_error("Error on write: %d\n", errno);
+			// drop the replies, the device is probably gone
+			dt->outrdp = dt->outwrp;
+			break;
+		}
+		dt->outrdp += e;
+	}
+	if (dt->outrdp == dt->outwrp) {
+		dt->outrdp = 0;
+		dt->outwrp = 0;
+	}
+	return dt->outwrp - dt->outrdp;
+}
+
+static void cmd_sendxcmd(in_device_t *dt, char buf[]) {
 	// now send all the X-commands
 	int ncmds = xcmd_num_options();
 	log_debug("Got %d options to send:\n", ncmds);
@@ -141,10 +227,35 @@ static void cmd_sendxcmd(serial_port_t writefd, char buf[]) {
 			strncpy(buf+FSP_DATA, opt, MAX_BUFFER_SIZE);
 			buf[FSP_DATA + len] = 0;
 
-			// TODO: error handling
-			dev_write_packet(writefd, buf);
+			dev_queue(dt, buf, 0xff & buf[FSP_LEN]);
+		}
+	}
+}
+
+// queue a reply packet, or keep it in the job when run as job
+static void dev_reply(in_device_t *dt, dev_job_t *job, char *retbuf) {
+
+	if (job == NULL) {
+		dev_queue(dt, retbuf, 0xff & retbuf[FSP_LEN]);
+		return;
+	}
+
+	int plen = 0xff & retbuf[FSP_LEN];
+	if (job->outlen + plen > job->outcap) {
+		int newcap = job->outcap ? job->outcap * 2 : 1024;
+		while (newcap < job->outlen + plen) {
+			newcap *= 2;
+		}
+		char *newout = mem_alloc_c(newcap, "dev_job_out");
+		if (job->out != NULL) {
+			memcpy(newout, job->out, job->outlen);
+			mem_free(job->out);
 		}
+		job->out = newout;
+		job->outcap = newcap;
 	}
+	memcpy(job->out + job->outlen, retbuf, plen);
+	job->outlen += plen;
 }
 
 static void dev_sendreset(serial_port_t writefd) {
@@ -164,13 +275,15 @@ static void dev_sendreset(serial_port_t writefd) {
  * to the appropriate provider for further processing, using C-style arguments
  * (and not buffer + offsets).
  *
- * The return packet is written into the file descriptor fd
+ * The return packet is queued for the file descriptor fd, or collected
+ * in the job when run in a worker thread.
  */
-static void dev_dispatch(char *buf, in_device_t *dt) {
+static void dev_dispatch(char *buf, in_device_t *dt, dev_job_t *job) {
 	int tfd, cmd;
 	unsigned int len;
 	char retbuf[RET_BUFFER_SIZE];
 	int rv;
+	int credits;
 	char *name2;
 
 	cmd = buf[FSP_CMD];		// 0
@@ -228,6 +341,7 @@ static void dev_dispatch(char *buf, in_device_t *dt) {
 	int outlen = 0;
 	int namelen = len - FSP_DATA;
 
+	uint64_t start = stats_now();
 
 	// dispatch to the correct cmd_* routine.
 	// may someday be replaced by an array lookup when the routine calls have been unified...
@@ -238,81 +352,112 @@ static void dev_dispatch(char *buf, in_device_t *dt) {
 	case FS_OPEN_WR:
 	case FS_OPEN_OW:
 	case FS_OPEN_RW:
-		rv = cmd_open_file(tfd, buf+FSP_DATA, len-FSP_DATA, dt->charset, retbuf+FSP_DATA+1, &outlen, cmd);
+		rv = cmd_open_file(dt->session, tfd, buf+FSP_DATA, len-FSP_DATA, retbuf+FSP_DATA+1, &outlen, cmd);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1 + outlen;
 		break;
 	case FS_OPEN_DR:
-		rv = cmd_open_dir(tfd, buf+FSP_DATA, len-FSP_DATA, dt->charset);
+		rv = cmd_open_dir(dt->session, tfd, buf+FSP_DATA, len-FSP_DATA);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1;
 		break;
 	case FS_READ:
 		// note that on the server side, we do not need to handle FS_DATA*, as we only send those
-		rv = cmd_read(tfd, retbuf+FSP_DATA, &outlen, &readflag, dt->charset);
-		if (rv != CBM_ERROR_OK) {
-			retbuf[FSP_DATA] = rv;
-			retbuf[FSP_LEN] = FSP_DATA + 1;
-		} else {
+		// An optional payload byte gives the number of packets the device has room for
+		// (credits). We stream that many FS_DATA packets without waiting for further FS_READs,
+		// and stop early on EOF, error, or when no data is available.
+		credits = (len > FSP_DATA) ? (buf[FSP_DATA] & 255) : 1;
+		do {
+			readflag = 0;
+			outlen = 0;
+			rv = cmd_read(dt->session, tfd, retbuf+FSP_DATA, dt->maxpacket-FSP_DATA, &outlen, &readflag);
+			if (rv != CBM_ERROR_OK) {
+				retbuf[FSP_CMD] = FS_REPLY;
+				retbuf[FSP_DATA] = rv;
+				retbuf[FSP_LEN] = FSP_DATA + 1;
+				break;
+			}
 			retbuf[FSP_CMD] = (readflag & READFLAG_EOF) ? FS_DATA_EOF : FS_DATA;
 			retbuf[FSP_LEN] = FSP_DATA + outlen;
-		}
+			if ((readflag & READFLAG_EOF) || outlen == 0) {
+				break;
+			}
+			credits--;
+			if (credits > 0) {
+				// last one is sent below
+				dev_reply(dt, job, retbuf);
+				if (job != NULL) {
+					// a long stream should not hold up the other channels
+					workers_yield();
+				}
+			}
+		} while (credits > 0);
 		break;
 	case FS_INFO:
-		cmd_info(retbuf+FSP_DATA, &outlen, dt->charset);
-		retbuf[FSP_CMD] = FS_DATA_EOF;
+		if (len > FSP_DATA && (buf[FSP_DATA] & 255) == FS_INFO_STATS) {
+			int chunk = 0;
+			int eof = 0;
+			if (len > FSP_DATA + 2) {
+				chunk = (buf[FSP_DATA+1] & 255) | ((buf[FSP_DATA+2] & 255) << 8);
+			}
+			cmd_stats(dt->session, chunk, retbuf+FSP_DATA, dt->maxpacket-FSP_DATA, &outlen, &eof);
+			retbuf[FSP_CMD] = eof ? FS_DATA_EOF : FS_DATA;
+		} else {
+			cmd_info(dt->session, retbuf+FSP_DATA, &outlen);
+			retbuf[FSP_CMD] = FS_DATA_EOF;
+		}
 		retbuf[FSP_LEN] = FSP_DATA + outlen;
 		break;
 	case FS_WRITE:
 	case FS_WRITE_EOF:
-		rv = cmd_write(tfd, cmd, buf+FSP_DATA, len-FSP_DATA);
+		rv = cmd_write(dt->session, tfd, cmd, buf+FSP_DATA, len-FSP_DATA);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1;
 		break;
 	case FS_POSITION:
-		rv = cmd_position(tfd, buf+FSP_DATA, len-FSP_DATA);
+		rv = cmd_position(dt->session, tfd, buf+FSP_DATA, len-FSP_DATA);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1;
 		break;
 	case FS_CLOSE:
-		rv = cmd_close(tfd, retbuf+FSP_DATA+1, &outlen);
+		rv = cmd_close(dt->session, tfd, retbuf+FSP_DATA+1, &outlen);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1 + outlen;
 		break;
 
 		// command operations
 	case FS_DELETE:
-		rv = cmd_delete(buf+FSP_DATA, len-FSP_DATA, dt->charset, retbuf+FSP_DATA+1, &outlen, 0);
+		rv = cmd_delete(dt->session, buf+FSP_DATA, len-FSP_DATA, retbuf+FSP_DATA+1, &outlen, 0);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1 + outlen;
 		break;
 	case FS_MOVE:
-		rv = cmd_move(buf+FSP_DATA, len-FSP_DATA, dt->charset);
+		rv = cmd_move(dt->session, buf+FSP_DATA, len-FSP_DATA);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1;
 		break;
 	case FS_CHDIR:
-		rv = cmd_chdir(buf+FSP_DATA, len-FSP_DATA, dt->charset);
+		rv = cmd_chdir(dt->session, buf+FSP_DATA, len-FSP_DATA);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1;
 		break;
 	case FS_MKDIR:
-		rv = cmd_mkdir(buf+FSP_DATA, len-FSP_DATA, dt->charset);
+		rv = cmd_mkdir(dt->session, buf+FSP_DATA, len-FSP_DATA);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1;
 		break;
 	case FS_RMDIR:
-		rv = cmd_delete(buf+FSP_DATA, len-FSP_DATA, dt->charset, retbuf+FSP_DATA+1, &outlen, 1);
+		rv = cmd_delete(dt->session, buf+FSP_DATA, len-FSP_DATA, retbuf+FSP_DATA+1, &outlen, 1);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1 + outlen;
 		break;
 	case FS_COPY:
-		rv = cmd_copy(buf+FSP_DATA, len-FSP_DATA, dt->charset);
+		rv = cmd_copy(dt->session, buf+FSP_DATA, len-FSP_DATA);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1 + outlen;
       		break;
 	case FS_BLOCK:
-		rv = cmd_block(tfd, buf+FSP_DATA, len-FSP_DATA, retbuf+FSP_DATA+1, &outlen);
+		rv = cmd_block(dt->session, tfd, buf+FSP_DATA, len-FSP_DATA, retbuf+FSP_DATA+1, &outlen);
 		retbuf[FSP_DATA] = rv;
 		retbuf[FSP_LEN] = FSP_DATA + 1 + outlen;
 		break;
@@ -336,7 +481,7 @@ static void dev_dispatch(char *buf, in_device_t *dt) {
 			name2 = NULL;
 		}
 		log_info("ASSIGN(%d -> %s = %s)\n", drive, name, name2);
-		rv = provider_assign(drive, name, name2, dt->charset, 0);
+		rv = provider_assign(dt->session, drive, name, name2, dt->session->charset, 0);
 		if (rv != 0) {
 			log_rv(rv);
 		}
@@ -344,8 +489,17 @@ static void dev_dispatch(char *buf, in_device_t *dt) {
 		break;
 	case FS_RESET:
 		log_info("RESET\n");
+		// a device that does not tell us its buffer size gets the default
+		dt->maxpacket = FSP_DEFAULT_LEN;
+		if (len > FSP_DATA) {
+			int maxlen = buf[FSP_DATA] & 255;
+			if (maxlen > FSP_DATA) {
+				dt->maxpacket = maxlen;
+			}
+		}
+		log_info("Using max packet length of %d\n", dt->maxpacket);
 		// send the X command line options again
-		cmd_sendxcmd(dt->writefd, retbuf);
+		cmd_sendxcmd(dt, retbuf);
 		// we have already sent everything
 		sendreply = 0;
 		break;
@@ -353,13 +507,13 @@ static void dev_dispatch(char *buf, in_device_t *dt) {
 		log_info("CHARSET: %s\n", buf+FSP_DATA);
 		if (tfd == FSFD_CMD) {
 			charset_t c = cconv_getcharset(buf + FSP_DATA);
-			dt->charset = c;
+			dt->session->charset = c;
 			//provider_set_ext_charset(buf+FSP_DATA);
 			retbuf[FSP_DATA] = CBM_ERROR_OK;
 		}
 		break;
 	case FS_FORMAT:
-		rv = cmd_format(buf+FSP_DATA, len-FSP_DATA, dt->charset);
+		rv = cmd_format(dt->session, buf+FSP_DATA, len-FSP_DATA);
 		retbuf[FSP_DATA] = rv;
       		break;
 	case FS_DUPLICATE:
@@ -376,20 +530,115 @@ static void dev_dispatch(char *buf, in_device_t *dt) {
 		log_error("Received unknown command: %d in a %d byte packet\n", cmd, len);
 	}
 
+	int is_error = sendreply && retbuf[FSP_CMD] == FS_REPLY
+		&& (retbuf[FSP_DATA] & 255) >= CBM_ERROR_READ
+		&& (retbuf[FSP_DATA] & 255) != CBM_ERROR_DOSVERSION;
+	stats_cmd(cmd, is_error, stats_now() - start, len - FSP_DATA);
+
 	if (sendreply) {
-		dev_write_packet(dt->writefd, retbuf);
+		dev_reply(dt, job, retbuf);
 	}
 }
 
+// flush the replies, and tell the poll loop what to wait for: while
+// replies are pending, for the fd to become writable, and for input only
+// below the high water mark and with room in the input buffer
+static void dev_flush_wait(in_device_t *dt) {
+
+	int pending = dev_flush(dt);
+
+	if (dt->wait != NULL) {
+		dt->wait(dt, pending < DEV_OUT_HIGH && dt->wrp - dt->rdp < DEV_RING_SIZE,
+			pending > 0);
+	}
+}
+
+//------------------------------------------------------------------------------------
+// worker jobs
+
+static void dev_process(in_device_t *tp);
+
+static void dev_job_run(void *arg) {
+	dev_job_t *job = (dev_job_t*) arg;
+
+	dev_dispatch(job->buf, job->dt, job);
+}
+
+static void dev_job_done(void *arg) {
+	dev_job_t *job = (dev_job_t*) arg;
+	in_device_t *dt = job->dt;
+
+	if (dt->closed) {
+		if (workers_pending(dt, -1) == 0) {
+			// the last job for a connection already gone
+			in_device_free(dt);
+		}
+	} else {
+		if (job->outlen) {
+			dev_queue(dt, job->out, job->outlen);
+		}
+		// take the packets left in the input while too many requests
+		// were outstanding
+		dev_process(dt);
+		dev_flush_wait(dt);
+	}
+
+	if (job->out != NULL) {
+		mem_free(job->out);
+	}
+	mem_free(job);
+}
+
+// commands whose provider operations may block, e.g. on the network
+static int dev_is_blocking(int cmd) {
+	switch (cmd) {
+	case FS_OPEN_RD:
+	case FS_OPEN_WR:
+	case FS_OPEN_RW:
+	case FS_OPEN_AP:
+	case FS_OPEN_OW:
+	case FS_OPEN_DR:
+	case FS_READ:
+	case FS_WRITE:
+	case FS_WRITE_EOF:
+	case FS_COPY:
+	case FS_FORMAT:
+		return 1;
+	}
+	return 0;
+}
+
+// run a packet, or queue it for the workers. Commands for a channel that
+// still has jobs are queued as well, to keep the order per channel
+static void dev_handle(char *buf, in_device_t *dt) {
+
+	int cmd = 0xff & buf[FSP_CMD];
+	int tfd = 0xff & buf[FSP_FD];
+
+	if (workers_enabled() && cmd != FS_TERM && cmd != FS_RESET
+		&& (dev_is_blocking(cmd) || workers_pending(dt, tfd))) {
+
+		dev_job_t *job = mem_alloc(&dev_job_type);
+		job->dt = dt;
+		memcpy(job->buf, buf, 0xff & buf[FSP_LEN]);
+
+		workers_submit(dt, tfd, dev_job_run, dev_job_done, job);
+		return;
+	}
+
+	dev_dispatch(buf, dt, NULL);
+}
+
 
 //------------------------------------------------------------------------------------
 // init
 
-in_device_t *in_device_init(serial_port_t readfd, serial_port_t writefd, int do_reset) {
+in_device_t *in_device_init(serial_port_t readfd, serial_port_t writefd, int do_reset, int shared_assigns) {
 
 	in_device_t *tp = mem_alloc(&in_device_type);	
 	tp->readfd = readfd;
 	tp->writefd = writefd;
+	tp->session = session_new(shared_assigns);
 
 	if (do_reset) {
 		// sync device and server
@@ -401,17 +650,79 @@ in_device_t *in_device_init(serial_port_t readfd, serial_port_t writefd, int do_
 	}
 	return tp;
 }
+
+void in_device_free(in_device_t *tp) {
+
+	if (workers_pending(tp, -1) > 0) {
+		// freed when the last job is done
+		tp->closed = 1;
+		return;
+	}
+
+	session_free(tp->session);
+	if (tp->out != NULL) {
+		mem_free(tp->out);
+	}
+	mem_free(tp);
+}
 	
 
 //------------------------------------------------------------------------------------
 // loop
 
 
+// take the complete packets from the input ring buffer and run them, or
+// queue them for the workers, until the reply queue gets too long or too
+// many requests are outstanding
+static void dev_process(in_device_t *tp) {
+
+	unsigned int fill;
+	int plen;
+	int cmd;
+	char pkt[256];
+
+	// as long as we have more than FSP_LEN bytes in the buffer
+	// i.e. 2 or more, we loop and process packets
+	// FSP_LEN is the position of the packet length
+	while ((fill = tp->wrp - tp->rdp) > FSP_LEN
+		&& tp->outwrp - tp->outrdp < DEV_OUT_HIGH
+		&& workers_pending(tp, -1) < DEV_MAX_PENDING) {
+
+		// first byte in packet is command, second is length of packet
+		cmd = 255 & tp->buf[tp->rdp & (DEV_RING_SIZE - 1)];
+		plen = 255 & tp->buf[(tp->rdp + FSP_LEN) & (DEV_RING_SIZE - 1)];
+
+		if (cmd == FS_SYNC || plen < FSP_DATA) {
+			// a packet is at least 3 bytes (when with zero data length)
+			// or the byte is the FS_SYNC command
+			// so ignore byte and shift one in buffer position
+			tp->rdp++;
+		} else
+		if (fill >= (unsigned int) plen) {
+			// we already received the full packet, so execute it;
+			// a packet wrapping around the end of the buffer is copied
+			unsigned int off = tp->rdp & (DEV_RING_SIZE - 1);
+			char *p = tp->buf + off;
+			if (off + plen > DEV_RING_SIZE) {
+				int first = DEV_RING_SIZE - off;
+				memcpy(pkt, tp->buf + off, first);
+				memcpy(pkt + first, tp->buf, plen - first);
+				p = pkt;
+			}
+			dev_handle(p, tp);
+			tp->rdp += plen;
+		} else {
+			// no, then break out of the while, to read more data
+			break;
+		}
+	}
+}
+
 /**
  *
  * Here the data is read from the given readfd, put into a packet buffer,
- * then given to cmd_dispatch() for the actual execution, and the reply is 
- * again packeted and written to the writefd
+ * then given to cmd_dispatch() for the actual execution, and the replies
+ * are queued and written to the writefd in one go at the end of the burst
  *
  * returns
  *   2 if read fails (errno gives more information)
@@ -420,70 +731,61 @@ in_device_t *in_device_init(serial_port_t readfd, serial_port_t writefd, int do_
  */
 int in_device_loop(in_device_t *tp) {
 
-        int n;
-	int plen;
-	int cmd;
+	int n;
+	unsigned int off = tp->wrp & (DEV_RING_SIZE - 1);
+	unsigned int room = DEV_RING_SIZE - (tp->wrp - tp->rdp);
 
-	      n = os_read(tp->readfd, tp->buf+tp->wrp, 8192-tp->wrp);
+	if (room == 0) {
+		// only when the replies are backed up
+		return 1;
+	}
+	// read into the free space up to the end of the buffer; the rest
+	// is read on the next call
+	if (room > DEV_RING_SIZE - off) {
+		room = DEV_RING_SIZE - off;
+	}
+
+	n = os_read(tp->readfd, tp->buf + off, room);
 #ifdef DEBUG_READ
-	      if(n) {
-		log_debug("read %d bytes (wrp=%d, rdp=%d: ",n,tp->wrp,tp->rdp);
-		log_hexdump(tp->buf+tp->wrp, n, 0);
-              }
+	if(n) {
+		log_debug("read %d bytes (wrp=%u, rdp=%u: ",n,tp->wrp,tp->rdp);
+		log_hexdump(tp->buf + off, n, 0);
+	}
 #endif
 
-	      if(!n) {
+	if(!n) {
 		if(!device_still_present()) {
 			log_error("Device lost.\n");
 			return 2;
-                }
+		}
 		return 1;
-	      }
+	}
 
-              if(n < 0) {
+	if(n < 0) {
 
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
 			return 1;
 		}
-                log_error("fsser: read error %d (%s) on fd %d\nDid you power off your device?\n",
+		log_error("fsser: read error %d (%s) on fd %d\nDid you power off your device?\n",
 			os_errno(),strerror(os_errno()), tp->readfd);
-                return 2;
-              }
-              tp->wrp+=n;
-              if(tp->rdp && (tp->wrp==8192 || tp->rdp==tp->wrp)) {
-                if(tp->rdp!=tp->wrp) {
-                  memmove(tp->buf, tp->buf+tp->rdp, tp->wrp-tp->rdp);
-                }
-                tp->wrp -= tp->rdp;
-                tp->rdp = 0;
-              }
-              // as long as we have more than FSP_LEN bytes in the buffer
-              // i.e. 2 or more, we loop and process packets
-              // FSP_LEN is the position of the packet length
-              while(tp->wrp-tp->rdp > FSP_LEN) {
-                // first byte in packet is command, second is length of packet
-                plen = 255 & tp->buf[tp->rdp+FSP_LEN];	//  AND with 255 to fix sign
-                cmd = 255 & tp->buf[tp->rdp+FSP_CMD];	//  AND with 255 to fix sign
-                // full packet received already?
-                if (cmd == FS_SYNC || plen < FSP_DATA) {
-		  // a packet is at least 3 bytes (when with zero data length)
-		  // or the byte is the FS_SYNC command
-		  // so ignore byte and shift one in buffer position
-		  tp->rdp++;
-		} else 
-                if(tp->wrp-tp->rdp >= plen) {
-		  // did we already receive the full packet?
-                  // yes, then execute
-		  //printf("dispatch @rdp=%d [%02x %02x ... ]\n", rdp, buf[rdp], buf[rdp+1]);
-                  dev_dispatch(tp->buf+tp->rdp, tp);
-                  tp->rdp +=plen;
-                } else {
-		  // no, then break out of the while, to read more data
-		  break;
-                }
-              }
-	return 0;
+		return 2;
+	}
+	tp->wrp += n;
+
+	dev_process(tp);
 
+	// all replies of the burst in one write
+	dev_flush_wait(tp);
+
+	return 0;
 }
 
+void in_device_write(in_device_t *tp) {
+
+	if (dev_flush(tp) < DEV_OUT_HIGH) {
+		// take the packets left in the input while the queue was full
+		dev_process(tp);
+	}
+	dev_flush_wait(tp);
+}
 
@@ -22,22 +22,54 @@
 #ifndef IN_DEVICE_H
 #define IN_DEVICE_H
 
-typedef struct {
+#include "session.h"
+
+// size of the input ring buffer; must be a power of two
+#define	DEV_RING_SIZE	8192
+// no further packets are taken from the input while more reply bytes
+// than this are waiting to be written
+#define	DEV_OUT_HIGH	65536
+// no further packets are taken from the input while this many requests
+// of the connection are outstanding in the worker threads
+#define	DEV_MAX_PENDING	16
+
+typedef struct _in_device in_device_t;
+
+struct _in_device {
 	serial_port_t readfd;
 	serial_port_t writefd;
-	int wrp;
-	int rdp;
-	charset_t charset;
-	char buf[8192];
-} in_device_t;
+	unsigned int wrp;	// input ring buffer write and read positions, taken
+	unsigned int rdp;	// modulo DEV_RING_SIZE
+	char *out;		// queued reply packets, the bytes from outrdp to outwrp
+	int outrdp;		// are still to be written
+	int outwrp;
+	int outcap;
+	// tells the poll loop whether to wait for input, and for the fd to
+	// become writable; NULL when not run in the poll loop
+	void (*wait)(in_device_t *tp, int rd, int wr);
+	session_t *session;	// open channels, assigns and charset of this connection
+	int closed;		// connection is gone, but worker jobs are still pending
+	int maxpacket;		// max. packet length the device can receive (negotiated on FS_RESET)
+	char buf[DEV_RING_SIZE];
+};
 
-in_device_t *in_device_init(int readfd, int writefd, int do_reset);
+/**
+ * set up a new connection. Tools connections share their assigns with
+ * the default session (see session.h)
+ */
+in_device_t *in_device_init(int readfd, int writefd, int do_reset, int shared_assigns);
+
+/**
+ * free the connection, including its session (but does not close the fds).
+ * With worker jobs pending, this is deferred until the last one is done.
+ */
+void in_device_free(in_device_t *tp);
 
 /**
  *
  * Here the data is read from the given readfd, put into a packet buffer,
- * then given to cmd_dispatch() for the actual execution, and the reply is 
- * again packeted and written to the writefd
+ * then given to cmd_dispatch() for the actual execution, and the replies
+ * are queued and written to the writefd in one go at the end of the burst
  *
  * returns
  *   2 if read fails (errno gives more information)
@@ -46,5 +78,11 @@ in_device_t *in_device_init(int readfd, int writefd, int do_reset);
  */
 int in_device_loop(in_device_t *tp);
 
+/**
+ * write the queued replies when the fd has become writable, and take
+ * further packets from the input once the queue has drained
+ */
+void in_device_write(in_device_t *tp);
+
 
 #endif
@@ -34,7 +34,9 @@
 #include "os.h"
 
 #include <stdbool.h>
+#include <string.h>
 #include <strings.h>
+#include <unistd.h>
 
 #include "provider.h"
 #include "dir.h"
@@ -42,6 +44,7 @@
 #include "cmd.h"
 #include "errors.h"
 #include "cmdline.h"
+#include "loop.h"
 
 static int user_interface_enabled = true;
 static int user_interface_aborted = false;
@@ -90,32 +93,17 @@ void disable_user_interface(void) {
 }
 
 #define INBUF_SIZE 1024
-// reads stdin and returns true, if the main loop should abort
-int in_ui_loop(void) {
 
-	int err;
-	char buf[INBUF_SIZE + 1];
+static char inbuf[INBUF_SIZE + 1];
+static int inbuf_len = 0;
 
-	// are we enabled?
-        if(!user_interface_enabled) {
-		return 0;
-	}
-	
-	// do we have data to process?
-	if(!os_stdin_has_data()) {
-		return 0;
-	}
+static void ui_line(char *buf) {
 
-	//log_debug("cmd_process_stdin()\n");
-
-	if (fgets(buf, INBUF_SIZE, stdin) == NULL) {
-		return false;
-	}
 	drop_crlf(buf);
 
 	// ignore empty line
 	if (buf[0] == 0) {
-		return false;
+		return;
 	}
 
 	log_debug("stdin: %s\n", buf);
@@ -124,8 +112,64 @@ int in_ui_loop(void) {
 	if (rv) {
 		log_error("Syntax error: '%s'\n", buf);
 	}
+}
 
-	return user_interface_aborted;
+// called from the poll loop when stdin has data
+static void ui_read(int fd, void *data) {
+	(void) data;
+
+	ssize_t n = read(fd, inbuf + inbuf_len, INBUF_SIZE - inbuf_len);
+
+	if (n <= 0) {
+		// EOF (e.g. stdin from /dev/null) - stop watching it
+		log_debug("stdin closed\n");
+		poll_unregister(fd);
+		return;
+	}
+	inbuf_len += n;
+
+	// process all complete lines
+	char *p = inbuf;
+	char *nl;
+	while ((nl = memchr(p, '\n', inbuf_len - (p - inbuf))) != NULL) {
+		*nl = 0;
+		ui_line(p);
+		p = nl + 1;
+	}
+	inbuf_len -= p - inbuf;
+
+	if (inbuf_len >= INBUF_SIZE) {
+		// line too long, process what we have
+		inbuf[inbuf_len] = 0;
+		ui_line(inbuf);
+		inbuf_len = 0;
+	} else
+	if (inbuf_len > 0 && p != inbuf) {
+		memmove(inbuf, p, inbuf_len);
+	}
 }
 
+static void ui_hup(int fd, void *data) {
+	(void) data;
+
+	poll_unregister(fd);
+}
+
+// registers stdin with the poll loop, if the user interface is enabled
+void in_ui_register(void) {
+
+	// are we enabled?
+        if(!user_interface_enabled) {
+		return;
+	}
+
+	poll_register_readwrite(STDIN_FILENO, NULL, ui_read, NULL, ui_hup);
+	poll_set_options(STDIN_FILENO, POLL_OPT_AUX);
+}
+
+// returns true, if the main loop should abort
+int in_ui_aborted(void) {
+
+	return user_interface_aborted;
+}
 
@@ -25,8 +25,11 @@
 
 void in_ui_init(void);
 
-// reads stdin and returns true, if the main loop should abort
-int in_ui_loop(void);
+// registers stdin with the poll loop, if the user interface is enabled
+void in_ui_register(void);
+
+// returns true, if the main loop should abort
+int in_ui_aborted(void);
 
 void disable_user_interface(void);
 void enable_user_interface(void);
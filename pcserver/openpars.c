@@ -19,6 +19,8 @@
 */
 
 
+#define	LOG_MODULE	LOGM_PROV
+
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
@@ -61,6 +61,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stdio.h>		/* SuSE Linux fileno() */
+#include <sys/mman.h>
 #endif
 
 // =======================================================================
@@ -148,6 +149,38 @@ static inline int os_fsync(FILE * f)
 	return res;
 }
 
+// map a whole file into memory, shared with the file
+// returns NULL if that is not possible
+static inline void *os_mmap(FILE * f, size_t len, int writable)
+{
+	void *p = mmap(NULL, len, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		       MAP_SHARED, fileno(f), 0);
+	if (p == MAP_FAILED) {
+		log_error("mmap failed: (%d) %s\n", os_errno(),
+			  os_strerror(os_errno()));
+		return NULL;
+	}
+	return p;
+}
+
+static inline int os_munmap(void *p, size_t len)
+{
+	return munmap(p, len);
+}
+
+// with wait set, return only when the data is written; otherwise just
+// schedule the writeback
+static inline int os_msync(void *p, size_t len, int wait)
+{
+	int res;
+
+	res = msync(p, len, wait ? MS_SYNC : MS_ASYNC);
+	if (res)
+		log_error("msync failed: (%d) %s\n", os_errno(),
+			  os_strerror(os_errno()));
+	return res;
+}
+
 // -----------------------------------------------------------------------
 //      LINUX and MAC OS X
 // -----------------------------------------------------------------------
@@ -199,6 +232,30 @@ static inline int os_fsync(FILE * f)
 		-1);
 }
 
+// No file mapping on Windows (yet); callers fall back to stdio
+static inline void *os_mmap(FILE * f, size_t len, int writable)
+{
+	(void)(f);
+	(void)(len);
+	(void)(writable);
+	return NULL;
+}
+
+static inline int os_munmap(void *p, size_t len)
+{
+	(void)(p);
+	(void)(len);
+	return 0;
+}
+
+static inline int os_msync(void *p, size_t len, int wait)
+{
+	(void)(p);
+	(void)(len);
+	(void)(wait);
+	return 0;
+}
+
 /* dirent.h */
 
 /*
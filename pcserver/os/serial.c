@@ -31,6 +31,8 @@
  * POSIX RS232 interface handling
  */
 
+#define	LOG_MODULE	LOGM_DEV
+
 #include "os.h"
 
 #include <stdio.h>
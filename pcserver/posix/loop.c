@@ -19,38 +19,106 @@
 
 ****************************************************************************/
 
+/*
+ * The loop keeps a table indexed by file descriptor, so (un)registering a
+ * socket is O(1). On Linux the descriptors are watched with epoll(), so
+ * a loop run only costs time for those descriptors that have events. On
+ * other systems the poll() parameter list is rebuilt when registrations
+ * change.
+ *
+ * Entries that are unregistered while events are dispatched are only freed
+ * after the dispatch, as further events of the same batch may still refer
+ * to them.
+ *
+ * epoll() rejects regular files and some devices, e.g. stdin redirected
+ * from a file or /dev/null. Such descriptors are always ready, as poll()
+ * would report them, and their actions are called on each loop run.
+ */
+
 #include <poll.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __linux__
+#define	USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "mem.h"
 #include "log.h"
 #include "registry.h"
 #include "loop.h"
 
-static registry_t poll_list;
-static struct pollfd *poll_pars = NULL;
-static int update_needed = 0;
+// max number of events read with one epoll_wait()
+#define	POLL_MAX_EVENTS	32
 
 typedef struct {
 	int 	fd;
+	int	options;
 	void 	*data;
 	void	(*accept)(int fd, void *data);
 	void	(*read)(int fd, void *data);
 	void 	(*write)(int fd, void *data);
 	void 	(*hup)(int fd, void *data);
+#ifdef USE_EPOLL
+	int	always_ready;	// not watched by epoll, see above
+#endif
 } poll_info_t;
 
+typedef struct {
+	int	id;
+	int	interval;	// in ms, 0 for one-shot timers
+	int64_t	due;		// in ms on the monotonic clock
+	void	(*cb)(void *data);	// NULL when cancelled or expired
+	void	*data;
+} poll_timer_t;
+
+// all entries, including unregistered ones (fd < 0) not yet purged
+static registry_t poll_list;
+// registered entries, indexed by file descriptor
+static poll_info_t **poll_fds = NULL;
+static int poll_fds_len = 0;
+// number of registered entries, and of those without POLL_OPT_AUX
+static int num_entries = 0;
+static int num_sockets = 0;
+// set when entries have been unregistered, or the poll() list must be rebuilt
+static int update_needed = 0;
+
+// called around the wait for events
+static void (*wait_before)(void) = NULL;
+static void (*wait_after)(void) = NULL;
+
+static registry_t poll_timers;
+static int timer_id = 0;
+static int timers_cancelled = 0;
+
+#ifdef USE_EPOLL
+static int epoll_fd = -1;
+// number of entries epoll could not watch
+static int num_ready = 0;
+#else
+static struct pollfd *poll_pars = NULL;
+static poll_info_t **poll_pinfos = NULL;
+static int poll_npars = 0;
+#endif
+
 static void poll_info_init(const type_t *type, void *obj) {
 	(void) type;
 	poll_info_t *pinfo = (poll_info_t*) obj;
 
 	pinfo->fd = -1;
+	pinfo->options = 0;
 	pinfo->data = NULL;
 
 	pinfo->accept = NULL;
 	pinfo->read = NULL;
 	pinfo->write = NULL;
 	pinfo->hup = NULL;
+#ifdef USE_EPOLL
+	pinfo->always_ready = 0;
+#endif
 }
 
 static type_t poll_info_type = {
@@ -59,31 +127,84 @@ static type_t poll_info_type = {
 	poll_info_init
 };
 
+static type_t poll_fds_type = {
+	"poll_fds",
+	sizeof(poll_info_t*),
+	NULL
+};
+
+static type_t poll_timer_type = {
+	"poll_timer",
+	sizeof(poll_timer_t),
+	NULL
+};
+
+#ifndef USE_EPOLL
 static type_t poll_pars_type = {
 	"pollfd",
 	sizeof(struct pollfd),
 	NULL
 };
+#endif
 
 /**
  * init data structures
  */
 void poll_init(void) {
 
-	poll_pars = NULL;
 	reg_init(&poll_list, "poll_list", 10);
-
+	reg_init(&poll_timers, "poll_timers", 4);
+
+	poll_fds = NULL;
+	poll_fds_len = 0;
+	num_entries = 0;
+	num_sockets = 0;
+
+#ifdef USE_EPOLL
+	num_ready = 0;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		log_errno("Could not create epoll instance");
+	}
+#else
+	poll_pars = NULL;
+	poll_pinfos = NULL;
+	poll_npars = 0;
+#endif
 	update_needed = 1;
 }
 
 /**
- * init data structures
+ * free all structures
  */
-void poll_free_pinfo(registry_t *reg, void *pinfo) {
-	mem_free(pinfo);
+static void poll_free_entry(registry_t *reg, void *entry) {
+	(void) reg;
+	mem_free(entry);
 }
+
 void poll_free(void) {
-	reg_free(&poll_list, poll_free_pinfo);
+	reg_free(&poll_list, poll_free_entry);
+	reg_free(&poll_timers, poll_free_entry);
+
+	if (poll_fds != NULL) {
+		mem_free(poll_fds);
+		poll_fds = NULL;
+	}
+	poll_fds_len = 0;
+
+#ifdef USE_EPOLL
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+#else
+	if (poll_pars != NULL) {
+		mem_free(poll_pars);
+		mem_free(poll_pinfos);
+		poll_pars = NULL;
+		poll_pinfos = NULL;
+	}
+#endif
 }
 
 /**
@@ -91,62 +212,180 @@ void poll_free(void) {
  */
 int poll_num_sockets() {
 
-	return reg_size(&poll_list);
+	return num_sockets;
 }
 
-static void update_poll_list() {
+//------------------------------------------------------------------------------------
+// file descriptor table
 
-	if (!update_needed) {
+static poll_info_t *poll_get(int fd) {
+
+	if (fd < 0 || fd >= poll_fds_len) {
+		return NULL;
+	}
+	return poll_fds[fd];
+}
+
+static void poll_set(int fd, poll_info_t *pinfo) {
+
+	if (fd >= poll_fds_len) {
+		int newlen = poll_fds_len ? poll_fds_len : 16;
+		while (newlen <= fd) {
+			newlen *= 2;
+		}
+		if (poll_fds == NULL) {
+			poll_fds = mem_alloc_n(newlen, &poll_fds_type);
+		} else {
+			poll_fds = mem_realloc_n(newlen, &poll_fds_type, poll_fds);
+			// realloc does not clear the new area
+			for (int i = poll_fds_len; i < newlen; i++) {
+				poll_fds[i] = NULL;
+			}
+		}
+		poll_fds_len = newlen;
+	}
+	poll_fds[fd] = pinfo;
+}
+
+#ifdef USE_EPOLL
+static int poll_ctl(int op, poll_info_t *pinfo) {
+
+	struct epoll_event ev;
+
+	if (pinfo->always_ready) {
+		return 0;
+	}
+
+	ev.events = 0;
+	if (pinfo->accept || pinfo->read) {
+		ev.events |= EPOLLIN;
+	}
+	if (pinfo->write) {
+		ev.events |= EPOLLOUT;
+	}
+	if (pinfo->options & POLL_OPT_EDGE) {
+		ev.events |= EPOLLET;
+	}
+	ev.data.ptr = pinfo;
+
+	if (epoll_ctl(epoll_fd, op, pinfo->fd, &ev) < 0) {
+		if (op == EPOLL_CTL_ADD && errno == EPERM) {
+			// a regular file or similar, handled like poll() does
+			log_debug("fd %d cannot be watched by epoll, always ready\n", pinfo->fd);
+			pinfo->always_ready = 1;
+			num_ready++;
+			return 0;
+		}
+		log_errno("epoll_ctl(op=%d) failed for fd %d", op, pinfo->fd);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static void poll_add(poll_info_t *pinfo) {
+
+	int fd = pinfo->fd;
+
+	if (poll_get(fd) != NULL) {
+		log_error("poll_add: fd %d is already registered\n", fd);
 		return;
 	}
-	update_needed = 0;
 
-	// remove old poll() parameters
-	if (poll_pars != NULL) {
-		mem_free(poll_pars);
-		poll_pars = NULL;
+#ifdef USE_EPOLL
+	if (poll_ctl(EPOLL_CTL_ADD, pinfo) < 0) {
+		// not registered
+		mem_free(pinfo);
+		return;
+	}
+#endif
+
+	poll_set(fd, pinfo);
+	reg_append(&poll_list, pinfo);
+	num_entries++;
+	num_sockets++;
+
+#ifndef USE_EPOLL
+	update_needed = 1;
+#endif
+}
+
+static void poll_remove(poll_info_t *pinfo) {
+
+	int fd = pinfo->fd;
+
+	poll_set(fd, NULL);
+	num_entries--;
+	if (!(pinfo->options & POLL_OPT_AUX)) {
+		num_sockets--;
+	}
+
+#ifdef USE_EPOLL
+	if (pinfo->always_ready) {
+		pinfo->always_ready = 0;
+		num_ready--;
+	} else
+	// the fd may already have been closed by the caller, which removes
+	// it from the epoll set anyway
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0
+		&& errno != EBADF && errno != ENOENT) {
+		log_errno("epoll_ctl(DEL) failed for fd %d", fd);
 	}
+#endif
+
+	// mark for purge
+	pinfo->fd = -fd - 1;
+	update_needed = 1;
+}
+
+// free entries unregistered before, and rebuild the poll() list if needed
+static void poll_purge(void) {
+
+	if (!update_needed) {
+		return;
+	}
+	update_needed = 0;
 
-	// purge closed entries from poll_list
 	int len = reg_size(&poll_list);
-	for (int i = 0; i < len; ) {
+	for (int i = len - 1; i >= 0; i--) {
 		poll_info_t *pinfo = reg_get(&poll_list, i);
 
 		if (pinfo->fd < 0) {
-			// purge
 			reg_remove_pos(&poll_list, i);
-			len--;
-		} else {
-			i++;
+			mem_free(pinfo);
 		}
 	}
 
-	// create new poll_list from remaining entries
+#ifndef USE_EPOLL
+	// create new poll() parameters from remaining entries
+	if (poll_pars != NULL) {
+		mem_free(poll_pars);
+		mem_free(poll_pinfos);
+	}
+	len = reg_size(&poll_list);
 	poll_pars = mem_alloc_n(len, &poll_pars_type);
+	poll_pinfos = mem_alloc_n(len, &poll_fds_type);
+	poll_npars = len;
 
 	for (int i = 0; i < len; i++) {
 
 		poll_info_t *pinfo = reg_get(&poll_list, i);
-		if (pinfo != NULL) {
-			short events = 0;
-			if (pinfo->accept) {
-				events |= POLLIN;
-			}
-			if (pinfo->read) {
-				events |= POLLIN;
-			}
-			if (pinfo->write) {
-				events |= POLLOUT;
-			}
-			poll_pars[i].events = events;
-			poll_pars[i].fd = pinfo->fd;
-
-		} else {
-			//
-			log_warn("Did not expect pinfo to be NULL!\n");
+		short events = 0;
+		if (pinfo->accept) {
+			events |= POLLIN;
 		}
+		if (pinfo->read) {
+			events |= POLLIN;
+		}
+		if (pinfo->write) {
+			events |= POLLOUT;
+		}
+		poll_pars[i].events = events;
+		poll_pars[i].fd = pinfo->fd;
+		poll_pinfos[i] = pinfo;
 	}
-	log_info("Create poll list with %d entries\n", len);
+	log_debug("Create poll list with %d entries\n", len);
+#endif
 }
 
 /**
@@ -168,9 +407,7 @@ void poll_register_accept(int fd, void *data,
 	pinfo->accept = accept;
 	pinfo->hup = hup;
 
-	reg_append(&poll_list, pinfo);
-
-	update_needed = 1;
+	poll_add(pinfo);
 }
 
 /**
@@ -193,9 +430,54 @@ void poll_register_readwrite(int fd, void *data,
 	pinfo->write = write;
 	pinfo->hup = hup;
 
-	reg_append(&poll_list, pinfo);
+	poll_add(pinfo);
+}
+
+/**
+ * change the read and write actions of a registered read/write socket
+ */
+void poll_set_actions(int fd, void (*read)(int fd, void *data),
+				void (*write)(int fd, void *data)) {
+
+	poll_info_t *pinfo = poll_get(fd);
 
+	if (pinfo == NULL) {
+		log_error("poll_set_actions: fd %d is not registered\n", fd);
+		return;
+	}
+	if (pinfo->read == read && pinfo->write == write) {
+		return;
+	}
+	pinfo->read = read;
+	pinfo->write = write;
+
+#ifdef USE_EPOLL
+	poll_ctl(EPOLL_CTL_MOD, pinfo);
+#else
 	update_needed = 1;
+#endif
+}
+
+/**
+ * set the POLL_OPT_* options for a registered socket
+ */
+void poll_set_options(int fd, int options) {
+
+	poll_info_t *pinfo = poll_get(fd);
+
+	if (pinfo == NULL) {
+		log_error("poll_set_options: fd %d is not registered\n", fd);
+		return;
+	}
+
+	if ((pinfo->options ^ options) & POLL_OPT_AUX) {
+		num_sockets += (options & POLL_OPT_AUX) ? -1 : 1;
+	}
+	pinfo->options = options;
+
+#ifdef USE_EPOLL
+	poll_ctl(EPOLL_CTL_MOD, pinfo);
+#endif
 }
 
 /**
@@ -203,105 +485,313 @@ void poll_register_readwrite(int fd, void *data,
  */
 void poll_unregister(int fd) {
 
-        log_debug("poll_unregister: Removing entry for fd %d from registry %p (%s, size=%d)\n", fd, &poll_list, poll_list.name, poll_list.numentries);
+        log_debug("poll_unregister: Removing entry for fd %d from registry %p (%s, size=%d)\n", fd, &poll_list, poll_list.name, num_entries);
+
+	poll_info_t *pinfo = poll_get(fd);
+
+	if (pinfo == NULL) {
+        	log_error("poll_unregister: Unable to remove entry for fd %d from registry %p (%s)\n", fd, &poll_list, poll_list.name);
+		return;
+	}
+
+	poll_remove(pinfo);
+}
+
+//------------------------------------------------------------------------------------
+// timers
+
+static int64_t poll_now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * add a timer that calls cb after ms milliseconds
+ */
+int poll_timer_add(int ms, int repeat, void (*cb)(void *data), void *data) {
 
-	int n = reg_size(&poll_list);
+	poll_timer_t *timer = mem_alloc(&poll_timer_type);
 
-        for (int i = 0; i < n; i++) {
-		poll_info_t *pinfo = (poll_info_t*) reg_get(&poll_list, i);
-                if (pinfo != NULL && pinfo->fd == fd) {
-			pinfo->fd = -fd;
-			update_needed = 1;
-                        return;
-                }
-        }
-        log_error("poll_unregister: Unable to remove entry for fd %d from registry %p (%s)\n", fd, &poll_list, poll_list.name);
+	timer->id = ++timer_id;
+	timer->interval = repeat ? ms : 0;
+	timer->due = poll_now() + ms;
+	timer->cb = cb;
+	timer->data = data;
+
+	reg_append(&poll_timers, timer);
+
+	log_debug("poll_timer_add(id=%d, ms=%d, repeat=%d)\n", timer->id, ms, repeat);
+
+	return timer->id;
 }
 
 /**
- * return 0 when timeout
- * return <0 when no file descriptor left
+ * cancel a timer
+ */
+void poll_timer_cancel(int id) {
+
+	for (int i = reg_size(&poll_timers) - 1; i >= 0; i--) {
+		poll_timer_t *timer = reg_get(&poll_timers, i);
+		if (timer->id == id) {
+			// freed in poll_timer_run(), as we may be called from a timer callback
+			timer->cb = NULL;
+			timers_cancelled = 1;
+			return;
+		}
+	}
+	log_warn("poll_timer_cancel: timer %d not found\n", id);
+}
+
+// compute the timeout for the wait from the given one and the next timer
+static int poll_timer_wait(int timeoutMs) {
+
+	int n = reg_size(&poll_timers);
+	if (n == 0) {
+		return timeoutMs;
+	}
+
+	int64_t now = poll_now();
+
+	for (int i = 0; i < n; i++) {
+		poll_timer_t *timer = reg_get(&poll_timers, i);
+		if (timer->cb == NULL) {
+			continue;
+		}
+		int64_t diff = timer->due - now;
+		if (diff < 0) {
+			diff = 0;
+		}
+		if (timeoutMs < 0 || diff < timeoutMs) {
+			timeoutMs = (int) diff;
+		}
+	}
+	return timeoutMs;
+}
+
+// run expired timers
+static void poll_timer_run(void) {
+
+	int n = reg_size(&poll_timers);
+	if (n == 0) {
+		return;
+	}
+
+	int64_t now = poll_now();
+
+	for (int i = 0; i < n; i++) {
+		poll_timer_t *timer = reg_get(&poll_timers, i);
+		if (timer->cb == NULL || timer->due > now) {
+			continue;
+		}
+		void (*cb)(void *data) = timer->cb;
+
+		if (timer->interval) {
+			timer->due += timer->interval;
+			if (timer->due <= now) {
+				// do not try to catch up on missed runs
+				timer->due = now + timer->interval;
+			}
+		} else {
+			timer->cb = NULL;
+			timers_cancelled = 1;
+		}
+		cb(timer->data);
+	}
+
+	if (timers_cancelled) {
+		timers_cancelled = 0;
+		for (int i = reg_size(&poll_timers) - 1; i >= 0; i--) {
+			poll_timer_t *timer = reg_get(&poll_timers, i);
+			if (timer->cb == NULL) {
+				reg_remove_pos(&poll_timers, i);
+				mem_free(timer);
+			}
+		}
+	}
+}
+
+//------------------------------------------------------------------------------------
+// loop
+
+static void poll_dispatch(poll_info_t *pinfo, int in, int out, int err) {
+
+	int fd = pinfo->fd;
+
+	if (fd < 0) {
+		// unregistered by an earlier event of this batch
+		return;
+	}
+
+	// a callback may unregister the fd, so check before each further one
+
+	if (in) {
+		if (pinfo->accept) {
+			pinfo->accept(fd, pinfo->data);
+		} else
+		if (pinfo->read) {
+			pinfo->read(fd, pinfo->data);
+		}
+		// else reading has been stopped with poll_set_actions()
+		// after the events were collected
+	}
+	if (out && pinfo->fd >= 0) {
+		if (pinfo->write) {
+			pinfo->write(fd, pinfo->data);
+		}
+	}
+	if (err && pinfo->fd >= 0) {
+		if (pinfo->hup) {
+			pinfo->hup(fd, pinfo->data);
+		} else {
+			log_error("unexpected POLLERR/HUP/NVAL on fd %d\n", fd);
+			close(fd);
+			if (pinfo->fd >= 0) {
+				poll_remove(pinfo);
+			}
+		}
+	}
+}
+
+#ifdef USE_EPOLL
+// true when an entry not watched by epoll has an action to call
+static int poll_ready_waiting(void) {
+
+	if (num_ready == 0) {
+		return 0;
+	}
+	int len = reg_size(&poll_list);
+	for (int i = 0; i < len; i++) {
+		poll_info_t *pinfo = reg_get(&poll_list, i);
+		if (pinfo->fd >= 0 && pinfo->always_ready
+			&& (pinfo->accept || pinfo->read || pinfo->write)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// call the actions of the entries not watched by epoll
+static void poll_ready_dispatch(void) {
+
+	if (num_ready == 0) {
+		return;
+	}
+	// callbacks may register new entries, which are appended
+	for (int i = 0; i < reg_size(&poll_list); i++) {
+		poll_info_t *pinfo = reg_get(&poll_list, i);
+		if (pinfo->fd >= 0 && pinfo->always_ready) {
+			poll_dispatch(pinfo, 1, 1, 0);
+		}
+	}
+}
+#endif
+
+/**
+ * return 0 when events were processed or timeout
+ * return <0 when no file descriptor or timer left
  */
 int poll_loop(int timeoutMs) {
 	
-	int nfds = 0;
 	int n = 0;
-	int fd = 0;
 
-	do {
-		update_poll_list();
+	poll_purge();
 
-		nfds = reg_size(&poll_list);
+	if (num_entries == 0 && reg_size(&poll_timers) == 0) {
+		return -1;
+	}
 
-		if (nfds == 0) {
-			return -1;
-		}
-	
-		n = poll(poll_pars, nfds, timeoutMs);
+	timeoutMs = poll_timer_wait(timeoutMs);
 
-		for (int i = 0; i < nfds; i++) {
+#ifdef USE_EPOLL
+	struct epoll_event events[POLL_MAX_EVENTS];
 
-			if (poll_pars[i].revents) {
-				poll_info_t *pinfo = reg_get(&poll_list, i);
-				fd = poll_pars[i].fd;
-	
-				if (poll_pars[i].revents & POLLIN) {
-
-					if (pinfo->accept) {
-						pinfo->accept(fd, pinfo->data);
-					} else
-					if (pinfo->read) {
-						pinfo->read(fd, pinfo->data);
-					} else {
-						log_error("unexpected POLLIN on fd %d\n", fd);
-					}
-				}
-				if (poll_pars[i].revents & POLLOUT) {
-
-					if (pinfo->write) {
-						pinfo->write(fd, pinfo->data);
-					} else {
-						log_error("unexpected POLLOUT on fd %d\n", fd);
-					}
-				}
-				if (poll_pars[i].revents & (POLLHUP | POLLERR | POLLNVAL)) {
-			
-					if (pinfo->hup) {
-						pinfo->hup(fd, pinfo->data);
-					} else {
-						log_error("unexpected POLLERR/HUP/NVAL on fd %d\n", fd);
-						close(fd);
-						pinfo->fd = -fd;
-					}
-				}
-				n--;
-			}
+	if (poll_ready_waiting()) {
+		// do not wait, as there is work already
+		timeoutMs = 0;
+	}
+
+	if (wait_before != NULL) {
+		wait_before();
+	}
+	n = epoll_wait(epoll_fd, events, POLL_MAX_EVENTS, timeoutMs);
+	if (wait_after != NULL) {
+		wait_after();
+	}
+	if (n < 0 && errno != EINTR) {
+		log_errno("epoll_wait failed");
+	}
+
+	for (int i = 0; i < n; i++) {
+		uint32_t ev = events[i].events;
+
+		poll_dispatch((poll_info_t*) events[i].data.ptr,
+			ev & EPOLLIN,
+			ev & EPOLLOUT,
+			ev & (EPOLLHUP | EPOLLERR));
+	}
+
+	poll_ready_dispatch();
+#else
+	if (wait_before != NULL) {
+		wait_before();
+	}
+	n = poll(poll_pars, poll_npars, timeoutMs);
+	if (wait_after != NULL) {
+		wait_after();
+	}
+	if (n < 0 && errno != EINTR) {
+		log_errno("poll failed");
+	}
+
+	for (int i = 0; n > 0 && i < poll_npars; i++) {
+		short ev = poll_pars[i].revents;
+
+		if (ev) {
+			poll_dispatch(poll_pinfos[i],
+				ev & POLLIN,
+				ev & POLLOUT,
+				ev & (POLLHUP | POLLERR | POLLNVAL));
+			n--;
 		}
-	} while (n > 0);
+	}
+#endif
+
+	poll_timer_run();
+
+	poll_purge();
 
 	return 0;	
 }
 
+void poll_set_wait_hooks(void (*before)(void), void (*after)(void)) {
+	wait_before = before;
+	wait_after = after;
+}
+
 void poll_shutdown() {
 
 	log_info("poll_shutdown()\n");
 
-	update_poll_list();
-
-	int nfds = reg_size(&poll_list);
-
-	for (int i = 0; i < nfds; i++) {
-		poll_info_t *pinfo = reg_get(&poll_list, i);
+	for (int fd = 0; fd < poll_fds_len; fd++) {
+		poll_info_t *pinfo = poll_fds[fd];
 
+		if (pinfo == NULL) {
+			continue;
+		}
 		if (pinfo->hup) {
-			pinfo->hup(pinfo->fd, pinfo->data);
+			pinfo->hup(fd, pinfo->data);
 		} else {
-			close(pinfo->fd);
+			close(fd);
+		}
+		if (pinfo->fd >= 0) {
+			poll_remove(pinfo);
 		}
-		pinfo->fd = -pinfo->fd;
 	}
 
-	update_poll_list();
+	poll_purge();
 }
 
- 
@@ -47,19 +47,59 @@ void poll_register_readwrite(int fd, void *data,
 				void (*hup)(int fd, void *data)
 );
 
+/**
+ * change the read and write actions of a registered read/write socket.
+ * NULL stops waiting for that direction, e.g. waiting for input while
+ * output is backed up, or waiting for the socket to become writable
+ * while there is no output.
+ */
+void poll_set_actions(int fd, void (*read)(int fd, void *data),
+				void (*write)(int fd, void *data));
+
+/**
+ * options for poll_set_options()
+ */
+// edge triggered - callbacks must then read/write until EAGAIN (epoll only)
+#define	POLL_OPT_EDGE	1
+// auxiliary input like stdin, not counted in poll_num_sockets()
+#define	POLL_OPT_AUX	2
+
+/**
+ * set the POLL_OPT_* options for a registered socket
+ */
+void poll_set_options(int fd, int options);
+
 /**
  * unregister socket
  */
 void poll_unregister(int fd);
 
+/**
+ * add a timer that calls cb(data) after ms milliseconds, and then every ms
+ * milliseconds if repeat is set. Returns the timer id.
+ */
+int poll_timer_add(int ms, int repeat, void (*cb)(void *data), void *data);
 
 /**
- * loop until timeout without activity
- * return 0 when timeout
- * return <0 when no file descriptor left
+ * cancel a timer; can be called from within a timer callback
+ */
+void poll_timer_cancel(int id);
+
+
+/**
+ * wait for and dispatch one batch of events and expired timers;
+ * timeoutMs < 0 waits until there is an event or a timer is due
+ * return 0 when events were processed or timeout
+ * return <0 when no file descriptor or timer left
  */
 int poll_loop(int timeoutMs);
 
+/**
+ * set functions called before and after waiting for events in poll_loop(),
+ * e.g. to release a lock while waiting. NULL to remove.
+ */
+void poll_set_wait_hooks(void (*before)(void), void (*after)(void));
+
 /**
  * close everything
  */
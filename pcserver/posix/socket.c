@@ -21,6 +21,8 @@
 
 
 
+#define	LOG_MODULE	LOGM_DEV
+
 #include "os.h"
 
 #include <stdio.h>
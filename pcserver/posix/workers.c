@@ -0,0 +1,343 @@
+/****************************************************************************
+
+    Worker threads
+    Copyright (C) 2018 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/**
+ * worker thread pool, see workers.h
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "mem.h"
+#include "log.h"
+#include "registry.h"
+#include "loop.h"
+#include "workers.h"
+
+typedef struct {
+	void	*owner;
+	int	key;
+	int	state;
+	void	(*run)(void *arg);
+	void	(*done)(void *arg);
+	void	*arg;
+} job_t;
+
+// job states
+#define	JOB_QUEUED	0
+#define	JOB_RUNNING	1
+#define	JOB_DONE	2
+
+static type_t job_type = {
+	"worker_job",
+	sizeof(job_t),
+	NULL
+};
+
+static type_t thread_type = {
+	"pthread_t",
+	sizeof(pthread_t),
+	NULL
+};
+
+// the server lock
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled when a job may have become runnable, or on shutdown
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+// signalled for workers_wait(), or on shutdown
+static pthread_cond_t wait_cond = PTHREAD_COND_INITIALIZER;
+
+// all jobs not yet finished (i.e. done not yet called), in submission order
+static registry_t jobs;
+
+static int initialized = 0;
+static pthread_t *threads = NULL;
+static int num_threads = 0;
+static int shutdown_flag = 0;
+
+// written by the workers to wake the loop when a job is done
+static int done_pipe[2] = { -1, -1 };
+
+// set in the worker threads
+static __thread int is_worker = 0;
+
+static void lock_hook(void) {
+	pthread_mutex_lock(&server_lock);
+}
+
+static void unlock_hook(void) {
+	pthread_mutex_unlock(&server_lock);
+}
+
+int workers_enabled(void) {
+	return num_threads > 0;
+}
+
+int workers_in_worker(void) {
+	return is_worker;
+}
+
+void workers_lock(void) {
+	if (num_threads > 0) {
+		pthread_mutex_lock(&server_lock);
+	}
+}
+
+void workers_unlock(void) {
+	if (num_threads > 0) {
+		pthread_mutex_unlock(&server_lock);
+	}
+}
+
+void workers_yield(void) {
+	if (num_threads > 0) {
+		pthread_mutex_unlock(&server_lock);
+		sched_yield();
+		pthread_mutex_lock(&server_lock);
+	}
+}
+
+int workers_wait(void) {
+	if (!is_worker || shutdown_flag) {
+		return -1;
+	}
+	pthread_cond_wait(&wait_cond, &server_lock);
+	return shutdown_flag ? -1 : 0;
+}
+
+void workers_notify(void) {
+	if (num_threads > 0) {
+		pthread_cond_broadcast(&wait_cond);
+	}
+}
+
+void workers_wakeup(void) {
+	if (num_threads > 0) {
+		char c = 0;
+		if (write(done_pipe[1], &c, 1) < 0 && errno != EAGAIN) {
+			log_errno("Could not wake up the loop");
+		}
+	}
+}
+
+// a job can run when it is the first in the list for its owner and key
+static job_t *next_runnable(void) {
+
+	int n = reg_size(&jobs);
+
+	for (int i = 0; i < n; i++) {
+		job_t *job = reg_get(&jobs, i);
+		if (job->state != JOB_QUEUED) {
+			continue;
+		}
+		int blocked = 0;
+		for (int j = 0; j < i; j++) {
+			job_t *prev = reg_get(&jobs, j);
+			if (prev->owner == job->owner && prev->key == job->key) {
+				blocked = 1;
+				break;
+			}
+		}
+		if (!blocked) {
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static void *worker_main(void *arg) {
+	(void) arg;
+
+	is_worker = 1;
+
+	pthread_mutex_lock(&server_lock);
+
+	while (!shutdown_flag) {
+
+		job_t *job = next_runnable();
+		if (job == NULL) {
+			pthread_cond_wait(&job_cond, &server_lock);
+			continue;
+		}
+
+		job->state = JOB_RUNNING;
+		job->run(job->arg);
+		job->state = JOB_DONE;
+
+		// wake up the loop
+		char c = 0;
+		if (write(done_pipe[1], &c, 1) < 0 && errno != EAGAIN) {
+			log_errno("Could not signal job completion");
+		}
+	}
+
+	pthread_mutex_unlock(&server_lock);
+
+	return NULL;
+}
+
+// call the done callbacks of finished jobs, in submission order per key
+static void workers_done(int fd, void *data) {
+	(void) data;
+
+	char buf[64];
+	while (read(fd, buf, sizeof(buf)) > 0);
+
+	int started = 0;
+	for (int i = 0; i < reg_size(&jobs); ) {
+		job_t *job = reg_get(&jobs, i);
+		if (job->state == JOB_DONE) {
+			reg_remove_pos(&jobs, i);
+			job->done(job->arg);
+			mem_free(job);
+			started = 1;
+		} else {
+			i++;
+		}
+	}
+	if (started) {
+		// jobs waiting for the ones just finished can run now
+		pthread_cond_broadcast(&job_cond);
+	}
+}
+
+static void workers_hup(int fd, void *data) {
+	(void) data;
+	// closed in workers_free()
+	poll_unregister(fd);
+}
+
+void workers_init(int nthreads) {
+
+	reg_init(&jobs, "worker_jobs", 10);
+	initialized = 1;
+
+	if (nthreads <= 0) {
+		return;
+	}
+
+	if (pipe(done_pipe) < 0) {
+		log_errno("Could not create worker pipe, running without worker threads");
+		return;
+	}
+	fcntl(done_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(done_pipe[1], F_SETFL, O_NONBLOCK);
+
+	poll_register_readwrite(done_pipe[0], NULL, workers_done, NULL, workers_hup);
+	poll_set_options(done_pipe[0], POLL_OPT_AUX);
+
+	// the loop thread holds the server lock, except while waiting for events
+	pthread_mutex_lock(&server_lock);
+	poll_set_wait_hooks(unlock_hook, lock_hook);
+
+	threads = mem_alloc_n(nthreads, &thread_type);
+	shutdown_flag = 0;
+
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, worker_main, NULL) != 0) {
+			log_errno("Could not create worker thread");
+			break;
+		}
+		num_threads++;
+	}
+	if (num_threads == 0) {
+		poll_set_wait_hooks(NULL, NULL);
+		pthread_mutex_unlock(&server_lock);
+	}
+	log_info("Started %d worker threads\n", num_threads);
+}
+
+void workers_free(void) {
+
+	if (!initialized) {
+		return;
+	}
+	initialized = 0;
+
+	if (num_threads > 0) {
+		shutdown_flag = 1;
+		pthread_cond_broadcast(&job_cond);
+		pthread_cond_broadcast(&wait_cond);
+
+		// let the workers finish their current job
+		pthread_mutex_unlock(&server_lock);
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		pthread_mutex_lock(&server_lock);
+
+		poll_set_wait_hooks(NULL, NULL);
+		mem_free(threads);
+		threads = NULL;
+		num_threads = 0;
+		pthread_mutex_unlock(&server_lock);
+	}
+
+	// drop what is left, but give the jobs the chance to clean up
+	job_t *job;
+	while ((job = reg_get(&jobs, 0)) != NULL) {
+		reg_remove_pos(&jobs, 0);
+		job->done(job->arg);
+		mem_free(job);
+	}
+	reg_free(&jobs, NULL);
+
+	if (done_pipe[0] >= 0) {
+		close(done_pipe[0]);
+		close(done_pipe[1]);
+		done_pipe[0] = -1;
+		done_pipe[1] = -1;
+	}
+}
+
+void workers_submit(void *owner, int key, void (*run)(void *arg), void (*done)(void *arg),
+		void *arg) {
+
+	job_t *job = mem_alloc(&job_type);
+
+	job->owner = owner;
+	job->key = key;
+	job->state = JOB_QUEUED;
+	job->run = run;
+	job->done = done;
+	job->arg = arg;
+
+	reg_append(&jobs, job);
+
+	pthread_cond_signal(&job_cond);
+}
+
+int workers_pending(void *owner, int key) {
+
+	int n = 0;
+
+	for (int i = 0; i < reg_size(&jobs); i++) {
+		job_t *job = reg_get(&jobs, i);
+		if (job->owner == owner && (key < 0 || job->key == key)) {
+			n++;
+		}
+	}
+	return n;
+}
+
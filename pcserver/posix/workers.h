@@ -0,0 +1,109 @@
+/****************************************************************************
+
+    Worker threads
+    Copyright (C) 2018 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/**
+ * A pool of worker threads to run blocking provider operations, so that
+ * a slow network provider does not stall the other connections.
+ *
+ * All server state is protected by one server lock. The loop thread holds
+ * it except while waiting for events, and a worker holds it while running
+ * a job. Provider code releases it with workers_unlock()/workers_lock()
+ * around calls that may block on the network, so other jobs and the loop
+ * can run in the meantime.
+ *
+ * Jobs are ordered per (owner, key), i.e. per channel of a connection: a job
+ * does not start before the previous job with the same owner and key has
+ * completed and its done callback has run. The done callback is called in
+ * the loop thread.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/**
+ * start nthreads worker threads; with 0, no threads are started and
+ * workers_enabled() returns false
+ */
+void workers_init(int nthreads);
+
+/**
+ * stop the threads. Jobs not yet run are dropped, but their done callback
+ * is still called, so they can free their data.
+ */
+void workers_free(void);
+
+/**
+ * return true when there are worker threads
+ */
+int workers_enabled(void);
+
+/**
+ * return true when called in a worker thread. The loop thread must not
+ * use workers_wait() for something only the loop itself can do.
+ */
+int workers_in_worker(void);
+
+/**
+ * queue a job: run(arg) is called in a worker thread, then done(arg) in the
+ * loop thread
+ */
+void workers_submit(void *owner, int key, void (*run)(void *arg), void (*done)(void *arg), 
+		void *arg);
+
+/**
+ * return the number of jobs queued, running or waiting for the done callback
+ * for owner and key; with key < 0 for all keys of the owner
+ */
+int workers_pending(void *owner, int key);
+
+/**
+ * release and re-acquire the server lock around blocking calls
+ */
+void workers_unlock(void);
+void workers_lock(void);
+
+/**
+ * give other threads the chance to take the server lock, e.g. between
+ * the blocks of a long copy
+ */
+void workers_yield(void);
+
+/**
+ * wait in a worker thread until workers_notify() is called, with the server
+ * lock released while waiting. The caller checks its condition again after
+ * the return. Returns -1 when not called in a worker thread, or the workers
+ * are shutting down, 0 otherwise.
+ */
+int workers_wait(void);
+
+/**
+ * wake up all threads waiting in workers_wait()
+ */
+void workers_notify(void);
+
+/**
+ * wake up the loop thread, e.g. when a worker has added a timer that is due
+ * before the loop would otherwise wake up
+ */
+void workers_wakeup(void);
+
+#endif
+
@@ -24,12 +24,15 @@
 
 ****************************************************************************/
 
+#define	LOG_MODULE	LOGM_PROV
+
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
 
 #include "log.h"
 #include "provider.h"
+#include "session.h"
 #include "errors.h"
 #include "wireformat.h"
 #include "types.h"
@@ -128,31 +131,92 @@ static type_t endpoints_type = {
 	endpoints_init
 };
 
-static registry_t endpoints;
+// the session a session's assigns are stored in
+static session_t *assign_session(session_t *session) {
+	if (session->shared_assigns && session->parent != NULL) {
+		return session->parent;
+	}
+	return session;
+}
+
+// find the assign for a drive in the session or its parents; an entry
+// without endpoint hides an assign of the parent in this session
+static ept_t *find_ept(session_t *session, int drive, session_t **owner) {
+
+	ept_t *ept = NULL;
+
+	for (session = assign_session(session); session != NULL; session = session->parent) {
+	        for(int i=0;(ept = reg_get(&session->assigns, i)) != NULL;i++) {
+               		if (ept->drive == drive) {
+				if (owner != NULL) {
+					*owner = session;
+				}
+				return ept;
+			}
+		}
+	}
+	return NULL;
+}
 
-static int unassign(int drive) {
+static void free_ept(ept_t *ept, int release) {
+	if (release && ept->ep != NULL) {
+		provider_t *prevprov = ept->ep->ptype;
+		prevprov->freeep(ept->ep);
+	}
+	if (ept->cdpath != NULL) {
+		mem_free(ept->cdpath);
+	}
+	mem_free(ept);
+}
+
+// remove the assign of a drive from the session. If mask is set and the
+// drive is assigned in the parent session, hide that in this session
+static int unassign(session_t *session, int drive, int mask) {
 	int rv = CBM_ERROR_DRIVE_NOT_READY;
 	ept_t *ept = NULL;
-        for(int i=0;(ept = reg_get(&endpoints, i)) != NULL;i++) {
+
+	session = assign_session(session);
+
+        for(int i=0;(ept = reg_get(&session->assigns, i)) != NULL;i++) {
                	if (ept->drive == drive) {
 			// remove from list
-			reg_remove(&endpoints, ept);
-			// clean up
-			provider_t *prevprov = ept->ep->ptype;
-			prevprov->freeep(ept->ep);
-			if (ept->cdpath != NULL) {
-				mem_free(ept->cdpath);
+			reg_remove(&session->assigns, ept);
+			if (ept->ep != NULL) {
+				rv = CBM_ERROR_OK;
 			}
-			// free it
-			mem_free(ept);
+			// clean up and free it
+			free_ept(ept, 1);
 			ept = NULL;
-			rv = CBM_ERROR_OK;
 			break;
                	}
        	}
+
+	if (mask && session->parent != NULL) {
+		ept = find_ept(session->parent, drive, NULL);
+		if (ept != NULL && ept->ep != NULL) {
+			ept = mem_alloc(&endpoints_type);
+			ept->drive = drive;
+			reg_append(&session->assigns, ept);
+			rv = CBM_ERROR_OK;
+		}
+	}
 	return rv;
 }
 
+static void provider_free_ept(registry_t *reg, void *entry) {
+	(void) reg;
+	free_ept((ept_t*) entry, 0);
+}
+
+static void provider_release_ept(registry_t *reg, void *entry) {
+	(void) reg;
+	free_ept((ept_t*) entry, 1);
+}
+
+void provider_unassign_all(session_t *session, int release) {
+	reg_free(&session->assigns, release ? provider_release_ept : provider_free_ept);
+}
+
 
 //------------------------------------------------------------------------------------
 // wrap a given (raw) file into a container file_t (i.e. a directory), when
@@ -184,7 +248,7 @@ file_t *provider_wrap(file_t *file) {
  * of the "A0:fs=foo/bar" the "0" becomes the drive, "fs" becomes the wirename,
  * and "foo/bar" becomes the assign_to.
  */
-int provider_assign(int drive, const char *wirename, const char *assign_to, charset_t cset, int from_cmdline) {
+int provider_assign(session_t *session, int drive, const char *wirename, const char *assign_to, charset_t cset, int from_cmdline) {
 
 	int err = CBM_ERROR_FAULT;
 
@@ -195,7 +259,7 @@ int provider_assign(int drive, const char *wirename, const char *assign_to, char
 	endpoint_t *newep = NULL;
 
 	if (assign_to == NULL) {
-		return unassign(drive);
+		return unassign(session, drive, 1);
 	}
 
 	int len = strlen(wirename);
@@ -233,7 +297,7 @@ int provider_assign(int drive, const char *wirename, const char *assign_to, char
 		char drvname[2];
 		drvname[0] = drv;
 		drvname[1] = 0;
-		parent = provider_lookup(drvname, len, 0, NULL, NAMEINFO_UNDEF_DRIVE);
+		parent = provider_lookup(session, drvname, len, 0, NULL, NAMEINFO_UNDEF_DRIVE);
 		if (parent != NULL) {
 			provider = parent->ptype;
 			log_debug("Got drive number: %d, with provider %p\n", drv, provider);
@@ -300,7 +364,7 @@ int provider_assign(int drive, const char *wirename, const char *assign_to, char
 		// check if the drive is already in use and free it if necessary
 		// NOTE: a Map construct would be nice here...
 
-		unassign(drive);
+		unassign(session, drive, 0);
 
 		newep->is_assigned++;
 
@@ -311,7 +375,7 @@ int provider_assign(int drive, const char *wirename, const char *assign_to, char
 		ept->cdpath = mem_alloc_str("/");
 
 		// register new endpoint
-		reg_append(&endpoints, ept);
+		reg_append(&assign_session(session)->assigns, ept);
 
 		return CBM_ERROR_OK;
 	}
@@ -326,11 +390,6 @@ void provider_cleanup(endpoint_t *ep) {
 	}
 }
 
-static void provider_free_ep(registry_t *reg, void *entry) {
-	(void) reg;
-	mem_free(entry);
-}
-
 static void provider_free_entry(registry_t *reg, void *entry) {
 	((providers_t*)entry)->provider->free();
 	mem_free(entry);
@@ -338,8 +397,6 @@ static void provider_free_entry(registry_t *reg, void *entry) {
 
 void provider_free() {
 
-	reg_free(&endpoints, provider_free_ep);
-
 	reg_free(&providers, provider_free_entry);
 }
 
@@ -347,8 +404,6 @@ void provider_init() {
 
 	reg_init(&providers, "providers", 10);
 
-	reg_init(&endpoints, "endpoints", 10);
-
         // manually handle the initial provider
         fs_provider.init();
 
@@ -373,7 +428,7 @@ void provider_init() {
  * It then identifies the drive, puts the CD path before the name if it
  * is not absolute, and allocates the new name that it returns
  */
-endpoint_t *provider_lookup(const char *inname, int namelen, charset_t cset, const char **outname, int default_drive) {
+endpoint_t *provider_lookup(session_t *session, const char *inname, int namelen, charset_t cset, const char **outname, int default_drive) {
 
 	int drive = inname[0];
 	inname++;
@@ -451,18 +506,16 @@ endpoint_t *provider_lookup(const char *inname, int namelen, charset_t cset, con
 
 	log_debug("Trying to resolve drive %d with name '%s'\n", drive, inname);
 
-	ept_t *ept = NULL;
-	for(int i=0; (ept = reg_get(&endpoints, i)) != NULL;i++) {
-                if (ept->drive == drive) {
-			if (outname != NULL) {
-				if (inname != NULL) {
-					*outname = malloc_path(ept->cdpath, inname);
-				} else {
-					*outname = NULL;
-				}
+	ept_t *ept = find_ept(session, drive, NULL);
+	if (ept != NULL && ept->ep != NULL) {
+		if (outname != NULL) {
+			if (inname != NULL) {
+				*outname = malloc_path(ept->cdpath, inname);
+			} else {
+				*outname = NULL;
 			}
-                        return ept->ep;
-                }
+		}
+		return ept->ep;
         }
 	log_warn("Drive %d is not assigned!\n", drive);
 
@@ -476,7 +529,7 @@ endpoint_t *provider_lookup(const char *inname, int namelen, charset_t cset, con
  * It then identifies the drive, puts the CD path before the name if it
  * is not absolute, and allocates the new name that it returns
  */
-int provider_chdir(const char *inname, int namelen, charset_t cset) {
+int provider_chdir(session_t *session, const char *inname, int namelen, charset_t cset) {
 
 	int drive = inname[0];
 	inname++;
@@ -492,14 +545,10 @@ int provider_chdir(const char *inname, int namelen, charset_t cset) {
 
 	log_debug("Trying to resolve drive %d with path '%s'\n", drive, inname);
 
-	ept_t *ept = NULL;
-	for(int i=0; (ept = reg_get(&endpoints, i)) != NULL;i++) {
-                if (ept->drive == drive) {
-			break;	// found it
-                }
-        }
+	session_t *owner = NULL;
+	ept_t *ept = find_ept(session, drive, &owner);
 
-	if (ept == NULL) {
+	if (ept == NULL || ept->ep == NULL) {
 		// drive number not found
 		return CBM_ERROR_DRIVE_NOT_READY;
 	}
@@ -510,9 +559,22 @@ int provider_chdir(const char *inname, int namelen, charset_t cset) {
 	int rv = handler_resolve_path(ept->ep, newpath, cset, &path);
 
 	if (rv == CBM_ERROR_OK) {
-		mem_free(ept->cdpath);
+		session = assign_session(session);
+		if (owner != session) {
+			// drive is assigned in the parent; the current directory
+			// is per session, so take a copy of the assign
+			endpoint_t *ep = ept->ep;
+			ep->is_assigned++;
+			ept = mem_alloc(&endpoints_type);
+			ept->drive = drive;
+			ept->ep = ep;
+			reg_append(&session->assigns, ept);
+		} else {
+			mem_free(ept->cdpath);
+		}
 		ept->cdpath = path;
 	}
+	mem_free(newpath);
 	return rv;
 }
 
@@ -525,8 +587,8 @@ void provider_dump() {
 	const char *eppref = dump_indent(indent+1);
 
 	for (int i = 0; ; i++) {
-		ept_t *ept = reg_get(&endpoints, i);
-		if (ept != NULL) {
+		ept_t *ept = reg_get(&session_default()->assigns, i);
+		if (ept != NULL && ept->ep != NULL) {
 			log_debug("%s// Dumping endpoint for drive %d\n", prefix, ept->drive);
 			log_debug("%s{\n", prefix);
 			log_debug("%sdrive=%d;\n", eppref, ept->drive);
@@ -58,6 +58,8 @@
 
 typedef struct _endpoint endpoint_t;
 typedef struct _file file_t;
+// per-connection state, see session.h
+typedef struct session_s session_t;
 typedef struct _handler handler_t;
 
 typedef struct {
@@ -95,8 +97,10 @@ typedef struct {
 
 	// command channel
 	// B-A/B-F
+	// U1/U2 open a block channel; the file for it is returned in outfp,
+	// so the caller can register it for the channel number
 	int (*block) (endpoint_t * ep, const char *buf, char *retbuf,
-		      int *retlen);
+		      int *retlen, file_t ** outfp);
 	
 	// format a disk image (where applicable)
 	int (*format) (endpoint_t * ep, const char *name);
@@ -142,6 +146,12 @@ struct _file {
 	uint8_t attr;		// same as FS_DIR_ATTR
 	uint8_t writable;	// is file writable?
 	uint8_t seekable;	// is file seekable?    
+	uint8_t drive;		// drive the file was opened on (for statistics)
+	uint8_t shared;		// used by all channels of an endpoint, e.g. a disk image
+	// device and inode in the host file system, 0 when not known.
+	// Used with lastmod and filesize to cache the wrapper detection
+	uint64_t fsdev;
+	uint64_t fsino;
 };
 
 // note: go from FIRST to ENTRIES to END by +1
@@ -227,6 +237,12 @@ struct _handler {
 
 	void (*dump) (file_t * fp, int recurse, int indent);	// dump info for analysis / debug
 
+	// optional: map the whole file into memory, writable if the file is writable.
+	// Returns NULL if not supported. The mapping stays valid until the file is closed,
+	// flush() syncs it back to the file. Each call checks the file size again, and
+	// returns NULL when the file has been truncated, so call it before accessing
+	// the mapping and fall back to read/write then.
+	uint8_t *(*map) (file_t * fp, size_t * outlen);
 };
 
 // values to be set in the out parameter readflag for readfile()
@@ -237,8 +253,18 @@ struct _handler {
 #define SEEKFLAG_ABS            0	/* count from the start */
 #define SEEKFLAG_END            1	/* count from the end of the file */
 
-int provider_assign(int drive, const char *name, const char *assign_to, charset_t cset,
-		    int from_cmdline);
+/**
+ * assign a drive in the given session to a provider, or unassign it if assign_to
+ * is NULL
+ */
+int provider_assign(session_t * session, int drive, const char *name,
+		    const char *assign_to, charset_t cset, int from_cmdline);
+
+/**
+ * remove all assigns of a session; if release is set, the endpoints are freed
+ * (i.e. unassigned) as well
+ */
+void provider_unassign_all(session_t * session, int release);
 
 /**
  * looks up a provider like "tcp:" for "fs:" by drive number.
@@ -262,13 +288,13 @@ int provider_assign(int drive, const char *name, const char *assign_to, charset_
  * If a default drive is given, and no named provider could be found, the default drive
  * is used instead.
  */
-endpoint_t *provider_lookup(const char *inname, int namelen, charset_t cset,
-			    const char **outname, int default_drive);
+endpoint_t *provider_lookup(session_t * session, const char *inname, int namelen,
+			    charset_t cset, const char **outname, int default_drive);
 
 /**
  * change directory for an endpoint
  */
-int provider_chdir(const char *inname, int namelen, charset_t cset);
+int provider_chdir(session_t * session, const char *inname, int namelen, charset_t cset);
 
 /**
  * cleans up a temporary provider after it has been done with,
@@ -302,6 +328,15 @@ file_t *provider_wrap(file_t * file);
 endpoint_t *fs_root_endpoint(const char *assign_path, char **new_assign_path,
 			     int from_cmdline);
 
+// seconds a directory listing of the ftp/http providers is reused, 0 to
+// always read a new one
+extern int curl_dir_ttl;
+
+// directory of the block cache of the ftp/http providers, NULL for the
+// default ~/.cache/xd2031/curl, and its max. size in megabytes
+extern char *curl_cache_dir;
+extern int curl_cache_mb;
+
 
 #define	conv_name_alloc(str,from,to)	conv_name_alloc_(str,from,to,__FILE__,__LINE__)
 static inline char *conv_name_alloc_(const char *str, charset_t from, charset_t to, char *file, int line)
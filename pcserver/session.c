@@ -0,0 +1,94 @@
+/****************************************************************************
+
+    Serial line filesystem server
+    Copyright (C) 2012 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/**
+ * per-connection state, see session.h
+ */
+
+#define	LOG_MODULE	LOGM_CMD
+
+#include <stddef.h>
+
+#include "mem.h"
+#include "log.h"
+#include "session.h"
+#include "channel.h"
+
+static void session_constructor(const type_t *type, void *obj) {
+	(void) type;
+	session_t *session = (session_t*) obj;
+
+	session->charset = cconv_getcharset(CHARSET_ASCII_NAME);
+	session->parent = NULL;
+	session->shared_assigns = 0;
+	session->stats = NULL;
+
+	channel_init(session);
+	reg_init(&session->assigns, "assigns", 10);
+}
+
+static type_t session_type = {
+	"session_t",
+	sizeof(session_t),
+	session_constructor
+};
+
+static session_t default_session;
+
+void session_init(void) {
+	session_constructor(&session_type, &default_session);
+}
+
+void session_exit(void) {
+	// keep the endpoints, the providers clean up behind them
+	provider_unassign_all(&default_session, 0);
+}
+
+session_t *session_default(void) {
+	return &default_session;
+}
+
+session_t *session_new(int shared_assigns) {
+
+	session_t *session = mem_alloc(&session_type);
+
+	session->parent = &default_session;
+	session->shared_assigns = shared_assigns;
+
+	log_debug("session_new(%p, shared_assigns=%d)\n", session, shared_assigns);
+
+	return session;
+}
+
+void session_free(session_t *session) {
+
+	log_debug("session_free(%p): %d channels open, max. %d, %lu total\n", session,
+		session->chan_open, session->chan_peak, session->chan_total);
+
+	// open files refer to the endpoints, so close them first
+	channel_close_all(session);
+
+	provider_unassign_all(session, 1);
+
+	mem_free(session->stats);
+	mem_free(session);
+}
+
@@ -0,0 +1,83 @@
+/****************************************************************************
+
+    Serial line filesystem server
+    Copyright (C) 2012 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/**
+ * A session holds the state of one connection to the server, i.e. of
+ * a device or of an xdcmd tools connection: the open channels, the drive
+ * assigns (including the current directory per drive), and the character
+ * set the other side talks in.
+ *
+ * Drives not assigned in a session are looked up in its parent, the
+ * server-wide default session. That holds the assigns from the command
+ * line and the config file. Tools sessions share their assigns with the
+ * default session, so that e.g. "xdcmd assign" works for all devices.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "provider.h"
+#include "registry.h"
+#include "charconvert.h"
+
+struct session_s {
+	charset_t	charset;
+	// open files, indexed by channel number, see channel.c
+	file_t		**channels;
+	int		chancap;
+	// channel counters
+	int		chan_open;	// currently open
+	int		chan_peak;	// max. open at the same time
+	unsigned long	chan_total;	// opened since the session started
+	// drive assigns, see provider.c
+	registry_t	assigns;
+	// where to look up drives not assigned here; NULL for the default session
+	session_t	*parent;
+	// when set, assigns and chdirs go to the parent
+	int		shared_assigns;
+	// statistics snapshot being sent with FS_INFO_STATS
+	char		*stats;
+	int		statslen;
+};
+
+void session_init(void);
+
+/**
+ * close the default session - at server exit
+ */
+void session_exit(void);
+
+/**
+ * the server-wide default session
+ */
+session_t *session_default(void);
+
+/**
+ * create a new session for a connection
+ */
+session_t *session_new(int shared_assigns);
+
+/**
+ * close all open channels, release the assigns, and free the session
+ */
+void session_free(session_t *session);
+
+#endif
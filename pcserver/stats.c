@@ -0,0 +1,391 @@
+/****************************************************************************
+
+    Serial line filesystem server
+    Copyright (C) 2012 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/**
+ * server statistics, see stats.h
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "mem.h"
+#include "log.h"
+#include "wireformat.h"
+#include "stats.h"
+#include "loop.h"
+
+// number of FS_* commands counted
+#define	STATS_NCMDS		(FS_INFO + 1)
+// max. number of providers and caches counted
+#define	STATS_NPROVIDERS	16
+#define	STATS_NCACHES		16
+#define	STATS_NDRIVES		256
+
+// upper bounds of the latency histogram buckets in microseconds; the last
+// bucket (+Inf) is implicit
+static const unsigned long stats_bounds[] = {
+	10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000
+};
+#define	STATS_NBOUNDS	(sizeof(stats_bounds)/sizeof(stats_bounds[0]))
+
+static const char *stats_cmdnames[STATS_NCMDS] = {
+	"TERM", "OPEN_RD", "OPEN_WR", "OPEN_RW", "OPEN_OW", "OPEN_AP", "OPEN_DR",
+	"READ", "WRITE", "WRITE_EOF", "REPLY", "DATA", "DATA_EOF", "SEEK", "CLOSE",
+	"MOVE", "DELETE", "FORMAT", "CHKDSK", "RMDIR", "MKDIR", "CHDIR",
+	"ASSIGN", "SETOPT", "RESET", "BLOCK", "GETDATIM", "POSITION", "OPEN_DIRECT",
+	"CHARSET", "COPY", "DUPLICATE", "INITIALIZE", "INFO"
+};
+
+typedef struct {
+	unsigned long	count;
+	unsigned long	errors;
+	uint64_t	sum_ns;
+	unsigned long long inbytes;
+	unsigned long	buckets[STATS_NBOUNDS + 1];
+} stats_cmd_t;
+
+typedef struct {
+	const char	*name;		// provider name, NULL for drives
+	unsigned long	opens;
+	unsigned long long rbytes;
+	unsigned long long wbytes;
+} stats_io_t;
+
+typedef struct {
+	const char	*name;
+	unsigned long	hits;
+	unsigned long	misses;
+} stats_cachectr_t;
+
+static stats_cmd_t stats_cmds[STATS_NCMDS];
+static stats_io_t stats_providers[STATS_NPROVIDERS];
+static int stats_nproviders = 0;
+static stats_io_t stats_drives[STATS_NDRIVES];
+static stats_cachectr_t stats_caches[STATS_NCACHES];
+static int stats_ncaches = 0;
+static uint64_t stats_start = 0;
+
+static char *stats_file = NULL;
+static int stats_timer = -1;
+
+uint64_t stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void stats_cmd(int cmd, int is_error, uint64_t ns, int inbytes) {
+
+	if (stats_start == 0) {
+		stats_start = stats_now();
+	}
+	if (cmd < 0 || cmd >= STATS_NCMDS) {
+		return;
+	}
+	stats_cmd_t *c = &stats_cmds[cmd];
+	c->count++;
+	if (is_error) {
+		c->errors++;
+	}
+	c->sum_ns += ns;
+	c->inbytes += inbytes;
+
+	unsigned long us = ns / 1000;
+	unsigned int b = 0;
+	while (b < STATS_NBOUNDS && us > stats_bounds[b]) {
+		b++;
+	}
+	c->buckets[b]++;
+}
+
+// find the counters of the provider of a file
+static stats_io_t *stats_provider(file_t *fp) {
+
+	if (fp->endpoint == NULL || fp->endpoint->ptype == NULL) {
+		return NULL;
+	}
+	const char *name = fp->endpoint->ptype->name;
+
+	for (int i = 0; i < stats_nproviders; i++) {
+		if (stats_providers[i].name == name) {
+			return &stats_providers[i];
+		}
+	}
+	if (stats_nproviders >= STATS_NPROVIDERS) {
+		return NULL;
+	}
+	stats_io_t *p = &stats_providers[stats_nproviders++];
+	p->name = name;
+	return p;
+}
+
+void stats_open(file_t *fp) {
+	stats_io_t *p = stats_provider(fp);
+	if (p != NULL) {
+		p->opens++;
+	}
+	stats_drives[fp->drive].opens++;
+}
+
+void stats_read(file_t *fp, int nbytes) {
+	stats_io_t *p = stats_provider(fp);
+	if (p != NULL) {
+		p->rbytes += nbytes;
+	}
+	stats_drives[fp->drive].rbytes += nbytes;
+}
+
+void stats_write(file_t *fp, int nbytes) {
+	stats_io_t *p = stats_provider(fp);
+	if (p != NULL) {
+		p->wbytes += nbytes;
+	}
+	stats_drives[fp->drive].wbytes += nbytes;
+}
+
+void stats_cache(const char *name, int hit) {
+
+	stats_cachectr_t *c = NULL;
+
+	for (int i = 0; i < stats_ncaches; i++) {
+		if (stats_caches[i].name == name) {
+			c = &stats_caches[i];
+			break;
+		}
+	}
+	if (c == NULL) {
+		if (stats_ncaches >= STATS_NCACHES) {
+			return;
+		}
+		c = &stats_caches[stats_ncaches++];
+		c->name = name;
+	}
+	if (hit) {
+		c->hits++;
+	} else {
+		c->misses++;
+	}
+}
+
+// --------------------------------------------------------------------------------
+// rendering
+
+typedef struct {
+	char	*buf;
+	int	len;
+	int	cap;
+} outbuf_t;
+
+static void out(outbuf_t *o, const char *fmt, ...) {
+	va_list args;
+
+	for (;;) {
+		va_start(args, fmt);
+		int n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, args);
+		va_end(args);
+
+		if (o->len + n < o->cap) {
+			o->len += n;
+			return;
+		}
+		int newcap = o->cap * 2;
+		while (newcap <= o->len + n) {
+			newcap *= 2;
+		}
+		char *newbuf = mem_alloc_c(newcap, "stats_text");
+		memcpy(newbuf, o->buf, o->len);
+		mem_free(o->buf);
+		o->buf = newbuf;
+		o->cap = newcap;
+	}
+}
+
+static void out_header(outbuf_t *o, const char *name, const char *type, const char *help) {
+	out(o, "# HELP xd2031_%s %s\n# TYPE xd2031_%s %s\n", name, help, name, type);
+}
+
+// label value of an I/O counter entry; drives have no name but their number
+static const char *io_label(stats_io_t *io, int i, char *buf, int buflen) {
+	if (io[i].name != NULL) {
+		return io[i].name;
+	}
+	snprintf(buf, buflen, "%d", i);
+	return buf;
+}
+
+static void out_io(outbuf_t *o, stats_io_t *io, int n, const char *kind) {
+
+	char label[8];
+	char name[40];
+
+	snprintf(name, sizeof(name), "%s_opens_total", kind);
+	out_header(o, name, "counter", "Number of files opened");
+	for (int i = 0; i < n; i++) {
+		if (io[i].opens) {
+			out(o, "xd2031_%s{%s=\"%s\"} %lu\n", name, kind, 
+				io_label(io, i, label, sizeof(label)), io[i].opens);
+		}
+	}
+	snprintf(name, sizeof(name), "%s_read_bytes_total", kind);
+	out_header(o, name, "counter", "Number of bytes read from files");
+	for (int i = 0; i < n; i++) {
+		if (io[i].opens) {
+			out(o, "xd2031_%s{%s=\"%s\"} %llu\n", name, kind, 
+				io_label(io, i, label, sizeof(label)), io[i].rbytes);
+		}
+	}
+	snprintf(name, sizeof(name), "%s_written_bytes_total", kind);
+	out_header(o, name, "counter", "Number of bytes written to files");
+	for (int i = 0; i < n; i++) {
+		if (io[i].opens) {
+			out(o, "xd2031_%s{%s=\"%s\"} %llu\n", name, kind, 
+				io_label(io, i, label, sizeof(label)), io[i].wbytes);
+		}
+	}
+}
+
+char *stats_render(int *outlen) {
+
+	outbuf_t o;
+	o.cap = 4096;
+	o.len = 0;
+	o.buf = mem_alloc_c(o.cap, "stats_text");
+
+	uint64_t now = stats_now();
+	out_header(&o, "uptime_seconds", "gauge", "Time since the first request");
+	out(&o, "xd2031_uptime_seconds %.3f\n", stats_start ? (now - stats_start) / 1e9 : 0.0);
+
+	out_header(&o, "requests_total", "counter", "Number of requests per FS_* command");
+	for (int i = 0; i < STATS_NCMDS; i++) {
+		if (stats_cmds[i].count) {
+			out(&o, "xd2031_requests_total{cmd=\"%s\"} %lu\n", 
+				stats_cmdnames[i], stats_cmds[i].count);
+		}
+	}
+	out_header(&o, "request_errors_total", "counter", "Number of requests per FS_* command that returned an error");
+	for (int i = 0; i < STATS_NCMDS; i++) {
+		if (stats_cmds[i].count) {
+			out(&o, "xd2031_request_errors_total{cmd=\"%s\"} %lu\n", 
+				stats_cmdnames[i], stats_cmds[i].errors);
+		}
+	}
+	out_header(&o, "request_received_bytes_total", "counter", "Number of payload bytes received per FS_* command");
+	for (int i = 0; i < STATS_NCMDS; i++) {
+		if (stats_cmds[i].count) {
+			out(&o, "xd2031_request_received_bytes_total{cmd=\"%s\"} %llu\n", 
+				stats_cmdnames[i], stats_cmds[i].inbytes);
+		}
+	}
+	out_header(&o, "request_duration_seconds", "histogram", "Time to handle a request per FS_* command");
+	for (int i = 0; i < STATS_NCMDS; i++) {
+		stats_cmd_t *c = &stats_cmds[i];
+		if (c->count == 0) {
+			continue;
+		}
+		unsigned long cum = 0;
+		for (unsigned int b = 0; b < STATS_NBOUNDS; b++) {
+			cum += c->buckets[b];
+			out(&o, "xd2031_request_duration_seconds_bucket{cmd=\"%s\",le=\"%g\"} %lu\n",
+				stats_cmdnames[i], stats_bounds[b] / 1e6, cum);
+		}
+		out(&o, "xd2031_request_duration_seconds_bucket{cmd=\"%s\",le=\"+Inf\"} %lu\n",
+			stats_cmdnames[i], c->count);
+		out(&o, "xd2031_request_duration_seconds_sum{cmd=\"%s\"} %.6f\n",
+			stats_cmdnames[i], c->sum_ns / 1e9);
+		out(&o, "xd2031_request_duration_seconds_count{cmd=\"%s\"} %lu\n",
+			stats_cmdnames[i], c->count);
+	}
+
+	out_io(&o, stats_providers, stats_nproviders, "provider");
+	out_io(&o, stats_drives, STATS_NDRIVES, "drive");
+
+	out_header(&o, "cache_hits_total", "counter", "Number of cache hits");
+	for (int i = 0; i < stats_ncaches; i++) {
+		out(&o, "xd2031_cache_hits_total{cache=\"%s\"} %lu\n",
+			stats_caches[i].name, stats_caches[i].hits);
+	}
+	out_header(&o, "cache_misses_total", "counter", "Number of cache misses");
+	for (int i = 0; i < stats_ncaches; i++) {
+		out(&o, "xd2031_cache_misses_total{cache=\"%s\"} %lu\n",
+			stats_caches[i].name, stats_caches[i].misses);
+	}
+
+	*outlen = o.len;
+	return o.buf;
+}
+
+// --------------------------------------------------------------------------------
+// periodic dump
+
+static void stats_dump(void *data) {
+	(void) data;
+
+	int len = 0;
+	char *text = stats_render(&len);
+
+	// write to a temporary file and rename it, so readers never see a partial file
+	int tmplen = strlen(stats_file) + 5;
+	char *tmpname = mem_alloc_c(tmplen, "stats_tmpname");
+	snprintf(tmpname, tmplen, "%s.tmp", stats_file);
+
+	FILE *fp = fopen(tmpname, "w");
+	if (fp == NULL) {
+		log_errno("Could not open statistics file %s", tmpname);
+	} else {
+		int ok = (fwrite(text, 1, len, fp) == (size_t) len);
+		if (fclose(fp) != 0 || !ok) {
+			log_errno("Could not write statistics file %s", tmpname);
+		} else
+		if (rename(tmpname, stats_file) < 0) {
+			log_errno("Could not rename %s to %s", tmpname, stats_file);
+		}
+	}
+
+	mem_free(tmpname);
+	mem_free(text);
+}
+
+void stats_set_file(const char *filename, int interval) {
+
+	if (stats_timer >= 0) {
+		poll_timer_cancel(stats_timer);
+		stats_timer = -1;
+	}
+	mem_free(stats_file);
+	stats_file = NULL;
+
+	if (filename != NULL) {
+		stats_file = mem_alloc_str(filename);
+		stats_timer = poll_timer_add(interval * 1000, 1, stats_dump, NULL);
+		log_info("Writing statistics to %s every %d seconds\n", filename, interval);
+	}
+}
+
+void stats_free(void) {
+	if (stats_file != NULL) {
+		// last update on exit
+		stats_dump(NULL);
+	}
+	stats_set_file(NULL, 0);
+}
+
@@ -0,0 +1,83 @@
+/****************************************************************************
+
+    Serial line filesystem server
+    Copyright (C) 2012 Andre Fachat
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+****************************************************************************/
+
+/**
+ * Server statistics: request counters and latency histograms per FS_*
+ * command, byte counters per provider and per drive, and hit/miss
+ * counters of the caches.
+ *
+ * The statistics are rendered in the Prometheus text exposition format.
+ * They can be queried with FS_INFO/FS_INFO_STATS (e.g. "xdcmd stats"),
+ * and are periodically written to a file when set with stats_set_file().
+ *
+ * All functions must be called with the server lock held (see workers.h).
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "provider.h"
+
+/**
+ * current time in nanoseconds, from a monotonic clock
+ */
+uint64_t stats_now(void);
+
+/**
+ * record a handled FS_* command, with the time it took in nanoseconds,
+ * and the number of payload bytes received
+ */
+void stats_cmd(int cmd, int is_error, uint64_t ns, int inbytes);
+
+/**
+ * record an opened file, on the drive set in fp->drive
+ */
+void stats_open(file_t *fp);
+
+/**
+ * record data read from resp. written to a file
+ */
+void stats_read(file_t *fp, int nbytes);
+void stats_write(file_t *fp, int nbytes);
+
+/**
+ * record a hit or miss in a cache. The name must be a static string.
+ */
+void stats_cache(const char *name, int hit);
+
+/**
+ * render the statistics into a newly allocated text; the length
+ * is returned in *outlen
+ */
+char *stats_render(int *outlen);
+
+/**
+ * write the statistics to the given file every interval seconds;
+ * a NULL file name stops it.
+ */
+void stats_set_file(const char *filename, int interval);
+
+void stats_free(void);
+
+#endif
+
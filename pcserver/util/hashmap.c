@@ -260,7 +260,7 @@ void hash_free(hash_t *hash, void (callback)(const void* key, void* value)) {
 
 		hash_bucket_t *bucket = &hash->buckets[i];
 
-		for (int j = 0; j < bucket->num_allocated; j++) {
+		for (int j = 0; j < bucket->num_filled; j++) {
 		
 			entry_t *en = &bucket->array[j];
 
@@ -21,6 +21,7 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <strings.h>
@@ -28,6 +29,17 @@
 #include <ctype.h>
 #include <inttypes.h>
 
+#if defined(LOG_ASYNC) && defined(_WIN32)
+#undef	LOG_ASYNC
+#endif
+
+#ifdef LOG_ASYNC
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include "log.h"
 #include "petscii.h"
 #include "terminal.h"
 
@@ -35,134 +47,377 @@
 #define	LOG_PREFIX	""
 #endif
 
-static int verbose = 0;
+// max length of a single log line, longer lines are truncated
+#define	LOG_LINE_LEN	512
+
+unsigned char log_levels[LOGM_NUM] = {
+	LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO
+};
+
+static const char *log_modnames[LOGM_NUM] = {
+	"main", "dev", "cmd", "prov", "di", "fs", "net"
+};
+
+static const char *log_levelnames[] = {
+	"error", "warn", "info", "debug"
+};
 
 static const char* spaces = "                                                                  ";
 
-static enum lastlog {
+// what the last message of this thread was, when it did not end its line.
+// Per thread, as the worker threads log as well.
+static __thread enum lastlog {
 	lastlog_anything, lastlog_warn, lastlog_error, lastlog_info, lastlog_debug
 } newline = lastlog_anything;
 
+// colors of the output lines
+typedef enum {
+	logc_term, logc_error, logc_warn, logc_info, logc_debug
+} logcolor_t;
+
 void set_verbose(int flag) {
-	verbose = flag;
+	for (int i = 0; i < LOGM_NUM; i++) {
+		log_levels[i] = flag ? LOG_DEBUG : LOG_INFO;
+	}
 }
 
-void log_term(const char *msg) {
-	
-	int newline = 0;
+static int log_find(const char *name, size_t len, const char **names, int n) {
+	for (int i = 0; i < n; i++) {
+		if (strlen(names[i]) == len && !strncasecmp(name, names[i], len)) {
+			return i;
+		}
+	}
+	return -1;
+}
 
-	color_log_term();
-	printf(LOG_PREFIX ">>>: ");
-	char c;
-	while ((c = *msg) != 0) {
-		if (newline) {
-			printf("\n" LOG_PREFIX ">>>: ");
+int log_set_levels(const char *spec) {
+
+	while (*spec != 0) {
+		const char *eq = strchr(spec, '=');
+		if (eq == NULL) {
+			return -1;
 		}
-		if (isprint(c)) {
-			putchar(c);
-			newline = 0;
-		} else
-		if (c == 10) {
-			newline = 1;
-		} else
-		if (c == 13) {
-			// silently ignore
+		const char *lvl = eq + 1;
+		size_t lvllen = strcspn(lvl, ",");
+
+		int level = log_find(lvl, lvllen, log_levelnames, 
+				sizeof(log_levelnames)/sizeof(log_levelnames[0]));
+		if (level < 0) {
+			return -1;
+		}
+		if ((eq - spec) == 3 && !strncasecmp(spec, "all", 3)) {
+			for (int i = 0; i < LOGM_NUM; i++) {
+				log_levels[i] = level;
+			}
 		} else {
-			printf("{%02x}", ((int)c) & 0xff);
-			newline = 0;
+			int mod = log_find(spec, eq - spec, log_modnames, LOGM_NUM);
+			if (mod < 0) {
+				return -1;
+			}
+			log_levels[mod] = level;
+		}
+		spec = lvl + lvllen;
+		if (*spec == ',') {
+			spec++;
 		}
-		msg++;
 	}
-	printf("\n");
-	color_default();
-	fflush(stdout);
+	return 0;
 }
 
-void log_errno(const char *msg, ...) {
-       va_list args;
-       va_start(args, msg);
-	char buffer[1024];
+// --------------------------------------------------------------------------------
+// output
 
-	color_log_error();
-	if (strchr(msg, '%') != NULL) {
-		// the msg contains parameter, so we need to fix it
-		vsprintf(buffer, msg, args);
-		msg = buffer;
+static void log_write(logcolor_t color, const char *text) {
+	switch (color) {
+	case logc_term:		color_log_term(); break;
+	case logc_error:	color_log_error(); break;
+	case logc_warn:		color_log_warn(); break;
+	case logc_info:		color_log_info(); break;
+	case logc_debug:	color_log_debug(); break;
 	}
-        printf(LOG_PREFIX "ERN: %s: errno=%d: %s\n", msg, errno, strerror(errno));
-	newline = lastlog_anything;
+	fputs(text, stdout);
 	color_default();
-	fflush(stdout);
 }
 
-void log_warn(const char *msg, ...) {
-       va_list args;
-       va_start(args, msg);
+#ifdef LOG_ASYNC
+
+// Messages are put into a bounded ring and written to the terminal by a
+// background thread, so the thread that logs never waits for terminal I/O.
+// The ring is a lock-free multi-producer queue: each slot carries a sequence
+// number that tells whether it is free for the producer at position seq, or
+// filled for the consumer at position seq-1. When the ring is full, messages
+// are dropped and counted.
+
+#define	LOG_RING_SLOTS	1024	// must be a power of two
+
+typedef struct {
+	atomic_uint seq;
+	logcolor_t color;
+	char text[LOG_LINE_LEN];
+} log_slot_t;
+
+static log_slot_t log_ring[LOG_RING_SLOTS];
+static atomic_uint log_head;		// next position to write
+static unsigned int log_tail;		// next position to read (writer thread only)
+static atomic_uint log_dropped;
+
+static pthread_t log_thread;
+static pthread_mutex_t log_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int log_sleeping;
+static atomic_int log_stopping;
+static int log_running = 0;
+
+static void log_out(logcolor_t color, const char *text) {
+
+	if (!log_running) {
+		log_write(color, text);
+		fflush(stdout);
+		return;
+	}
 
-	color_log_warn();
-	if (newline != lastlog_warn) {
-       		printf(LOG_PREFIX "WRN:");
+	unsigned int pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+	log_slot_t *slot;
+	for (;;) {
+		slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+		unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		int dif = (int)(seq - pos);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else
+		if (dif < 0) {
+			// full
+			atomic_fetch_add(&log_dropped, 1);
+			return;
+		} else {
+			pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+		}
 	}
-	newline = lastlog_anything;
-	if (msg[strlen(msg)-1]!='\n') {
-		newline = lastlog_warn;
+
+	slot->color = color;
+	strncpy(slot->text, text, LOG_LINE_LEN - 1);
+	slot->text[LOG_LINE_LEN - 1] = 0;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+	if (atomic_load(&log_sleeping)) {
+		pthread_cond_signal(&log_wake_cond);
 	}
-        vprintf(msg, args);
-	color_default();
-	fflush(stdout);
 }
 
-void log_error(const char *msg, ...) {
-       va_list args;
-       va_start(args, msg);
+// write all queued messages, returns the number of messages written
+static int log_drain(void) {
+	int n = 0;
 
-	color_log_error();
-	if (newline != lastlog_error) {
-       		printf(LOG_PREFIX "ERR:");
+	for (;;) {
+		log_slot_t *slot = &log_ring[log_tail & (LOG_RING_SLOTS - 1)];
+		unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq != log_tail + 1) {
+			break;
+		}
+		log_write(slot->color, slot->text);
+		atomic_store_explicit(&slot->seq, log_tail + LOG_RING_SLOTS, memory_order_release);
+		log_tail++;
+		n++;
 	}
-	newline = lastlog_anything;
-	if (msg[strlen(msg)-1]!='\n') {
-		newline = lastlog_error;
+
+	unsigned int dropped = atomic_exchange(&log_dropped, 0);
+	if (dropped > 0) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), LOG_PREFIX "WRN:%u log messages dropped\n", dropped);
+		log_write(logc_warn, buf);
+		n++;
 	}
-        vprintf(msg, args);
-	color_default();
-	fflush(stdout);
+	if (n > 0) {
+		fflush(stdout);
+	}
+	return n;
+}
+
+static int log_empty(void) {
+	log_slot_t *slot = &log_ring[log_tail & (LOG_RING_SLOTS - 1)];
+	return atomic_load(&slot->seq) != log_tail + 1;
 }
 
-void log_info(const char *msg, ...) {
-       va_list args;
-       va_start(args, msg);
+static void *log_writer(void *arg) {
+	(void) arg;
+
+	for (;;) {
+		log_drain();
 
-	color_log_info();
-	if (newline != lastlog_info) {
-		printf(LOG_PREFIX "INF:");
+		pthread_mutex_lock(&log_wake_mutex);
+		atomic_store(&log_sleeping, 1);
+		if (log_empty()) {
+			if (atomic_load(&log_stopping)) {
+				pthread_mutex_unlock(&log_wake_mutex);
+				break;
+			}
+			// the timeout catches a wakeup lost between the check and the wait
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 50000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&log_wake_cond, &log_wake_mutex, &ts);
+		}
+		atomic_store(&log_sleeping, 0);
+		pthread_mutex_unlock(&log_wake_mutex);
 	}
-	newline = lastlog_anything;
-	if (msg[strlen(msg)-1]!='\n') {
-		newline = lastlog_info;
+	return NULL;
+}
+
+void log_async_start(void) {
+	if (log_running) {
+		return;
 	}
-        vprintf(msg, args);
-	color_default();
+	for (unsigned int i = 0; i < LOG_RING_SLOTS; i++) {
+		atomic_init(&log_ring[i].seq, i);
+	}
+	atomic_init(&log_head, 0);
+	log_tail = 0;
+	atomic_init(&log_stopping, 0);
+	fflush(stdout);
+
+	if (pthread_create(&log_thread, NULL, log_writer, NULL)) {
+		log_errno("Could not start log writer thread, logging synchronously");
+		return;
+	}
+	log_running = 1;
+	atexit(log_async_stop);
+}
+
+void log_async_stop(void) {
+	if (!log_running) {
+		return;
+	}
+	atomic_store(&log_stopping, 1);
+	pthread_mutex_lock(&log_wake_mutex);
+	pthread_cond_signal(&log_wake_cond);
+	pthread_mutex_unlock(&log_wake_mutex);
+	pthread_join(log_thread, NULL);
+	log_running = 0;
+}
+
+#else
+
+static void log_out(logcolor_t color, const char *text) {
+	log_write(color, text);
 	fflush(stdout);
 }
 
-void log_debug(const char *msg, ...) {
-	if (verbose) {
-       		va_list args;
-       		va_start(args, msg);
+void log_async_start(void) {
+}
+
+void log_async_stop(void) {
+}
+
+#endif
+
+// --------------------------------------------------------------------------------
+
+void log_term(const char *msg) {
+	
+	char buf[LOG_LINE_LEN];
+	int p = 0;
+	char c;
 
-		color_log_debug();
-		if (newline != lastlog_debug) {
-			printf(LOG_PREFIX "DBG:");
+	p = snprintf(buf, sizeof(buf), LOG_PREFIX ">>>: ");
+	while ((c = *msg) != 0) {
+		if (p >= LOG_LINE_LEN - 8) {
+			// keep room for "{xx}" and the newline
+			buf[p++] = '\n';
+			buf[p] = 0;
+			log_out(logc_term, buf);
+			p = snprintf(buf, sizeof(buf), LOG_PREFIX ">>>: ");
 		}
-		newline = lastlog_anything;
-		if (msg[strlen(msg)-1]!='\n') {
-			newline = lastlog_debug;
+		if (isprint(c)) {
+			buf[p++] = c;
+		} else
+		if (c == 10) {
+			if (msg[1] != 0) {
+				buf[p++] = '\n';
+				buf[p] = 0;
+				log_out(logc_term, buf);
+				p = snprintf(buf, sizeof(buf), LOG_PREFIX ">>>: ");
+			}
+		} else
+		if (c == 13) {
+			// silently ignore
+		} else {
+			p += sprintf(buf + p, "{%02x}", ((int)c) & 0xff);
 		}
-        	vprintf(msg, args);
-		color_default();
+		msg++;
 	}
-	fflush(stdout);
+	buf[p++] = '\n';
+	buf[p] = 0;
+	log_out(logc_term, buf);
+}
+
+// format a message with its prefix (if not a continued line) and output it
+static void log_msg(logcolor_t color, enum lastlog type, const char *prefix, 
+		const char *msg, va_list args) {
+
+	char buf[LOG_LINE_LEN];
+	int p = 0;
+
+	if (newline != type) {
+		p = snprintf(buf, sizeof(buf), LOG_PREFIX "%s", prefix);
+	}
+	newline = lastlog_anything;
+	if (msg[0] == 0 || msg[strlen(msg)-1]!='\n') {
+		newline = type;
+	}
+	vsnprintf(buf + p, sizeof(buf) - p, msg, args);
+
+	log_out(color, buf);
+}
+
+void log_errno_(const char *msg, ...) {
+	va_list args;
+	va_start(args, msg);
+	int err = errno;
+	char buffer[LOG_LINE_LEN / 2];
+
+	vsnprintf(buffer, sizeof(buffer), msg, args);
+	va_end(args);
+
+	char line[LOG_LINE_LEN];
+	snprintf(line, sizeof(line), LOG_PREFIX "ERN: %s: errno=%d: %s\n", buffer, err, strerror(err));
+	newline = lastlog_anything;
+
+	log_out(logc_error, line);
+}
+
+void log_warn_(const char *msg, ...) {
+	va_list args;
+	va_start(args, msg);
+	log_msg(logc_warn, lastlog_warn, "WRN:", msg, args);
+	va_end(args);
+}
+
+void log_error_(const char *msg, ...) {
+	va_list args;
+	va_start(args, msg);
+	log_msg(logc_error, lastlog_error, "ERR:", msg, args);
+	va_end(args);
+}
+
+void log_info_(const char *msg, ...) {
+	va_list args;
+	va_start(args, msg);
+	log_msg(logc_info, lastlog_info, "INF:", msg, args);
+	va_end(args);
+}
+
+void log_debug_(const char *msg, ...) {
+	va_list args;
+	va_start(args, msg);
+	log_msg(logc_debug, lastlog_debug, "DBG:", msg, args);
+	va_end(args);
 }
 
 
@@ -171,39 +426,43 @@ void log_hexdump2(const char *p, int len, int petscii, const char *prefix) {
 	int line = 0;
 	int x = 0;
 	const char *spaceprefix = spaces + strlen(spaces) - strlen(prefix);
+	char buf[LOG_LINE_LEN];
 
 	newline = lastlog_anything;
-	color_log_debug();
 
 	if(len) {
 		while(tot < len) {
+			int n;
 			if (tot == 0) {
-				printf(LOG_PREFIX "%s%04X  ", prefix, tot);
+				n = snprintf(buf, sizeof(buf), LOG_PREFIX "%s%04X  ", prefix, tot);
 			} else {
-				printf(LOG_PREFIX "%s%04X  ", spaceprefix , tot);
+				n = snprintf(buf, sizeof(buf), LOG_PREFIX "%s%04X  ", spaceprefix , tot);
 			}
 			for(x=0; x<16; x++) {
 				if(line+x < len) {
 					tot++;
-					printf("%02X ", 255&p[line+x]);
+					n += sprintf(buf + n, "%02X ", 255&p[line+x]);
 				}
-				else printf("   ");
-				if(x == 7) putchar(' ');
+				else n += sprintf(buf + n, "   ");
+				if(x == 7) buf[n++] = ' ';
 			}
-			printf(" |");
+			buf[n++] = ' ';
+			buf[n++] = '|';
 			for(x=0; x<16; x++) {
 				if(line+x < len) {
 					int c = p[line+x];
 					if (petscii) c = petscii_to_ascii(c);
-					if(isprint(c)) putchar(c); else putchar(' ');
-				} else putchar(' ');
+					buf[n++] = isprint(c) ? c : ' ';
+				} else buf[n++] = ' ';
 			}
-			printf("|\n");
+			buf[n++] = '|';
+			buf[n++] = '\n';
+			buf[n] = 0;
+			log_out(logc_debug, buf);
 			line = tot;
 		}
 
 	}
-	color_default();
 }
 
 void log_hexdump(const char *p, int len, int petscii) {
@@ -24,17 +24,66 @@
 
 ****************************************************************************/
 
+#ifndef LOG_H
+#define LOG_H
+
+// log levels; a message is shown when its level is less or equal
+// to the level set for the module it comes from
+#define	LOG_ERROR	0
+#define	LOG_WARN	1
+#define	LOG_INFO	2
+#define	LOG_DEBUG	3
+
+// modules with separate log levels. A source file selects its module by
+// defining LOG_MODULE before its first include, otherwise it logs as "main"
+typedef enum {
+	LOGM_MAIN,	// main program, ui, poll loop
+	LOGM_DEV,	// device connections and packet handling
+	LOGM_CMD,	// command execution and channels
+	LOGM_PROV,	// provider and handler framework
+	LOGM_DI,	// disk image provider
+	LOGM_FS,	// file system provider
+	LOGM_NET,	// tcp, http and ftp providers
+	LOGM_NUM
+} logmod_t;
+
+#ifndef LOG_MODULE
+#define	LOG_MODULE	LOGM_MAIN
+#endif
+
+extern unsigned char log_levels[LOGM_NUM];
+
+// true when messages of the given level from this module are shown
+#define	log_enabled(level)	(log_levels[LOG_MODULE] >= (level))
+
+// set all modules to debug (flag != 0) or info level
 void set_verbose(int flag);
 
-void log_errno(const char *msg, ...);
+// set levels from a "module=level[,module=level...]" list, where module
+// may be "all". Returns 0 on success, -1 on a syntax error
+int log_set_levels(const char *spec);
 
-void log_warn(const char *msg, ...);
+// start resp. stop the background writer. Without it (or when not
+// compiled with LOG_ASYNC) messages are written synchronously
+void log_async_start(void);
+void log_async_stop(void);
 
-void log_error(const char *msg, ...);
+// The macros check the level before the arguments are evaluated, so
+// disabled messages do not cost more than a compare.
+void log_errno_(const char *msg, ...);
+#define	log_errno(...)	do { if (log_enabled(LOG_ERROR)) log_errno_(__VA_ARGS__); } while (0)
 
-void log_info(const char *msg, ...);
+void log_warn_(const char *msg, ...);
+#define	log_warn(...)	do { if (log_enabled(LOG_WARN)) log_warn_(__VA_ARGS__); } while (0)
 
-void log_debug(const char *msg, ...);
+void log_error_(const char *msg, ...);
+#define	log_error(...)	do { if (log_enabled(LOG_ERROR)) log_error_(__VA_ARGS__); } while (0)
+
+void log_info_(const char *msg, ...);
+#define	log_info(...)	do { if (log_enabled(LOG_INFO)) log_info_(__VA_ARGS__); } while (0)
+
+void log_debug_(const char *msg, ...);
+#define	log_debug(...)	do { if (log_enabled(LOG_DEBUG)) log_debug_(__VA_ARGS__); } while (0)
 
 void log_term(const char *msg);
 
@@ -48,3 +97,5 @@ void log_hexdump2(const char *p, int len, int petscii, const char *prefix);
 #define	log_rv(rv)	log_error("ERROR RETURN: %d\n", (rv))
 
 const char *dump_indent(int n);
+
+#endif
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifndef __APPLE__
 #include <malloc.h>
@@ -38,19 +39,106 @@
 #include "mem.h"
 
 
-#define	DEBUG_MEM
+// Define DEBUG_MEM (make DEBUG_MEM=y) to record every allocation in a
+// hash table, so that mem_exit() can report memory that has not been freed.
+//#define	DEBUG_MEM
 
-#ifdef DEBUG_MEM
 #define	MEM_MAGIC	0xbadc0de
-#define	MEM_OFFSET	(sizeof(int))
-#else
-#define	MEM_OFFSET	0
-#endif
+
+// header in front of each allocated block. It is padded to the largest
+// scalar alignment, so the returned pointer keeps malloc()'s alignment.
+typedef union {
+	struct {
+		unsigned int magic;	// MEM_MAGIC while allocated
+		int pool;		// size class index, or -1 if not pooled
+	} h;
+	long double align_ld;
+	long long align_ll;
+	void *align_p;
+} mem_hdr_t;
+
+#define	MEM_OFFSET	(sizeof(mem_hdr_t))
+
+// --------------------------------------------------------------------------------
+// pools for single objects allocated with mem_alloc(). Freed objects are kept
+// on a free list per size class (sizeoftype rounded up to MEM_POOL_GRAIN), so
+// the many small file_t and similar objects are recycled in O(1).
+
+#define	MEM_POOL_GRAIN		16
+#define	MEM_POOL_CLASSES	32	// objects up to 512 byte are pooled
+#define	MEM_POOL_MAX_FREE	1024	// max number of free objects kept per class
+
+typedef struct mem_free_s mem_free_t;
+struct mem_free_s {
+	mem_free_t *next;
+};
+
+typedef struct {
+	mem_free_t *free;	// free list (points to the headers)
+	int nfree;		// number of entries in the free list
+} mem_pool_t;
+
+static mem_pool_t mem_pools[MEM_POOL_CLASSES];
+
+static inline int pool_class(size_t size) {
+	size_t cls = (size + MEM_POOL_GRAIN - 1) / MEM_POOL_GRAIN;
+	if (cls == 0) {
+		cls = 1;
+	}
+	return (cls <= MEM_POOL_CLASSES) ? (int)(cls - 1) : -1;
+}
+
+static inline mem_hdr_t *pool_get(int cls) {
+	mem_pool_t *pool = &mem_pools[cls];
+	mem_free_t *p = pool->free;
+	if (p != NULL) {
+		pool->free = p->next;
+		pool->nfree--;
+		return (mem_hdr_t*) p;
+	}
+	return malloc(MEM_OFFSET + (cls + 1) * MEM_POOL_GRAIN);
+}
+
+static inline void pool_put(mem_hdr_t *hdr) {
+	mem_pool_t *pool = &mem_pools[hdr->h.pool];
+	if (pool->nfree >= MEM_POOL_MAX_FREE) {
+		free(hdr);
+		return;
+	}
+	mem_free_t *p = (mem_free_t*) hdr;
+	p->next = pool->free;
+	pool->free = p;
+	pool->nfree++;
+}
+
+static void pool_release(void) {
+	for (int i = 0; i < MEM_POOL_CLASSES; i++) {
+		mem_free_t *p = mem_pools[i].free;
+		while (p != NULL) {
+			mem_free_t *next = p->next;
+			free(p);
+			p = next;
+		}
+		mem_pools[i].free = NULL;
+		mem_pools[i].nfree = 0;
+	}
+}
 
 // --------------------------------------------------------------------------------
 // memory allocation checker
 
-static const int mem_records_initial = 1000;
+static void check_null(void *ptr, const char *file, int line) {
+	if(!ptr) {
+		fprintf(stderr, "Could not allocate memory, "
+		"file: %s line: %d\n", file, line);
+		exit(EXIT_FAILURE);
+	}
+}
+
+#ifdef DEBUG_MEM
+
+// open addressing hash table of all allocations, keyed by pointer
+static const int mem_records_initial = 1024;
 
 typedef struct {
 	void *ptr;
@@ -59,89 +147,111 @@ typedef struct {
 	int line;
 } mem_record_t;
 
-// array to record all allocations
+// marks a removed entry, so probe sequences are not broken
+static char mem_deleted;
+#define	MEM_DELETED	((void*)&mem_deleted)
+
+// hash table to record all allocations
 static mem_record_t *mem_records = NULL;
-// size of record array in number of records
-static int mem_cap = 0;
-// behind last written record
-static int mem_last = 0;
-// first unused entry lies here or behind this rec#
-static int mem_tag = 0;
+// size of record table in number of records (power of two)
+static size_t mem_cap = 0;
+// number of live records
+static size_t mem_used = 0;
+// number of live plus deleted records
+static size_t mem_filled = 0;
+
+static inline size_t mem_hash(const void *ptr) {
+	uintptr_t h = (uintptr_t) ptr;
+	h ^= h >> 17;
+	h *= 0x9e3779b1u;
+	h ^= h >> 13;
+	return (size_t) h;
+}
+
+static void mem_rehash(size_t newcap) {
+	mem_record_t *old = mem_records;
+	size_t oldcap = mem_cap;
+
+	mem_records = calloc(newcap, sizeof(mem_record_t));
+	if(!mem_records) {
+		fprintf(stderr, "Could not allocate memory of size %zu for alloc table!\n",
+			newcap * sizeof(mem_record_t));
+		exit(EXIT_FAILURE);
+	}
+	mem_cap = newcap;
+	mem_filled = mem_used;
+
+	for (size_t i = 0; i < oldcap; i++) {
+		void *ptr = old[i].ptr;
+		if (ptr != NULL && ptr != MEM_DELETED) {
+			size_t j = mem_hash(ptr) & (mem_cap - 1);
+			while (mem_records[j].ptr != NULL) {
+				j = (j + 1) & (mem_cap - 1);
+			}
+			mem_records[j] = old[i];
+		}
+	}
+	free(old);
+}
 
 #define check_alloc(ptr, file, line) check_alloc_(ptr, NULL, file, line)
 #define check_alloc2(ptr, name, file, line) check_alloc_(ptr, name, file, line)
 #define check_free(ptr) check_free_(ptr)
 
 static void check_alloc_(void *ptr, const char *name, char *file, int line) {
-	if(!ptr) {
-		fprintf(stderr, "Could not allocate memory, "
-		"file: %s line: %d\n", file, line);
-		exit(EXIT_FAILURE);
-	}
+
+	check_null(ptr, file, line);
 
 	if (mem_records == NULL) {
-		size_t s = sizeof(mem_record_t) * mem_records_initial;
-		mem_records = malloc(s);
-		if(!mem_records) {
-			fprintf(stderr, "Could not allocate memory of size %ld for alloc table!\n", s);
-			exit(EXIT_FAILURE);
-		}
-		mem_cap = mem_records_initial;
-		mem_last = 0;
-		mem_tag = 0;
-		memset(mem_records, 0, s); 
-	}
-	// search for first empty slot (from mem_tag)
-	while (mem_tag < mem_last && mem_records[mem_tag].ptr != NULL) {
-		mem_tag++;
+		mem_rehash(mem_records_initial);
+	} else
+	if ((mem_filled + 1) * 4 > mem_cap * 3) {
+		// keep load factor below 3/4; only grow if live entries need it
+		mem_rehash((mem_used + 1) * 2 > mem_cap ? mem_cap * 2 : mem_cap);
 	}
 
-	// either mem_tag == mem_last, which means we just append,
-	// or we found an entry
-	if (mem_tag == mem_last) {
-		// if we are at the last place, check against cap
-		if (mem_last >= mem_cap) {
-			// we are at the limit!
-			size_t oldsize = sizeof(mem_record_t) * mem_cap;
-			// double the limit
-			mem_cap = mem_cap * 2;
-			size_t newsize = sizeof(mem_record_t) * mem_cap;
-			mem_records = realloc(mem_records, newsize);
-			if(!mem_records) {
-				fprintf(stderr, "Could not re-allocate memory of size %ld for alloc table!\n", newsize);
-				exit(EXIT_FAILURE);
-			}
-			// clear out newly allocated memory
-			memset(((char*)mem_records) + oldsize, 0, newsize - oldsize);
-		}
-		mem_last ++;
+	size_t i = mem_hash(ptr) & (mem_cap - 1);
+	while (mem_records[i].ptr != NULL && mem_records[i].ptr != MEM_DELETED) {
+		i = (i + 1) & (mem_cap - 1);
+	}
+	if (mem_records[i].ptr == NULL) {
+		mem_filled++;
 	}
-	mem_records[mem_tag].ptr = ptr;
-	mem_records[mem_tag].file = file;
-	mem_records[mem_tag].line = line;
-	mem_records[mem_tag].name = name;
+	mem_used++;
+
+	mem_records[i].ptr = ptr;
+	mem_records[i].file = file;
+	mem_records[i].line = line;
+	mem_records[i].name = name;
 }
 
 static void check_free_(const void *ptr) {
 
-	for (int i = 0; i < mem_last; i++) {
-		if (mem_records[i].ptr == ptr) {
-			log_debug("Free memory at %p (from %s:%d, name=%s)\n", ptr, mem_records[i].file, mem_records[i].line, mem_records[i].name);
-			// unalloc
-			mem_records[i].ptr = NULL;
-			if (i < mem_tag) {
-				mem_tag = i;
-			}
-			if (i + 1 == mem_last) {
-				// was last used entry
-				mem_last --;
+	if (mem_records != NULL) {
+		size_t i = mem_hash(ptr) & (mem_cap - 1);
+		while (mem_records[i].ptr != NULL) {
+			if (mem_records[i].ptr == ptr) {
+				log_debug("Free memory at %p (from %s:%d, name=%s)\n", ptr,
+					mem_records[i].file, mem_records[i].line, mem_records[i].name);
+				// unalloc
+				mem_records[i].ptr = MEM_DELETED;
+				mem_used--;
+				return;
 			}
-			return;
+			i = (i + 1) & (mem_cap - 1);
 		}
 	}
 	log_error("check_free: Trying to free memory at %p that is not allocated\n", ptr);
 }
 
+#else
+
+#define check_alloc(ptr, file, line) check_null(ptr, file, line)
+#define check_alloc2(ptr, name, file, line) check_null(ptr, file, line)
+#define check_free(ptr)
+
+#endif
+
 // --------------------------------------------------------------------------------
 
 void mem_init (void) {
@@ -149,18 +259,29 @@ void mem_init (void) {
 
 void mem_exit (void) {
 
-	for (int i = 0; i < mem_last; i++) {
+#ifdef DEBUG_MEM
+	for (size_t i = 0; i < mem_cap; i++) {
 
-		if (mem_records[i].ptr != NULL) {
+		void *ptr = mem_records[i].ptr;
+		if (ptr != NULL && ptr != MEM_DELETED) {
 			fprintf(stderr, "Did not free memory at %p, allocated in %s:%d, name=%s\n", 
-					mem_records[i].ptr, mem_records[i].file, mem_records[i].line, mem_records[i].name);
+					ptr, mem_records[i].file, mem_records[i].line, mem_records[i].name);
 
 		}
 	}
+#endif
+	pool_release();
 }
 
 // --------------------------------------------------------------------------------
 
+// set up the header of a new block and return the user pointer
+static inline void *mem_setup(mem_hdr_t *hdr, int pool) {
+	hdr->h.magic = MEM_MAGIC;
+	hdr->h.pool = pool;
+	return ((char*)hdr) + MEM_OFFSET;
+}
+
 // allocate memory and copy given string up to n chars
 //#define mem_alloc_strn(s,n) mem_alloc_str_(s, n, __FILE__, __LINE__)
 char *mem_alloc_strn_(const char *orig, size_t n, char *file, int line) {
@@ -170,14 +291,11 @@ char *mem_alloc_strn_(const char *orig, size_t n, char *file, int line) {
 		len = n;
 	}
 
-	char *ptr = malloc(len+MEM_OFFSET+1);
+	mem_hdr_t *hdr = malloc(len+MEM_OFFSET+1);
 
-	check_alloc(ptr, file, line);		
+	check_alloc(hdr, file, line);		
 
-#ifdef DEBUG_MEM
-	((int*)ptr)[0] = MEM_MAGIC;
-#endif
-	ptr+=MEM_OFFSET;
+	char *ptr = mem_setup(hdr, -1);
 
 	strncpy(ptr, orig, len);
 
@@ -190,16 +308,13 @@ char *mem_alloc_strn_(const char *orig, size_t n, char *file, int line) {
 //#define mem_alloc_str(s) mem_alloc_str_(s, __FILE__, __LINE__)
 char *mem_alloc_str_(const char *orig, char *file, int line) {
 
-	int len = strlen(orig);
-	len+=MEM_OFFSET;
+	size_t len = strlen(orig);
 
-	char *ptr = malloc(len+1);
+	mem_hdr_t *hdr = malloc(len+MEM_OFFSET+1);
 
-	check_alloc(ptr, file, line);		
-#ifdef DEBUG_MEM
-	((int*)ptr)[0] = MEM_MAGIC;
-#endif
-	ptr+=MEM_OFFSET;
+	check_alloc(hdr, file, line);		
+
+	char *ptr = mem_setup(hdr, -1);
 	
 	strcpy(ptr, orig);
 
@@ -208,20 +323,23 @@ char *mem_alloc_str_(const char *orig, char *file, int line) {
 
 #define mem_alloc(t) mem_alloc_(t, __FILE__, __LINE__)
 void *mem_alloc_(const type_t *type, char *file, int line) {
-	// for now just malloc()
 
-	void *ptr = malloc(type->sizeoftype + MEM_OFFSET);
+	mem_hdr_t *hdr;
+	int cls = pool_class(type->sizeoftype);
+
+	if (cls >= 0) {
+		hdr = pool_get(cls);
+	} else {
+		hdr = malloc(type->sizeoftype + MEM_OFFSET);
+	}
+
+	check_alloc(hdr, file, line);
 
-	check_alloc(ptr, file, line);
+	void *ptr = mem_setup(hdr, cls);
 
-	// malloc returns "non-initialized" memory! 
+	// malloc returns "non-initialized" memory, and pooled objects are dirty
 	memset(ptr, 0, type->sizeoftype);
 
-#ifdef DEBUG_MEM
-	((int*)ptr)[0] = MEM_MAGIC;
-#endif
-	ptr = ((char*)ptr) + MEM_OFFSET;
-	
 	if (type->constructor != NULL) {
 		type->constructor(type, ptr);
 	}
@@ -233,71 +351,63 @@ void *mem_alloc_(const type_t *type, char *file, int line) {
 void *mem_alloc_c_(size_t n, const char *name, char *file, int line) {
 	// for now just malloc()
 
-	//(void) name; // name not used at the moment, silence warning
+	(void) name; // name only used with DEBUG_MEM
 
-	void *ptr = malloc(n + MEM_OFFSET);
+	mem_hdr_t *hdr = malloc(n + MEM_OFFSET);
 
-	check_alloc2(ptr, name, file, line);
+	check_alloc2(hdr, name, file, line);
 
-#ifdef DEBUG_MEM
-	((int*)ptr)[0] = MEM_MAGIC;
-#endif
-	ptr = ((char*)ptr) + MEM_OFFSET;
-
-	return ptr;
+	return mem_setup(hdr, -1);
 }
 
 // NOTE: does not handle padding, this must be fixed in the type->sizeofstruct value!
 void *mem_alloc_n_(const size_t n, const type_t *type, char *file, int line) {
 	// for now just malloc()
 
-	void *ptr = calloc(n + ((MEM_OFFSET == 0) ? 0 : 1), type->sizeoftype);
+	mem_hdr_t *hdr = calloc(1, n * type->sizeoftype + MEM_OFFSET);
 
-	check_alloc(ptr, file, line);
+	check_alloc(hdr, file, line);
 
-#ifdef DEBUG_MEM
-	((int*)ptr)[0] = MEM_MAGIC;
-	ptr = ((char*)ptr) + MEM_OFFSET;
-#endif
-
-	return ptr;
+	return mem_setup(hdr, -1);
 }
 
 // NOTE: does not handle padding, this must be fixed in the type->sizeofstruct value!
 // NOTE: this does currently not zero-fill the added area when the array size is increased
 void *mem_realloc_n_(const size_t n, const type_t *type, void *ptr, char *file, int line) {
 
-#ifdef DEBUG_MEM
-	check_free(((char*)ptr) - MEM_OFFSET);
-	ptr = realloc(((char*)ptr) - MEM_OFFSET, (n + 1) * type->sizeoftype);
-	check_alloc(ptr, file, line);
-	ptr = ((char*)ptr) + MEM_OFFSET;
-#else
-	check_free(ptr);
-	ptr = realloc(ptr, n * type->sizeoftype);
-	check_alloc(ptr, file, line);
-#endif
+	if (ptr == NULL) {
+		return mem_alloc_n_(n, type, file, line);
+	}
 
-	return ptr;
+	mem_hdr_t *hdr = (mem_hdr_t*) (((char*)ptr) - MEM_OFFSET);
+
+	check_free(hdr);
+	hdr = realloc(hdr, n * type->sizeoftype + MEM_OFFSET);
+	check_alloc(hdr, file, line);
+
+	// the block is now owned by malloc, even if it came from a pool
+	return mem_setup(hdr, -1);
 }
 
 void mem_free_(const void* ptr) {
 
-#ifdef DEBUG_MEM
-	if (ptr != NULL) {
-		ptr = ((char*)ptr) - MEM_OFFSET;
-		if ( ((int*)ptr)[0] != MEM_MAGIC ) {
-			log_error("Trying to free memory at %p that is not allocated\n", ptr);
-			return;
-		}
-		((int*)ptr)[0] = 0;
-		check_free(ptr);
+	if (ptr == NULL) {
+		return;
 	}
-#else
-	check_free(ptr);
-#endif
-	free((void*)ptr);
 
+	mem_hdr_t *hdr = (mem_hdr_t*) (((char*)ptr) - MEM_OFFSET);
+	if (hdr->h.magic != MEM_MAGIC) {
+		log_error("Trying to free memory at %p that is not allocated\n", ptr);
+		return;
+	}
+	hdr->h.magic = 0;
+	check_free(hdr);
+
+	if (hdr->h.pool >= 0) {
+		pool_put(hdr);
+	} else {
+		free(hdr);
+	}
 }
 
 /**
@@ -347,6 +457,7 @@ void mem_append_str5(char **baseptr, const char *s1, const char *s2, const char
 		+ 1;
 
 	char *base = mem_alloc_c(newlen, "mem_append");
+	base[0] = 0;
 
 	if (*baseptr != NULL) { strcpy(base, *baseptr); };
 	if (s1 != NULL) { strcat(base, s1); }
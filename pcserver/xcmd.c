@@ -26,6 +26,8 @@
  into the argv[] array.
 */
 
+#define	LOG_MODULE	LOGM_CMD
+
 #include "types.h"
 #include "mem.h"
 #include "xcmd.h"
@@ -0,0 +1,149 @@
+#!/bin/bash
+#
+# call this script without params to run all benchmark workloads in this
+# directory. Providing workload names (e.g. "load-d64") only runs those.
+#
+# Each workload is a *.trs runner script; the part after its "bench" line
+# is repeated, and the runner reports p50/p99 latency per request type and
+# the sustained payload bytes/s.
+#
+# Available options are:
+#	-n <iterations>		number of iterations per workload (default 100)
+#	-t <seconds>		run each workload for the given time instead
+#	-c <connections>	run the read-only workloads with that many
+#				concurrent connections (using the tools socket)
+#	-v			verbose server log
+#	-k			keep the run directory
+#	-R <run directory>	use given run directory instead of tmp folder
+#
+
+THISDIR=`dirname $0`
+BASEDIR="../.."
+
+RUNNER="$THISDIR"/${BASEDIR}/testrunner/pcrunner
+SERVER="$THISDIR"/${BASEDIR}/pcserver/fsser
+
+# workloads in the order they need to run: save-d64 creates the file
+# that load-d64 reads
+WORKLOADS="save-d64 load-d64 load-fs dir1000 rel-random"
+
+# workloads that only read, and can run on multiple connections
+SHARED="load-d64 load-fs dir1000"
+
+# drive 0 is a directory with the "BIG" file, drive 1 a D64 image,
+# drive 2 a directory with 1000 files
+SERVEROPTS="-A0:fs=data -A1:fs=bench.d64 -A2:fs=dir1000"
+
+LIMIT="-b 100"
+CONNS=1
+VERBOSE=""
+CLEAN=1
+
+TMPDIR=`mktemp -d`
+OWNDIR=1
+
+while test $# -gt 0; do
+  case $1 in
+  -n)
+	LIMIT="-b $2"
+	shift 2;
+	;;
+  -t)
+	LIMIT="-B $2"
+	shift 2;
+	;;
+  -c)
+	CONNS=$2
+	shift 2;
+	;;
+  -v)
+	VERBOSE="-v"
+	shift;
+	;;
+  -k)
+	CLEAN=0
+	shift;
+	;;
+  -R)
+	rmdir $TMPDIR
+	TMPDIR="$2"
+	OWNDIR=0
+	CLEAN=0
+	shift 2;
+	;;
+  -*)
+	echo "Unknown option $1"
+	exit 1;
+	;;
+  *)
+	break;
+	;;
+  esac;
+done;
+
+if [ "x$*" != "x" ]; then
+	WORKLOADS="$*"
+fi
+
+if test ! -e $RUNNER -o ! -e $SERVER; then
+	echo "$RUNNER or $SERVER does not exist! Maybe forgot to compile?"
+	exit 1;
+fi
+
+########################
+# prepare files
+#
+
+mkdir -p $TMPDIR/data $TMPDIR/dir1000
+head -c 50800 /dev/zero | tr '\0' 'U' > $TMPDIR/data/BIG
+for i in `seq 1000 1999`; do
+	echo "$i" > $TMPDIR/dir1000/FILE$i
+done
+gunzip -c $THISDIR/../file/empty.d64.gz > $TMPDIR/bench.d64
+
+# load-d64 needs the file written by save-d64
+if ! echo " $WORKLOADS " | grep -q " save-d64 "; then
+	WORKLOADS="save-d64 $WORKLOADS"
+fi
+
+########################
+# run workloads
+#
+
+RESULT=0
+
+for workload in $WORKLOADS; do
+
+	script=$THISDIR/${workload%.trs}.trs
+	SOCKET=socket_$workload
+	TSOCKET=tools_$workload
+
+	OPTS="$LIMIT"
+	if [ $CONNS -gt 1 ] && echo " $SHARED " | grep -q " ${workload%.trs} "; then
+		OPTS="$OPTS -c $CONNS"
+	fi
+
+	echo "====================== Running workload $workload"
+
+	$SERVER -s $SOCKET -T $TMPDIR/$TSOCKET $VERBOSE $SERVEROPTS $TMPDIR > $TMPDIR/_$workload.log 2>&1 &
+	SERVERPID=$!
+	trap "kill -TERM $SERVERPID" INT
+
+	$RUNNER -w -d $TMPDIR/$SOCKET -T $TMPDIR/$TSOCKET $OPTS $script | grep -v "^\]\]INF"
+	if [ ${PIPESTATUS[0]} -ne 0 ]; then
+		echo "Workload $workload failed, see $TMPDIR/_$workload.log"
+		RESULT=1
+		CLEAN=0
+	fi
+
+	wait $SERVERPID
+	trap - INT
+done;
+
+if [ $CLEAN -ge 1 -a $OWNDIR -ge 1 ]; then
+	rm -rf $TMPDIR
+else
+	echo "Run directory is $TMPDIR"
+fi
+
+exit $RESULT
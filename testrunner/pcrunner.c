@@ -35,10 +35,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 
 #include "log.h"
@@ -60,6 +62,10 @@ void usage(int rv) {
                 "   -t          trace send/received data\n"
                 "   -w          wait for socket or device to appear\n"
                 "   -T <sock>   connect to tools socket in parallel\n"
+                "   -b <n>      benchmark: repeat the script after its 'bench' line n times\n"
+                "   -B <secs>   benchmark: repeat the script for the given number of seconds\n"
+                "   -c <m>      benchmark: run with m concurrent connections, the additional\n"
+                "               ones on the tools socket (requires -T)\n"
                 "   -?          gives you this help text\n"
         );
         exit(rv);
@@ -107,6 +113,8 @@ cmd_tab_t cmds[] = {
 	{ "errmsg", 6, parse_msg },
 	{ "init", 4, parse_init },
 	{ "channel", 7, parse_msg },
+	{ "bench", 5, parse_buf },
+	{ "readall", 7, parse_buf },
 	{ NULL, 0, NULL }
 };
 
@@ -117,6 +125,205 @@ cmd_tab_t cmds[] = {
 #define CMD_ERRMSG	3
 #define CMD_INIT	4
 #define CMD_CHANNEL	5
+#define CMD_BENCH	6
+#define CMD_READALL	7
+
+// -----------------------------------------------------------------------
+// benchmark mode
+//
+// In benchmark mode the part of the script after the "bench" line is
+// repeated. Each request sent is timed until the last packet received
+// before the next request, and the samples are kept per FS_* command.
+
+#define	BENCH_MAXCMD	64
+
+typedef struct {
+	uint32_t *us;		// request latencies in microseconds
+	int num;
+	int cap;
+} samples_t;
+
+static type_t sample_type = {
+	"bench_sample",
+	sizeof(uint32_t),
+	NULL
+};
+
+static const char *reqnames[] = {
+	"TERM", "OPEN_RD", "OPEN_WR", "OPEN_RW", "OPEN_OW", "OPEN_AP", "OPEN_DR",
+	"READ", "WRITE", "WRITE_EOF", "REPLY", "DATA", "DATA_EOF", "SEEK", "CLOSE",
+	"MOVE", "DELETE", "FORMAT", "CHKDSK", "RMDIR", "MKDIR", "CHDIR", "ASSIGN",
+	"SETOPT", "RESET", "BLOCK", "GETDATIM", "POSITION", "OPEN_DIRECT", "CHARSET",
+	"COPY", "DUPLICATE", "INITIALIZE", "INFO"
+};
+
+// set in benchmark mode; samples taken in the setup part are dropped
+static int bench = 0;
+// when not set, "init" only sends the sync bytes (for the tools socket)
+static int initreply = 1;
+// script position after the "bench" line, -1 if none found yet
+static int benchpos = -1;
+
+static samples_t samples[BENCH_MAXCMD];
+// payload bytes received (FS_DATA*) and sent (FS_WRITE*)
+static uint64_t bench_bytes = 0;
+// iterations run and time used by the repeated part
+static int bench_iter = 0;
+static uint64_t bench_us = 0;
+
+// the currently timed request
+static int req_cmd = -1;
+static int req_replied = 0;
+static uint64_t req_start;
+static uint64_t req_last;
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static void sample_add(int cmd, uint32_t us) {
+	samples_t *s = &samples[cmd];
+
+	if (s->num >= s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 256;
+		s->us = mem_realloc_n(s->cap, &sample_type, s->us);
+	}
+	s->us[s->num++] = us;
+}
+
+// close the currently timed request, if it got an answer
+static void bench_done(void) {
+	if (req_cmd >= 0 && req_replied) {
+		sample_add(req_cmd, (uint32_t)(req_last - req_start));
+	}
+	req_cmd = -1;
+}
+
+static void bench_send(const char *pkt, int len) {
+	if (!bench) {
+		return;
+	}
+	bench_done();
+
+	int cmd = pkt[FSP_CMD] & 255;
+	if (cmd < BENCH_MAXCMD) {
+		req_cmd = cmd;
+		req_replied = 0;
+		req_start = now_us();
+	}
+	if ((cmd == FS_WRITE || cmd == FS_WRITE_EOF) && len > FSP_DATA) {
+		bench_bytes += len - FSP_DATA;
+	}
+}
+
+static void bench_recv(const char *pkt, int len) {
+	if (!bench) {
+		return;
+	}
+	req_last = now_us();
+	req_replied = 1;
+
+	int cmd = pkt[FSP_CMD] & 255;
+	if ((cmd == FS_DATA || cmd == FS_DATA_EOF) && len > FSP_DATA) {
+		bench_bytes += len - FSP_DATA;
+	}
+}
+
+static int cmp_us(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+// write the samples of a benchmark child process to the given file
+static void bench_save(FILE *fp) {
+	for (int cmd = 0; cmd < BENCH_MAXCMD; cmd++) {
+		if (samples[cmd].num > 0) {
+			fwrite(&cmd, sizeof(cmd), 1, fp);
+			fwrite(&samples[cmd].num, sizeof(int), 1, fp);
+			fwrite(samples[cmd].us, sizeof(uint32_t), samples[cmd].num, fp);
+		}
+	}
+	int end = -1;
+	fwrite(&end, sizeof(end), 1, fp);
+	fwrite(&bench_bytes, sizeof(bench_bytes), 1, fp);
+	fwrite(&bench_iter, sizeof(bench_iter), 1, fp);
+	fwrite(&bench_us, sizeof(bench_us), 1, fp);
+	fflush(fp);
+}
+
+// merge the samples saved by a benchmark child process
+static int bench_load(FILE *fp) {
+	int cmd, num, iter;
+	uint32_t us;
+	uint64_t bytes, elapsed;
+
+	rewind(fp);
+	while (fread(&cmd, sizeof(cmd), 1, fp) == 1) {
+		if (cmd < 0) {
+			if (fread(&bytes, sizeof(bytes), 1, fp) != 1
+				|| fread(&iter, sizeof(iter), 1, fp) != 1
+				|| fread(&elapsed, sizeof(elapsed), 1, fp) != 1) {
+				break;
+			}
+			bench_bytes += bytes;
+			bench_iter += iter;
+			if (elapsed > bench_us) {
+				bench_us = elapsed;
+			}
+			return 0;
+		}
+		if (cmd >= BENCH_MAXCMD || fread(&num, sizeof(num), 1, fp) != 1) {
+			break;
+		}
+		while (num-- > 0 && fread(&us, sizeof(us), 1, fp) == 1) {
+			sample_add(cmd, us);
+		}
+	}
+	log_error("Incomplete benchmark results from connection\n");
+	return 1;
+}
+
+static void bench_report(const char *scriptname, int conns) {
+	double secs = bench_us / 1000000.0;
+
+	printf("%s: %d iteration%s on %d connection%s in %.3f s\n", scriptname,
+		bench_iter, bench_iter == 1 ? "" : "s", conns, conns == 1 ? "" : "s", secs);
+	printf("%-12s %8s %10s %10s %10s\n", "request", "count", "p50[us]", "p99[us]", "max[us]");
+
+	for (int cmd = 0; cmd < BENCH_MAXCMD; cmd++) {
+		samples_t *s = &samples[cmd];
+		if (s->num == 0) {
+			continue;
+		}
+		qsort(s->us, s->num, sizeof(uint32_t), cmp_us);
+
+		char num[8];
+		const char *name = num;
+		if (cmd < (int)(sizeof(reqnames) / sizeof(reqnames[0]))) {
+			name = reqnames[cmd];
+		} else {
+			snprintf(num, sizeof(num), "%d", cmd);
+		}
+		printf("%-12s %8d %10u %10u %10u\n", name, s->num,
+			s->us[(s->num - 1) * 50 / 100], s->us[(s->num - 1) * 99 / 100],
+			s->us[s->num - 1]);
+	}
+	printf("%llu payload bytes, %.1f kB/s\n", (unsigned long long) bench_bytes,
+		secs > 0 ? bench_bytes / secs / 1024 : 0.0);
+}
+
+static void bench_free(void) {
+	for (int cmd = 0; cmd < BENCH_MAXCMD; cmd++) {
+		if (samples[cmd].us != NULL) {
+			mem_free(samples[cmd].us);
+		}
+	}
+}
 
 
  
@@ -140,13 +347,18 @@ char buf[8192];
 int wrp = 0;
 int rdp = 0;
 
+/**
+ * read the next packet into outbuf. Returns the packet length, which is
+ * at least FSP_DATA, 0 when the server has closed the connection, or -1
+ * on a read error.
+ */
 int read_packet(int fd, char *outbuf, int buflen) {
 
         int plen, cmd;
         int n;
 
-	wrp = 0;
-	rdp = 0;
+	// note: wrp/rdp are kept between calls, as the server may
+	// send multiple packets in a row (e.g. streamed FS_DATA)
 
         for(;;) {
 
@@ -182,26 +394,34 @@ int read_packet(int fd, char *outbuf, int buflen) {
                 }
               }
 
+              // make room for the rest of a partial packet; as the
+              // buffer is kept between calls, it may be full here
+              if(rdp && (wrp==8192 || rdp==wrp)) {
+                if(rdp!=wrp) {
+                  memmove(buf, buf+rdp, wrp-rdp);
+                }
+                wrp -= rdp;
+                rdp = 0;
+              }
+
               n = read(fd, buf+wrp, 8192-wrp);
 	      //log_debug("read->%d\n", n);
 	      if (n == 0) {
+		// the server has closed the connection
 		return 0;
 	      }
 
               if(n < 0) {
+                if (errno == EINTR || errno == EAGAIN) {
+                  // no data yet, read again
+                  continue;
+                }
                 log_error("testrunner: read error %d (%s)\n",
                         errno,strerror(errno));
                 return -1;
               }
 
               wrp+=n;
-              if(rdp && (wrp==8192 || rdp==wrp)) {
-                if(rdp!=wrp) {
-                  memmove(buf, buf+rdp, wrp-rdp);
-                }
-                wrp -= rdp;
-                rdp = 0;
-              }
 
             }
 }
@@ -219,7 +439,12 @@ int compare_packet(int fd, const char *inbuffer, const char *mask, const int inb
 	if (cnt < 0) {
 		log_errno("Error reading from socket at line %d\n", curpos);
 		err = 2;
+	} else
+	if (cnt == 0) {
+		log_error("Server closed the connection at line %d\n", curpos);
+		err = 2;
 	} else {
+		bench_recv(buffer, cnt);
 		if (inbuflen > 0) {
 			// only check data when we actually expect something
 			if (cnt == inbuflen) {
@@ -254,16 +479,79 @@ int compare_packet(int fd, const char *inbuffer, const char *mask, const int inb
 	return err;
 }
 
+/**
+ * read a file on the given channel until EOF, without checking the data.
+ * The optional second byte gives the number of credits (packets streamed
+ * per FS_READ) to request.
+ */
+int read_all(int fd, line_t *line) {
+	char req[FSP_DATA + 1];
+	char buffer[8192];
+	int reqlen = FSP_DATA;
+	int credits = 1;
+	int cnt;
+
+	if (line->length < 1) {
+		log_error("> %d: -> readall needs a channel number\n", line->num);
+		return 1;
+	}
+	req[FSP_CMD] = FS_READ;
+	req[FSP_FD] = line->buffer[0];
+	if (line->length > 1) {
+		credits = line->buffer[1] & 255;
+		req[FSP_DATA] = credits;
+		reqlen++;
+	}
+	req[FSP_LEN] = reqlen;
+
+	for (;;) {
+		if (trace) {
+			log_hexdump2(req, reqlen, 0, "Send  : ");
+		}
+		bench_send(req, reqlen);
+		if (write(fd, req, reqlen) < 0) {
+			log_errno("Error writing to socket at line %d\n", line->num);
+			return -1;
+		}
+		for (int i = 0; i < credits; i++) {
+			cnt = read_packet(fd, buffer, sizeof(buffer));
+			if (cnt < 0) {
+				log_errno("Error reading from socket at line %d\n", line->num);
+				return 2;
+			}
+			if (cnt == 0) {
+				log_error("Server closed the connection at line %d\n", line->num);
+				return 2;
+			}
+			bench_recv(buffer, cnt);
+			if (trace) {
+				log_hexdump2(buffer, cnt, 0, "Rxd   : ");
+			}
+			if (buffer[FSP_CMD] == FS_DATA_EOF) {
+				return 0;
+			}
+			if (buffer[FSP_CMD] != FS_DATA) {
+				log_error("Unexpected reply at line %d\n", line->num);
+				log_hexdump2(buffer, cnt, 0, "Rxd   : ");
+				return 1;
+			}
+			if (cnt == FSP_DATA) {
+				// no data available right now, the server ended the stream
+				break;
+			}
+		}
+	}
+}
 
 /**
  * returns the status of the execution
  *  0 = normal end
  *  1 = expect mismatch
  */
-int execute_script(int sockfd, int toolsfd, registry_t *script) {
+int execute_script(int sockfd, int toolsfd, registry_t *script, int startpos) {
 
 	// current "pc" pointer to script line
-	int curpos = 0;	
+	int curpos = startpos;
 	line_t *line = NULL;
 	int lineno = 0;
 
@@ -300,6 +588,7 @@ int execute_script(int sockfd, int toolsfd, registry_t *script) {
 			if (trace) {
 				log_hexdump2(line->buffer, line->length, 0, "Send  : ");
 			}
+			bench_send(line->buffer, line->length);
 
 			size = write(curfd, line->buffer, line->length);
 			if (size < 0) {
@@ -328,6 +617,9 @@ int execute_script(int sockfd, int toolsfd, registry_t *script) {
 			break;
 		case CMD_INIT:
 			send_sync(curfd);
+			if (!initreply) {
+				break;
+			}
 			err = compare_packet(curfd, line->buffer, NULL, line->length, lineno);
 			if (err != 0) {
 				if (errmsg != NULL) {
@@ -347,13 +639,154 @@ int execute_script(int sockfd, int toolsfd, registry_t *script) {
 				return 1;
 			}
 			break;
+		case CMD_BENCH:
+			// end of the setup part; in benchmark mode the rest is
+			// run by the benchmark loop
+			benchpos = curpos + 1;
+			if (bench) {
+				return 0;
+			}
+			break;
+		case CMD_READALL:
+			err = read_all(curfd, line);
+			if (err != 0) {
+				if (errmsg != NULL) {
+					log_error("> %d: %s -> %d\n", lineno, errmsg->buffer, err);
+				}
+				return 1;
+			}
+			break;
 		}
 		curpos++;
 	}
+	bench_done();
+
+	return 0;
+}
+
+/**
+ * run the setup part of the script once, then repeat the rest after the
+ * "bench" line for the given number of iterations or seconds (whichever
+ * limit is set and is reached first).
+ * Returns 0 on success, 1 on error.
+ */
+int bench_script(int sockfd, int toolsfd, registry_t *script, int iterations, int seconds) {
+
+	int n = 0;
+
+	// setup part; returns at the "bench" line
+	bench = 1;
+	benchpos = -1;
+	if (execute_script(sockfd, toolsfd, script, 0)) {
+		return -1;
+	}
+	if (benchpos < 0) {
+		log_error("Benchmark script has no 'bench' line\n");
+		return -1;
+	}
+	// the setup part is not measured
+	bench_done();
+	bench_free();
+	memset(samples, 0, sizeof(samples));
+	bench_bytes = 0;
+
+	uint64_t start = now_us();
+	while ((iterations <= 0 || n < iterations)
+		&& (seconds <= 0 || now_us() - start < (uint64_t)seconds * 1000000u)) {
+		if (execute_script(sockfd, toolsfd, script, benchpos)) {
+			return 1;
+		}
+		n++;
+	}
+	bench_us = now_us() - start;
+	bench_iter = n;
+	bench = 0;
 
 	return 0;
 }
 
+/**
+ * run a benchmark with the given number of connections. The first one is
+ * the device socket, all others are forked processes connecting to the
+ * tools socket, and reporting their samples back through a temp file.
+ */
+int bench_main(const char *device, int dowait, const char *tsocket, registry_t *script,
+		const char *scriptname, int iterations, int seconds, int conns) {
+
+	int rv = 0;
+	int status;
+
+	// connect before forking, as the server only accepts further
+	// connections once the device connection is set up
+	int sockfd = socket_open(device, dowait);
+	if (sockfd < 0) {
+		return 1;
+	}
+	int toolsfd = -1;
+	if (tsocket) {
+		toolsfd = socket_open(tsocket, 1);
+		send_sync(toolsfd);
+	}
+
+	pid_t *pids = mem_alloc_c(conns * sizeof(pid_t), "bench_pids");
+	FILE **results = mem_alloc_c(conns * sizeof(FILE*), "bench_results");
+
+	for (int c = 1; c < conns; c++) {
+		results[c] = tmpfile();
+		if (results[c] == NULL) {
+			log_errno("Could not create temp file for benchmark results\n");
+			exit(1);
+		}
+		pids[c] = fork();
+		if (pids[c] < 0) {
+			log_errno("Could not fork benchmark connection\n");
+			exit(1);
+		}
+		if (pids[c] == 0) {
+			close(sockfd);
+			if (toolsfd >= 0) {
+				close(toolsfd);
+			}
+			int fd = socket_open(tsocket, 1);
+			if (fd < 0) {
+				exit(1);
+			}
+			send_sync(fd);
+			initreply = 0;
+			rv = bench_script(fd, fd, script, iterations, seconds);
+			bench_save(results[c]);
+			close(fd);
+			exit(rv);
+		}
+	}
+
+	rv = bench_script(sockfd, toolsfd, script, iterations, seconds);
+
+	for (int c = 1; c < conns; c++) {
+		if (waitpid(pids[c], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			log_error("Benchmark connection %d failed\n", c);
+			rv = 1;
+		} else {
+			rv |= bench_load(results[c]);
+		}
+		fclose(results[c]);
+	}
+
+	if (rv == 0) {
+		bench_report(scriptname, conns);
+	}
+
+	close(sockfd);
+	if (toolsfd >= 0) {
+		close(toolsfd);
+	}
+	bench_free();
+	mem_free(results);
+	mem_free(pids);
+
+	return rv;
+}
+
 // -----------------------------------------------------------------------
 
 int main(int argc, char *argv[]) {
@@ -367,6 +800,11 @@ int main(int argc, char *argv[]) {
 	// wait for socket if not there right away?
 	int dowait = 0;
 
+	// benchmark mode
+	int iterations = 0;
+	int seconds = 0;
+	int conns = 1;
+
 	terminal_init();
 
 
@@ -399,6 +837,25 @@ int main(int argc, char *argv[]) {
                   		exit(1);
                 	}
                 	break;
+            	case 'b':
+            	case 'B':
+            	case 'c':
+                	assert_single_char(argv[i]);
+                	if (i < argc-1 && atoi(argv[i+1]) > 0) {
+                  		i++;
+				if (argv[i-1][1] == 'b') {
+					iterations = atoi(argv[i]);
+				} else
+				if (argv[i-1][1] == 'B') {
+					seconds = atoi(argv[i]);
+				} else {
+					conns = atoi(argv[i]);
+				}
+                	} else {
+                  		log_error("%s requires a positive number parameter\n", argv[i]);
+                  		exit(1);
+                	}
+                	break;
 		case 'v':
 			set_verbose(1);
 			break;
@@ -425,8 +882,17 @@ int main(int argc, char *argv[]) {
 	scriptname = argv[i];
 	i++;
 
+	if (conns > 1 && tsocket == NULL) {
+		log_error("Multiple connections require the tools socket (-T)\n");
+		return -1;
+	}
+
 	registry_t *script = load_script_from_file(scriptname);
 
+	if (script != NULL && (iterations > 0 || seconds > 0)) {
+
+		rv = bench_main(device, dowait, tsocket, script, scriptname, iterations, seconds, conns);
+	} else
 	if (script != NULL) {
 
 		int sockfd = socket_open(device, dowait);
@@ -440,7 +906,7 @@ int main(int argc, char *argv[]) {
 	
 		if (sockfd >= 0) {
 
-			rv = execute_script(sockfd, toolsfd, script);
+			rv = execute_script(sockfd, toolsfd, script, 0);
 
 			close(sockfd);
 		}